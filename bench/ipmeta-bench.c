@@ -0,0 +1,811 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * libipmeta is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libipmeta is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libipmeta.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "libipmeta.h"
+
+/** @file
+ *
+ * @brief Lookup benchmark suite for libipmeta datastructures
+ *
+ * For each datastructure, the given providers (or a synthetic pfx2as table)
+ * are loaded in a child process, and then every combination of workload and
+ * address stream is run. One result row is written to stdout per combination,
+ * as '|' separated fields (preceded by a header row), so that results can be
+ * compared across deployments and releases.
+ *
+ * Throughput is measured over the whole stream. Latency percentiles are
+ * measured by timing a sample of lookups individually (minus the overhead of
+ * reading the clock). Peak RSS is the high-water mark of the child process,
+ * i.e., it includes the datastructure and the address streams.
+ *
+ * The synthetic table can also include IPv6 prefixes (-6), which are loaded
+ * from a second pfx2as file. The lookup workloads are IPv4-only, so this is
+ * for comparing build times, e.g., "-D patricia -S 1000000 -6 0" against
+ * "-D patricia -S 0 -6 1000000".
+ */
+
+/** Default number of lookups per workload and stream */
+#define DEFAULT_LOOKUP_CNT 1000000
+
+/** Default number of individually timed lookups */
+#define DEFAULT_LATENCY_CNT 100000
+
+/** Default seed for the address generator */
+#define DEFAULT_SEED 1
+
+/** Default number of prefixes in the synthetic pfx2as table */
+#define DEFAULT_SYNTH_CNT 500000
+
+/** Default number of IPv6 prefixes in the synthetic pfx2as table */
+#define DEFAULT_SYNTH6_CNT 0
+
+/** Default prefix length for the prefix workload */
+#define DEFAULT_PREFIX_LEN 24
+
+/** Default exponent of the Zipf distribution */
+#define DEFAULT_ZIPF_S 1.0
+
+/** Number of distinct addresses in the Zipf stream */
+#define ZIPF_KEY_CNT 65536
+
+/** Number of lookups in each batch of the batch workload */
+#define BATCH_SIZE 64
+
+/** Which huge page configurations to benchmark */
+typedef enum hugepage_mode {
+  HUGEPAGES_OFF = 0x1,
+  HUGEPAGES_ON = 0x2,
+  HUGEPAGES_BOTH = HUGEPAGES_OFF | HUGEPAGES_ON,
+} hugepage_mode_t;
+
+/** Lookup workloads */
+typedef enum workload {
+  /** ipmeta_lookup_single for each address */
+  WORKLOAD_SINGLE = 0,
+
+  /** ipmeta_lookup for the prefix containing each address */
+  WORKLOAD_PREFIX = 1,
+
+  /** ipmeta_lookup_single into a batch of record sets, which are then all
+      walked (as a packet-batch consumer would) */
+  WORKLOAD_BATCH = 2,
+
+  /** ipmeta_lookup_single_range, skipping the lookup for addresses inside
+      the range returned by the previous lookup */
+  WORKLOAD_RANGE = 3,
+
+  /** ipmeta_lookup_single_provider for the first provider, for comparison
+      with the single workload */
+  WORKLOAD_PROVIDER = 4,
+
+  WORKLOAD_CNT = 5,
+} workload_t;
+
+static const char *workload_names[] = {"single", "prefix", "batch", "range",
+                                       "provider"};
+
+/** Address streams */
+typedef enum stream {
+  /** Addresses drawn uniformly from all of IPv4 */
+  STREAM_UNIFORM = 0,
+
+  /** Addresses drawn from a fixed pool with Zipf-distributed popularity */
+  STREAM_ZIPF = 1,
+
+  /** Uniform addresses, sorted in ascending order */
+  STREAM_SORTED = 2,
+
+  STREAM_CNT = 3,
+} stream_t;
+
+static const char *stream_names[] = {"uniform", "zipf", "sorted"};
+
+/** Names of the datastructures, indexed by ipmeta_ds_id_t */
+static const char *ds_names[] = {NULL,           "patricia",   "bigarray",
+                                 "intervaltree", "treebitmap", "cpatricia"};
+
+/** Whether each datastructure supports IPv6, indexed by ipmeta_ds_id_t */
+static const int ds_ipv6[] = {0, 1, 0, 0, 1, 0};
+
+/** Provider names and their (optional) argument strings */
+static char *provider_names[IPMETA_PROVIDER_ID_MAX];
+static char *provider_args[IPMETA_PROVIDER_ID_MAX];
+static int providers_cnt = 0;
+
+/** Benchmark parameters */
+static uint64_t lookup_cnt = DEFAULT_LOOKUP_CNT;
+static uint64_t latency_cnt = DEFAULT_LATENCY_CNT;
+static uint64_t seed = DEFAULT_SEED;
+static uint8_t prefix_len = DEFAULT_PREFIX_LEN;
+static double zipf_s = DEFAULT_ZIPF_S;
+static uint32_t cache_entries = 0;
+
+/** Provider used by the provider workload (the first one enabled) */
+static ipmeta_provider_id_t first_provider_id = 0;
+
+/** Record sets used by the workloads */
+static ipmeta_record_set_t *batch_sets[BATCH_SIZE];
+
+/** Simple xorshift PRNG so that runs are repeatable */
+static uint32_t next_rand(uint64_t *state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return (uint32_t)(*state >> 16);
+}
+
+/** Uniform double in [0, 1) */
+static double next_unit(uint64_t *state)
+{
+  return next_rand(state) / 4294967296.0;
+}
+
+static double now_sec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+  uint32_t ua = *(const uint32_t *)a;
+  uint32_t ub = *(const uint32_t *)b;
+  return (ua > ub) - (ua < ub);
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+  uint64_t ua = *(const uint64_t *)a;
+  uint64_t ub = *(const uint64_t *)b;
+  return (ua > ub) - (ua < ub);
+}
+
+/** Fill addrs with cnt addresses (network byte order) from the given stream */
+static int generate_stream(stream_t stream, uint32_t *addrs, uint64_t cnt)
+{
+  uint64_t rng = seed;
+  uint32_t *keys = NULL;
+  double *cdf = NULL;
+  double u, total = 0;
+  uint64_t i;
+  int lo, hi, mid;
+
+  switch (stream) {
+  case STREAM_UNIFORM:
+  case STREAM_SORTED:
+    for (i = 0; i < cnt; i++) {
+      addrs[i] = next_rand(&rng);
+    }
+    if (stream == STREAM_SORTED) {
+      qsort(addrs, cnt, sizeof(uint32_t), compare_u32);
+    }
+    break;
+
+  case STREAM_ZIPF:
+    if ((keys = malloc(sizeof(uint32_t) * ZIPF_KEY_CNT)) == NULL ||
+        (cdf = malloc(sizeof(double) * ZIPF_KEY_CNT)) == NULL) {
+      free(keys);
+      return -1;
+    }
+    /* key i has popularity proportional to 1/(i+1)^s */
+    for (i = 0; i < ZIPF_KEY_CNT; i++) {
+      keys[i] = next_rand(&rng);
+      total += 1.0 / pow(i + 1, zipf_s);
+      cdf[i] = total;
+    }
+    for (i = 0; i < cnt; i++) {
+      u = next_unit(&rng) * total;
+      lo = 0;
+      hi = ZIPF_KEY_CNT - 1;
+      while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (cdf[mid] < u) {
+          lo = mid + 1;
+        } else {
+          hi = mid;
+        }
+      }
+      addrs[i] = keys[lo];
+    }
+    free(keys);
+    free(cdf);
+    break;
+
+  default:
+    return -1;
+  }
+
+  for (i = 0; i < cnt; i++) {
+    addrs[i] = htonl(addrs[i]);
+  }
+  return 0;
+}
+
+/** Perform the lookups for cnt addresses starting at addrs, return the
+    number of records found */
+static uint64_t lookup_range(ipmeta_t *ipmeta, workload_t workload,
+                             uint32_t *addrs, uint64_t cnt)
+{
+  /* the range of the last range lookup (empty until the first one) */
+  static uint32_t range_first = 1, range_last = 0;
+  static int range_cnt = 0;
+  uint32_t haddr;
+  ipmeta_record_t *rec;
+  uint64_t found = 0;
+  uint64_t i;
+  uint32_t num_ips;
+  int j;
+
+  switch (workload) {
+  case WORKLOAD_SINGLE:
+    for (i = 0; i < cnt; i++) {
+      found += ipmeta_lookup_single(ipmeta, addrs[i], 0, batch_sets[0]);
+    }
+    break;
+
+  case WORKLOAD_PREFIX:
+    for (i = 0; i < cnt; i++) {
+      found += ipmeta_lookup(
+        ipmeta, addrs[i] & htonl(~0UL << (32 - prefix_len)), prefix_len, 0,
+        batch_sets[0]);
+    }
+    break;
+
+  case WORKLOAD_BATCH:
+    for (i = 0; i < cnt; i += BATCH_SIZE) {
+      for (j = 0; j < BATCH_SIZE && i + j < cnt; j++) {
+        ipmeta_lookup_single(ipmeta, addrs[i + j], 0, batch_sets[j]);
+      }
+      for (j = 0; j < BATCH_SIZE && i + j < cnt; j++) {
+        ipmeta_record_set_rewind(batch_sets[j]);
+        while ((rec = ipmeta_record_set_next(batch_sets[j], &num_ips)) !=
+               NULL) {
+          found++;
+        }
+      }
+    }
+    break;
+
+  case WORKLOAD_RANGE:
+    for (i = 0; i < cnt; i++) {
+      haddr = ntohl(addrs[i]);
+      if (haddr < range_first || haddr > range_last) {
+        range_cnt = ipmeta_lookup_single_range(ipmeta, addrs[i], 0,
+                                               batch_sets[0], &range_first,
+                                               &range_last);
+      }
+      found += range_cnt;
+    }
+    break;
+
+  case WORKLOAD_PROVIDER:
+    for (i = 0; i < cnt; i++) {
+      found += ipmeta_lookup_single_provider(ipmeta, addrs[i],
+                                             first_provider_id) != NULL;
+    }
+    break;
+
+  default:
+    break;
+  }
+
+  return found;
+}
+
+/** Estimate the overhead of reading the clock */
+static uint64_t clock_overhead()
+{
+  uint64_t min = UINT64_MAX;
+  uint64_t t0, t1;
+  int i;
+
+  for (i = 0; i < 1000; i++) {
+    t0 = now_ns();
+    t1 = now_ns();
+    if (t1 - t0 < min) {
+      min = t1 - t0;
+    }
+  }
+  return min;
+}
+
+/** Load the providers into the given datastructure, returns NULL on error */
+static ipmeta_t *build(ipmeta_ds_id_t dstype, uint32_t flags)
+{
+  ipmeta_t *ipmeta;
+  ipmeta_provider_t *provider;
+  int i;
+
+  if ((ipmeta = ipmeta_init_flags(dstype, flags)) == NULL) {
+    fprintf(stderr, "ERROR: Could not initialize libipmeta\n");
+    return NULL;
+  }
+
+  for (i = 0; i < providers_cnt; i++) {
+    if ((provider = ipmeta_get_provider_by_name(ipmeta, provider_names[i])) ==
+        NULL) {
+      fprintf(stderr, "ERROR: Invalid provider name (%s)\n",
+              provider_names[i]);
+      goto err;
+    }
+    /* a provider given again is loaded as another instance */
+    if (ipmeta_is_provider_enabled(provider) != 0 &&
+        (provider = ipmeta_add_provider_instance(ipmeta, provider, NULL)) ==
+          NULL) {
+      fprintf(stderr, "ERROR: Could not add another %s instance\n",
+              provider_names[i]);
+      goto err;
+    }
+    if (ipmeta_enable_provider(ipmeta, provider, provider_args[i],
+                               IPMETA_PROVIDER_DEFAULT_NO) != 0) {
+      fprintf(stderr, "ERROR: Could not enable provider %s\n",
+              provider_names[i]);
+      goto err;
+    }
+    if (i == 0) {
+      first_provider_id = ipmeta_get_provider_id(provider);
+    }
+  }
+
+  if (cache_entries != 0 &&
+      ipmeta_set_lookup_cache(ipmeta, cache_entries) != 0) {
+    fprintf(stderr, "ERROR: Could not enable the lookup cache\n");
+    goto err;
+  }
+
+  return ipmeta;
+
+err:
+  ipmeta_free(ipmeta);
+  return NULL;
+}
+
+/** Run all workloads and streams against one datastructure (in a child
+    process, so that the peak RSS is per datastructure) */
+static int run(ipmeta_ds_id_t dstype, uint32_t flags)
+{
+  ipmeta_t *ipmeta = NULL;
+  uint32_t *addrs = NULL;
+  uint64_t *latencies = NULL;
+  uint64_t unit, sample_cnt, overhead, t0, t1;
+  uint64_t i;
+  double start, build_time, lookup_time;
+  struct rusage usage;
+  int stream, workload;
+  int rc = -1;
+
+  start = now_sec();
+  if ((ipmeta = build(dstype, flags)) == NULL) {
+    goto quit;
+  }
+  build_time = now_sec() - start;
+
+  if ((addrs = malloc(sizeof(uint32_t) * lookup_cnt)) == NULL ||
+      (latencies = malloc(sizeof(uint64_t) * latency_cnt)) == NULL) {
+    fprintf(stderr, "ERROR: Could not allocate address list\n");
+    goto quit;
+  }
+
+  overhead = clock_overhead();
+
+  for (stream = 0; stream < STREAM_CNT; stream++) {
+    if (generate_stream(stream, addrs, lookup_cnt) != 0) {
+      fprintf(stderr, "ERROR: Could not generate %s stream\n",
+              stream_names[stream]);
+      goto quit;
+    }
+
+    for (workload = 0; workload < WORKLOAD_CNT; workload++) {
+      /* throughput over the whole stream */
+      start = now_sec();
+      lookup_range(ipmeta, workload, addrs, lookup_cnt);
+      lookup_time = now_sec() - start;
+
+      /* latency of individual lookups (or batches, divided by the batch
+         size) */
+      unit = (workload == WORKLOAD_BATCH) ? BATCH_SIZE : 1;
+      sample_cnt = lookup_cnt / unit;
+      if (sample_cnt > latency_cnt) {
+        sample_cnt = latency_cnt;
+      }
+      for (i = 0; i < sample_cnt; i++) {
+        t0 = now_ns();
+        lookup_range(ipmeta, workload, &addrs[i * unit], unit);
+        t1 = now_ns();
+        t1 -= t0;
+        latencies[i] = ((t1 > overhead) ? t1 - overhead : 0) / unit;
+      }
+      qsort(latencies, sample_cnt, sizeof(uint64_t), compare_u64);
+
+      getrusage(RUSAGE_SELF, &usage);
+
+      fprintf(stdout,
+              "%s|%s|%" PRIu32 "|%s|%s|%" PRIu64 "|%.3f|%.0f|%" PRIu64
+              "|%" PRIu64 "|%ld\n",
+              ds_names[dstype], (flags & IPMETA_FLAG_HUGEPAGES) ? "on" : "off",
+              cache_entries, workload_names[workload], stream_names[stream],
+              lookup_cnt, build_time, lookup_cnt / lookup_time,
+              sample_cnt ? latencies[sample_cnt / 2] : 0,
+              sample_cnt ? latencies[sample_cnt * 99 / 100] : 0,
+              usage.ru_maxrss);
+      fflush(stdout);
+    }
+  }
+
+  rc = 0;
+
+quit:
+  if (ipmeta != NULL) {
+    ipmeta_free(ipmeta);
+  }
+  free(addrs);
+  free(latencies);
+  return rc;
+}
+
+/** Run the benchmarks for one datastructure in a child process */
+static int run_child(ipmeta_ds_id_t dstype, uint32_t flags)
+{
+  pid_t pid;
+  int status;
+
+  fflush(stdout);
+  if ((pid = fork()) < 0) {
+    fprintf(stderr, "ERROR: Could not fork\n");
+    return -1;
+  }
+  if (pid == 0) {
+    exit(run(dstype, flags) == 0 ? 0 : 1);
+  }
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "ERROR: Benchmark of %s failed\n", ds_names[dstype]);
+    return -1;
+  }
+  return 0;
+}
+
+/** Write cnt synthetic IPv6 pfx2as prefixes to a temporary file */
+static int synthesize6(uint64_t cnt, char *path)
+{
+  uint64_t rng = seed ^ 0x9e3779b97f4a7c15ULL;
+  struct in6_addr addr;
+  char buf[INET6_ADDRSTRLEN];
+  uint32_t hi, lo;
+  uint8_t mask;
+  uint64_t i;
+  int j;
+  FILE *fh;
+  int fd;
+
+  if ((fd = mkstemp(path)) < 0 || (fh = fdopen(fd, "w")) == NULL) {
+    fprintf(stderr, "ERROR: Could not create synthetic pfx2as file\n");
+    return -1;
+  }
+
+  /* mostly /48s, with a spread of prefixes up to /29 as seen in BGP, all
+     inside 2000::/3 */
+  memset(&addr, 0, sizeof(addr));
+  for (i = 0; i < cnt; i++) {
+    mask = 48 - (next_rand(&rng) % 100 < 50 ? 0 : next_rand(&rng) % 20);
+    hi = (next_rand(&rng) & 0x1fffffff) | 0x20000000;
+    lo = next_rand(&rng) & 0xffff0000;
+    for (j = 0; j < 4; j++) {
+      addr.s6_addr[j] = hi >> (24 - j * 8);
+      addr.s6_addr[j + 4] = lo >> (24 - j * 8);
+    }
+    /* clear the host bits (all prefixes are at most /48) */
+    for (j = mask; j < 64; j++) {
+      addr.s6_addr[j / 8] &= ~(0x80 >> (j % 8));
+    }
+    inet_ntop(AF_INET6, &addr, buf, sizeof(buf));
+    fprintf(fh, "%s\t%u\t%u\n", buf, mask, 1 + next_rand(&rng) % 65000);
+  }
+  fclose(fh);
+
+  return 0;
+}
+
+/** Write a synthetic pfx2as table to a temporary file (and its IPv6 prefixes,
+    if any, to a second one) and use it as the only provider */
+static int synthesize(uint64_t cnt, char *path, uint64_t cnt6, char *path6)
+{
+  uint64_t rng = seed;
+  uint32_t addr;
+  uint8_t mask;
+  uint64_t i;
+  FILE *fh;
+  int fd;
+
+  if ((fd = mkstemp(path)) < 0 || (fh = fdopen(fd, "w")) == NULL) {
+    fprintf(stderr, "ERROR: Could not create synthetic pfx2as file\n");
+    return -1;
+  }
+
+  /* mostly /24s, with a spread of shorter prefixes as seen in BGP */
+  for (i = 0; i < cnt; i++) {
+    mask = 24 - (next_rand(&rng) % 100 < 60 ? 0 : next_rand(&rng) % 13);
+    addr = next_rand(&rng) & (~0UL << (32 - mask));
+    fprintf(fh, "%u.%u.%u.%u\t%u\t%u\n", addr >> 24, (addr >> 16) & 0xff,
+            (addr >> 8) & 0xff, addr & 0xff, mask,
+            1 + next_rand(&rng) % 65000);
+  }
+  fclose(fh);
+
+  if (cnt6 > 0 && synthesize6(cnt6, path6) != 0) {
+    unlink(path);
+    return -1;
+  }
+
+  provider_names[0] = strdup("pfx2as");
+  if ((provider_args[0] = malloc(strlen(path) + strlen(path6) + 8)) == NULL) {
+    return -1;
+  }
+  if (cnt6 > 0) {
+    sprintf(provider_args[0], "-f %s -f %s", path, path6);
+  } else {
+    sprintf(provider_args[0], "-f %s", path);
+  }
+  providers_cnt = 1;
+
+  return 0;
+}
+
+static void usage(const char *name)
+{
+  fprintf(
+    stderr,
+    "usage: %s [-P] [-C entries] [-D struct] [-l len] [-L count] [-m mode]\n"
+    "       [-n lookups] [-S count] [-6 count] [-s seed] [-z s]\n"
+    "       [-p provider [-p provider]]\n"
+    "       -6 <count>    number of IPv6 prefixes in the synthetic table\n"
+    "                     (default: %d). only the datastructures that\n"
+    "                     support IPv6 are benchmarked\n"
+    "       -C <entries>  enable the per-thread lookup cache with the given\n"
+    "                     number of entries (default: disabled)\n"
+    "       -D <struct>   data structure to benchmark (default: all)\n"
+    "       -l <len>      prefix length for the prefix workload (default: %d)\n"
+    "       -L <count>    number of individually timed lookups (default: %d)\n"
+    "       -m <mode>     huge page configurations to run: off, on or both\n"
+    "                     (default: off)\n"
+    "       -n <lookups>  number of lookups per workload and stream "
+    "(default: %d)\n"
+    "       -P            pre-fault large tables when they are allocated\n"
+    "       -p <provider> enable the given provider (with options),\n"
+    "                     -p can be used multiple times (giving a provider\n"
+    "                     again loads another instance). if no providers\n"
+    "                     are given, a synthetic pfx2as table is used\n"
+    "       -S <count>    number of prefixes in the synthetic table "
+    "(default: %d)\n"
+    "       -s <seed>     seed for the address generator (default: %d)\n"
+    "       -z <s>        exponent of the Zipf stream (default: %.1f)\n",
+    name, DEFAULT_SYNTH6_CNT, DEFAULT_PREFIX_LEN, DEFAULT_LATENCY_CNT,
+    DEFAULT_LOOKUP_CNT, DEFAULT_SYNTH_CNT, DEFAULT_SEED, DEFAULT_ZIPF_S);
+}
+
+int main(int argc, char **argv)
+{
+  int opt;
+  int i;
+  int rc = -1;
+  char *p;
+  char synth_path[] = "/tmp/ipmeta-bench-XXXXXX";
+  char synth6_path[] = "/tmp/ipmeta-bench6-XXXXXX";
+  int synth_created = 0;
+
+  ipmeta_ds_id_t dstype = 0;
+  hugepage_mode_t mode = HUGEPAGES_OFF;
+  uint32_t flags = 0;
+  uint64_t synth_cnt = DEFAULT_SYNTH_CNT;
+  uint64_t synth6_cnt = DEFAULT_SYNTH6_CNT;
+
+  /* every datastructure must have a name here */
+  assert(sizeof(ds_names) / sizeof(ds_names[0]) == IPMETA_DS_MAX + 1);
+  assert(sizeof(ds_ipv6) / sizeof(ds_ipv6[0]) == IPMETA_DS_MAX + 1);
+
+  while ((opt = getopt(argc, argv, ":6:C:D:l:L:m:n:p:S:s:z:P?")) >= 0) {
+    switch (opt) {
+    case '6':
+      synth6_cnt = strtoull(optarg, NULL, 10);
+      break;
+
+    case 'C':
+      cache_entries = strtoul(optarg, NULL, 10);
+      break;
+
+    case 'D':
+      for (i = 1; i <= IPMETA_DS_MAX; i++) {
+        if (strcasecmp(optarg, ds_names[i]) == 0) {
+          dstype = i;
+        }
+      }
+      if (dstype == 0) {
+        fprintf(stderr, "ERROR: Unknown data structure type %s\n", optarg);
+        usage(argv[0]);
+        goto quit;
+      }
+      break;
+
+    case 'l':
+      prefix_len = atoi(optarg);
+      if (prefix_len < 1 || prefix_len > 32) {
+        fprintf(stderr, "ERROR: Prefix length must be between 1 and 32\n");
+        goto quit;
+      }
+      break;
+
+    case 'L':
+      latency_cnt = strtoull(optarg, NULL, 10);
+      break;
+
+    case 'm':
+      if (strcmp(optarg, "off") == 0) {
+        mode = HUGEPAGES_OFF;
+      } else if (strcmp(optarg, "on") == 0) {
+        mode = HUGEPAGES_ON;
+      } else if (strcmp(optarg, "both") == 0) {
+        mode = HUGEPAGES_BOTH;
+      } else {
+        fprintf(stderr, "ERROR: Unknown huge page mode %s\n", optarg);
+        usage(argv[0]);
+        goto quit;
+      }
+      break;
+
+    case 'n':
+      lookup_cnt = strtoull(optarg, NULL, 10);
+      break;
+
+    case 'P':
+      flags |= IPMETA_FLAG_PREFAULT;
+      break;
+
+    case 'p':
+      if (providers_cnt == IPMETA_PROVIDER_ID_MAX) {
+        fprintf(stderr, "ERROR: Too many providers\n");
+        goto quit;
+      }
+      provider_names[providers_cnt] = strdup(optarg);
+      /* split "name args..." into the name and the argument string */
+      if ((p = strchr(provider_names[providers_cnt], ' ')) != NULL) {
+        *p = '\0';
+        provider_args[providers_cnt] = strdup(p + 1);
+      }
+      providers_cnt++;
+      break;
+
+    case 'S':
+      synth_cnt = strtoull(optarg, NULL, 10);
+      break;
+
+    case 's':
+      seed = strtoull(optarg, NULL, 10);
+      break;
+
+    case 'z':
+      zipf_s = atof(optarg);
+      break;
+
+    case ':':
+      fprintf(stderr, "ERROR: Missing option argument for -%c\n", optopt);
+      usage(argv[0]);
+      goto quit;
+
+    case '?':
+    default:
+      usage(argv[0]);
+      goto quit;
+    }
+  }
+
+  if (lookup_cnt == 0) {
+    fprintf(stderr, "ERROR: The number of lookups must be positive\n");
+    goto quit;
+  }
+
+  /* xorshift must not be seeded with zero */
+  if (seed == 0) {
+    seed = DEFAULT_SEED;
+  }
+
+  if (providers_cnt == 0) {
+    if (synthesize(synth_cnt, synth_path, synth6_cnt, synth6_path) != 0) {
+      goto quit;
+    }
+    synth_created = 1;
+  }
+
+  for (i = 0; i < BATCH_SIZE; i++) {
+    if ((batch_sets[i] = ipmeta_record_set_init()) == NULL) {
+      fprintf(stderr, "ERROR: Could not allocate record sets\n");
+      goto quit;
+    }
+  }
+
+  fprintf(stdout, "ds|hugepages|cache|workload|stream|lookups|build_sec|"
+                  "lookups_per_sec|p50_ns|p99_ns|peak_rss_kb\n");
+
+  for (i = 1; i <= IPMETA_DS_MAX; i++) {
+    if (dstype != 0 && dstype != i) {
+      continue;
+    }
+    /* the other datastructures would fail to load the IPv6 prefixes */
+    if (synth_created && synth6_cnt > 0 && !ds_ipv6[i]) {
+      continue;
+    }
+    if ((mode & HUGEPAGES_OFF) && run_child(i, flags) != 0) {
+      goto quit;
+    }
+    if ((mode & HUGEPAGES_ON) &&
+        run_child(i, flags | IPMETA_FLAG_HUGEPAGES) != 0) {
+      goto quit;
+    }
+  }
+
+  rc = 0;
+
+quit:
+  for (i = 0; i < BATCH_SIZE; i++) {
+    if (batch_sets[i] != NULL) {
+      ipmeta_record_set_free(&batch_sets[i]);
+    }
+  }
+  for (i = 0; i < providers_cnt; i++) {
+    free(provider_names[i]);
+    free(provider_args[i]);
+  }
+  if (synth_created) {
+    unlink(synth_path);
+    if (synth6_cnt > 0) {
+      unlink(synth6_path);
+    }
+  }
+  return rc;
+}
@@ -27,6 +27,12 @@
 
 #include <arpa/inet.h>
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "utils.h"
 
@@ -42,20 +48,150 @@ static ipmeta_ds_t ipmeta_ds_bigarray = {
 
 KHASH_INIT(u32u32, uint32_t, uint32_t, 1, kh_int_hash_func, kh_int_hash_equal)
 
+#define record_ptr_hash(rec) kh_int64_hash_func((khint64_t)(uintptr_t)(rec))
+#define record_ptr_equal(a, b) ((a) == (b))
+KHASH_INIT(recu32, ipmeta_record_t *, uint32_t, 1, record_ptr_hash,
+           record_ptr_equal)
+
+/** Number of addresses in each provider plane (all of IPv4) */
+#define PLANE_SIZE ((uint64_t)1 << 32)
+
+/** Number of leading address bits used to split the fill into blocks */
+#define FILL_BLOCK_BITS 8
+
+/** Number of fill blocks (each one is filled by a single thread) */
+#define FILL_BLOCK_CNT (1 << FILL_BLOCK_BITS)
+
+/** Fills of at least this many elements use streaming (non-temporal) stores */
+#define FILL_STREAM_MIN 1024
+
+/** Record ids below this value can always be mapped using the dense array */
+#define RECORD_LOOKUP_DENSE_MIN 65536
+
+/** The dense record id map may grow to at most this many slots per lookup id
+    before record ids are considered too sparse and are stored in the hash */
+#define RECORD_LOOKUP_DENSE_FACTOR 4
+
+/** Maximum number of addresses scanned on either side of an address when
+    looking for the range that shares its lookup ids */
+#define RANGE_SCAN_MAX 65536
+
+/** A prefix waiting to be written into the big array */
+typedef struct fill_entry {
+  /** First address of the prefix (host byte order) */
+  uint32_t first_addr;
+
+  /** Lookup id to store for each address in the prefix */
+  uint32_t lookup_id;
+
+  /** Prefix length */
+  uint8_t mask;
+
+  /** Provider that the prefix belongs to */
+  uint8_t provider_id;
+} fill_entry_t;
+
+/** A prefix in the index of a provider */
+typedef struct pfx_entry {
+  /** First address of the prefix (host byte order) */
+  uint32_t first_addr;
+
+  /** Lookup id stored for the addresses of the prefix that are not in a more
+      specific prefix */
+  uint32_t lookup_id;
+
+  /** Prefix length */
+  uint8_t mask;
+} pfx_entry_t;
+
+/** The prefixes of one provider, sorted by address and then length (so each
+    prefix comes right before the more specific prefixes inside it) */
+typedef struct pfx_index {
+  pfx_entry_t *entries;
+  uint32_t cnt;
+  uint32_t alloc;
+} pfx_index_t;
+
+/** A prefix that was updated or removed after the provider was filled */
+typedef struct pfx_change {
+  /** First address of the prefix (host byte order) */
+  uint32_t first_addr;
+
+  /** New lookup id of the prefix (0 if the prefix was removed) */
+  uint32_t lookup_id;
+
+  /** Order in which the change was made, so the last change of a prefix
+      wins */
+  uint32_t seq;
+
+  /** Prefix length */
+  uint8_t mask;
+
+  /** Provider that the prefix belongs to */
+  uint8_t provider_id;
+} pfx_change_t;
+
+/** The prefixes that overlap one fill block */
+typedef struct fill_block {
+  /** Sort keys of the entries (mask in the upper 32 bits, entry index in the
+      lower 32 bits) */
+  uint64_t *keys;
+  uint32_t keys_cnt;
+  uint32_t keys_alloc;
+} fill_block_t;
+
 typedef struct ipmeta_ds_bigarray_state {
-  /** Temporary hash to map from record id to lookup id */
-  khash_t(u32u32) * record_lookup;
+  /** Dense map from record id to lookup id (0 indicates no mapping) */
+  uint32_t *record_lookup;
+
+  /** Number of slots in the record_lookup array */
+  uint32_t record_lookup_cnt;
 
-  /** Mapping from a uint32 lookup id to a list of records (one per provider).
+  /** Hash to map from record id to lookup id for record ids that are too
+   * sparse to be stored in the record_lookup array (NULL until needed) */
+  khash_t(u32u32) * record_lookup_sparse;
+
+  /** Hash to map from record to lookup id for records whose id is mapped to
+   * a lookup id that holds another record of the same provider (which happens
+   * when snapshots share records, as ids are only unique within a snapshot).
+   * NULL until needed. */
+  khash_t(recu32) * record_lookup_shared;
+
+  /** Mapping from a uint32 lookup id to the record slots of the providers
+   * that use the id.
    * @note, 0 is a reserved ID (indicates empty)
    */
-  ipmeta_record_t ***lookup_table;
+  ipmeta_ds_slots_t **lookup_table;
 
   /** Number of records in the lookup table */
   int lookup_table_cnt;
 
-  /** Mapping from IP address to uint32 lookup id (see lookup table) */
-  uint32_t *array;
+  /** Mapping from IP address to uint32 lookup id (see lookup table), one
+   * plane per provider (NULL until the provider adds a prefix) */
+  uint32_t *planes[IPMETA_PROVIDER_ID_MAX];
+
+  /** Size of the mapping backing each plane */
+  size_t plane_sizes[IPMETA_PROVIDER_ID_MAX];
+
+  /** Prefixes added since the last finalize */
+  fill_entry_t *fill_entries;
+  uint32_t fill_entries_cnt;
+  uint32_t fill_entries_alloc;
+
+  /** Per-block index of the pending prefixes */
+  fill_block_t fill_blocks[FILL_BLOCK_CNT];
+
+  /** Prefixes of each provider. The planes only hold the result of all the
+   * prefixes, so this is needed to find what is left when a prefix is
+   * changed or removed. */
+  pfx_index_t index[IPMETA_PROVIDER_ID_MAX];
+
+  /** Prefixes updated or removed since the last finalize. Unlike new
+   * prefixes, these are written by repainting each changed prefix from the
+   * index. */
+  pfx_change_t *changes;
+  uint32_t changes_cnt;
+  uint32_t changes_alloc;
 } ipmeta_ds_bigarray_state_t;
 
 ipmeta_ds_t *ipmeta_ds_bigarray_alloc()
@@ -76,23 +212,35 @@ int ipmeta_ds_bigarray_init(ipmeta_ds_t *ds)
 
   /** NEVER support IPv6 :) */
 
-  if ((STATE(ds)->array = malloc_zero(sizeof(uint32_t) * IPMETA_PROVIDER_MAX *
-                                      UINT32_MAX)) == NULL) {
-    ipmeta_log(__func__, "could not malloc big array. is this a 64bit OS?");
-    return -1;
-  }
+  /* the per-provider planes are allocated when they are first needed */
 
-  if ((STATE(ds)->lookup_table = malloc_zero(sizeof(ipmeta_record_t **))) ==
+  if ((STATE(ds)->lookup_table = malloc_zero(sizeof(ipmeta_ds_slots_t *))) ==
       NULL) {
     return -1;
   }
   STATE(ds)->lookup_table_cnt = 1;
 
-  STATE(ds)->record_lookup = kh_init(u32u32);
-
   return 0;
 }
 
+/** Free the list of pending prefixes */
+static void free_fill_entries(ipmeta_ds_bigarray_state_t *state)
+{
+  int i;
+
+  free(state->fill_entries);
+  state->fill_entries = NULL;
+  state->fill_entries_cnt = 0;
+  state->fill_entries_alloc = 0;
+
+  for (i = 0; i < FILL_BLOCK_CNT; i++) {
+    free(state->fill_blocks[i].keys);
+    state->fill_blocks[i].keys = NULL;
+    state->fill_blocks[i].keys_cnt = 0;
+    state->fill_blocks[i].keys_alloc = 0;
+  }
+}
+
 void ipmeta_ds_bigarray_free(ipmeta_ds_t *ds)
 {
   uint64_t i;
@@ -109,11 +257,29 @@ void ipmeta_ds_bigarray_free(ipmeta_ds_t *ds)
       STATE(ds)->lookup_table = NULL;
     }
 
-    if (STATE(ds)->record_lookup != NULL) {
-      kh_destroy(u32u32, STATE(ds)->record_lookup);
-      STATE(ds)->record_lookup = NULL;
+    free(STATE(ds)->record_lookup);
+    STATE(ds)->record_lookup = NULL;
+    STATE(ds)->record_lookup_cnt = 0;
+
+    if (STATE(ds)->record_lookup_sparse != NULL) {
+      kh_destroy(u32u32, STATE(ds)->record_lookup_sparse);
+      STATE(ds)->record_lookup_sparse = NULL;
+    }
+    if (STATE(ds)->record_lookup_shared != NULL) {
+      kh_destroy(recu32, STATE(ds)->record_lookup_shared);
+      STATE(ds)->record_lookup_shared = NULL;
+    }
+    for (i = 0; i < IPMETA_PROVIDER_ID_MAX; i++) {
+      ipmeta_ds_large_free(STATE(ds)->planes[i], STATE(ds)->plane_sizes[i]);
+      STATE(ds)->planes[i] = NULL;
     }
-    free(STATE(ds)->array);
+
+    free_fill_entries(STATE(ds));
+    for (i = 0; i < IPMETA_PROVIDER_ID_MAX; i++) {
+      free(STATE(ds)->index[i].entries);
+    }
+    free(STATE(ds)->changes);
+
     free(STATE(ds));
     ds->state = NULL;
   }
@@ -123,66 +289,625 @@ void ipmeta_ds_bigarray_free(ipmeta_ds_t *ds)
   return;
 }
 
-#define LOOKUPINDEX(addr, prov)                                                \
-  (STATE(ds)->array[(addr * IPMETA_PROVIDER_MAX) + (prov - 1)])
+#define LOOKUPINDEX(addr, prov) (STATE(ds)->planes[(prov)-1][(addr)])
+
+/** Get the lookup id for the given record id (0 if there is none) */
+static uint32_t get_lookup_id(ipmeta_ds_bigarray_state_t *state,
+                              uint32_t record_id)
+{
+  khiter_t khiter;
+
+  if (record_id < state->record_lookup_cnt) {
+    return state->record_lookup[record_id];
+  }
+
+  if (state->record_lookup_sparse == NULL ||
+      (khiter = kh_get(u32u32, state->record_lookup_sparse, record_id)) ==
+        kh_end(state->record_lookup_sparse)) {
+    return 0;
+  }
+  return kh_value(state->record_lookup_sparse, khiter);
+}
+
+/** Associate the given record id with the given lookup id */
+static int set_lookup_id(ipmeta_ds_bigarray_state_t *state, uint32_t record_id,
+                         uint32_t lookup_id)
+{
+  uint64_t dense_max;
+  uint32_t new_cnt;
+  uint32_t *tmp;
+  khiter_t khiter;
+  int khret;
+
+  dense_max = (uint64_t)RECORD_LOOKUP_DENSE_FACTOR * state->lookup_table_cnt;
+  if (dense_max < RECORD_LOOKUP_DENSE_MIN) {
+    dense_max = RECORD_LOOKUP_DENSE_MIN;
+  }
+
+  if (record_id >= state->record_lookup_cnt && record_id < dense_max) {
+    new_cnt = record_id + 1;
+    kroundup32(new_cnt);
+    if ((tmp = realloc(state->record_lookup, sizeof(uint32_t) * new_cnt)) ==
+        NULL) {
+      return -1;
+    }
+    memset(&tmp[state->record_lookup_cnt], 0,
+           sizeof(uint32_t) * (new_cnt - state->record_lookup_cnt));
+    state->record_lookup = tmp;
+    state->record_lookup_cnt = new_cnt;
+
+    /* move any sparse ids that now fit in the array */
+    if (state->record_lookup_sparse != NULL) {
+      for (khiter = kh_begin(state->record_lookup_sparse);
+           khiter != kh_end(state->record_lookup_sparse); ++khiter) {
+        if (kh_exist(state->record_lookup_sparse, khiter) &&
+            kh_key(state->record_lookup_sparse, khiter) < new_cnt) {
+          state->record_lookup[kh_key(state->record_lookup_sparse, khiter)] =
+            kh_value(state->record_lookup_sparse, khiter);
+          kh_del(u32u32, state->record_lookup_sparse, khiter);
+        }
+      }
+    }
+  }
+
+  if (record_id < state->record_lookup_cnt) {
+    state->record_lookup[record_id] = lookup_id;
+    return 0;
+  }
+
+  if (state->record_lookup_sparse == NULL &&
+      (state->record_lookup_sparse = kh_init(u32u32)) == NULL) {
+    return -1;
+  }
+  khiter = kh_put(u32u32, state->record_lookup_sparse, record_id, &khret);
+  if (khret < 0) {
+    return -1;
+  }
+  kh_value(state->record_lookup_sparse, khiter) = lookup_id;
+  return 0;
+}
+
+/** Add a sort key to the given fill block */
+static int add_block_key(fill_block_t *block, uint64_t key)
+{
+  uint64_t *tmp;
+
+  if (block->keys_cnt == block->keys_alloc) {
+    block->keys_alloc = (block->keys_alloc == 0) ? 1024 : block->keys_alloc * 2;
+    if ((tmp = realloc(block->keys, sizeof(uint64_t) * block->keys_alloc)) ==
+        NULL) {
+      return -1;
+    }
+    block->keys = tmp;
+  }
+  block->keys[block->keys_cnt++] = key;
+  return 0;
+}
+
+/** Allocate a new (empty) lookup id */
+static uint32_t new_lookup_id(ipmeta_ds_bigarray_state_t *state)
+{
+  ipmeta_ds_slots_t **tmp;
+
+  /* check if we have run out of space */
+  if (state->lookup_table_cnt == UINT32_MAX - 1) {
+    ipmeta_log(__func__,
+               "The Big Array datastructure only supports 2^32 records");
+    return 0;
+  }
+
+  /* realloc the lookup table for this record */
+  if ((tmp = realloc(state->lookup_table, sizeof(ipmeta_ds_slots_t *) *
+                                            (state->lookup_table_cnt + 1))) ==
+      NULL) {
+    return 0;
+  }
+  state->lookup_table = tmp;
+
+  /* the slots are allocated when a record is stored */
+  state->lookup_table[state->lookup_table_cnt] = NULL;
+
+  /* move on to the next lookup id */
+  return state->lookup_table_cnt++;
+}
+
+/** Get (or allocate) the lookup id for a record whose id is mapped to a
+    lookup id that holds another record of the provider */
+static uint32_t get_shared_lookup_id(ipmeta_ds_bigarray_state_t *state,
+                                     ipmeta_record_t *record)
+{
+  khiter_t khiter;
+  int khret;
+
+  if (state->record_lookup_shared == NULL &&
+      (state->record_lookup_shared = kh_init(recu32)) == NULL) {
+    return 0;
+  }
+  khiter = kh_put(recu32, state->record_lookup_shared, record, &khret);
+  if (khret < 0) {
+    return 0;
+  }
+  if (khret > 0 && (kh_value(state->record_lookup_shared, khiter) =
+                      new_lookup_id(state)) == 0) {
+    kh_del(recu32, state->record_lookup_shared, khiter);
+    return 0;
+  }
+  return kh_value(state->record_lookup_shared, khiter);
+}
+
+/** Get the lookup id to store for the given record of the given provider
+    (allocating one, and storing the record in it, if needed). Returns 0 on
+    failure. */
+static uint32_t record_lookup_id(ipmeta_ds_bigarray_state_t *state,
+                                 uint32_t provider_id, ipmeta_record_t *record)
+{
+  uint32_t lookup_id;
+  ipmeta_record_t *prev;
+
+  /* check if this record already has a lookup id */
+  if ((lookup_id = get_lookup_id(state, record->id)) == 0) {
+    /* allocate the next id in the actual lookup table */
+    if ((lookup_id = new_lookup_id(state)) == 0) {
+      return 0;
+    }
+
+    /* associate this record id with this lookup id */
+    if (set_lookup_id(state, record->id, lookup_id) != 0) {
+      ipmeta_log(__func__, "could not map record id to lookup id");
+      return 0;
+    }
+  } else if ((prev = ipmeta_ds_slots_get(state->lookup_table[lookup_id],
+                                         provider_id - 1)) != NULL &&
+             prev != record) {
+    if ((lookup_id = get_shared_lookup_id(state, record)) == 0) {
+      ipmeta_log(__func__, "could not map record to lookup id");
+      return 0;
+    }
+  }
+
+  if (ipmeta_ds_slots_set(&state->lookup_table[lookup_id], provider_id - 1,
+                          record) != 0) {
+    ipmeta_log(__func__, "could not store record in lookup table");
+    return 0;
+  }
+
+  return lookup_id;
+}
+
+/** Queue a change to the given prefix of the given provider until the ds is
+    finalized */
+static int add_change(ipmeta_ds_bigarray_state_t *state, uint32_t first_addr,
+                      uint8_t mask, uint32_t provider_id, uint32_t lookup_id)
+{
+  pfx_change_t *tmp;
+
+  if (state->changes_cnt == UINT32_MAX) {
+    ipmeta_log(__func__, "too many prefixes changed before finalize");
+    return -1;
+  }
+  if (state->changes_cnt == state->changes_alloc) {
+    state->changes_alloc =
+      (state->changes_alloc == 0) ? 1024 : state->changes_alloc * 2;
+    if ((tmp = realloc(state->changes,
+                       sizeof(pfx_change_t) * state->changes_alloc)) == NULL) {
+      ipmeta_log(__func__, "could not realloc change list");
+      return -1;
+    }
+    state->changes = tmp;
+  }
+  state->changes[state->changes_cnt].first_addr = first_addr;
+  state->changes[state->changes_cnt].lookup_id = lookup_id;
+  state->changes[state->changes_cnt].seq = state->changes_cnt;
+  state->changes[state->changes_cnt].mask = mask;
+  state->changes[state->changes_cnt].provider_id = provider_id;
+  state->changes_cnt++;
+
+  return 0;
+}
 
 int ipmeta_ds_bigarray_add_prefix(ipmeta_ds_t *ds, uint32_t addr, uint8_t mask,
+                                  uint32_t provider_id,
                                   ipmeta_record_t *record)
 {
   assert(ds != NULL && STATE(ds) != NULL);
   ipmeta_ds_bigarray_state_t *state = STATE(ds);
-  ipmeta_record_t **recarray = NULL;
 
   uint32_t first_addr = ntohl(addr) & (~0UL << (32 - mask));
-  uint64_t i;
+  uint32_t first_block, last_block;
+  uint32_t i;
   uint32_t lookup_id;
-  khiter_t khiter;
-  int khret;
+  fill_entry_t *entry;
+  fill_entry_t *tmp;
 
-  /* check if this record is already in the record_lookup hash */
-  if ((khiter = kh_get(u32u32, state->record_lookup, record->id)) ==
-      kh_end(state->record_lookup)) {
-    /* allocate the next id in the actual lookup table */
+  if ((lookup_id = record_lookup_id(state, provider_id, record)) == 0) {
+    return -1;
+  }
 
-    /* check if we have run out of space */
-    if (state->lookup_table_cnt == UINT32_MAX - 1) {
-      ipmeta_log(__func__,
-                 "The Big Array datastructure only supports 2^32 records");
+  /* once prefixes have been changed, new ones have to be applied after those
+     changes, so they are changes too */
+  if (state->changes_cnt != 0) {
+    return add_change(state, first_addr, mask, provider_id, lookup_id);
+  }
+
+  /* the addresses are filled in bulk when the ds is finalized */
+  if (state->fill_entries_cnt == UINT32_MAX) {
+    ipmeta_log(__func__, "too many prefixes added before finalize");
+    return -1;
+  }
+  if (state->fill_entries_cnt == state->fill_entries_alloc) {
+    state->fill_entries_alloc = (state->fill_entries_alloc == 0)
+                                  ? 1024
+                                  : state->fill_entries_alloc * 2;
+    if ((tmp = realloc(state->fill_entries,
+                       sizeof(fill_entry_t) * state->fill_entries_alloc)) ==
+        NULL) {
+      ipmeta_log(__func__, "could not realloc fill list");
       return -1;
     }
+    state->fill_entries = tmp;
+  }
+  entry = &state->fill_entries[state->fill_entries_cnt];
+  entry->first_addr = first_addr;
+  entry->lookup_id = lookup_id;
+  entry->mask = mask;
+  entry->provider_id = provider_id;
 
-    /* realloc the lookup table for this record */
-    if ((state->lookup_table = realloc(
-           state->lookup_table, sizeof(ipmeta_record_t **) *
-                                  (state->lookup_table_cnt + 1))) == NULL) {
+  /* index the entry under each block that it overlaps (only prefixes
+     shorter than FILL_BLOCK_BITS overlap more than one) */
+  first_block = first_addr >> (32 - FILL_BLOCK_BITS);
+  last_block = (mask >= FILL_BLOCK_BITS)
+                 ? first_block
+                 : first_block + (1 << (FILL_BLOCK_BITS - mask)) - 1;
+  for (i = first_block; i <= last_block; i++) {
+    if (add_block_key(&state->fill_blocks[i],
+                      ((uint64_t)mask << 32) | state->fill_entries_cnt) != 0) {
+      ipmeta_log(__func__, "could not realloc fill block");
       return -1;
     }
+  }
+  state->fill_entries_cnt++;
 
-    recarray = calloc(IPMETA_PROVIDER_MAX, sizeof(ipmeta_record_t *));
+  return 0;
+}
 
-    lookup_id = state->lookup_table_cnt;
-    /* move on to the next lookup id */
-    state->lookup_table_cnt++;
+/** Set cnt elements of dst to val */
+static void fill_u32(uint32_t *dst, uint64_t cnt, uint32_t val)
+{
+  uint64_t i = 0;
 
-    /* store this record in the lookup table */
-    state->lookup_table[lookup_id] = recarray;
+#ifdef __SSE2__
+  /* large fills bypass the cache, we are unlikely to read them back soon */
+  if (cnt >= FILL_STREAM_MIN) {
+    __m128i v = _mm_set1_epi32((int)val);
 
-    /* associate this record id with this lookup id */
-    khiter = kh_put(u32u32, state->record_lookup, record->id, &khret);
-    kh_value(state->record_lookup, khiter) = lookup_id;
+    /* scalar stores until dst is 16-byte aligned */
+    for (; ((uintptr_t)&dst[i] & 15) != 0; i++) {
+      dst[i] = val;
+    }
+    for (; i + 4 <= cnt; i += 4) {
+      _mm_stream_si128((__m128i *)&dst[i], v);
+    }
+    _mm_sfence();
+  }
+#endif
+
+  for (; i < cnt; i++) {
+    dst[i] = val;
+  }
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+  uint64_t ka = *(const uint64_t *)a;
+  uint64_t kb = *(const uint64_t *)b;
+  return (ka > kb) - (ka < kb);
+}
+
+/** Write all pending prefixes that overlap one block (run by a worker
+    thread) */
+static int fill_block(void *user, int block_idx)
+{
+  ipmeta_ds_bigarray_state_t *state = (ipmeta_ds_bigarray_state_t *)user;
+  fill_block_t *block = &state->fill_blocks[block_idx];
+  fill_entry_t *entry;
+  uint64_t block_first = (uint64_t)block_idx << (32 - FILL_BLOCK_BITS);
+  uint64_t block_last = block_first + (1 << (32 - FILL_BLOCK_BITS)) - 1;
+  uint64_t first, last;
+  uint32_t i;
+
+  /* less specific prefixes are written first so that more specific ones
+     overwrite them. prefixes of the same length are written in the order
+     they were added. */
+  qsort(block->keys, block->keys_cnt, sizeof(uint64_t), compare_keys);
+
+  for (i = 0; i < block->keys_cnt; i++) {
+    entry = &state->fill_entries[block->keys[i] & 0xffffffff];
+    first = entry->first_addr;
+    last = first + ((uint64_t)1 << (32 - entry->mask)) - 1;
+    if (first < block_first) {
+      first = block_first;
+    }
+    if (last > block_last) {
+      last = block_last;
+    }
+    fill_u32(&state->planes[entry->provider_id - 1][first], last - first + 1,
+             entry->lookup_id);
+  }
+
+  return 0;
+}
+
+/** Allocate the plane of the given provider, if it does not exist yet */
+static int alloc_plane(ipmeta_ds_t *ds, int provider_id)
+{
+  ipmeta_ds_bigarray_state_t *state = STATE(ds);
+
+  if (state->planes[provider_id - 1] == NULL &&
+      (state->planes[provider_id - 1] = ipmeta_ds_large_alloc(
+         ds, sizeof(uint32_t) * PLANE_SIZE,
+         &state->plane_sizes[provider_id - 1])) == NULL) {
+    ipmeta_log(__func__, "could not malloc big array. is this a 64bit OS?");
+    return -1;
+  }
+  return 0;
+}
+
+/** Order changes by provider, address, length, and then the order they were
+    made in */
+static int compare_changes(const void *a, const void *b)
+{
+  const pfx_change_t *ca = (const pfx_change_t *)a;
+  const pfx_change_t *cb = (const pfx_change_t *)b;
+
+  if (ca->provider_id != cb->provider_id) {
+    return (ca->provider_id < cb->provider_id) ? -1 : 1;
+  }
+  if (ca->first_addr != cb->first_addr) {
+    return (ca->first_addr < cb->first_addr) ? -1 : 1;
+  }
+  if (ca->mask != cb->mask) {
+    return (ca->mask < cb->mask) ? -1 : 1;
+  }
+  return (ca->seq > cb->seq) - (ca->seq < cb->seq);
+}
+
+/** Compare a prefix to the given address and length (in index order) */
+static inline int compare_pfx(const pfx_entry_t *e, uint32_t first_addr,
+                              uint8_t mask)
+{
+  if (e->first_addr != first_addr) {
+    return (e->first_addr < first_addr) ? -1 : 1;
+  }
+  return (e->mask > mask) - (e->mask < mask);
+}
+
+/** Find the first prefix of the index that does not sort before the given
+    one */
+static uint32_t index_lower_bound(const pfx_index_t *index,
+                                  uint32_t first_addr, uint8_t mask)
+{
+  uint32_t lo = 0, hi = index->cnt, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (compare_pfx(&index->entries[mid], first_addr, mask) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/** Merge the given changes (sorted, with only the last change of each
+    prefix, all for the same provider) into the index of the provider */
+static int merge_changes(pfx_index_t *index, const pfx_change_t *changes,
+                         uint32_t cnt)
+{
+  pfx_entry_t *merged;
+  uint64_t alloc = (uint64_t)index->cnt + cnt;
+  uint32_t i = 0, j = 0, n = 0;
+  int cmp;
+
+  if ((merged = malloc(sizeof(pfx_entry_t) * alloc)) == NULL) {
+    ipmeta_log(__func__, "could not malloc prefix index");
+    return -1;
+  }
+
+  while (i < index->cnt || j < cnt) {
+    if (j == cnt) {
+      cmp = -1;
+    } else if (i == index->cnt) {
+      cmp = 1;
+    } else {
+      cmp = compare_pfx(&index->entries[i], changes[j].first_addr,
+                        changes[j].mask);
+    }
+    if (cmp < 0) {
+      merged[n++] = index->entries[i++];
+      continue;
+    }
+    /* the change replaces (or removes) the prefix in the index */
+    if (changes[j].lookup_id != 0) {
+      merged[n].first_addr = changes[j].first_addr;
+      merged[n].lookup_id = changes[j].lookup_id;
+      merged[n].mask = changes[j].mask;
+      n++;
+    }
+    if (cmp == 0) {
+      i++;
+    }
+    j++;
+  }
+
+  free(index->entries);
+  index->entries = merged;
+  index->cnt = n;
+  index->alloc = alloc;
+
+  return 0;
+}
+
+/** Sort the given changes, drop all but the last change of each prefix, and
+    merge them into the indexes of their providers. cnt is updated to the
+    number of changes that are left. */
+static int index_changes(ipmeta_ds_bigarray_state_t *state, pfx_change_t *c,
+                         uint32_t *cnt)
+{
+  uint32_t i, j, n = 0;
+
+  qsort(c, *cnt, sizeof(pfx_change_t), compare_changes);
+
+  for (i = 0; i < *cnt; i++) {
+    if (i + 1 < *cnt && c[i + 1].provider_id == c[i].provider_id &&
+        c[i + 1].first_addr == c[i].first_addr && c[i + 1].mask == c[i].mask) {
+      continue;
+    }
+    c[n++] = c[i];
+  }
+  *cnt = n;
+
+  for (i = 0; i < n; i = j) {
+    for (j = i + 1; j < n && c[j].provider_id == c[i].provider_id; j++)
+      ;
+    if (merge_changes(&state->index[c[i].provider_id - 1], &c[i], j - i) !=
+        0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/** Write the addresses of the given prefix of a provider again, from what is
+    in the index of the provider */
+static void repaint_prefix(ipmeta_ds_bigarray_state_t *state,
+                           uint32_t provider_id, uint32_t first_addr,
+                           uint8_t mask)
+{
+  pfx_index_t *index = &state->index[provider_id - 1];
+  uint32_t *plane = state->planes[provider_id - 1];
+  uint64_t last = first_addr + ((uint64_t)1 << (32 - mask)) - 1;
+  uint32_t cover_id = 0, cover_addr, i;
+  pfx_entry_t *e;
+  int len;
+
+  /* the most specific prefix that covers this one provides the background */
+  for (len = mask - 1; len >= 0 && cover_id == 0; len--) {
+    cover_addr = first_addr & (~0UL << (32 - len));
+    i = index_lower_bound(index, cover_addr, len);
+    if (i < index->cnt &&
+        compare_pfx(&index->entries[i], cover_addr, len) == 0) {
+      cover_id = index->entries[i].lookup_id;
+    }
+  }
+  fill_u32(&plane[first_addr], last - first_addr + 1, cover_id);
+
+  /* then the prefix itself and all prefixes inside it, in index order so that
+     more specific prefixes are written last */
+  for (i = index_lower_bound(index, first_addr, mask);
+       i < index->cnt && index->entries[i].first_addr <= last; i++) {
+    e = &index->entries[i];
+    fill_u32(&plane[e->first_addr], ((uint64_t)1 << (32 - e->mask)),
+             e->lookup_id);
+  }
+}
+
+/** Apply the pending changes to the indexes and the planes */
+static int apply_changes(ipmeta_ds_t *ds)
+{
+  ipmeta_ds_bigarray_state_t *state = STATE(ds);
+  pfx_change_t *c = state->changes;
+  uint64_t painted_end = 0;
+  uint32_t i, cnt = state->changes_cnt;
+
+  for (i = 0; i < cnt; i++) {
+    if (alloc_plane(ds, c[i].provider_id) != 0) {
+      return -1;
+    }
+  }
+  if (index_changes(state, c, &cnt) != 0) {
+    return -1;
+  }
+
+  /* changes are sorted by provider and then address, so a change inside a
+     prefix that has just been repainted is done already */
+  for (i = 0; i < cnt; i++) {
+    if (i > 0 && c[i].provider_id == c[i - 1].provider_id &&
+        c[i].first_addr < painted_end) {
+      continue;
+    }
+    repaint_prefix(state, c[i].provider_id, c[i].first_addr, c[i].mask);
+    painted_end = c[i].first_addr + ((uint64_t)1 << (32 - c[i].mask));
+  }
+
+  free(state->changes);
+  state->changes = NULL;
+  state->changes_cnt = 0;
+  state->changes_alloc = 0;
+
+  return 0;
+}
+
+/** Add the pending prefixes (which are in the planes already) to the indexes
+    of their providers */
+static int index_fill_entries(ipmeta_ds_bigarray_state_t *state)
+{
+  pfx_change_t *c;
+  uint32_t i, cnt = state->fill_entries_cnt;
+  int rc;
+
+  if ((c = malloc(sizeof(pfx_change_t) * cnt)) == NULL) {
+    ipmeta_log(__func__, "could not malloc prefix list");
+    return -1;
+  }
+  for (i = 0; i < cnt; i++) {
+    c[i].first_addr = state->fill_entries[i].first_addr;
+    c[i].lookup_id = state->fill_entries[i].lookup_id;
+    c[i].seq = i;
+    c[i].mask = state->fill_entries[i].mask;
+    c[i].provider_id = state->fill_entries[i].provider_id;
+  }
+
+  /* prefixes added twice keep the last record, as they do in the planes */
+  rc = index_changes(state, c, &cnt);
+
+  free(c);
+  return rc;
+}
+
+int ipmeta_ds_bigarray_finalize(ipmeta_ds_t *ds)
+{
+  ipmeta_ds_bigarray_state_t *state = STATE(ds);
+  uint32_t i;
+
+  /* prefixes are only ever queued as fill entries or as changes */
+  if (state->changes_cnt != 0) {
+    return apply_changes(ds);
+  }
+  if (state->fill_entries_cnt == 0) {
+    return 0;
+  }
+
+  /* allocate the planes for any providers that have added prefixes */
+  for (i = 0; i < state->fill_entries_cnt; i++) {
+    if (alloc_plane(ds, state->fill_entries[i].provider_id) != 0) {
+      return -1;
+    }
+  }
 
-  } else {
-    lookup_id = kh_value(state->record_lookup, khiter);
-    recarray = state->lookup_table[lookup_id];
+  /* the blocks are disjoint, so they can be filled in parallel */
+  if (ipmeta_ds_parallel_for(FILL_BLOCK_CNT, fill_block, state) != 0) {
+    ipmeta_log(__func__, "failed to fill big array");
+    return -1;
   }
 
-  recarray[record->source - 1] = record;
-  /* iterate over all ips in this prefix and point them to this index in the
-     table */
-  for (i = first_addr; i < ((uint64_t)first_addr + (1 << (32 - mask))); i++) {
-    LOOKUPINDEX(i, record->source) = lookup_id;
+  if (index_fill_entries(state) != 0) {
+    return -1;
   }
 
+  free_fill_entries(state);
+
   return 0;
 }
 
@@ -195,17 +920,21 @@ int ipmeta_ds_bigarray_lookup_records(ipmeta_ds_t *ds, uint32_t addr,
   uint64_t total_ips = 1 << (32 - mask);
   uint64_t i;
   int j;
-  ipmeta_record_t **recarray;
   uint64_t lookupind, arrayind;
 
   /* This has HORRIBLE performance. Never use bigarray for prefixes! */
   for (i = 0; i < total_ips; i++) {
     arrayind = ntohl(addr) + i;
-    for (j = 0; j < IPMETA_PROVIDER_MAX; j++) {
-      if ((1 << (j)) & providermask) {
+    for (j = 0; j < IPMETA_PROVIDER_ID_MAX; j++) {
+      if (((1U << (j)) & providermask) && STATE(ds)->planes[j] != NULL) {
         lookupind = LOOKUPINDEX(arrayind, j + 1);
-        recarray = (ipmeta_record_t **)(STATE(ds)->lookup_table[lookupind]);
-        if (ipmeta_record_set_add_record(records, recarray[j], 1) != 0) {
+        if (lookupind == 0) {
+          continue;
+        }
+        if (ipmeta_record_set_add_record(
+              records,
+              ipmeta_ds_slots_get(STATE(ds)->lookup_table[lookupind], j),
+              j + 1, 1) != 0) {
           return -1;
         }
       }
@@ -219,23 +948,178 @@ int ipmeta_ds_bigarray_lookup_record_single(ipmeta_ds_t *ds, uint32_t addr,
                                             uint32_t providermask,
                                             ipmeta_record_set_t *found)
 {
-  ipmeta_record_t **recarray;
+  uint32_t wanted;
   int i;
   uint64_t lookupind, arrayind;
 
   arrayind = ntohl(addr);
-  for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
-    if (((1 << (i)) & providermask) == 0) {
+  /* only visit the providers in the mask */
+  for (wanted = providermask; wanted != 0; wanted &= wanted - 1) {
+    i = __builtin_ctz(wanted);
+    if (STATE(ds)->planes[i] == NULL) {
       continue;
     }
     lookupind = LOOKUPINDEX(arrayind, i + 1);
     if (lookupind == 0) {
       continue;
     }
-    recarray = (ipmeta_record_t **)(STATE(ds)->lookup_table[lookupind]);
-    if (ipmeta_record_set_add_record(found, recarray[i], 1) != 0) {
+    if (ipmeta_record_set_add_record(
+          found, ipmeta_ds_slots_get(STATE(ds)->lookup_table[lookupind], i),
+          i + 1, 1) != 0) {
       return -1;
     }
   }
   return found->n_recs;
 }
+
+int ipmeta_ds_bigarray_lookup_record_range(ipmeta_ds_t *ds, uint32_t addr,
+                                           uint32_t providermask,
+                                           ipmeta_record_set_t *found,
+                                           uint32_t *first, uint32_t *last)
+{
+  uint32_t *plane;
+  uint32_t haddr = ntohl(addr);
+  uint32_t lo, hi, a, id;
+  int i;
+
+  /* the scan is bounded, so the range may be shorter than the run of equal
+     lookup ids that contains the address */
+  lo = (haddr > RANGE_SCAN_MAX) ? haddr - RANGE_SCAN_MAX : 0;
+  hi = (haddr < UINT32_MAX - RANGE_SCAN_MAX) ? haddr + RANGE_SCAN_MAX
+                                             : UINT32_MAX;
+
+  for (i = 0; i < IPMETA_PROVIDER_ID_MAX; i++) {
+    if (((1U << (i)) & providermask) == 0 ||
+        (plane = STATE(ds)->planes[i]) == NULL) {
+      continue;
+    }
+    id = plane[haddr];
+    for (a = haddr; a > lo && plane[a - 1] == id; a--)
+      ;
+    lo = a;
+    for (a = haddr; a < hi && plane[a + 1] == id; a++)
+      ;
+    hi = a;
+  }
+
+  *first = lo;
+  *last = hi;
+
+  return ipmeta_ds_bigarray_lookup_record_single(ds, addr, providermask,
+                                                 found);
+}
+
+ipmeta_record_t *ipmeta_ds_bigarray_lookup_record_provider(ipmeta_ds_t *ds,
+                                                          uint32_t addr,
+                                                          uint32_t provider_id)
+{
+  uint32_t *plane = STATE(ds)->planes[provider_id - 1];
+  uint32_t lookupind;
+
+  if (plane == NULL || (lookupind = plane[ntohl(addr)]) == 0) {
+    return NULL;
+  }
+  return ipmeta_ds_slots_get(STATE(ds)->lookup_table[lookupind],
+                             provider_id - 1);
+}
+
+int ipmeta_ds_bigarray_add_prefix6(ipmeta_ds_t *ds, const struct in6_addr *addr,
+                                   uint8_t mask, uint32_t provider_id,
+                                   ipmeta_record_t *record)
+{
+  ipmeta_log(__func__, "the bigarray datastructure does not support IPv6");
+  return -1;
+}
+
+int ipmeta_ds_bigarray_lookup_records6(ipmeta_ds_t *ds,
+                                       const struct in6_addr *addr,
+                                       uint8_t mask, uint32_t providermask,
+                                       ipmeta_record_set_t *records)
+{
+  ipmeta_log(__func__, "the bigarray datastructure does not support IPv6");
+  return -1;
+}
+
+int ipmeta_ds_bigarray_lookup_record_single6(ipmeta_ds_t *ds,
+                                             const struct in6_addr *addr,
+                                             uint32_t providermask,
+                                             ipmeta_record_set_t *found)
+{
+  ipmeta_log(__func__, "the bigarray datastructure does not support IPv6");
+  return -1;
+}
+
+void ipmeta_ds_bigarray_memory_usage(ipmeta_ds_t *ds,
+                                     ipmeta_memory_usage_t *usage)
+{
+  ipmeta_ds_bigarray_state_t *state = STATE(ds);
+  int i;
+
+  usage->ds[IPMETA_MEM_OTHER] += sizeof(ipmeta_ds_t) + sizeof(*state);
+
+  /* each plane belongs to exactly one provider */
+  for (i = 0; i < IPMETA_PROVIDER_ID_MAX; i++) {
+    usage->providers[i][IPMETA_MEM_TABLES] +=
+      ipmeta_ds_large_resident(state->planes[i], state->plane_sizes[i]);
+  }
+
+  /* entry 0 of the lookup table is reserved and has no record slots */
+  usage->ds[IPMETA_MEM_NODE_RECORDS] +=
+    (uint64_t)state->lookup_table_cnt * sizeof(ipmeta_ds_slots_t *);
+  for (i = 1; i < state->lookup_table_cnt; i++) {
+    if (state->lookup_table[i] != NULL) {
+      usage->ds[IPMETA_MEM_NODE_RECORDS] +=
+        IPMETA_DS_SLOTS_SIZE(state->lookup_table[i]);
+    }
+  }
+
+  usage->ds[IPMETA_MEM_HASHES] +=
+    (uint64_t)state->record_lookup_cnt * sizeof(uint32_t) +
+    IPMETA_KH_MEMORY(state->record_lookup_sparse, sizeof(uint32_t),
+                     sizeof(uint32_t)) +
+    IPMETA_KH_MEMORY(state->record_lookup_shared, sizeof(ipmeta_record_t *),
+                     sizeof(uint32_t));
+
+  for (i = 0; i < IPMETA_PROVIDER_ID_MAX; i++) {
+    usage->providers[i][IPMETA_MEM_TABLES] +=
+      (uint64_t)state->index[i].alloc * sizeof(pfx_entry_t);
+  }
+
+  usage->ds[IPMETA_MEM_OTHER] +=
+    (uint64_t)state->fill_entries_alloc * sizeof(fill_entry_t) +
+    (uint64_t)state->changes_alloc * sizeof(pfx_change_t);
+  for (i = 0; i < FILL_BLOCK_CNT; i++) {
+    usage->ds[IPMETA_MEM_OTHER] +=
+      (uint64_t)state->fill_blocks[i].keys_alloc * sizeof(uint64_t);
+  }
+}
+
+int ipmeta_ds_bigarray_remove_prefix(ipmeta_ds_t *ds, uint32_t addr,
+                                     uint8_t mask, uint32_t provider_id)
+{
+  ipmeta_ds_bigarray_state_t *state = STATE(ds);
+
+  /* changes are made against the index, so it must be complete */
+  if (state->fill_entries_cnt != 0 && ipmeta_ds_bigarray_finalize(ds) != 0) {
+    return -1;
+  }
+  return add_change(state, ntohl(addr) & (~0UL << (32 - mask)), mask,
+                    provider_id, 0);
+}
+
+int ipmeta_ds_bigarray_update_prefix(ipmeta_ds_t *ds, uint32_t addr,
+                                     uint8_t mask, uint32_t provider_id,
+                                     ipmeta_record_t *record)
+{
+  ipmeta_ds_bigarray_state_t *state = STATE(ds);
+  uint32_t lookup_id;
+
+  if (state->fill_entries_cnt != 0 && ipmeta_ds_bigarray_finalize(ds) != 0) {
+    return -1;
+  }
+  if ((lookup_id = record_lookup_id(state, provider_id, record)) == 0) {
+    return -1;
+  }
+  return add_change(state, ntohl(addr) & (~0UL << (32 - mask)), mask,
+                    provider_id, lookup_id);
+}
@@ -0,0 +1,698 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * libipmeta is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libipmeta is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libipmeta.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <stdlib.h>
+
+#include "utils.h"
+
+#include "libipmeta_int.h"
+#include "ipmeta_ds_cpatricia.h"
+
+#define DS_NAME "cpatricia"
+
+#define STATE(ds) (IPMETA_DS_STATE(cpatricia, ds))
+
+/** Index used for "no node" and "no result" (the first element of each pool
+    is never used) */
+#define NONE 0
+
+/** Initial number of nodes (and results) in the pools */
+#define INITIAL_ALLOC 1024
+
+/** Maximum depth of the trie (one level per address bit, plus the root) */
+#define MAX_DEPTH 33
+
+/** Test the given bit (0 is the most significant) of a host byte-ordered
+    address */
+#define BIT_TEST(addr, bit) (((addr) >> (31 - (bit))) & 1)
+
+/** Netmask of a prefix of the given length, in host byte order */
+#define NETMASK(len) ((len) == 0 ? 0 : ~0U << (32 - (len)))
+
+static ipmeta_ds_t ipmeta_ds_cpatricia = {
+  IPMETA_DS_CPATRICIA, DS_NAME, IPMETA_DS_GENERATE_PTRS(cpatricia) NULL};
+
+/** A node of the trie
+ *
+ * Nodes are allocated from a single pool and refer to each other by their
+ * index in it. As in libpatricia, a node either holds a prefix (of length bit)
+ * or is a glue node (which has no result, and always has both children) that
+ * branches on the given bit. For glue nodes, addr is the address of one of
+ * the prefixes below it, so the first bit bits are shared by all of them.
+ */
+typedef struct cpt_node {
+  /** Address (host byte order) of the prefix */
+  uint32_t addr;
+
+  /** Indexes of the children for a 0 and a 1 at position bit */
+  uint32_t child[2];
+
+  /** Index of the records of the prefix (NONE for glue nodes) */
+  uint32_t result;
+
+  /** Length of the prefix (or the bit that a glue node branches on) */
+  uint8_t bit;
+} cpt_node_t;
+
+typedef struct ipmeta_ds_cpatricia_state {
+  /** Pool of nodes */
+  cpt_node_t *nodes;
+  uint32_t nodes_cnt;
+  uint32_t nodes_alloc;
+
+  /** Pool of record tuples, one row per prefix */
+  ipmeta_ds_slot_table_t results;
+
+  /** Index of the root node (NONE if the trie is empty) */
+  uint32_t root;
+
+  /** First node of the list of removed nodes (linked by child[0]), which
+      are reused before the pool grows */
+  uint32_t free_nodes;
+
+  /** Rows of the records pool that were freed by removed prefixes */
+  uint32_t *free_results;
+  uint32_t free_results_cnt;
+  uint32_t free_results_alloc;
+
+} ipmeta_ds_cpatricia_state_t;
+
+/** Allocate a node from the pool, returns its index (or NONE on failure).
+    This may move the pool, so pointers to nodes must be looked up again */
+static uint32_t alloc_node(ipmeta_ds_cpatricia_state_t *state, uint32_t addr,
+                           uint8_t bit, uint32_t result)
+{
+  cpt_node_t *tmp;
+  uint32_t alloc, idx;
+
+  if ((idx = state->free_nodes) != NONE) {
+    state->free_nodes = state->nodes[idx].child[0];
+  } else if (state->nodes_cnt == state->nodes_alloc) {
+    alloc = (state->nodes_alloc == 0) ? INITIAL_ALLOC : state->nodes_alloc * 2;
+    if ((tmp = realloc(state->nodes, sizeof(cpt_node_t) * alloc)) == NULL) {
+      ipmeta_log(__func__, "could not realloc node pool");
+      return NONE;
+    }
+    state->nodes = tmp;
+    state->nodes_alloc = alloc;
+  }
+  if (idx == NONE) {
+    idx = state->nodes_cnt++;
+  }
+  state->nodes[idx].addr = addr;
+  state->nodes[idx].bit = bit;
+  state->nodes[idx].result = result;
+  state->nodes[idx].child[0] = NONE;
+  state->nodes[idx].child[1] = NONE;
+
+  return idx;
+}
+
+/** Put a node that is no longer in the trie on the free list */
+static void free_node(ipmeta_ds_cpatricia_state_t *state, uint32_t idx)
+{
+  state->nodes[idx].child[0] = state->free_nodes;
+  state->free_nodes = idx;
+}
+
+/** Allocate an empty record tuple, returns its index (or NONE on failure) */
+static uint32_t alloc_result(ipmeta_ds_cpatricia_state_t *state)
+{
+  uint32_t row;
+
+  /* freed rows are empty already */
+  if (state->free_results_cnt > 0) {
+    return state->free_results[--state->free_results_cnt];
+  }
+  if (ipmeta_ds_slot_table_alloc(&state->results, 1, &row) != 0) {
+    ipmeta_log(__func__, "could not grow record pool");
+    return NONE;
+  }
+  return row;
+}
+
+/** Put a record tuple that no longer has any records on the free list */
+static int free_result(ipmeta_ds_cpatricia_state_t *state, uint32_t row)
+{
+  uint32_t *tmp;
+  uint32_t alloc;
+
+  if (state->free_results_cnt == state->free_results_alloc) {
+    alloc = (state->free_results_alloc == 0) ? INITIAL_ALLOC
+                                             : state->free_results_alloc * 2;
+    if ((tmp = realloc(state->free_results, sizeof(uint32_t) * alloc)) ==
+        NULL) {
+      ipmeta_log(__func__, "could not realloc free record list");
+      return -1;
+    }
+    state->free_results = tmp;
+    state->free_results_alloc = alloc;
+  }
+  state->free_results[state->free_results_cnt++] = row;
+  return 0;
+}
+
+/** Check if a record tuple holds no records */
+static int result_empty(ipmeta_ds_cpatricia_state_t *state, uint32_t row)
+{
+  uint32_t left;
+
+  for (left = state->results.providers; left != 0; left &= left - 1) {
+    if (ipmeta_ds_slot_table_get(&state->results, row,
+                                 __builtin_ctz(left)) != NULL) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/** Make the given node the child of parent on the given side (or the root,
+    if parent is NONE) */
+static void set_link(ipmeta_ds_cpatricia_state_t *state, uint32_t parent,
+                     int side, uint32_t idx)
+{
+  if (parent == NONE) {
+    state->root = idx;
+  } else {
+    state->nodes[parent].child[side] = idx;
+  }
+}
+
+/** Find the node of the given prefix, creating it (and a glue node, if
+    needed) if it does not exist. Returns NONE on failure. */
+static uint32_t insert_node(ipmeta_ds_cpatricia_state_t *state, uint32_t addr,
+                            uint8_t mask)
+{
+  cpt_node_t *node;
+  uint32_t idx, parent, new_idx, glue_idx, result, diff;
+  uint8_t check_bit, differ_bit;
+  int side;
+
+  if (state->root == NONE) {
+    if ((result = alloc_result(state)) == NONE) {
+      return NONE;
+    }
+    return (state->root = alloc_node(state, addr, mask, result));
+  }
+
+  /* descend as far as the prefix would go */
+  node = &state->nodes[state->root];
+  while (node->bit < mask || node->result == NONE) {
+    idx = node->child[(node->bit < 32) ? BIT_TEST(addr, node->bit) : 0];
+    if (idx == NONE) {
+      break;
+    }
+    node = &state->nodes[idx];
+  }
+
+  /* the first bit where the prefix differs from the one we found */
+  check_bit = (node->bit < mask) ? node->bit : mask;
+  diff = node->addr ^ addr;
+  differ_bit = (diff == 0) ? 32 : __builtin_clz(diff);
+  if (differ_bit > check_bit) {
+    differ_bit = check_bit;
+  }
+
+  /* the new node goes above the first node on the path that branches at or
+     after that bit (there is no parent index, so descend again) */
+  parent = NONE;
+  side = 0;
+  idx = state->root;
+  while (state->nodes[idx].bit < differ_bit) {
+    parent = idx;
+    side = BIT_TEST(addr, state->nodes[idx].bit);
+    idx = state->nodes[idx].child[side];
+    assert(idx != NONE);
+  }
+
+  if (differ_bit == mask && state->nodes[idx].bit == mask) {
+    /* the prefix exists already (perhaps as a glue node) */
+    if (state->nodes[idx].result == NONE &&
+        (state->nodes[idx].result = alloc_result(state)) == NONE) {
+      return NONE;
+    }
+    return idx;
+  }
+
+  if ((result = alloc_result(state)) == NONE ||
+      (new_idx = alloc_node(state, addr, mask, result)) == NONE) {
+    return NONE;
+  }
+  node = &state->nodes[idx];
+
+  if (node->bit == differ_bit) {
+    /* the new prefix is a child of this node */
+    assert(node->child[BIT_TEST(addr, node->bit)] == NONE);
+    node->child[BIT_TEST(addr, node->bit)] = new_idx;
+  } else if (mask == differ_bit) {
+    /* the new prefix covers this node */
+    state->nodes[new_idx].child[(mask < 32) ? BIT_TEST(node->addr, mask) : 0] =
+      idx;
+    set_link(state, parent, side, new_idx);
+  } else {
+    /* the new prefix and this node branch off a new glue node */
+    if ((glue_idx = alloc_node(state, addr, differ_bit, NONE)) == NONE) {
+      return NONE;
+    }
+    state->nodes[glue_idx].child[BIT_TEST(addr, differ_bit)] = new_idx;
+    state->nodes[glue_idx].child[!BIT_TEST(addr, differ_bit)] = idx;
+    set_link(state, parent, side, glue_idx);
+  }
+
+  return new_idx;
+}
+
+/** Add the records of the prefix of the given node for the providers in
+    provmask that are not yet in foundsofar */
+static int extract_records(ipmeta_ds_cpatricia_state_t *state,
+                           cpt_node_t *node, uint32_t provmask,
+                           uint32_t *foundsofar, ipmeta_record_set_t *found)
+{
+  uint32_t ip_cnt = (node->bit == 0) ? UINT32_MAX : 1U << (32 - node->bit);
+
+  return ipmeta_ds_slot_table_extract(&state->results, node->result, provmask,
+                                      foundsofar, ip_cnt, found);
+}
+
+/** Find the nodes of the prefixes that cover the first mask bits of the given
+    (host byte-ordered) address, from the least to the most specific. Returns
+    the number of nodes found. */
+static int search_covering(ipmeta_ds_cpatricia_state_t *state, uint32_t addr,
+                           uint8_t mask, uint32_t *path)
+{
+  cpt_node_t *node;
+  uint32_t idx = state->root;
+  int cnt = 0;
+
+  while (idx != NONE) {
+    node = &state->nodes[idx];
+    /* nothing below a node that does not match the address can match it
+       either */
+    if (node->bit > mask || ((node->addr ^ addr) & NETMASK(node->bit)) != 0) {
+      break;
+    }
+    if (node->result != NONE) {
+      path[cnt++] = idx;
+    }
+    if (node->bit == 32) {
+      break;
+    }
+    idx = node->child[BIT_TEST(addr, node->bit)];
+  }
+
+  return cnt;
+}
+
+/** Find records of the prefixes in the subtree of the given node for
+    providers that have none yet */
+static int search_subtree(ipmeta_ds_cpatricia_state_t *state, uint32_t idx,
+                          uint32_t provmask, uint32_t *foundsofar,
+                          ipmeta_record_set_t *found)
+{
+  uint32_t stack[MAX_DEPTH * 2];
+  int sp = 0;
+  cpt_node_t *node;
+
+  stack[sp++] = idx;
+  while (sp > 0 && *foundsofar != provmask) {
+    node = &state->nodes[stack[--sp]];
+    if (node->result != NONE &&
+        extract_records(state, node, provmask, foundsofar, found) != 0) {
+      return -1;
+    }
+    /* visit the 0 child next, and come back for the 1 child */
+    if (node->child[1] != NONE) {
+      assert(sp < MAX_DEPTH * 2);
+      stack[sp++] = node->child[1];
+    }
+    if (node->child[0] != NONE) {
+      assert(sp < MAX_DEPTH * 2);
+      stack[sp++] = node->child[0];
+    }
+  }
+  return 0;
+}
+
+/** Get the length of the largest prefix around the given address (host byte
+    order) that does not contain any more specific prefix of the trie. The
+    result of a lookup is the same for every address in that prefix. */
+static int empty_prefix_len(ipmeta_ds_cpatricia_state_t *state, uint32_t addr)
+{
+  cpt_node_t *node;
+  uint32_t idx, diff;
+  int differ_bit;
+
+  if (state->root == NONE) {
+    return 0;
+  }
+
+  /* descend as insert_node would for addr/32, glue nodes always have both
+     children */
+  node = &state->nodes[state->root];
+  while (node->bit < 32 || node->result == NONE) {
+    idx = node->child[(node->bit < 32) ? BIT_TEST(addr, node->bit) : 0];
+    if (idx == NONE) {
+      break;
+    }
+    node = &state->nodes[idx];
+  }
+
+  /* no prefix in the trie agrees with addr beyond the first differing bit
+     (or beyond the prefix where the descent stopped) */
+  diff = node->addr ^ addr;
+  differ_bit = (diff == 0) ? 32 : __builtin_clz(diff);
+  if (differ_bit > node->bit) {
+    differ_bit = node->bit;
+  }
+
+  /* a leaf prefix that covers addr contains no more specific prefixes */
+  if (differ_bit == node->bit && node->child[0] == NONE &&
+      node->child[1] == NONE) {
+    return differ_bit;
+  }
+
+  return (differ_bit < 32) ? differ_bit + 1 : 32;
+}
+
+/* ==================== PUBLIC API FUNCTIONS ==================== */
+
+ipmeta_ds_t *ipmeta_ds_cpatricia_alloc()
+{
+  return &ipmeta_ds_cpatricia;
+}
+
+int ipmeta_ds_cpatricia_init(ipmeta_ds_t *ds)
+{
+  ipmeta_ds_cpatricia_state_t *state;
+  uint32_t row;
+
+  /* the ds structure is malloc'd already, we just need to init the state */
+
+  assert(STATE(ds) == NULL);
+
+  if ((ds->state = malloc_zero(sizeof(ipmeta_ds_cpatricia_state_t))) ==
+      NULL) {
+    ipmeta_log(__func__, "could not malloc cpatricia state");
+    return -1;
+  }
+  state = STATE(ds);
+
+  /* the first node and result are never used, so that index 0 is NONE */
+  if ((state->nodes = malloc(sizeof(cpt_node_t) * INITIAL_ALLOC)) == NULL ||
+      ipmeta_ds_slot_table_alloc(&state->results, 1, &row) != 0) {
+    ipmeta_log(__func__, "could not malloc pools");
+    return -1;
+  }
+  state->nodes_cnt = 1;
+  state->nodes_alloc = INITIAL_ALLOC;
+  state->root = NONE;
+  state->free_nodes = NONE;
+
+  return 0;
+}
+
+void ipmeta_ds_cpatricia_free(ipmeta_ds_t *ds)
+{
+  if (ds == NULL) {
+    return;
+  }
+
+  /* nodes live in the pools, so there is nothing to walk */
+  if (STATE(ds) != NULL) {
+    free(STATE(ds)->nodes);
+    ipmeta_ds_slot_table_free(&STATE(ds)->results);
+    free(STATE(ds)->free_results);
+    free(STATE(ds));
+    ds->state = NULL;
+  }
+
+  free(ds);
+
+  return;
+}
+
+int ipmeta_ds_cpatricia_add_prefix(ipmeta_ds_t *ds, uint32_t addr,
+                                   uint8_t mask, uint32_t provider_id,
+                                   ipmeta_record_t *record)
+{
+  ipmeta_ds_cpatricia_state_t *state = STATE(ds);
+  uint32_t idx;
+
+  if (mask > 32) {
+    ipmeta_log(__func__, "invalid IPv4 prefix length (%d)", mask);
+    return -1;
+  }
+
+  if ((idx = insert_node(state, ntohl(addr) & NETMASK(mask), mask)) == NONE) {
+    ipmeta_log(__func__, "failed to insert prefix in trie");
+    return -1;
+  }
+  if (ipmeta_ds_slot_table_set(&state->results, state->nodes[idx].result,
+                               provider_id - 1, record) != 0) {
+    ipmeta_log(__func__, "failed to store record for prefix");
+    return -1;
+  }
+
+  return 0;
+}
+
+int ipmeta_ds_cpatricia_finalize(ipmeta_ds_t *ds)
+{
+  /* prefixes are inserted as they are added */
+  return 0;
+}
+
+int ipmeta_ds_cpatricia_lookup_records(ipmeta_ds_t *ds, uint32_t addr,
+                                       uint8_t mask, uint32_t providermask,
+                                       ipmeta_record_set_t *records)
+{
+  ipmeta_ds_cpatricia_state_t *state = STATE(ds);
+  uint32_t path[MAX_DEPTH];
+  uint32_t haddr = ntohl(addr);
+  uint32_t foundsofar = 0;
+  uint32_t idx;
+  int cnt;
+
+  /* the most specific covering prefixes go first */
+  cnt = search_covering(state, haddr, mask, path);
+  while (cnt > 0 && foundsofar != providermask) {
+    if (extract_records(state, &state->nodes[path[--cnt]], providermask,
+                        &foundsofar, records) != 0) {
+      return -1;
+    }
+  }
+  if (foundsofar == providermask || mask >= 32) {
+    return records->n_recs;
+  }
+
+  /* then any more specific prefix for the remaining providers. all of them
+     are below the first node that is at least as long as the prefix */
+  idx = state->root;
+  while (idx != NONE && state->nodes[idx].bit < mask) {
+    idx = state->nodes[idx].child[BIT_TEST(haddr, state->nodes[idx].bit)];
+  }
+  if (idx != NONE &&
+      ((state->nodes[idx].addr ^ haddr) & NETMASK(mask)) == 0 &&
+      search_subtree(state, idx, providermask, &foundsofar, records) != 0) {
+    return -1;
+  }
+
+  return records->n_recs;
+}
+
+int ipmeta_ds_cpatricia_lookup_record_single(ipmeta_ds_t *ds, uint32_t addr,
+                                             uint32_t providermask,
+                                             ipmeta_record_set_t *found)
+{
+  ipmeta_ds_cpatricia_state_t *state = STATE(ds);
+  uint32_t path[MAX_DEPTH];
+  uint32_t foundsofar = 0;
+  int cnt;
+
+  cnt = search_covering(state, ntohl(addr), 32, path);
+  while (cnt > 0 && foundsofar != providermask) {
+    if (extract_records(state, &state->nodes[path[--cnt]], providermask,
+                        &foundsofar, found) != 0) {
+      return -1;
+    }
+  }
+
+  return found->n_recs;
+}
+
+int ipmeta_ds_cpatricia_lookup_record_range(ipmeta_ds_t *ds, uint32_t addr,
+                                            uint32_t providermask,
+                                            ipmeta_record_set_t *found,
+                                            uint32_t *first, uint32_t *last)
+{
+  uint32_t haddr = ntohl(addr);
+  uint32_t netmask = NETMASK(empty_prefix_len(STATE(ds), haddr));
+
+  *first = haddr & netmask;
+  *last = *first | ~netmask;
+
+  return ipmeta_ds_cpatricia_lookup_record_single(ds, addr, providermask,
+                                                  found);
+}
+
+ipmeta_record_t *ipmeta_ds_cpatricia_lookup_record_provider(
+  ipmeta_ds_t *ds, uint32_t addr, uint32_t provider_id)
+{
+  ipmeta_ds_cpatricia_state_t *state = STATE(ds);
+  uint32_t path[MAX_DEPTH];
+  ipmeta_record_t *rec;
+  int cnt;
+
+  cnt = search_covering(state, ntohl(addr), 32, path);
+  while (cnt > 0) {
+    if ((rec = ipmeta_ds_slot_table_get(&state->results,
+                                        state->nodes[path[--cnt]].result,
+                                        provider_id - 1)) != NULL) {
+      return rec;
+    }
+  }
+  return NULL;
+}
+
+int ipmeta_ds_cpatricia_add_prefix6(ipmeta_ds_t *ds,
+                                    const struct in6_addr *addr, uint8_t mask,
+                                    uint32_t provider_id,
+                                    ipmeta_record_t *record)
+{
+  ipmeta_log(__func__, "the cpatricia datastructure does not support IPv6");
+  return -1;
+}
+
+int ipmeta_ds_cpatricia_lookup_records6(ipmeta_ds_t *ds,
+                                        const struct in6_addr *addr,
+                                        uint8_t mask, uint32_t providermask,
+                                        ipmeta_record_set_t *records)
+{
+  ipmeta_log(__func__, "the cpatricia datastructure does not support IPv6");
+  return -1;
+}
+
+int ipmeta_ds_cpatricia_lookup_record_single6(ipmeta_ds_t *ds,
+                                              const struct in6_addr *addr,
+                                              uint32_t providermask,
+                                              ipmeta_record_set_t *found)
+{
+  ipmeta_log(__func__, "the cpatricia datastructure does not support IPv6");
+  return -1;
+}
+
+void ipmeta_ds_cpatricia_memory_usage(ipmeta_ds_t *ds,
+                                      ipmeta_memory_usage_t *usage)
+{
+  ipmeta_ds_cpatricia_state_t *state = STATE(ds);
+
+  usage->ds[IPMETA_MEM_OTHER] += sizeof(ipmeta_ds_t) + sizeof(*state);
+  usage->ds[IPMETA_MEM_TRIE_NODES] +=
+    (uint64_t)state->nodes_alloc * sizeof(cpt_node_t);
+  usage->ds[IPMETA_MEM_NODE_RECORDS] +=
+    IPMETA_DS_SLOT_TABLE_SIZE(&state->results) +
+    (uint64_t)state->free_results_alloc * sizeof(uint32_t);
+}
+
+int ipmeta_ds_cpatricia_remove_prefix(ipmeta_ds_t *ds, uint32_t addr,
+                                      uint8_t mask, uint32_t provider_id)
+{
+  ipmeta_ds_cpatricia_state_t *state = STATE(ds);
+  uint32_t haddr = ntohl(addr) & NETMASK(mask);
+  uint32_t idx, parent = NONE, grandparent = NONE, child;
+  cpt_node_t *node;
+  int side = 0, parent_side = 0;
+
+  if (mask > 32) {
+    ipmeta_log(__func__, "invalid IPv4 prefix length (%d)", mask);
+    return -1;
+  }
+
+  /* find the node of the prefix, and the two nodes above it */
+  idx = state->root;
+  while (idx != NONE && state->nodes[idx].bit < mask) {
+    grandparent = parent;
+    parent_side = side;
+    parent = idx;
+    side = BIT_TEST(haddr, state->nodes[idx].bit);
+    idx = state->nodes[idx].child[side];
+  }
+  if (idx == NONE) {
+    return 0;
+  }
+  node = &state->nodes[idx];
+  if (node->bit != mask || node->result == NONE ||
+      ((node->addr ^ haddr) & NETMASK(mask)) != 0 ||
+      ipmeta_ds_slot_table_get(&state->results, node->result,
+                               provider_id - 1) == NULL) {
+    return 0;
+  }
+
+  if (ipmeta_ds_slot_table_set(&state->results, node->result,
+                               provider_id - 1, NULL) != 0) {
+    ipmeta_log(__func__, "failed to remove record for prefix");
+    return -1;
+  }
+  if (!result_empty(state, node->result)) {
+    return 0;
+  }
+
+  /* no provider has the prefix any more, so its node goes (as in
+     libpatricia), otherwise dead nodes would pile up with every diff and
+     split the ranges that lookups return */
+  if (free_result(state, node->result) != 0) {
+    return -1;
+  }
+  node->result = NONE;
+  if (node->child[0] != NONE && node->child[1] != NONE) {
+    /* it is still needed to branch */
+    return 0;
+  }
+  child = (node->child[0] != NONE) ? node->child[0] : node->child[1];
+  set_link(state, parent, side, child);
+  free_node(state, idx);
+
+  /* a glue node left with a single child is replaced by that child */
+  if (child == NONE && parent != NONE &&
+      state->nodes[parent].result == NONE) {
+    set_link(state, grandparent, parent_side,
+             state->nodes[parent].child[!side]);
+    free_node(state, parent);
+  }
+
+  return 0;
+}
+
+int ipmeta_ds_cpatricia_update_prefix(ipmeta_ds_t *ds, uint32_t addr,
+                                      uint8_t mask, uint32_t provider_id,
+                                      ipmeta_record_t *record)
+{
+  /* prefixes are inserted immediately, so this is just an add */
+  return ipmeta_ds_cpatricia_add_prefix(ds, addr, mask, provider_id, record);
+}
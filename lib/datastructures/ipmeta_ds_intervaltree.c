@@ -40,10 +40,24 @@
 static ipmeta_ds_t ipmeta_ds_intervaltree = {
   IPMETA_DS_INTERVALTREE, DS_NAME, IPMETA_DS_GENERATE_PTRS(intervaltree) NULL};
 
+/** Approximate size of an interval tree node (the interval plus the
+    red-black tree node that holds it) */
+#define INTERVAL_NODE_SIZE (sizeof(interval_t) + 6 * sizeof(void *))
+
+/** Ranges returned by lookup_record_range are restricted to the prefix of
+    this length around the address, which bounds the number of intervals
+    that have to be examined */
+#define RANGE_SEARCH_BITS 16
+
 typedef struct ipmeta_ds_intervaltree_state {
   interval_tree_t *tree;
   uint8_t providerid;
 
+  /** Number of intervals in the tree (including removed ones, which the tree
+      cannot drop, so they stay behind with a NULL record and are skipped by
+      lookups) */
+  uint64_t intervals_cnt;
+
 } ipmeta_ds_intervaltree_state_t;
 
 ipmeta_ds_t *ipmeta_ds_intervaltree_alloc()
@@ -67,6 +81,7 @@ int ipmeta_ds_intervaltree_init(ipmeta_ds_t *ds)
     return -1;
   }
   STATE(ds)->providerid = 0;
+  STATE(ds)->intervals_cnt = 0;
 
   return 0;
 }
@@ -93,7 +108,8 @@ void ipmeta_ds_intervaltree_free(ipmeta_ds_t *ds)
 }
 
 int ipmeta_ds_intervaltree_add_prefix(ipmeta_ds_t *ds, uint32_t addr,
-                                      uint8_t mask, ipmeta_record_t *record)
+                                      uint8_t mask, uint32_t provider_id,
+                                      ipmeta_record_t *record)
 {
 
   assert(ds != NULL && ds->state != NULL);
@@ -107,8 +123,8 @@ int ipmeta_ds_intervaltree_add_prefix(ipmeta_ds_t *ds, uint32_t addr,
   interval.data = record;
 
   if (STATE(ds)->providerid == 0) {
-    STATE(ds)->providerid = record->source;
-  } else if (STATE(ds)->providerid != record->source) {
+    STATE(ds)->providerid = provider_id;
+  } else if (STATE(ds)->providerid != provider_id) {
     ipmeta_log(
       __func__,
       "interval tree does not support storing records from multiple providers");
@@ -121,10 +137,17 @@ int ipmeta_ds_intervaltree_add_prefix(ipmeta_ds_t *ds, uint32_t addr,
     ipmeta_log(__func__, "could not malloc to insert prefix in interval tree");
     return -1;
   }
+  STATE(ds)->intervals_cnt++;
 
   return 0;
 }
 
+int ipmeta_ds_intervaltree_finalize(ipmeta_ds_t *ds)
+{
+  /* prefixes are inserted immediately, nothing to do */
+  return 0;
+}
+
 int ipmeta_ds_intervaltree_lookup_records(ipmeta_ds_t *ds, uint32_t addr,
                                           uint8_t mask, uint32_t providermask,
                                           ipmeta_record_set_t *records)
@@ -144,6 +167,9 @@ int ipmeta_ds_intervaltree_lookup_records(ipmeta_ds_t *ds, uint32_t addr,
   matches = getOverlapping(tree, &interval, &num_matches);
 
   for (i = 0; i < num_matches; i++) {
+    if (matches[i]->data == NULL) {
+      continue;
+    }
     /* Calculate number of (overlapping) IPs in record match */
     ov_start =
       (interval.start > matches[i]->start) ? interval.start : matches[i]->start;
@@ -152,6 +178,7 @@ int ipmeta_ds_intervaltree_lookup_records(ipmeta_ds_t *ds, uint32_t addr,
 
     if (ipmeta_record_set_add_record(records,
                                      (ipmeta_record_t *)matches[i]->data,
+                                     STATE(ds)->providerid,
                                      ov_end - ov_start + 1) != 0) {
       return -1;
     }
@@ -180,11 +207,195 @@ int ipmeta_ds_intervaltree_lookup_record_single(ipmeta_ds_t *ds, uint32_t addr,
     return 0;
   }
   for (i = 0; i < num_matches; i++) {
-    if (ipmeta_record_set_add_record(
-          found, (ipmeta_record_t *)(matches[i]->data), 1) != 0) {
+    if (matches[i]->data != NULL &&
+        ipmeta_record_set_add_record(found,
+                                     (ipmeta_record_t *)(matches[i]->data),
+                                     STATE(ds)->providerid, 1) != 0) {
       return -1;
     }
   }
 
   return found->n_recs;
 }
+
+int ipmeta_ds_intervaltree_lookup_record_range(ipmeta_ds_t *ds, uint32_t addr,
+                                               uint32_t providermask,
+                                               ipmeta_record_set_t *found,
+                                               uint32_t *first,
+                                               uint32_t *last)
+{
+  interval_tree_t *tree = STATE(ds)->tree;
+  interval_t interval;
+  int num_matches = 0, i;
+  interval_t **matches = NULL;
+  uint32_t haddr = ntohl(addr);
+  uint32_t lo, hi;
+
+  lo = haddr & (~0U << (32 - RANGE_SEARCH_BITS));
+  hi = lo | ~(~0U << (32 - RANGE_SEARCH_BITS));
+
+  interval.start = haddr;
+  interval.end = haddr;
+  interval.data = NULL;
+
+  /* the range lies inside every interval that contains the address */
+  matches = getOverlapping(tree, &interval, &num_matches);
+  for (i = 0; i < num_matches; i++) {
+    if (matches[i]->data != NULL &&
+        ipmeta_record_set_add_record(found,
+                                     (ipmeta_record_t *)(matches[i]->data),
+                                     STATE(ds)->providerid, 1) != 0) {
+      return -1;
+    }
+    if (matches[i]->start > lo) {
+      lo = matches[i]->start;
+    }
+    if (matches[i]->end < hi) {
+      hi = matches[i]->end;
+    }
+  }
+
+  /* and must not overlap any interval that does not contain the address */
+  interval.start = lo;
+  interval.end = hi;
+  matches = getOverlapping(tree, &interval, &num_matches);
+  for (i = 0; i < num_matches; i++) {
+    if (matches[i]->end < haddr && matches[i]->end >= lo) {
+      lo = matches[i]->end + 1;
+    } else if (matches[i]->start > haddr && matches[i]->start <= hi) {
+      hi = matches[i]->start - 1;
+    }
+  }
+
+  *first = lo;
+  *last = hi;
+
+  return found->n_recs;
+}
+
+ipmeta_record_t *
+ipmeta_ds_intervaltree_lookup_record_provider(ipmeta_ds_t *ds, uint32_t addr,
+                                              uint32_t provider_id)
+{
+  interval_t interval;
+  int num_matches = 0, i;
+  interval_t **matches = NULL;
+  interval_t *best = NULL;
+
+  /* the tree only ever holds the intervals of a single provider */
+  if (STATE(ds)->providerid != provider_id) {
+    return NULL;
+  }
+
+  interval.start = ntohl(addr);
+  interval.end = interval.start;
+  interval.data = NULL;
+
+  /* return the most specific (i.e., shortest) matching interval */
+  matches = getOverlapping(STATE(ds)->tree, &interval, &num_matches);
+  for (i = 0; i < num_matches; i++) {
+    if (matches[i]->data == NULL) {
+      continue;
+    }
+    if (best == NULL ||
+        matches[i]->end - matches[i]->start < best->end - best->start) {
+      best = matches[i];
+    }
+  }
+
+  return (best != NULL) ? (ipmeta_record_t *)best->data : NULL;
+}
+
+int ipmeta_ds_intervaltree_add_prefix6(ipmeta_ds_t *ds,
+                                       const struct in6_addr *addr,
+                                       uint8_t mask, uint32_t provider_id,
+                                       ipmeta_record_t *record)
+{
+  ipmeta_log(__func__, "the intervaltree datastructure does not support IPv6");
+  return -1;
+}
+
+int ipmeta_ds_intervaltree_lookup_records6(ipmeta_ds_t *ds,
+                                           const struct in6_addr *addr,
+                                           uint8_t mask, uint32_t providermask,
+                                           ipmeta_record_set_t *records)
+{
+  ipmeta_log(__func__, "the intervaltree datastructure does not support IPv6");
+  return -1;
+}
+
+int ipmeta_ds_intervaltree_lookup_record_single6(ipmeta_ds_t *ds,
+                                                 const struct in6_addr *addr,
+                                                 uint32_t providermask,
+                                                 ipmeta_record_set_t *found)
+{
+  ipmeta_log(__func__, "the intervaltree datastructure does not support IPv6");
+  return -1;
+}
+
+void ipmeta_ds_intervaltree_memory_usage(ipmeta_ds_t *ds,
+                                         ipmeta_memory_usage_t *usage)
+{
+  usage->ds[IPMETA_MEM_OTHER] +=
+    sizeof(ipmeta_ds_t) + sizeof(ipmeta_ds_intervaltree_state_t);
+
+  /* the tree only ever holds the intervals of a single provider */
+  if (STATE(ds)->providerid == 0) {
+    return;
+  }
+  usage->providers[STATE(ds)->providerid - 1][IPMETA_MEM_INTERVAL_NODES] +=
+    STATE(ds)->intervals_cnt * INTERVAL_NODE_SIZE;
+}
+
+/** Find the interval of the given prefix (or NULL if it was never added) */
+static interval_t *find_interval(interval_tree_t *tree, uint32_t addr,
+                                 uint8_t mask)
+{
+  interval_t interval;
+  int num_matches = 0, i;
+  interval_t **matches = NULL;
+
+  interval.start = ntohl(addr);
+  interval.end = interval.start + (1 << (32 - mask)) - 1;
+  interval.data = NULL;
+
+  /* the matches point at the intervals in the tree, so their records can be
+     changed in place */
+  matches = getOverlapping(tree, &interval, &num_matches);
+  for (i = 0; i < num_matches; i++) {
+    if (matches[i]->start == interval.start &&
+        matches[i]->end == interval.end) {
+      return matches[i];
+    }
+  }
+  return NULL;
+}
+
+int ipmeta_ds_intervaltree_remove_prefix(ipmeta_ds_t *ds, uint32_t addr,
+                                         uint8_t mask, uint32_t provider_id)
+{
+  interval_t *interval;
+
+  if (STATE(ds)->providerid != provider_id ||
+      (interval = find_interval(STATE(ds)->tree, addr, mask)) == NULL) {
+    return 0;
+  }
+  interval->data = NULL;
+
+  return 0;
+}
+
+int ipmeta_ds_intervaltree_update_prefix(ipmeta_ds_t *ds, uint32_t addr,
+                                         uint8_t mask, uint32_t provider_id,
+                                         ipmeta_record_t *record)
+{
+  interval_t *interval;
+
+  if (STATE(ds)->providerid == provider_id &&
+      (interval = find_interval(STATE(ds)->tree, addr, mask)) != NULL) {
+    interval->data = record;
+    return 0;
+  }
+  return ipmeta_ds_intervaltree_add_prefix(ds, addr, mask, provider_id,
+                                           record);
+}
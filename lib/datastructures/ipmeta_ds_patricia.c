@@ -25,6 +25,7 @@
 
 #include "config.h"
 
+#include <arpa/inet.h>
 #include <assert.h>
 
 #include "utils.h"
@@ -37,11 +38,89 @@
 
 #define STATE(ds) (IPMETA_DS_STATE(patricia, ds))
 
+/** Number of leading address bits used to partition the trie */
+#define ROOT_BITS 8
+
+/** Number of sub-tries hanging off the root */
+#define ROOT_CNT (1 << ROOT_BITS)
+
+/** Index of the sub-trie that the given (network byte-ordered) address
+    belongs to */
+#define ROOT_IDX(addr) (ntohl(addr) >> (32 - ROOT_BITS))
+
+/** Minimum number of pending prefixes before we use threads to build the
+    sub-tries */
+#define PARALLEL_MIN_PENDING 65536
+
+/** Number of address bits consumed by each level of the IPv6 trie */
+#define TRIE6_STRIDE 4
+
+/** Number of children of each IPv6 trie node */
+#define TRIE6_FANOUT (1 << TRIE6_STRIDE)
+
+/** Maximum depth of the IPv6 trie */
+#define TRIE6_MAX_DEPTH (128 / TRIE6_STRIDE)
+
+/** Number of prefix positions in each IPv6 trie node */
+#define TRIE6_POSITIONS (2 << TRIE6_STRIDE)
+
+/** Index of the child for the given address at the given depth */
+#define TRIE6_IDX(addr, depth)                                                 \
+  (((addr)->s6_addr[(depth) / 2] >> (((depth)&1) ? 0 : 4)) & 0xf)
+
+/** Position of the prefix of length depth * TRIE6_STRIDE + k that covers the
+    given address in the node at the given depth */
+#define TRIE6_POS(addr, depth, k)                                              \
+  ((1 << (k)) + (TRIE6_IDX(addr, depth) >> (TRIE6_STRIDE - (k))))
+
 static ipmeta_ds_t ipmeta_ds_patricia = {
   IPMETA_DS_PATRICIA, DS_NAME, IPMETA_DS_GENERATE_PTRS(patricia) NULL};
 
+/** A prefix waiting to be inserted into its sub-trie */
+typedef struct pending_prefix {
+  uint32_t addr;
+  uint8_t mask;
+  uint8_t provider_id;
+  ipmeta_record_t *record;
+} pending_prefix_t;
+
+/** The list of prefixes waiting to be inserted into one sub-trie */
+typedef struct pending_bucket {
+  pending_prefix_t *pfxs;
+  uint32_t pfxs_cnt;
+  uint32_t pfxs_alloc;
+} pending_bucket_t;
+
+/** A node of the IPv6 multibit trie. A node at depth d holds the prefixes of
+    length d * TRIE6_STRIDE + k (1 <= k <= TRIE6_STRIDE, and the root also
+    holds a /0 with k = 0) at position (1 << k) + (the k bits of the prefix
+    after the first d * TRIE6_STRIDE bits). */
+typedef struct trie6_node {
+  struct trie6_node *children[TRIE6_FANOUT];
+
+  /** Record slots of the prefixes that end in this node, indexed by position
+      (NULL until needed) */
+  ipmeta_ds_slots_t **prefixes;
+} trie6_node_t;
+
 typedef struct ipmeta_ds_patricia_state {
-  patricia_tree_t *trie;
+  /** Trie holding prefixes shorter than ROOT_BITS. These cover several
+   * sub-tries, so they are kept separately and inserted immediately */
+  patricia_tree_t *covering;
+
+  /** Sub-tries holding prefixes of length ROOT_BITS or longer, indexed by the
+   * top ROOT_BITS bits of the prefix (NULL until needed) */
+  patricia_tree_t *tries[ROOT_CNT];
+
+  /** Prefixes that have been added, but not yet inserted into a sub-trie.
+   * These are inserted (in parallel) when the ds is finalized. */
+  pending_bucket_t pending[ROOT_CNT];
+
+  /** Total number of prefixes in the pending buckets */
+  uint64_t pending_cnt;
+
+  /** Root of the IPv6 trie (NULL until an IPv6 prefix is added) */
+  trie6_node_t *root6;
 
 } ipmeta_ds_patricia_state_t;
 
@@ -56,14 +135,14 @@ int ipmeta_ds_patricia_init(ipmeta_ds_t *ds)
 
   assert(STATE(ds) == NULL);
 
-  if ((ds->state = malloc(sizeof(ipmeta_ds_patricia_state_t))) == NULL) {
+  if ((ds->state = malloc_zero(sizeof(ipmeta_ds_patricia_state_t))) == NULL) {
     ipmeta_log(__func__, "could not malloc patricia state");
     return -1;
   }
 
-  /** @todo make support IPv6 */
-  STATE(ds)->trie = New_Patricia(32);
-  assert(STATE(ds)->trie != NULL);
+  /* IPv6 prefixes are stored in a separate multibit trie */
+  STATE(ds)->covering = New_Patricia(32);
+  assert(STATE(ds)->covering != NULL);
 
   return 0;
 }
@@ -73,18 +152,51 @@ static void free_prefix(void *data)
   free(data);
 }
 
+static void free_trie6(trie6_node_t *node)
+{
+  int i;
+
+  if (node == NULL) {
+    return;
+  }
+  for (i = 0; i < TRIE6_FANOUT; i++) {
+    free_trie6(node->children[i]);
+  }
+  if (node->prefixes != NULL) {
+    for (i = 0; i < TRIE6_POSITIONS; i++) {
+      free(node->prefixes[i]);
+    }
+    free(node->prefixes);
+  }
+  free(node);
+}
+
 void ipmeta_ds_patricia_free(ipmeta_ds_t *ds)
 {
+  int i;
+
   if (ds == NULL) {
     return;
   }
 
   if (STATE(ds) != NULL) {
-    if (STATE(ds)->trie != NULL) {
-      Destroy_Patricia(STATE(ds)->trie, free_prefix);
-      STATE(ds)->trie = NULL;
+    if (STATE(ds)->covering != NULL) {
+      Destroy_Patricia(STATE(ds)->covering, free_prefix);
+      STATE(ds)->covering = NULL;
     }
 
+    for (i = 0; i < ROOT_CNT; i++) {
+      if (STATE(ds)->tries[i] != NULL) {
+        Destroy_Patricia(STATE(ds)->tries[i], free_prefix);
+        STATE(ds)->tries[i] = NULL;
+      }
+      free(STATE(ds)->pending[i].pfxs);
+      STATE(ds)->pending[i].pfxs = NULL;
+    }
+
+    free_trie6(STATE(ds)->root6);
+    STATE(ds)->root6 = NULL;
+
     free(STATE(ds));
     ds->state = NULL;
   }
@@ -94,12 +206,10 @@ void ipmeta_ds_patricia_free(ipmeta_ds_t *ds)
   return;
 }
 
-int ipmeta_ds_patricia_add_prefix(ipmeta_ds_t *ds, uint32_t addr, uint8_t mask,
-                                  ipmeta_record_t *record)
+/** Insert a prefix into the given trie */
+static int insert_prefix(patricia_tree_t *trie, uint32_t addr, uint8_t mask,
+                         uint32_t provider_id, ipmeta_record_t *record)
 {
-  assert(ds != NULL && ds->state != NULL);
-  patricia_tree_t *trie = STATE(ds)->trie;
-  ipmeta_record_t **recarray = NULL;
   assert(trie != NULL);
 
   prefix_t trie_pfx;
@@ -115,11 +225,114 @@ int ipmeta_ds_patricia_add_prefix(ipmeta_ds_t *ds, uint32_t addr, uint8_t mask,
     return -1;
   }
 
-  if (trie_node->data == NULL) {
-    trie_node->data = calloc(IPMETA_PROVIDER_MAX, sizeof(ipmeta_record_t *));
+  /* node data holds the record slots of the prefix */
+  if (ipmeta_ds_slots_set((ipmeta_ds_slots_t **)&trie_node->data,
+                          provider_id - 1, record) != 0) {
+    ipmeta_log(__func__, "failed to store record for prefix");
+    return -1;
+  }
+
+  return 0;
+}
+
+int ipmeta_ds_patricia_add_prefix(ipmeta_ds_t *ds, uint32_t addr, uint8_t mask,
+                                  uint32_t provider_id,
+                                  ipmeta_record_t *record)
+{
+  assert(ds != NULL && ds->state != NULL);
+  ipmeta_ds_patricia_state_t *state = STATE(ds);
+  pending_bucket_t *bucket;
+  pending_prefix_t *tmp;
+
+  /* short prefixes span several sub-tries, so they go straight into the
+     covering trie */
+  if (mask < ROOT_BITS) {
+    return insert_prefix(state->covering, addr, mask, provider_id, record);
+  }
+
+  /* everything else is queued up until the ds is finalized */
+  bucket = &state->pending[ROOT_IDX(addr)];
+  if (bucket->pfxs_cnt == bucket->pfxs_alloc) {
+    bucket->pfxs_alloc =
+      (bucket->pfxs_alloc == 0) ? 1024 : bucket->pfxs_alloc * 2;
+    if ((tmp = realloc(bucket->pfxs, sizeof(pending_prefix_t) *
+                                       bucket->pfxs_alloc)) == NULL) {
+      ipmeta_log(__func__, "could not realloc pending prefix list");
+      return -1;
+    }
+    bucket->pfxs = tmp;
+  }
+  bucket->pfxs[bucket->pfxs_cnt].addr = addr;
+  bucket->pfxs[bucket->pfxs_cnt].mask = mask;
+  bucket->pfxs[bucket->pfxs_cnt].provider_id = provider_id;
+  bucket->pfxs[bucket->pfxs_cnt].record = record;
+  bucket->pfxs_cnt++;
+  state->pending_cnt++;
+
+  return 0;
+}
+
+/** Insert all pending prefixes for one sub-trie (run by a worker thread) */
+static int build_subtrie(void *user, int idx)
+{
+  ipmeta_ds_patricia_state_t *state = (ipmeta_ds_patricia_state_t *)user;
+  pending_bucket_t *bucket = &state->pending[idx];
+  uint32_t i;
+
+  if (bucket->pfxs_cnt == 0) {
+    return 0;
+  }
+
+  /* prefixes are inserted in the order they were added, so if a prefix is
+     added twice by the same provider, the last record wins (just like it
+     would if we inserted immediately) */
+  for (i = 0; i < bucket->pfxs_cnt; i++) {
+    if (insert_prefix(state->tries[idx], bucket->pfxs[i].addr,
+                      bucket->pfxs[i].mask, bucket->pfxs[i].provider_id,
+                      bucket->pfxs[i].record) != 0) {
+      return -1;
+    }
+  }
+
+  free(bucket->pfxs);
+  bucket->pfxs = NULL;
+  bucket->pfxs_cnt = 0;
+  bucket->pfxs_alloc = 0;
+
+  return 0;
+}
+
+int ipmeta_ds_patricia_finalize(ipmeta_ds_t *ds)
+{
+  ipmeta_ds_patricia_state_t *state = STATE(ds);
+  int i;
+
+  if (state->pending_cnt == 0) {
+    return 0;
   }
-  recarray = (ipmeta_record_t **)(trie_node->data);
-  recarray[record->source - 1] = record;
+
+  /* create the sub-tries up front since New_Patricia is not thread-safe */
+  for (i = 0; i < ROOT_CNT; i++) {
+    if (state->pending[i].pfxs_cnt > 0 && state->tries[i] == NULL &&
+        (state->tries[i] = New_Patricia(32)) == NULL) {
+      ipmeta_log(__func__, "could not create sub-trie");
+      return -1;
+    }
+  }
+
+  /* each sub-trie is independent, so they can be built in parallel */
+  if (state->pending_cnt < PARALLEL_MIN_PENDING) {
+    for (i = 0; i < ROOT_CNT; i++) {
+      if (build_subtrie(state, i) != 0) {
+        return -1;
+      }
+    }
+  } else if (ipmeta_ds_parallel_for(ROOT_CNT, build_subtrie, state) != 0) {
+    ipmeta_log(__func__, "failed to build sub-tries");
+    return -1;
+  }
+
+  state->pending_cnt = 0;
 
   return 0;
 }
@@ -130,30 +343,16 @@ static inline int extract_records_from_pnode(patricia_node_t *node,
                                              ipmeta_record_set_t *found,
                                              uint8_t ascendallowed)
 {
-  ipmeta_record_t **recfound;
   while (*foundsofar != provmask && node != NULL) {
-    int i;
     if (node->prefix == NULL) {
       node = node->parent;
       continue;
     }
 
-    recfound = (ipmeta_record_t **)(node->data);
-    for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
-      if ((1 << (i)&provmask) == 0) {
-        continue;
-      }
-      if ((1 << (i) & *foundsofar) != 0) {
-        continue;
-      }
-      if (recfound[i] == NULL) {
-        continue;
-      }
-      if (ipmeta_record_set_add_record(
-            found, recfound[i], (1 << (32 - node->prefix->bitlen))) != 0) {
-        return -1;
-      }
-      *foundsofar |= (1 << (i));
+    if (ipmeta_ds_slots_extract((ipmeta_ds_slots_t *)node->data, provmask,
+                                foundsofar, (1 << (32 - node->prefix->bitlen)),
+                                found) != 0) {
+      return -1;
     }
     if (!ascendallowed) {
       node = NULL;
@@ -164,13 +363,13 @@ static inline int extract_records_from_pnode(patricia_node_t *node,
   return 0;
 }
 
-static int descend_ptree(ipmeta_ds_t *ds, prefix_t pfx, uint32_t provmask,
-                         uint32_t *foundsofar, ipmeta_record_set_t *records)
+static int descend_ptree(patricia_tree_t *trie, prefix_t pfx, u_short maxlen,
+                         uint32_t provmask, uint32_t *foundsofar,
+                         ipmeta_record_set_t *records)
 {
   prefix_t subpfx_a;
   prefix_t subpfx_b;
   patricia_node_t *node = NULL;
-  patricia_tree_t *trie = STATE(ds)->trie;
 
   subpfx_a.family = AF_INET;
   subpfx_a.ref_count = 0;
@@ -202,30 +401,35 @@ static int descend_ptree(ipmeta_ds_t *ds, prefix_t pfx, uint32_t provmask,
     return -1;
   }
 
-  if (*foundsofar == provmask || subpfx_a.bitlen == 32) {
+  /* this trie holds nothing longer than maxlen */
+  if (*foundsofar == provmask || subpfx_a.bitlen >= maxlen) {
     return 0;
   }
 
-  if (descend_ptree(ds, subpfx_a, provmask, foundsofar, records) < 0) {
+  if (descend_ptree(trie, subpfx_a, maxlen, provmask, foundsofar, records) <
+      0) {
     return -1;
   }
-  if (descend_ptree(ds, subpfx_b, provmask, foundsofar, records) < 0) {
+  if (descend_ptree(trie, subpfx_b, maxlen, provmask, foundsofar, records) <
+      0) {
     return -1;
   }
   return 0;
 }
 
-int _patricia_prefix_lookup(ipmeta_ds_t *ds, prefix_t pfx, uint32_t provmask,
-                            ipmeta_record_set_t *records, uint32_t *foundsofar)
+/** Find records for the given prefix (and any prefixes that cover it) in the
+    given trie */
+static int search_covering(patricia_tree_t *trie, prefix_t *pfx,
+                           uint32_t provmask, uint32_t *foundsofar,
+                           ipmeta_record_set_t *records)
 {
-  patricia_tree_t *trie = STATE(ds)->trie;
   patricia_node_t *node = NULL;
 
-  if (*foundsofar == provmask) {
+  if (trie == NULL || *foundsofar == provmask) {
     return 0;
   }
 
-  node = patricia_search_best2(trie, &pfx, 1);
+  node = patricia_search_best2(trie, pfx, 1);
 
   if (node &&
       extract_records_from_pnode(node, provmask, foundsofar, records, 1) < 0) {
@@ -233,14 +437,6 @@ int _patricia_prefix_lookup(ipmeta_ds_t *ds, prefix_t pfx, uint32_t provmask,
     return -1;
   }
 
-  if (*foundsofar != provmask && pfx.bitlen < 32) {
-    // try looking for more specific prefixes for any providers where we
-    // have no answer, but don't waste time ascending the tree
-    if (descend_ptree(ds, pfx, provmask, foundsofar, records) < 0) {
-      return -1;
-    }
-  }
-
   return 0;
 }
 
@@ -248,8 +444,11 @@ int ipmeta_ds_patricia_lookup_records(ipmeta_ds_t *ds, uint32_t addr,
                                       uint8_t mask, uint32_t providermask,
                                       ipmeta_record_set_t *records)
 {
+  ipmeta_ds_patricia_state_t *state = STATE(ds);
+  patricia_tree_t *trie;
   prefix_t pfx;
   uint32_t foundsofar = 0;
+  uint32_t first, i;
 
   /** @todo make support IPv6 */
   pfx.family = AF_INET;
@@ -257,7 +456,59 @@ int ipmeta_ds_patricia_lookup_records(ipmeta_ds_t *ds, uint32_t addr,
   pfx.add.sin.s_addr = addr;
   pfx.bitlen = mask;
 
-  _patricia_prefix_lookup(ds, pfx, providermask, records, &foundsofar);
+  if (mask >= ROOT_BITS) {
+    trie = state->tries[ROOT_IDX(addr)];
+
+    /* the most specific covering prefixes are in the sub-trie, and then the
+       shortest ones are in the covering trie */
+    if (search_covering(trie, &pfx, providermask, &foundsofar, records) != 0 ||
+        search_covering(state->covering, &pfx, providermask, &foundsofar,
+                        records) != 0) {
+      return -1;
+    }
+
+    // try looking for more specific prefixes for any providers where we
+    // have no answer, but don't waste time ascending the tree
+    if (trie != NULL && foundsofar != providermask && mask < 32 &&
+        descend_ptree(trie, pfx, 32, providermask, &foundsofar, records) <
+          0) {
+      return -1;
+    }
+
+    return records->n_recs;
+  }
+
+  /* this prefix is shorter than a sub-trie, so first look at the covering
+     trie (including more specific prefixes that are still too short to be in
+     a sub-trie) */
+  if (search_covering(state->covering, &pfx, providermask, &foundsofar,
+                      records) != 0) {
+    return -1;
+  }
+  if (foundsofar != providermask && mask < ROOT_BITS - 1 &&
+      descend_ptree(state->covering, pfx, ROOT_BITS - 1, providermask,
+                    &foundsofar, records) < 0) {
+    return -1;
+  }
+
+  /* and then each of the sub-tries inside this prefix */
+  first = ROOT_IDX(addr) & ~((1 << (ROOT_BITS - mask)) - 1);
+  for (i = first; i < first + (1 << (ROOT_BITS - mask)) &&
+                  foundsofar != providermask;
+       i++) {
+    if ((trie = state->tries[i]) == NULL) {
+      continue;
+    }
+    pfx.add.sin.s_addr = htonl(i << (32 - ROOT_BITS));
+    pfx.bitlen = ROOT_BITS;
+    if (search_covering(trie, &pfx, providermask, &foundsofar, records) != 0) {
+      return -1;
+    }
+    if (foundsofar != providermask &&
+        descend_ptree(trie, pfx, 32, providermask, &foundsofar, records) < 0) {
+      return -1;
+    }
+  }
 
   return records->n_recs;
 }
@@ -266,8 +517,7 @@ int ipmeta_ds_patricia_lookup_record_single(ipmeta_ds_t *ds, uint32_t addr,
                                             uint32_t providermask,
                                             ipmeta_record_set_t *found)
 {
-  patricia_tree_t *trie = STATE(ds)->trie;
-  patricia_node_t *node = NULL;
+  ipmeta_ds_patricia_state_t *state = STATE(ds);
   prefix_t pfx;
   uint32_t foundsofar = 0;
 
@@ -277,14 +527,528 @@ int ipmeta_ds_patricia_lookup_record_single(ipmeta_ds_t *ds, uint32_t addr,
   pfx.add.sin.s_addr = addr;
   pfx.bitlen = 32;
 
-  if ((node = patricia_search_best2(trie, &pfx, 1)) == NULL) {
+  if (search_covering(state->tries[ROOT_IDX(addr)], &pfx, providermask,
+                      &foundsofar, found) != 0 ||
+      search_covering(state->covering, &pfx, providermask, &foundsofar,
+                      found) != 0) {
+    return -1;
+  }
+
+  return found->n_recs;
+}
+
+/** Find the record of the given provider in the most specific prefix of the
+    given trie that covers pfx (and has a record for that provider) */
+static ipmeta_record_t *search_provider(patricia_tree_t *trie, prefix_t *pfx,
+                                        uint32_t provider_id)
+{
+  patricia_node_t *node;
+  ipmeta_record_t *rec;
+
+  if (trie == NULL) {
+    return NULL;
+  }
+
+  for (node = patricia_search_best2(trie, pfx, 1); node != NULL;
+       node = node->parent) {
+    if (node->prefix != NULL &&
+        (rec = ipmeta_ds_slots_get((ipmeta_ds_slots_t *)node->data,
+                                   provider_id - 1)) != NULL) {
+      return rec;
+    }
+  }
+  return NULL;
+}
+
+ipmeta_record_t *ipmeta_ds_patricia_lookup_record_provider(ipmeta_ds_t *ds,
+                                                          uint32_t addr,
+                                                          uint32_t provider_id)
+{
+  ipmeta_ds_patricia_state_t *state = STATE(ds);
+  ipmeta_record_t *rec;
+  prefix_t pfx;
+
+  pfx.family = AF_INET;
+  pfx.ref_count = 0;
+  pfx.add.sin.s_addr = addr;
+  pfx.bitlen = 32;
+
+  if ((rec = search_provider(state->tries[ROOT_IDX(addr)], &pfx,
+                             provider_id)) != NULL) {
+    return rec;
+  }
+  return search_provider(state->covering, &pfx, provider_id);
+}
+
+/** Get the length of the largest prefix around the given address (host byte
+    order) that does not contain any more specific prefix of the given trie.
+    The result of a lookup is the same for every address in that prefix. */
+static int empty_prefix_len(patricia_tree_t *trie, uint32_t addr)
+{
+  patricia_node_t *node;
+  uint32_t diff;
+  u_int differ_bit;
+
+  if (trie == NULL || (node = trie->head) == NULL) {
     return 0;
   }
 
-  if (extract_records_from_pnode(node, providermask, &foundsofar, found, 1) <
-      0) {
+  /* descend as patricia_lookup would when inserting addr/32, glue nodes
+     always have both children */
+  while (node->bit < 32 || node->prefix == NULL) {
+    if (node->bit < 32 && (addr & (0x80000000U >> node->bit)) != 0) {
+      if (node->r == NULL) {
+        break;
+      }
+      node = node->r;
+    } else {
+      if (node->l == NULL) {
+        break;
+      }
+      node = node->l;
+    }
+  }
+
+  /* no prefix in the trie agrees with addr beyond the first differing bit
+     (or beyond the prefix where the descent stopped) */
+  diff = ntohl(node->prefix->add.sin.s_addr) ^ addr;
+  differ_bit = (diff == 0) ? 32 : __builtin_clz(diff);
+  if (differ_bit > node->bit) {
+    differ_bit = node->bit;
+  }
+
+  /* a leaf prefix that covers addr contains no more specific prefixes */
+  if (differ_bit == node->bit && node->l == NULL && node->r == NULL) {
+    return differ_bit;
+  }
+
+  return (differ_bit < 32) ? differ_bit + 1 : 32;
+}
+
+/** Check that there are no sub-tries (other than the empty one of the
+    address itself) inside the given prefix */
+static int subtries_empty(ipmeta_ds_patricia_state_t *state, uint32_t addr,
+                          int len)
+{
+  uint32_t first, i;
+
+  first = (addr >> (32 - ROOT_BITS)) & ~((1 << (ROOT_BITS - len)) - 1);
+  for (i = first; i < first + (1 << (ROOT_BITS - len)); i++) {
+    if (state->tries[i] != NULL && state->tries[i]->head != NULL) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int ipmeta_ds_patricia_lookup_record_range(ipmeta_ds_t *ds, uint32_t addr,
+                                           uint32_t providermask,
+                                           ipmeta_record_set_t *found,
+                                           uint32_t *first, uint32_t *last)
+{
+  ipmeta_ds_patricia_state_t *state = STATE(ds);
+  uint32_t haddr = ntohl(addr);
+  uint32_t netmask;
+  int len, covering_len;
+
+  len = empty_prefix_len(state->tries[ROOT_IDX(addr)], haddr);
+  covering_len = empty_prefix_len(state->covering, haddr);
+  if (covering_len > len) {
+    len = covering_len;
+  }
+
+  /* a prefix shorter than a sub-trie must not contain any other sub-trie */
+  while (len < ROOT_BITS && subtries_empty(state, haddr, len) == 0) {
+    len++;
+  }
+
+  netmask = (len == 0) ? 0 : ~0U << (32 - len);
+  *first = haddr & netmask;
+  *last = *first | ~netmask;
+
+  return ipmeta_ds_patricia_lookup_record_single(ds, addr, providermask,
+                                                 found);
+}
+
+/** Number of addresses in an IPv6 prefix of the given length (saturated at
+    UINT32_MAX) */
+static uint32_t prefix6_size(uint8_t mask)
+{
+  return (mask > 96) ? (1U << (128 - mask)) : UINT32_MAX;
+}
+
+/** Allocate an empty IPv6 trie node */
+static trie6_node_t *trie6_node_create()
+{
+  return malloc_zero(sizeof(trie6_node_t));
+}
+
+int ipmeta_ds_patricia_add_prefix6(ipmeta_ds_t *ds,
+                                   const struct in6_addr *addr, uint8_t mask,
+                                   uint32_t provider_id,
+                                   ipmeta_record_t *record)
+{
+  ipmeta_ds_patricia_state_t *state = STATE(ds);
+  trie6_node_t *node;
+  int depth, last_depth, k, i;
+
+  if (mask > 128) {
+    ipmeta_log(__func__, "invalid IPv6 prefix length (%d)", mask);
+    return -1;
+  }
+
+  if (state->root6 == NULL &&
+      (state->root6 = trie6_node_create()) == NULL) {
+    ipmeta_log(__func__, "could not malloc IPv6 trie root");
     return -1;
   }
 
+  /* the prefix ends in the node that holds its last bit */
+  last_depth = (mask == 0) ? 0 : (mask - 1) / TRIE6_STRIDE;
+  node = state->root6;
+  for (depth = 0; depth < last_depth; depth++) {
+    i = TRIE6_IDX(addr, depth);
+    if (node->children[i] == NULL &&
+        (node->children[i] = trie6_node_create()) == NULL) {
+      ipmeta_log(__func__, "could not malloc IPv6 trie node");
+      return -1;
+    }
+    node = node->children[i];
+  }
+
+  if (node->prefixes == NULL) {
+    if ((node->prefixes = calloc(TRIE6_POSITIONS, sizeof(*node->prefixes))) ==
+        NULL) {
+      ipmeta_log(__func__, "could not malloc IPv6 trie positions");
+      return -1;
+    }
+  }
+
+  k = mask - last_depth * TRIE6_STRIDE;
+  if (ipmeta_ds_slots_set(&node->prefixes[TRIE6_POS(addr, last_depth, k)],
+                          provider_id - 1, record) != 0) {
+    ipmeta_log(__func__, "failed to store record for prefix");
+    return -1;
+  }
+
+  return 0;
+}
+
+/** Add the records of the given prefix for the providers in provmask that
+    are not yet in foundsofar */
+static int trie6_extract(ipmeta_ds_slots_t *slots, uint8_t mask,
+                         uint32_t provmask, uint32_t *foundsofar,
+                         ipmeta_record_set_t *found)
+{
+  return ipmeta_ds_slots_extract(slots, provmask, foundsofar,
+                                 prefix6_size(mask), found);
+}
+
+/** Find the most specific records (per provider) of the prefixes that cover
+    the first mask bits of addr */
+static int trie6_search_covering(ipmeta_ds_patricia_state_t *state,
+                                 const struct in6_addr *addr, uint8_t mask,
+                                 uint32_t provmask, uint32_t *foundsofar,
+                                 ipmeta_record_set_t *found)
+{
+  trie6_node_t *path[TRIE6_MAX_DEPTH];
+  trie6_node_t *node = state->root6;
+  int depth, path_cnt = 0, k, k_max;
+
+  /* remember the nodes that hold prefixes no longer than mask */
+  for (depth = 0; node != NULL && (depth == 0 || depth * TRIE6_STRIDE < mask);
+       depth++) {
+    path[path_cnt++] = node;
+    node = node->children[TRIE6_IDX(addr, depth)];
+  }
+
+  /* the deepest node, and its longest prefixes, are the most specific */
+  while (path_cnt > 0 && *foundsofar != provmask) {
+    depth = --path_cnt;
+    node = path[depth];
+    if (node->prefixes == NULL) {
+      continue;
+    }
+    k_max = mask - depth * TRIE6_STRIDE;
+    if (k_max > TRIE6_STRIDE) {
+      k_max = TRIE6_STRIDE;
+    }
+    for (k = k_max; k >= (depth == 0 ? 0 : 1); k--) {
+      if (trie6_extract(node->prefixes[TRIE6_POS(addr, depth, k)],
+                        depth * TRIE6_STRIDE + k, provmask, foundsofar,
+                        found) != 0) {
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+/** Find records of prefixes inside the given node (at the given depth) and
+    below it for providers that have none yet */
+static int trie6_search_subtree(trie6_node_t *node, int depth,
+                                uint32_t provmask, uint32_t *foundsofar,
+                                ipmeta_record_set_t *found)
+{
+  int i, k;
+
+  if (node->prefixes != NULL) {
+    for (k = 1; k <= TRIE6_STRIDE; k++) {
+      for (i = 0; i < (1 << k); i++) {
+        if (trie6_extract(node->prefixes[(1 << k) + i],
+                          depth * TRIE6_STRIDE + k, provmask, foundsofar,
+                          found) != 0) {
+          return -1;
+        }
+      }
+    }
+  }
+  for (i = 0; i < TRIE6_FANOUT && *foundsofar != provmask; i++) {
+    if (node->children[i] != NULL &&
+        trie6_search_subtree(node->children[i], depth + 1, provmask,
+                             foundsofar, found) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int ipmeta_ds_patricia_lookup_records6(ipmeta_ds_t *ds,
+                                       const struct in6_addr *addr,
+                                       uint8_t mask, uint32_t providermask,
+                                       ipmeta_record_set_t *records)
+{
+  ipmeta_ds_patricia_state_t *state = STATE(ds);
+  trie6_node_t *node = state->root6;
+  uint32_t foundsofar = 0;
+  int depth, last_depth, r, k, i, first, span;
+
+  if (mask > 128) {
+    ipmeta_log(__func__, "invalid IPv6 prefix length (%d)", mask);
+    return -1;
+  }
+
+  if (trie6_search_covering(state, addr, mask, providermask, &foundsofar,
+                            records) != 0) {
+    return -1;
+  }
+  if (foundsofar == providermask || mask == 128) {
+    return records->n_recs;
+  }
+
+  /* the node that holds prefixes of length mask + 1 */
+  last_depth = mask / TRIE6_STRIDE;
+  for (depth = 0; node != NULL && depth < last_depth; depth++) {
+    node = node->children[TRIE6_IDX(addr, depth)];
+  }
+  if (node == NULL) {
+    return records->n_recs;
+  }
+
+  /* r bits of the prefix are inside this node, so look at the longer
+     prefixes of the node that share them, and the children below them */
+  r = mask - last_depth * TRIE6_STRIDE;
+  if (node->prefixes != NULL) {
+    for (k = r + 1; k <= TRIE6_STRIDE; k++) {
+      first = TRIE6_POS(addr, last_depth, r) - (1 << r);
+      first = (1 << k) + (first << (k - r));
+      for (i = first; i < first + (1 << (k - r)); i++) {
+        if (trie6_extract(node->prefixes[i], last_depth * TRIE6_STRIDE + k,
+                          providermask, &foundsofar, records) != 0) {
+          return -1;
+        }
+      }
+    }
+  }
+  span = 1 << (TRIE6_STRIDE - r);
+  first = TRIE6_IDX(addr, last_depth) & ~(span - 1);
+  for (i = first; i < first + span && foundsofar != providermask; i++) {
+    if (node->children[i] != NULL &&
+        trie6_search_subtree(node->children[i], last_depth + 1, providermask,
+                             &foundsofar, records) != 0) {
+      return -1;
+    }
+  }
+
+  return records->n_recs;
+}
+
+int ipmeta_ds_patricia_lookup_record_single6(ipmeta_ds_t *ds,
+                                             const struct in6_addr *addr,
+                                             uint32_t providermask,
+                                             ipmeta_record_set_t *found)
+{
+  trie6_node_t *node = STATE(ds)->root6;
+  trie6_node_t *path[TRIE6_MAX_DEPTH];
+  uint32_t foundsofar = 0;
+  int depth, k;
+
+  /* one step per TRIE6_STRIDE bits, so a /48 takes 12 steps */
+  for (depth = 0; node != NULL && depth < TRIE6_MAX_DEPTH; depth++) {
+    path[depth] = node;
+    node = node->children[TRIE6_IDX(addr, depth)];
+  }
+
+  while (depth > 0 && foundsofar != providermask) {
+    node = path[--depth];
+    if (node->prefixes == NULL) {
+      continue;
+    }
+    for (k = TRIE6_STRIDE; k >= (depth == 0 ? 0 : 1); k--) {
+      if (trie6_extract(node->prefixes[TRIE6_POS(addr, depth, k)],
+                        depth * TRIE6_STRIDE + k, providermask, &foundsofar,
+                        found) != 0) {
+        return -1;
+      }
+    }
+  }
+
   return found->n_recs;
 }
+
+/** Maximum depth of a trie (one level per address bit, plus the root) */
+#define TRIE_MAX_DEPTH 129
+
+/** Add the memory used by the given trie to the shared ds usage */
+static void trie_memory_usage(patricia_tree_t *trie, uint64_t *usage)
+{
+  patricia_node_t *stack[TRIE_MAX_DEPTH];
+  patricia_node_t **sp = stack;
+  patricia_node_t *node;
+
+  if (trie == NULL) {
+    return;
+  }
+  usage[IPMETA_MEM_TRIE_NODES] += sizeof(patricia_tree_t);
+
+  node = trie->head;
+  while (node != NULL) {
+    usage[IPMETA_MEM_TRIE_NODES] += sizeof(patricia_node_t);
+    if (node->prefix != NULL) {
+      usage[IPMETA_MEM_TRIE_NODES] += sizeof(prefix_t);
+    }
+    if (node->data != NULL) {
+      usage[IPMETA_MEM_NODE_RECORDS] +=
+        IPMETA_DS_SLOTS_SIZE((ipmeta_ds_slots_t *)node->data);
+    }
+
+    /* visit the left child next, and come back for the right one */
+    if (node->l != NULL) {
+      if (node->r != NULL) {
+        assert(sp - stack < TRIE_MAX_DEPTH);
+        *sp++ = node->r;
+      }
+      node = node->l;
+    } else if (node->r != NULL) {
+      node = node->r;
+    } else if (sp != stack) {
+      node = *(--sp);
+    } else {
+      node = NULL;
+    }
+  }
+}
+
+/** Add the memory used by the given IPv6 trie node (and the nodes below it)
+    to the shared ds usage */
+static void trie6_memory_usage(trie6_node_t *node, uint64_t *usage)
+{
+  int i;
+
+  if (node == NULL) {
+    return;
+  }
+  usage[IPMETA_MEM_TRIE_NODES] += sizeof(trie6_node_t);
+  if (node->prefixes != NULL) {
+    usage[IPMETA_MEM_TRIE_NODES] +=
+      TRIE6_POSITIONS * sizeof(ipmeta_ds_slots_t *);
+    for (i = 0; i < TRIE6_POSITIONS; i++) {
+      if (node->prefixes[i] != NULL) {
+        usage[IPMETA_MEM_NODE_RECORDS] +=
+          IPMETA_DS_SLOTS_SIZE(node->prefixes[i]);
+      }
+    }
+  }
+  for (i = 0; i < TRIE6_FANOUT; i++) {
+    trie6_memory_usage(node->children[i], usage);
+  }
+}
+
+void ipmeta_ds_patricia_memory_usage(ipmeta_ds_t *ds,
+                                     ipmeta_memory_usage_t *usage)
+{
+  ipmeta_ds_patricia_state_t *state = STATE(ds);
+  int i;
+
+  usage->ds[IPMETA_MEM_OTHER] += sizeof(ipmeta_ds_t) + sizeof(*state);
+
+  trie_memory_usage(state->covering, usage->ds);
+  for (i = 0; i < ROOT_CNT; i++) {
+    trie_memory_usage(state->tries[i], usage->ds);
+    usage->ds[IPMETA_MEM_OTHER] +=
+      (uint64_t)state->pending[i].pfxs_alloc * sizeof(pending_prefix_t);
+  }
+
+  trie6_memory_usage(state->root6, usage->ds);
+}
+
+int ipmeta_ds_patricia_remove_prefix(ipmeta_ds_t *ds, uint32_t addr,
+                                     uint8_t mask, uint32_t provider_id)
+{
+  ipmeta_ds_patricia_state_t *state = STATE(ds);
+  patricia_tree_t *trie;
+  patricia_node_t *node;
+  prefix_t pfx;
+
+  /* the prefix may still be waiting in a bucket */
+  if (state->pending_cnt != 0 && ipmeta_ds_patricia_finalize(ds) != 0) {
+    return -1;
+  }
+
+  trie = (mask < ROOT_BITS) ? state->covering : state->tries[ROOT_IDX(addr)];
+  if (trie == NULL) {
+    return 0;
+  }
+
+  pfx.family = AF_INET;
+  pfx.ref_count = 0;
+  pfx.add.sin.s_addr = addr;
+  pfx.bitlen = mask;
+  if ((node = patricia_search_exact(trie, &pfx)) == NULL) {
+    return 0;
+  }
+
+  if (ipmeta_ds_slots_clear((ipmeta_ds_slots_t **)&node->data,
+                            provider_id - 1) != 0) {
+    return -1;
+  }
+  /* nodes without records would only slow lookups down */
+  if (node->data == NULL) {
+    patricia_remove(trie, node);
+  }
+
+  return 0;
+}
+
+int ipmeta_ds_patricia_update_prefix(ipmeta_ds_t *ds, uint32_t addr,
+                                     uint8_t mask, uint32_t provider_id,
+                                     ipmeta_record_t *record)
+{
+  ipmeta_ds_patricia_state_t *state = STATE(ds);
+  int idx = ROOT_IDX(addr);
+
+  if (mask < ROOT_BITS) {
+    return insert_prefix(state->covering, addr, mask, provider_id, record);
+  }
+
+  /* pending prefixes were added earlier, so they must not win over this */
+  if (state->pending_cnt != 0 && ipmeta_ds_patricia_finalize(ds) != 0) {
+    return -1;
+  }
+  if (state->tries[idx] == NULL &&
+      (state->tries[idx] = New_Patricia(32)) == NULL) {
+    ipmeta_log(__func__, "could not create sub-trie");
+    return -1;
+  }
+  return insert_prefix(state->tries[idx], addr, mask, provider_id, record);
+}
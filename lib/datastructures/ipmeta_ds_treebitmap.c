@@ -0,0 +1,1062 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * libipmeta is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libipmeta is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libipmeta.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+#include "libipmeta_int.h"
+#include "ipmeta_ds_treebitmap.h"
+
+#define DS_NAME "treebitmap"
+
+#define STATE(ds) (IPMETA_DS_STATE(treebitmap, ds))
+
+/** Number of address bits consumed by each level of the trie. With 6 bits the
+    bitmaps of a node fit in 64 bit words, and an IPv4 lookup visits at most 6
+    nodes */
+#define STRIDE 6
+
+/** Maximum depth of the trie. A node at depth d holds the prefixes of length
+    d * STRIDE + 1 to d * STRIDE + STRIDE */
+#define MAX_DEPTH ((128 + STRIDE - 1) / STRIDE)
+
+/** Position of the prefix of length depth * STRIDE + k (1 <= k <= STRIDE)
+    that covers an address whose bits in the node (at depth) are chunk */
+#define POS(chunk, k) ((1 << (k)) + ((chunk) >> (STRIDE - (k))))
+
+/** The bits of a 64 bit word below the given bit */
+#define BELOW(bit) ((((uint64_t)1) << (bit)) - 1)
+
+/** Initial number of nodes, results or entries allocated */
+#define INITIAL_ALLOC 1024
+
+static ipmeta_ds_t ipmeta_ds_treebitmap = {
+  IPMETA_DS_TREEBITMAP, DS_NAME, IPMETA_DS_GENERATE_PTRS(treebitmap) NULL};
+
+/** An address in host byte order (an IPv4 address is in the top 32 bits of
+    hi) */
+typedef struct tbm_key {
+  uint64_t hi;
+  uint64_t lo;
+} tbm_key_t;
+
+/** A node of the trie
+ *
+ * Bit p of internal is set if the node holds the prefix at position p (see
+ * POS), and bit c of external is set if the node has a child for the next
+ * STRIDE address bits being c. The records of the prefixes of a node are
+ * stored in contiguous rows of the results table from result_base in position
+ * order, and its
+ * children contiguously from nodes[child_base] in chunk order, so both are
+ * found by counting the bits that are set below the one of interest.
+ */
+typedef struct tbm_node {
+  uint64_t internal[2];
+  uint64_t external;
+  uint32_t child_base;
+  uint32_t result_base;
+} tbm_node_t;
+
+/** A prefix waiting to be compiled into a trie */
+typedef struct tbm_entry {
+  tbm_key_t key;
+
+  /** Record of the prefix, NULL if the prefix is being removed */
+  ipmeta_record_t *record;
+
+  /** Order in which the prefix was added, so that if a provider adds a
+      prefix twice, the last record wins */
+  uint32_t seq;
+
+  uint8_t mask;
+
+  /** Provider whose slot the record goes in */
+  uint8_t provider_id;
+} tbm_entry_t;
+
+/** A growable list of prefixes */
+typedef struct tbm_entries {
+  tbm_entry_t *entries;
+  uint32_t cnt;
+  uint32_t alloc;
+} tbm_entries_t;
+
+/** The trie of one address family */
+typedef struct tbm_trie {
+  /** Number of bits in an address of this family */
+  int max_bits;
+
+  /** Nodes of the trie, the root is nodes[0] (there are no nodes until the
+      first prefix is compiled) */
+  tbm_node_t *nodes;
+  uint32_t nodes_cnt;
+  uint32_t nodes_alloc;
+
+  /** Records of the prefixes in the trie, one row per prefix */
+  ipmeta_ds_slot_table_t results;
+
+  /** Records of the /0 prefix (NULL until one is added) */
+  ipmeta_ds_slots_t *deflt;
+
+  /** Prefixes that have been added (or removed), but not yet compiled into
+      the trie. Since nodes and results are packed into arrays, prefixes
+      cannot be inserted in place, so the trie is rebuilt when the ds is
+      finalized */
+  tbm_entries_t pending;
+} tbm_trie_t;
+
+typedef struct ipmeta_ds_treebitmap_state {
+  /** Trie holding IPv4 prefixes */
+  tbm_trie_t trie4;
+
+  /** Trie holding IPv6 prefixes */
+  tbm_trie_t trie6;
+
+} ipmeta_ds_treebitmap_state_t;
+
+/** Get the STRIDE bits of the key that are consumed at the given depth */
+static inline uint32_t key_chunk(const tbm_key_t *key, int depth)
+{
+  int off = depth * STRIDE;
+  uint64_t w;
+
+  if (off == 0) {
+    w = key->hi;
+  } else if (off < 64) {
+    w = (key->hi << off) | (key->lo >> (64 - off));
+  } else {
+    w = key->lo << (off - 64);
+  }
+  return w >> (64 - STRIDE);
+}
+
+/** Set the STRIDE bits of the key that are consumed at the given depth (which
+    must be clear) */
+static void key_set_chunk(tbm_key_t *key, int depth, uint64_t chunk)
+{
+  /* position of the lowest bit of the chunk, counting from the end of the
+     128 bit key */
+  int shift = 128 - STRIDE - depth * STRIDE;
+
+  if (shift >= 64) {
+    key->hi |= chunk << (shift - 64);
+  } else if (shift > 64 - STRIDE) {
+    key->hi |= chunk >> (64 - shift);
+    key->lo |= chunk << shift;
+  } else if (shift >= 0) {
+    key->lo |= chunk << shift;
+  } else {
+    key->lo |= chunk >> -shift;
+  }
+}
+
+/** Clear the bits of the key after the first mask bits */
+static void key_mask(tbm_key_t *key, int mask)
+{
+  if (mask <= 64) {
+    key->hi = (mask == 0) ? 0 : key->hi & ~BELOW(64 - mask);
+    key->lo = 0;
+  } else if (mask < 128) {
+    key->lo &= ~BELOW(128 - mask);
+  }
+}
+
+/** Get the key of a (network byte-ordered) IPv4 address */
+static inline void key4(tbm_key_t *key, uint32_t addr)
+{
+  key->hi = (uint64_t)ntohl(addr) << 32;
+  key->lo = 0;
+}
+
+/** Get the key of an IPv6 address */
+static void key6(tbm_key_t *key, const struct in6_addr *addr)
+{
+  int i;
+
+  key->hi = 0;
+  key->lo = 0;
+  for (i = 0; i < 8; i++) {
+    key->hi = (key->hi << 8) | addr->s6_addr[i];
+    key->lo = (key->lo << 8) | addr->s6_addr[i + 8];
+  }
+}
+
+/** Check whether the node holds the prefix at the given position */
+static inline int node_has_prefix(const tbm_node_t *node, int pos)
+{
+  return (node->internal[pos >> 6] >> (pos & 63)) & 1;
+}
+
+/** Get the row of the results table that holds the records of the prefix
+    at the given position of the node (which must hold it) */
+static inline uint32_t node_result(const tbm_node_t *node, int pos)
+{
+  uint32_t rank;
+
+  if (pos < 64) {
+    rank = __builtin_popcountll(node->internal[0] & BELOW(pos));
+  } else {
+    rank = __builtin_popcountll(node->internal[0]) +
+           __builtin_popcountll(node->internal[1] & BELOW(pos - 64));
+  }
+  return node->result_base + rank;
+}
+
+/** Get the child of the node for the given chunk, or NULL if there is none */
+static inline tbm_node_t *node_child(tbm_trie_t *trie, const tbm_node_t *node,
+                                     uint32_t chunk)
+{
+  if (((node->external >> chunk) & 1) == 0) {
+    return NULL;
+  }
+  return &trie->nodes[node->child_base +
+                      __builtin_popcountll(node->external & BELOW(chunk))];
+}
+
+/** Number of prefix lengths held by a node at the given depth */
+static inline int node_k_max(tbm_trie_t *trie, int depth)
+{
+  int k_max = trie->max_bits - depth * STRIDE;
+  return (k_max > STRIDE) ? STRIDE : k_max;
+}
+
+/** Number of addresses in a prefix of the given length (saturated at
+    UINT32_MAX) */
+static inline uint32_t prefix_size(tbm_trie_t *trie, int mask)
+{
+  return (trie->max_bits - mask >= 32) ? UINT32_MAX
+                                       : (1U << (trie->max_bits - mask));
+}
+
+/* ==================== BUILDING ==================== */
+
+/** Append a prefix to the given list */
+static int append_entry(tbm_entries_t *list, const tbm_key_t *key,
+                        uint8_t mask, uint32_t provider_id,
+                        ipmeta_record_t *record)
+{
+  tbm_entry_t *tmp;
+
+  if (list->cnt == list->alloc) {
+    list->alloc = (list->alloc == 0) ? INITIAL_ALLOC : list->alloc * 2;
+    if ((tmp = realloc(list->entries, sizeof(tbm_entry_t) * list->alloc)) ==
+        NULL) {
+      ipmeta_log(__func__, "could not realloc prefix list");
+      return -1;
+    }
+    list->entries = tmp;
+  }
+  list->entries[list->cnt].key = *key;
+  list->entries[list->cnt].mask = mask;
+  list->entries[list->cnt].provider_id = provider_id;
+  list->entries[list->cnt].record = record;
+  list->entries[list->cnt].seq = list->cnt;
+  list->cnt++;
+
+  return 0;
+}
+
+/** Order prefixes by address, then length, then the order they were added
+    in */
+static int entry_cmp(const void *a, const void *b)
+{
+  const tbm_entry_t *ea = (const tbm_entry_t *)a;
+  const tbm_entry_t *eb = (const tbm_entry_t *)b;
+
+  if (ea->key.hi != eb->key.hi) {
+    return (ea->key.hi < eb->key.hi) ? -1 : 1;
+  }
+  if (ea->key.lo != eb->key.lo) {
+    return (ea->key.lo < eb->key.lo) ? -1 : 1;
+  }
+  if (ea->mask != eb->mask) {
+    return (ea->mask < eb->mask) ? -1 : 1;
+  }
+  return (ea->seq < eb->seq) ? -1 : (ea->seq > eb->seq);
+}
+
+/** Allocate cnt zeroed nodes at the end of the node array, and set base to
+    the index of the first one */
+static int alloc_nodes(tbm_trie_t *trie, uint32_t cnt, uint32_t *base)
+{
+  tbm_node_t *tmp;
+  uint32_t alloc = trie->nodes_alloc;
+
+  while (alloc < trie->nodes_cnt + cnt) {
+    alloc = (alloc == 0) ? INITIAL_ALLOC : alloc * 2;
+  }
+  if (alloc != trie->nodes_alloc) {
+    if ((tmp = realloc(trie->nodes, sizeof(tbm_node_t) * alloc)) == NULL) {
+      ipmeta_log(__func__, "could not realloc trie nodes");
+      return -1;
+    }
+    trie->nodes = tmp;
+    trie->nodes_alloc = alloc;
+  }
+  memset(&trie->nodes[trie->nodes_cnt], 0, sizeof(tbm_node_t) * cnt);
+  *base = trie->nodes_cnt;
+  trie->nodes_cnt += cnt;
+
+  return 0;
+}
+
+/** Add the prefixes of the given node (with the given key and depth), and of
+    all nodes below it, to the list */
+static int decompile_node(tbm_trie_t *trie, uint32_t idx, int depth,
+                          const tbm_key_t *key, tbm_entries_t *list)
+{
+  tbm_node_t *node = &trie->nodes[idx];
+  ipmeta_record_t *rec;
+  uint32_t row;
+  tbm_key_t pfx_key;
+  uint32_t child;
+  int pos, k, i;
+
+  for (pos = 2; pos < 128; pos++) {
+    if (!node_has_prefix(node, pos)) {
+      continue;
+    }
+    k = 31 - __builtin_clz(pos);
+    pfx_key = *key;
+    key_set_chunk(&pfx_key, depth, (pos - (1 << k)) << (STRIDE - k));
+    row = node_result(node, pos);
+    for (i = 0; i < IPMETA_PROVIDER_ID_MAX; i++) {
+      if ((rec = ipmeta_ds_slot_table_get(&trie->results, row, i)) != NULL &&
+          append_entry(list, &pfx_key, depth * STRIDE + k, i + 1, rec) !=
+            0) {
+        return -1;
+      }
+    }
+  }
+
+  child = node->child_base;
+  for (i = 0; i < (1 << STRIDE); i++) {
+    if (((node->external >> i) & 1) == 0) {
+      continue;
+    }
+    pfx_key = *key;
+    key_set_chunk(&pfx_key, depth, i);
+    if (decompile_node(trie, child++, depth + 1, &pfx_key, list) != 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/** Build the node at the given index (and depth) from the given prefixes,
+    which are sorted and all belong inside the node */
+static int build_node(tbm_trie_t *trie, uint32_t idx, tbm_entry_t *entries,
+                      uint32_t cnt, int depth)
+{
+  uint64_t internal[2] = {0, 0};
+  uint64_t external = 0;
+  uint32_t child_base, result_base, chunk, i, j;
+  int base_len = depth * STRIDE;
+  int pos;
+
+  /* find out which prefixes and children the node has */
+  for (i = 0; i < cnt; i++) {
+    chunk = key_chunk(&entries[i].key, depth);
+    if (entries[i].mask <= base_len + STRIDE) {
+      pos = POS(chunk, entries[i].mask - base_len);
+      internal[pos >> 6] |= ((uint64_t)1) << (pos & 63);
+    } else {
+      external |= ((uint64_t)1) << chunk;
+    }
+  }
+
+  if (ipmeta_ds_slot_table_alloc(&trie->results,
+                                 __builtin_popcountll(internal[0]) +
+                                   __builtin_popcountll(internal[1]),
+                                 &result_base) != 0 ||
+      alloc_nodes(trie, __builtin_popcountll(external), &child_base) != 0) {
+    return -1;
+  }
+  trie->nodes[idx].internal[0] = internal[0];
+  trie->nodes[idx].internal[1] = internal[1];
+  trie->nodes[idx].external = external;
+  trie->nodes[idx].child_base = child_base;
+  trie->nodes[idx].result_base = result_base;
+
+  /* the prefixes that end in this node. entries for the same prefix are in
+     the order they were added, so the last one for a provider wins */
+  for (i = 0; i < cnt; i++) {
+    if (entries[i].mask <= base_len + STRIDE) {
+      pos = POS(key_chunk(&entries[i].key, depth), entries[i].mask - base_len);
+      if (ipmeta_ds_slot_table_set(&trie->results,
+                                   node_result(&trie->nodes[idx], pos),
+                                   entries[i].provider_id - 1,
+                                   entries[i].record) != 0) {
+        return -1;
+      }
+    }
+  }
+
+  /* the prefixes of each child are contiguous (any prefixes that end in this
+     node and share the chunk sort before them) */
+  for (i = 0; i < cnt; i = j) {
+    if (entries[i].mask <= base_len + STRIDE) {
+      j = i + 1;
+      continue;
+    }
+    chunk = key_chunk(&entries[i].key, depth);
+    for (j = i + 1; j < cnt && entries[j].mask > base_len + STRIDE &&
+                    key_chunk(&entries[j].key, depth) == chunk;
+         j++)
+      ;
+    if (build_node(trie,
+                   child_base + __builtin_popcountll(external & BELOW(chunk)),
+                   &entries[i], j - i, depth + 1) != 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/** Check if two entries are for the same prefix */
+static inline int entry_same_prefix(const tbm_entry_t *a, const tbm_entry_t *b)
+{
+  return a->mask == b->mask && a->key.hi == b->key.hi && a->key.lo == b->key.lo;
+}
+
+/** Keep only the last entry for each prefix and provider of the given sorted
+    list, and drop the ones that remove the prefix */
+static void squash_entries(tbm_entries_t *list)
+{
+  tbm_entry_t *entries = list->entries;
+  uint32_t i, j, cnt = 0;
+
+  for (i = 0; i < list->cnt; i++) {
+    if (entries[i].record == NULL) {
+      continue;
+    }
+    for (j = i + 1; j < list->cnt &&
+                    entry_same_prefix(&entries[j], &entries[i]) &&
+                    entries[j].provider_id != entries[i].provider_id;
+         j++)
+      ;
+    if (j < list->cnt && entry_same_prefix(&entries[j], &entries[i])) {
+      continue;
+    }
+    entries[cnt++] = entries[i];
+  }
+  list->cnt = cnt;
+}
+
+/** Rebuild the trie from the prefixes it holds and the pending prefixes */
+static int compile_trie(tbm_trie_t *trie)
+{
+  tbm_entries_t list = {NULL, 0, 0};
+  tbm_key_t root_key = {0, 0};
+  tbm_entry_t *entry;
+  tbm_node_t *nodes;
+  uint32_t root, i;
+  int rc = -1;
+
+  /* the prefixes already in the trie go first, so that pending prefixes
+     replace their records */
+  if (trie->nodes_cnt > 0 &&
+      decompile_node(trie, 0, 0, &root_key, &list) != 0) {
+    goto out;
+  }
+  for (i = 0; i < trie->pending.cnt; i++) {
+    entry = &trie->pending.entries[i];
+    if (entry->mask == 0) {
+      if ((entry->record == NULL
+             ? ipmeta_ds_slots_clear(&trie->deflt, entry->provider_id - 1)
+             : ipmeta_ds_slots_set(&trie->deflt, entry->provider_id - 1,
+                                   entry->record)) != 0) {
+        goto out;
+      }
+    } else if (append_entry(&list, &entry->key, entry->mask,
+                            entry->provider_id, entry->record) != 0) {
+      goto out;
+    }
+  }
+
+  if (list.cnt > 0) {
+    qsort(list.entries, list.cnt, sizeof(tbm_entry_t), entry_cmp);
+    squash_entries(&list);
+  }
+
+  free(trie->nodes);
+  trie->nodes = NULL;
+  trie->nodes_cnt = trie->nodes_alloc = 0;
+  ipmeta_ds_slot_table_free(&trie->results);
+
+  if (alloc_nodes(trie, 1, &root) != 0 ||
+      build_node(trie, root, list.entries, list.cnt, 0) != 0) {
+    ipmeta_log(__func__, "could not build trie");
+    goto out;
+  }
+
+  /* the arrays do not grow again until the next rebuild, so give back the
+     slack (keeping the larger arrays if that fails) */
+  if ((nodes = realloc(trie->nodes, sizeof(tbm_node_t) * trie->nodes_cnt)) !=
+      NULL) {
+    trie->nodes = nodes;
+    trie->nodes_alloc = trie->nodes_cnt;
+  }
+  ipmeta_ds_slot_table_trim(&trie->results);
+
+  free(trie->pending.entries);
+  trie->pending.entries = NULL;
+  trie->pending.cnt = trie->pending.alloc = 0;
+
+  rc = 0;
+
+out:
+  free(list.entries);
+  return rc;
+}
+
+/** Find the row of the results table that holds the records of the prefix
+    of the given key and length (1 or more), returns 0 if the trie holds the
+    prefix, -1 otherwise */
+static int find_result(tbm_trie_t *trie, const tbm_key_t *key, int mask,
+                       uint32_t *row)
+{
+  tbm_node_t *node = (trie->nodes_cnt > 0) ? &trie->nodes[0] : NULL;
+  int depth = (mask - 1) / STRIDE, d, pos;
+
+  for (d = 0; node != NULL && d < depth; d++) {
+    node = node_child(trie, node, key_chunk(key, d));
+  }
+  if (node == NULL) {
+    return -1;
+  }
+  pos = POS(key_chunk(key, depth), mask - depth * STRIDE);
+  if (!node_has_prefix(node, pos)) {
+    return -1;
+  }
+  *row = node_result(node, pos);
+  return 0;
+}
+
+/** Free everything held by the trie */
+static void free_trie(tbm_trie_t *trie)
+{
+  free(trie->nodes);
+  trie->nodes = NULL;
+  ipmeta_ds_slot_table_free(&trie->results);
+  free(trie->deflt);
+  trie->deflt = NULL;
+  free(trie->pending.entries);
+  trie->pending.entries = NULL;
+}
+
+/* ==================== SEARCHING ==================== */
+
+/** Add the records of the given prefix for the providers in provmask that
+    are not yet in foundsofar */
+static int extract_records(tbm_trie_t *trie, uint32_t row, int mask,
+                           uint32_t provmask, uint32_t *foundsofar,
+                           ipmeta_record_set_t *found)
+{
+  return ipmeta_ds_slot_table_extract(&trie->results, row, provmask,
+                                      foundsofar, prefix_size(trie, mask),
+                                      found);
+}
+
+/** Find the most specific records (per provider) of the prefixes that cover
+    the first mask bits of the key */
+static int search_covering(tbm_trie_t *trie, const tbm_key_t *key, int mask,
+                           uint32_t provmask, uint32_t *foundsofar,
+                           ipmeta_record_set_t *found)
+{
+  tbm_node_t *path[MAX_DEPTH];
+  uint32_t chunks[MAX_DEPTH];
+  tbm_node_t *node = (trie->nodes_cnt > 0) ? &trie->nodes[0] : NULL;
+  int depth = 0, k, pos;
+
+  /* only nodes that hold prefixes no longer than mask matter */
+  while (node != NULL && depth * STRIDE < mask) {
+    path[depth] = node;
+    chunks[depth] = key_chunk(key, depth);
+    node = node_child(trie, node, chunks[depth]);
+    depth++;
+  }
+
+  /* the deepest node, and its longest prefixes, are the most specific */
+  while (depth > 0 && *foundsofar != provmask) {
+    node = path[--depth];
+    k = mask - depth * STRIDE;
+    if (k > STRIDE) {
+      k = STRIDE;
+    }
+    for (; k >= 1; k--) {
+      pos = POS(chunks[depth], k);
+      if (node_has_prefix(node, pos) &&
+          extract_records(trie, node_result(node, pos),
+                          depth * STRIDE + k, provmask, foundsofar,
+                          found) != 0) {
+        return -1;
+      }
+    }
+  }
+
+  if (*foundsofar != provmask) {
+    return ipmeta_ds_slots_extract(trie->deflt, provmask, foundsofar,
+                                   prefix_size(trie, 0), found);
+  }
+  return 0;
+}
+
+/** Find records of prefixes inside the given node (at the given depth) and
+    below it for providers that have none yet */
+static int search_subtree(tbm_trie_t *trie, tbm_node_t *node, int depth,
+                          uint32_t provmask, uint32_t *foundsofar,
+                          ipmeta_record_set_t *found)
+{
+  uint32_t child = node->child_base;
+  int pos, i;
+
+  /* positions are ordered by prefix length, so shorter prefixes go first */
+  for (pos = 2; pos < 128 && *foundsofar != provmask; pos++) {
+    if (node_has_prefix(node, pos) &&
+        extract_records(trie, node_result(node, pos),
+                        depth * STRIDE + 31 - __builtin_clz(pos), provmask,
+                        foundsofar, found) != 0) {
+      return -1;
+    }
+  }
+  for (i = 0; i < (1 << STRIDE) && *foundsofar != provmask; i++) {
+    if (((node->external >> i) & 1) != 0 &&
+        search_subtree(trie, &trie->nodes[child++], depth + 1, provmask,
+                       foundsofar, found) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/** Find the records of the given prefix: the most specific covering record of
+    each provider, or if there is none, a record of a more specific prefix */
+static int lookup_records(tbm_trie_t *trie, const tbm_key_t *key, int mask,
+                          uint32_t provmask, ipmeta_record_set_t *records)
+{
+  tbm_node_t *node, *child;
+  uint32_t foundsofar = 0;
+  uint32_t chunk, bits;
+  int depth, last_depth, r, k, k_max, span, first, i;
+
+  if (search_covering(trie, key, mask, provmask, &foundsofar, records) != 0) {
+    return -1;
+  }
+  if (foundsofar == provmask || mask >= trie->max_bits ||
+      trie->nodes_cnt == 0) {
+    return records->n_recs;
+  }
+
+  /* the node that holds prefixes of length mask + 1 */
+  last_depth = mask / STRIDE;
+  node = &trie->nodes[0];
+  for (depth = 0; node != NULL && depth < last_depth; depth++) {
+    node = node_child(trie, node, key_chunk(key, depth));
+  }
+  if (node == NULL) {
+    return records->n_recs;
+  }
+
+  /* r bits of the prefix are inside this node, so look at the longer
+     prefixes of the node that share them, and the children below them */
+  r = mask - last_depth * STRIDE;
+  chunk = key_chunk(key, last_depth);
+  bits = chunk >> (STRIDE - r);
+  k_max = node_k_max(trie, last_depth);
+  for (k = r + 1; k <= k_max && foundsofar != provmask; k++) {
+    first = (1 << k) + (bits << (k - r));
+    for (i = first; i < first + (1 << (k - r)); i++) {
+      if (node_has_prefix(node, i) &&
+          extract_records(trie, node_result(node, i),
+                          last_depth * STRIDE + k, provmask, &foundsofar,
+                          records) != 0) {
+        return -1;
+      }
+    }
+  }
+  span = 1 << (STRIDE - r);
+  first = chunk & ~(span - 1);
+  for (i = first; i < first + span && foundsofar != provmask; i++) {
+    if ((child = node_child(trie, node, i)) != NULL &&
+        search_subtree(trie, child, last_depth + 1, provmask, &foundsofar,
+                       records) != 0) {
+      return -1;
+    }
+  }
+
+  return records->n_recs;
+}
+
+/** Check whether the node (at the given depth) holds prefixes longer than
+    depth * STRIDE + r inside the prefix of that length with the given chunk,
+    or has children inside it */
+static int node_block_empty(tbm_trie_t *trie, const tbm_node_t *node,
+                            int depth, uint32_t chunk, int r)
+{
+  int span = 1 << (STRIDE - r);
+  uint32_t bits = chunk >> (STRIDE - r);
+  uint64_t m;
+  int k, k_max, first;
+
+  m = (span == 64) ? ~(uint64_t)0 : BELOW(span) << (chunk & ~(span - 1));
+  if ((node->external & m) != 0) {
+    return 0;
+  }
+
+  /* the positions of each length are all in the same word */
+  k_max = node_k_max(trie, depth);
+  for (k = r + 1; k <= k_max; k++) {
+    first = (1 << k) + (bits << (k - r));
+    span = 1 << (k - r);
+    m = (span == 64) ? ~(uint64_t)0 : BELOW(span) << (first & 63);
+    if ((node->internal[first >> 6] & m) != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* ==================== PUBLIC API FUNCTIONS ==================== */
+
+ipmeta_ds_t *ipmeta_ds_treebitmap_alloc()
+{
+  return &ipmeta_ds_treebitmap;
+}
+
+int ipmeta_ds_treebitmap_init(ipmeta_ds_t *ds)
+{
+  /* the ds structure is malloc'd already, we just need to init the state */
+
+  assert(STATE(ds) == NULL);
+
+  if ((ds->state = malloc_zero(sizeof(ipmeta_ds_treebitmap_state_t))) ==
+      NULL) {
+    ipmeta_log(__func__, "could not malloc treebitmap state");
+    return -1;
+  }
+
+  STATE(ds)->trie4.max_bits = 32;
+  STATE(ds)->trie6.max_bits = 128;
+
+  return 0;
+}
+
+void ipmeta_ds_treebitmap_free(ipmeta_ds_t *ds)
+{
+  if (ds == NULL) {
+    return;
+  }
+
+  if (STATE(ds) != NULL) {
+    free_trie(&STATE(ds)->trie4);
+    free_trie(&STATE(ds)->trie6);
+    free(STATE(ds));
+    ds->state = NULL;
+  }
+
+  free(ds);
+
+  return;
+}
+
+int ipmeta_ds_treebitmap_add_prefix(ipmeta_ds_t *ds, uint32_t addr,
+                                    uint8_t mask, uint32_t provider_id,
+                                    ipmeta_record_t *record)
+{
+  tbm_key_t key;
+
+  if (mask > 32) {
+    ipmeta_log(__func__, "invalid IPv4 prefix length (%d)", mask);
+    return -1;
+  }
+
+  key4(&key, addr);
+  key_mask(&key, mask);
+  return append_entry(&STATE(ds)->trie4.pending, &key, mask, provider_id,
+                      record);
+}
+
+int ipmeta_ds_treebitmap_finalize(ipmeta_ds_t *ds)
+{
+  ipmeta_ds_treebitmap_state_t *state = STATE(ds);
+
+  if (state->trie4.pending.cnt > 0 && compile_trie(&state->trie4) != 0) {
+    return -1;
+  }
+  if (state->trie6.pending.cnt > 0 && compile_trie(&state->trie6) != 0) {
+    return -1;
+  }
+  return 0;
+}
+
+int ipmeta_ds_treebitmap_lookup_records(ipmeta_ds_t *ds, uint32_t addr,
+                                        uint8_t mask, uint32_t providermask,
+                                        ipmeta_record_set_t *records)
+{
+  tbm_key_t key;
+
+  key4(&key, addr);
+  return lookup_records(&STATE(ds)->trie4, &key, mask, providermask, records);
+}
+
+int ipmeta_ds_treebitmap_lookup_record_single(ipmeta_ds_t *ds, uint32_t addr,
+                                              uint32_t providermask,
+                                              ipmeta_record_set_t *found)
+{
+  tbm_key_t key;
+  uint32_t foundsofar = 0;
+
+  key4(&key, addr);
+  if (search_covering(&STATE(ds)->trie4, &key, 32, providermask, &foundsofar,
+                      found) != 0) {
+    return -1;
+  }
+  return found->n_recs;
+}
+
+int ipmeta_ds_treebitmap_lookup_record_range(ipmeta_ds_t *ds, uint32_t addr,
+                                             uint32_t providermask,
+                                             ipmeta_record_set_t *found,
+                                             uint32_t *first, uint32_t *last)
+{
+  tbm_trie_t *trie = &STATE(ds)->trie4;
+  tbm_node_t *node, *child;
+  tbm_key_t key;
+  uint32_t netmask, chunk = 0;
+  int depth = 0, len = 0, r;
+
+  key4(&key, addr);
+
+  if (trie->nodes_cnt > 0) {
+    /* find the deepest node on the path of the address */
+    node = &trie->nodes[0];
+    while ((child = node_child(trie, node, chunk = key_chunk(&key, depth))) !=
+           NULL) {
+      node = child;
+      depth++;
+    }
+
+    /* nothing longer than the prefixes of this node covers the address, so
+       the result is the same for every address in the prefix made of the
+       node's bits of the address. widen it while the node holds nothing
+       else inside it */
+    len = depth * STRIDE + node_k_max(trie, depth);
+    for (r = len - depth * STRIDE - 1;
+         r >= 0 && node_block_empty(trie, node, depth, chunk, r); r--) {
+      len = depth * STRIDE + r;
+    }
+  }
+
+  netmask = (len == 0) ? 0 : ~0U << (32 - len);
+  *first = ntohl(addr) & netmask;
+  *last = *first | ~netmask;
+
+  return ipmeta_ds_treebitmap_lookup_record_single(ds, addr, providermask,
+                                                   found);
+}
+
+ipmeta_record_t *ipmeta_ds_treebitmap_lookup_record_provider(
+  ipmeta_ds_t *ds, uint32_t addr, uint32_t provider_id)
+{
+  tbm_trie_t *trie = &STATE(ds)->trie4;
+  tbm_node_t *path[MAX_DEPTH];
+  uint32_t chunks[MAX_DEPTH];
+  tbm_node_t *node = (trie->nodes_cnt > 0) ? &trie->nodes[0] : NULL;
+  ipmeta_record_t *rec;
+  tbm_key_t key;
+  int depth = 0, k, pos;
+
+  key4(&key, addr);
+
+  while (node != NULL) {
+    path[depth] = node;
+    chunks[depth] = key_chunk(&key, depth);
+    node = node_child(trie, node, chunks[depth]);
+    depth++;
+  }
+
+  while (depth > 0) {
+    node = path[--depth];
+    for (k = node_k_max(trie, depth); k >= 1; k--) {
+      pos = POS(chunks[depth], k);
+      if (node_has_prefix(node, pos) &&
+          (rec = ipmeta_ds_slot_table_get(&trie->results,
+                                          node_result(node, pos),
+                                          provider_id - 1)) != NULL) {
+        return rec;
+      }
+    }
+  }
+
+  return ipmeta_ds_slots_get(trie->deflt, provider_id - 1);
+}
+
+int ipmeta_ds_treebitmap_add_prefix6(ipmeta_ds_t *ds,
+                                     const struct in6_addr *addr, uint8_t mask,
+                                     uint32_t provider_id,
+                                     ipmeta_record_t *record)
+{
+  tbm_key_t key;
+
+  if (mask > 128) {
+    ipmeta_log(__func__, "invalid IPv6 prefix length (%d)", mask);
+    return -1;
+  }
+
+  key6(&key, addr);
+  key_mask(&key, mask);
+  return append_entry(&STATE(ds)->trie6.pending, &key, mask, provider_id,
+                      record);
+}
+
+int ipmeta_ds_treebitmap_lookup_records6(ipmeta_ds_t *ds,
+                                         const struct in6_addr *addr,
+                                         uint8_t mask, uint32_t providermask,
+                                         ipmeta_record_set_t *records)
+{
+  tbm_key_t key;
+
+  if (mask > 128) {
+    ipmeta_log(__func__, "invalid IPv6 prefix length (%d)", mask);
+    return -1;
+  }
+
+  key6(&key, addr);
+  return lookup_records(&STATE(ds)->trie6, &key, mask, providermask, records);
+}
+
+int ipmeta_ds_treebitmap_lookup_record_single6(ipmeta_ds_t *ds,
+                                               const struct in6_addr *addr,
+                                               uint32_t providermask,
+                                               ipmeta_record_set_t *found)
+{
+  tbm_key_t key;
+  uint32_t foundsofar = 0;
+
+  key6(&key, addr);
+  if (search_covering(&STATE(ds)->trie6, &key, 128, providermask, &foundsofar,
+                      found) != 0) {
+    return -1;
+  }
+  return found->n_recs;
+}
+
+/** Add the memory used by the given trie to the shared ds usage */
+static void trie_memory_usage(tbm_trie_t *trie, uint64_t *usage)
+{
+  usage[IPMETA_MEM_TRIE_NODES] +=
+    (uint64_t)trie->nodes_alloc * sizeof(tbm_node_t);
+  usage[IPMETA_MEM_NODE_RECORDS] += IPMETA_DS_SLOT_TABLE_SIZE(&trie->results);
+  if (trie->deflt != NULL) {
+    usage[IPMETA_MEM_NODE_RECORDS] += IPMETA_DS_SLOTS_SIZE(trie->deflt);
+  }
+  usage[IPMETA_MEM_OTHER] +=
+    (uint64_t)trie->pending.alloc * sizeof(tbm_entry_t);
+}
+
+void ipmeta_ds_treebitmap_memory_usage(ipmeta_ds_t *ds,
+                                       ipmeta_memory_usage_t *usage)
+{
+  ipmeta_ds_treebitmap_state_t *state = STATE(ds);
+
+  usage->ds[IPMETA_MEM_OTHER] += sizeof(ipmeta_ds_t) + sizeof(*state);
+
+  trie_memory_usage(&state->trie4, usage->ds);
+  trie_memory_usage(&state->trie6, usage->ds);
+}
+
+int ipmeta_ds_treebitmap_remove_prefix(ipmeta_ds_t *ds, uint32_t addr,
+                                       uint8_t mask, uint32_t provider_id)
+{
+  tbm_trie_t *trie = &STATE(ds)->trie4;
+  tbm_key_t key;
+  uint32_t row;
+
+  if (mask > 32) {
+    ipmeta_log(__func__, "invalid IPv4 prefix length (%d)", mask);
+    return -1;
+  }
+
+  key4(&key, addr);
+  key_mask(&key, mask);
+
+  /* the prefix may still be pending, so the removal is queued behind it and
+     done by the rebuild at the next finalize */
+  if (trie->pending.cnt > 0) {
+    return append_entry(&trie->pending, &key, mask, provider_id, NULL);
+  }
+  if (mask == 0) {
+    return ipmeta_ds_slots_clear(&trie->deflt, provider_id - 1);
+  }
+  if (find_result(trie, &key, mask, &row) != 0 ||
+      ipmeta_ds_slot_table_get(&trie->results, row, provider_id - 1) ==
+        NULL) {
+    return 0;
+  }
+
+  /* the prefix stays in the trie until the next rebuild, which skips prefixes
+     without records */
+  return ipmeta_ds_slot_table_set(&trie->results, row, provider_id - 1, NULL);
+}
+
+int ipmeta_ds_treebitmap_update_prefix(ipmeta_ds_t *ds, uint32_t addr,
+                                       uint8_t mask, uint32_t provider_id,
+                                       ipmeta_record_t *record)
+{
+  tbm_trie_t *trie = &STATE(ds)->trie4;
+  tbm_key_t key;
+  uint32_t row;
+
+  if (mask > 32) {
+    ipmeta_log(__func__, "invalid IPv4 prefix length (%d)", mask);
+    return -1;
+  }
+
+  key4(&key, addr);
+  key_mask(&key, mask);
+
+  /* prefixes that are in the trie already can be changed in place (unless a
+     pending record for it would replace this one), everything else needs a
+     rebuild */
+  if (trie->pending.cnt == 0) {
+    if (mask == 0) {
+      return ipmeta_ds_slots_set(&trie->deflt, provider_id - 1, record);
+    }
+    if (find_result(trie, &key, mask, &row) == 0) {
+      return ipmeta_ds_slot_table_set(&trie->results, row, provider_id - 1,
+                                      record);
+    }
+  }
+  return append_entry(&trie->pending, &key, mask, provider_id, record);
+}
@@ -0,0 +1,40 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * libipmeta is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libipmeta is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libipmeta.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __IPMETA_DS_TREEBITMAP_H
+#define __IPMETA_DS_TREEBITMAP_H
+
+#include "ipmeta_ds.h"
+
+/** @file
+ *
+ * @brief Header file that exposes the ipmeta tree bitmap datastructure
+ * implementation interface
+ *
+ */
+
+IPMETA_DS_GENERATE_PROTOS(treebitmap)
+
+#endif /* __IPMETA_DS_TREEBITMAP_H */
@@ -25,6 +25,7 @@
 
 #include "config.h"
 
+#include <arpa/inet.h>
 #include <assert.h>
 #include <inttypes.h>
 #include <stdio.h>
@@ -44,10 +45,30 @@
 
 #define SEPARATOR "|"
 
+/** Maximum number of neighbouring ranges that a range lookup tries to merge
+    on either side of the range returned by the datastructure */
+#define RANGE_EXTEND_MAX 32
+
+/** Free all providers (built-in and extra instances) of the given instance */
+static void free_providers(ipmeta_t *ipmeta)
+{
+  int i;
+
+  for (i = 0; i < IPMETA_PROVIDER_ID_MAX; i++) {
+    if (ipmeta->providers[i] != NULL) {
+      ipmeta_provider_free(ipmeta, ipmeta->providers[i]);
+    }
+  }
+}
+
 ipmeta_t *ipmeta_init(enum ipmeta_ds_id dstype)
+{
+  return ipmeta_init_flags(dstype, 0);
+}
+
+ipmeta_t *ipmeta_init_flags(enum ipmeta_ds_id dstype, uint32_t flags)
 {
   ipmeta_t *ipmeta;
-  int i;
   ipmeta_log(__func__, "initializing libipmeta");
 
   /* allocate some memory for our state */
@@ -62,29 +83,39 @@ ipmeta_t *ipmeta_init(enum ipmeta_ds_id dstype)
     return NULL;
   }
 
-  if (ipmeta_ds_init(&(ipmeta->datastore), dstype) != 0) {
-    for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
-      ipmeta_provider_free(ipmeta, ipmeta->providers[i]);
-    }
+  if (ipmeta_ds_init(&(ipmeta->datastore), dstype, flags) != 0) {
+    free_providers(ipmeta);
     free(ipmeta);
     return NULL;
   }
 
+  /* generation 0 marks empty lookup cache entries */
+  ipmeta->generation = 1;
+
+#ifdef WITH_LOOKUP_STATS
+  if (ipmeta_stats_init(ipmeta) != 0) {
+    free_providers(ipmeta);
+    ipmeta->datastore->free(ipmeta->datastore);
+    free(ipmeta);
+    return NULL;
+  }
+#endif
+
   return ipmeta;
 }
 
 void ipmeta_free(ipmeta_t *ipmeta)
 {
-  int i;
-
   /* no mercy for double frees */
   assert(ipmeta != NULL);
 
   /* loop across all providers and free each one */
-  for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
-    ipmeta_provider_free(ipmeta, ipmeta->providers[i]);
-  }
+  free_providers(ipmeta);
   ipmeta->datastore->free(ipmeta->datastore);
+  ipmeta_cache_free(ipmeta);
+#ifdef WITH_LOOKUP_STATS
+  ipmeta_stats_free(ipmeta);
+#endif
   free(ipmeta);
   return;
 }
@@ -116,10 +147,55 @@ int ipmeta_enable_provider(ipmeta_t *ipmeta, ipmeta_provider_t *provider,
     free(local_args);
   }
 
-  ipmeta->all_provmask |= (1 << (provider->id - 1));
+  if (rc == 0) {
+    ipmeta->all_provmask |= (1U << (provider->id - 1));
+    /* the datastore has changed, so cached lookup results are stale */
+    ipmeta->generation++;
+  }
   return rc;
 }
 
+ipmeta_provider_t *ipmeta_add_provider_instance(ipmeta_t *ipmeta,
+                                                ipmeta_provider_t *provider,
+                                                const char *name)
+{
+  ipmeta_provider_t *instance;
+
+  assert(ipmeta != NULL && provider != NULL);
+
+  if (name != NULL && ipmeta_get_provider_by_name(ipmeta, name) != NULL) {
+    ipmeta_log(__func__, "there is already a provider named %s", name);
+    return NULL;
+  }
+
+  if ((instance = ipmeta_provider_alloc_instance(ipmeta, provider->type,
+                                                 name)) == NULL) {
+    return NULL;
+  }
+  ipmeta_log(__func__, "added provider instance (%s) with id %d",
+             instance->name, instance->id);
+
+  return instance;
+}
+
+int ipmeta_set_snapshot_time(ipmeta_provider_t *provider, time_t valid_from)
+{
+  assert(provider != NULL);
+
+  if (provider->enabled != 0) {
+    ipmeta_log(__func__, "provider (%s) is already enabled", provider->name);
+    return -1;
+  }
+  if (valid_from <= 0) {
+    ipmeta_log(__func__, "invalid snapshot time for provider (%s)",
+               provider->name);
+    return -1;
+  }
+
+  provider->snapshot_time = valid_from;
+  return 0;
+}
+
 ipmeta_provider_t *ipmeta_get_default_provider(ipmeta_t *ipmeta)
 {
   assert(ipmeta != NULL);
@@ -130,7 +206,7 @@ inline ipmeta_provider_t *ipmeta_get_provider_by_id(ipmeta_t *ipmeta,
                                                     ipmeta_provider_id_t id)
 {
   assert(ipmeta != NULL);
-  if (id <= 0 || id > IPMETA_PROVIDER_MAX) {
+  if (id <= 0 || id > IPMETA_PROVIDER_ID_MAX) {
     return NULL;
   }
   return ipmeta->providers[id - 1];
@@ -142,7 +218,7 @@ ipmeta_provider_t *ipmeta_get_provider_by_name(ipmeta_t *ipmeta,
   ipmeta_provider_t *provider;
   int i;
 
-  for (i = 1; i <= IPMETA_PROVIDER_MAX; i++) {
+  for (i = 1; i <= IPMETA_PROVIDER_ID_MAX; i++) {
     if ((provider = ipmeta_get_provider_by_id(ipmeta, i)) != NULL &&
         strcasecmp(provider->name, name) == 0) {
       return provider;
@@ -155,6 +231,11 @@ ipmeta_provider_t *ipmeta_get_provider_by_name(ipmeta_t *ipmeta,
 inline int ipmeta_lookup(ipmeta_t *ipmeta, uint32_t addr, uint8_t mask,
                          uint32_t providermask, ipmeta_record_set_t *records)
 {
+#ifdef WITH_LOOKUP_STATS
+  ipmeta_stats_sample_t sample;
+  int rc;
+#endif
+
   assert(ipmeta != NULL && records != NULL);
 
   ipmeta_record_set_clear(records);
@@ -162,20 +243,349 @@ inline int ipmeta_lookup(ipmeta_t *ipmeta, uint32_t addr, uint8_t mask,
     providermask = ipmeta->all_provmask;
   }
 
+#ifdef WITH_LOOKUP_STATS
+  ipmeta_stats_lookup_begin(ipmeta, &sample);
+  rc = ipmeta->datastore->lookup_records(ipmeta->datastore, addr, mask,
+                                         providermask, records);
+  ipmeta_stats_lookup_end(&sample, 0, providermask, records);
+  return rc;
+#else
   return ipmeta->datastore->lookup_records(ipmeta->datastore, addr, mask,
                                            providermask, records);
+#endif
 }
 
 inline int ipmeta_lookup_single(ipmeta_t *ipmeta, uint32_t addr,
                                 uint32_t providermask,
                                 ipmeta_record_set_t *found)
 {
+#ifdef WITH_LOOKUP_STATS
+  ipmeta_stats_sample_t sample;
+#endif
+  int rc;
+
   ipmeta_record_set_clear(found);
   if (providermask == 0) {
     providermask = ipmeta->all_provmask;
   }
-  return ipmeta->datastore->lookup_record_single(ipmeta->datastore, addr,
+
+#ifdef WITH_LOOKUP_STATS
+  ipmeta_stats_lookup_begin(ipmeta, &sample);
+#endif
+  if (ipmeta->cache_entries != 0) {
+    rc = ipmeta_cache_lookup_single(ipmeta, addr, providermask, found);
+  } else {
+    rc = ipmeta->datastore->lookup_record_single(ipmeta->datastore, addr,
                                                  providermask, found);
+  }
+#ifdef WITH_LOOKUP_STATS
+  ipmeta_stats_lookup_end(&sample, 1, providermask, found);
+#endif
+
+  return rc;
+}
+
+int ipmeta_lookup6(ipmeta_t *ipmeta, const struct in6_addr *addr, uint8_t mask,
+                   uint32_t providermask, ipmeta_record_set_t *records)
+{
+#ifdef WITH_LOOKUP_STATS
+  ipmeta_stats_sample_t sample;
+#endif
+  int rc;
+
+  assert(ipmeta != NULL && records != NULL);
+
+  ipmeta_record_set_clear(records);
+  if (providermask == 0) {
+    providermask = ipmeta->all_provmask;
+  }
+
+#ifdef WITH_LOOKUP_STATS
+  ipmeta_stats_lookup_begin(ipmeta, &sample);
+#endif
+  rc = ipmeta->datastore->lookup_records6(ipmeta->datastore, addr, mask,
+                                          providermask, records);
+#ifdef WITH_LOOKUP_STATS
+  ipmeta_stats_lookup_end(&sample, 0, providermask, records);
+#endif
+
+  return rc;
+}
+
+int ipmeta_lookup_single6(ipmeta_t *ipmeta, const struct in6_addr *addr,
+                          uint32_t providermask, ipmeta_record_set_t *found)
+{
+#ifdef WITH_LOOKUP_STATS
+  ipmeta_stats_sample_t sample;
+#endif
+  int rc;
+
+  ipmeta_record_set_clear(found);
+  if (providermask == 0) {
+    providermask = ipmeta->all_provmask;
+  }
+
+#ifdef WITH_LOOKUP_STATS
+  ipmeta_stats_lookup_begin(ipmeta, &sample);
+#endif
+  rc = ipmeta->datastore->lookup_record_single6(ipmeta->datastore, addr,
+                                                providermask, found);
+#ifdef WITH_LOOKUP_STATS
+  ipmeta_stats_lookup_end(&sample, 1, providermask, found);
+#endif
+
+  return rc;
+}
+
+ipmeta_record_t *
+ipmeta_lookup_single_provider(ipmeta_t *ipmeta, uint32_t addr,
+                              ipmeta_provider_id_t provider_id)
+{
+  if (provider_id < 1 || provider_id > IPMETA_PROVIDER_ID_MAX) {
+    return NULL;
+  }
+  return ipmeta->datastore->lookup_record_provider(ipmeta->datastore, addr,
+                                                   provider_id);
+}
+
+uint32_t ipmeta_get_snapshot_mask(ipmeta_t *ipmeta, time_t timestamp,
+                                  uint32_t providermask)
+{
+  ipmeta_provider_t *best[IPMETA_PROVIDER_MAX] = {NULL};
+  ipmeta_provider_t *provider;
+  uint32_t mask = 0;
+  int i;
+
+  if (providermask == 0) {
+    providermask = ipmeta->all_provmask;
+  }
+
+  for (i = 0; i < IPMETA_PROVIDER_ID_MAX; i++) {
+    if (((providermask >> i) & 1) == 0 ||
+        (provider = ipmeta->providers[i]) == NULL || provider->enabled == 0) {
+      continue;
+    }
+    if (provider->snapshot_time == 0) {
+      mask |= 1U << i;
+    } else if (provider->snapshot_time <= timestamp &&
+               (best[provider->type - 1] == NULL ||
+                best[provider->type - 1]->snapshot_time <
+                  provider->snapshot_time)) {
+      best[provider->type - 1] = provider;
+    }
+  }
+
+  for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+    if (best[i] != NULL) {
+      mask |= 1U << (best[i]->id - 1);
+    }
+  }
+
+  return mask;
+}
+
+int ipmeta_lookup_at(ipmeta_t *ipmeta, uint32_t addr, time_t timestamp,
+                     uint32_t providermask, ipmeta_record_set_t *found)
+{
+  uint32_t mask = ipmeta_get_snapshot_mask(ipmeta, timestamp, providermask);
+
+  /* a zero mask would mean all providers */
+  if (mask == 0) {
+    ipmeta_record_set_clear(found);
+    return 0;
+  }
+  return ipmeta_lookup_single(ipmeta, addr, mask, found);
+}
+
+/** Count the entries of the given part of a record set that have the same
+    record and provider as the given entry */
+static int record_set_count(ipmeta_record_set_t *set, int from, int to,
+                            ipmeta_record_set_entry_t *entry)
+{
+  int i, cnt = 0;
+
+  for (i = from; i < to; i++) {
+    if (set->entries[i].record == entry->record &&
+        set->entries[i].provider_id == entry->provider_id) {
+      cnt++;
+    }
+  }
+  return cnt;
+}
+
+/** Check whether the records added to the given record set after the first
+    cnt records are the same as the first cnt records (in any order, but with
+    as many copies of each, since the interval tree returns a record once for
+    each prefix that matched) */
+static int record_set_tail_equal(ipmeta_record_set_t *set, int cnt)
+{
+  int i;
+
+  if (set->n_recs - cnt != cnt) {
+    return 0;
+  }
+  for (i = 0; i < cnt; i++) {
+    if (record_set_count(set, 0, cnt, &set->entries[i]) !=
+        record_set_count(set, cnt, set->n_recs, &set->entries[i])) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int ipmeta_lookup_single_range(ipmeta_t *ipmeta, uint32_t addr,
+                               uint32_t providermask,
+                               ipmeta_record_set_t *found, uint32_t *first,
+                               uint32_t *last)
+{
+#ifdef WITH_LOOKUP_STATS
+  ipmeta_stats_sample_t sample;
+#endif
+  ipmeta_ds_t *ds = ipmeta->datastore;
+  uint32_t next_first, next_last;
+  int rc, cnt, i;
+
+  ipmeta_record_set_clear(found);
+  if (providermask == 0) {
+    providermask = ipmeta->all_provmask;
+  }
+
+#ifdef WITH_LOOKUP_STATS
+  ipmeta_stats_lookup_begin(ipmeta, &sample);
+#endif
+  if ((rc = ds->lookup_record_range(ds, addr, providermask, found, first,
+                                    last)) < 0) {
+    return -1;
+  }
+
+  /* datastructures may return a shorter range than the maximal one (e.g.,
+     a single CIDR block), so merge neighbouring ranges that have the same
+     records. The neighbours' records are appended to found, compared, and
+     then dropped again. */
+  cnt = found->n_recs;
+  for (i = 0; i < RANGE_EXTEND_MAX && *last != UINT32_MAX; i++) {
+    if (ds->lookup_record_range(ds, htonl(*last + 1), providermask, found,
+                                &next_first, &next_last) < 0) {
+      return -1;
+    }
+    if (record_set_tail_equal(found, cnt) == 0) {
+      found->n_recs = cnt;
+      break;
+    }
+    found->n_recs = cnt;
+    *last = next_last;
+  }
+  for (i = 0; i < RANGE_EXTEND_MAX && *first != 0; i++) {
+    if (ds->lookup_record_range(ds, htonl(*first - 1), providermask, found,
+                                &next_first, &next_last) < 0) {
+      return -1;
+    }
+    if (record_set_tail_equal(found, cnt) == 0) {
+      found->n_recs = cnt;
+      break;
+    }
+    found->n_recs = cnt;
+    *first = next_first;
+  }
+#ifdef WITH_LOOKUP_STATS
+  ipmeta_stats_lookup_end(&sample, 1, providermask, found);
+#endif
+
+  return rc;
+}
+
+ipmeta_sorted_stream_t *ipmeta_sorted_stream_init(ipmeta_t *ipmeta,
+                                                  uint32_t providermask)
+{
+  ipmeta_sorted_stream_t *stream;
+
+  if ((stream = malloc_zero(sizeof(ipmeta_sorted_stream_t))) == NULL) {
+    ipmeta_log(__func__, "could not malloc sorted stream");
+    return NULL;
+  }
+
+  if ((stream->records = ipmeta_record_set_init()) == NULL) {
+    free(stream);
+    return NULL;
+  }
+
+  stream->ipmeta = ipmeta;
+  stream->providermask = providermask;
+  stream->first = 1;
+  stream->last = 0;
+
+  return stream;
+}
+
+void ipmeta_sorted_stream_free(ipmeta_sorted_stream_t *stream)
+{
+  if (stream == NULL) {
+    return;
+  }
+
+  ipmeta_record_set_free(&stream->records);
+  free(stream);
+}
+
+int ipmeta_lookup_sorted_stream(ipmeta_sorted_stream_t *stream, uint32_t addr,
+                                ipmeta_record_set_t *found)
+{
+  ipmeta_t *ipmeta = stream->ipmeta;
+  ipmeta_ds_t *ds = ipmeta->datastore;
+  uint32_t providermask = stream->providermask;
+  uint32_t haddr = ntohl(addr);
+  int i;
+#ifdef WITH_LOOKUP_STATS
+  ipmeta_stats_sample_t sample;
+#endif
+
+  if (haddr < stream->prev_addr) {
+    ipmeta_log(__func__, "addresses are not sorted (%08" PRIx32
+                         " follows %08" PRIx32 ")",
+               haddr, stream->prev_addr);
+    return -1;
+  }
+  stream->prev_addr = haddr;
+
+  /* the datastore has changed, so the current range is no longer valid */
+  if (stream->generation != ipmeta->generation) {
+    stream->generation = ipmeta->generation;
+    stream->first = 1;
+    stream->last = 0;
+  }
+
+  /* the address has moved past the current range, so advance to the range
+     that contains it */
+  if (haddr < stream->first || haddr > stream->last) {
+    if (providermask == 0) {
+      providermask = ipmeta->all_provmask;
+    }
+    ipmeta_record_set_clear(stream->records);
+#ifdef WITH_LOOKUP_STATS
+    ipmeta_stats_lookup_begin(ipmeta, &sample);
+#endif
+    if (ds->lookup_record_range(ds, addr, providermask, stream->records,
+                                &stream->first, &stream->last) < 0) {
+      stream->first = 1;
+      stream->last = 0;
+      return -1;
+    }
+#ifdef WITH_LOOKUP_STATS
+    ipmeta_stats_lookup_end(&sample, 1, providermask, stream->records);
+#endif
+  }
+
+  ipmeta_record_set_clear(found);
+  for (i = 0; i < stream->records->n_recs; i++) {
+    if (ipmeta_record_set_add_record(
+          found, stream->records->entries[i].record,
+          stream->records->entries[i].provider_id,
+          stream->records->entries[i].ip_cnt) != 0) {
+      return -1;
+    }
+  }
+
+  return found->n_recs;
 }
 
 inline int ipmeta_is_provider_enabled(ipmeta_provider_t *provider)
@@ -191,6 +601,35 @@ inline int ipmeta_get_provider_id(ipmeta_provider_t *provider)
   return provider->id;
 }
 
+ipmeta_provider_id_t ipmeta_get_provider_type(ipmeta_provider_t *provider)
+{
+  assert(provider != NULL);
+
+  return provider->type;
+}
+
+time_t ipmeta_get_snapshot_time(ipmeta_provider_t *provider)
+{
+  assert(provider != NULL);
+
+  return provider->snapshot_time;
+}
+
+uint64_t ipmeta_get_asn_ip_cnt(ipmeta_provider_t *provider,
+                               ipmeta_record_t *record)
+{
+  khiter_t khiter;
+
+  assert(provider != NULL && record != NULL);
+
+  if (provider->asn_ip_cnts != NULL &&
+      (khiter = kh_get(ipmeta_ipcnt, provider->asn_ip_cnts, record->id)) !=
+        kh_end(provider->asn_ip_cnts)) {
+    return kh_value(provider->asn_ip_cnts, khiter);
+  }
+  return record->asn_ip_cnt;
+}
+
 inline const char *ipmeta_get_provider_name(ipmeta_provider_t *provider)
 {
   assert(provider != NULL);
@@ -198,6 +637,59 @@ inline const char *ipmeta_get_provider_name(ipmeta_provider_t *provider)
   return provider->name;
 }
 
+const ipmeta_load_stats_t *ipmeta_get_load_stats(ipmeta_provider_t *provider)
+{
+  assert(provider != NULL);
+
+  if (provider->enabled == 0) {
+    return NULL;
+  }
+
+  return &provider->load_stats;
+}
+
+/** Names of the memory categories, indexed by ipmeta_mem_category_t */
+static const char *mem_category_names[] = {
+  "trie_nodes", "node_records", "tables", "interval_nodes", "records",
+  "strings",    "polygons",     "hashes", "other",
+};
+
+int ipmeta_get_memory_usage(ipmeta_t *ipmeta, ipmeta_memory_usage_t *usage)
+{
+  int i, j;
+
+  assert(ipmeta != NULL && usage != NULL);
+  assert(ARR_CNT(mem_category_names) == IPMETA_MEM_CATEGORY_CNT);
+
+  memset(usage, 0, sizeof(ipmeta_memory_usage_t));
+
+  usage->ds[IPMETA_MEM_OTHER] += sizeof(ipmeta_t);
+  ipmeta->datastore->memory_usage(ipmeta->datastore, usage);
+
+  for (i = 0; i < IPMETA_PROVIDER_ID_MAX; i++) {
+    if (ipmeta->providers[i] != NULL) {
+      ipmeta_provider_memory_usage(ipmeta->providers[i], usage->providers[i]);
+    }
+  }
+
+  for (j = 0; j < IPMETA_MEM_CATEGORY_CNT; j++) {
+    usage->total += usage->ds[j];
+    for (i = 0; i < IPMETA_PROVIDER_ID_MAX; i++) {
+      usage->total += usage->providers[i][j];
+    }
+  }
+
+  return 0;
+}
+
+const char *ipmeta_get_memory_category_name(ipmeta_mem_category_t category)
+{
+  if (category < 0 || category >= IPMETA_MEM_CATEGORY_CNT) {
+    return NULL;
+  }
+  return mem_category_names[category];
+}
+
 ipmeta_provider_t **ipmeta_get_all_providers(ipmeta_t *ipmeta)
 {
   return ipmeta->providers;
@@ -207,17 +699,16 @@ ipmeta_record_set_t *ipmeta_record_set_init()
 {
   ipmeta_record_set_t *record_set;
 
-  if ((record_set = malloc_zero(sizeof(ipmeta_record_set_t))) == NULL) {
+  /* the inline entries should share a cache line */
+  if (posix_memalign((void **)&record_set, IPMETA_CACHE_LINE_SIZE,
+                     sizeof(ipmeta_record_set_t)) != 0) {
     ipmeta_log(__func__, "could not malloc ipmeta_record_set_t");
     return NULL;
   }
+  memset(record_set, 0, sizeof(ipmeta_record_set_t));
 
-  /* always have space for a single record */
-  if (ipmeta_record_set_add_record(record_set, NULL, 0) != 0) {
-    free(record_set);
-    return NULL;
-  }
-  ipmeta_record_set_clear(record_set);
+  record_set->entries = record_set->_inline;
+  record_set->_alloc_size = IPMETA_RECORD_SET_INLINE_CNT;
 
   return record_set;
 }
@@ -239,11 +730,10 @@ void ipmeta_record_set_free(ipmeta_record_set_t **record_set_p)
     return;
   }
 
-  free(record_set->records);
-  record_set->records = NULL;
-
-  free(record_set->ip_cnts);
-  record_set->ip_cnts = NULL;
+  if (record_set->entries != record_set->_inline) {
+    free(record_set->entries);
+  }
+  record_set->entries = NULL;
 
   record_set->n_recs = 0;
   record_set->_cursor = 0;
@@ -267,40 +757,56 @@ ipmeta_record_t *ipmeta_record_set_next(ipmeta_record_set_t *record_set,
   }
 
   if (num_ips != NULL) {
-    *num_ips = record_set->ip_cnts[record_set->_cursor];
+    *num_ips = record_set->entries[record_set->_cursor].ip_cnt;
   }
 
-  return record_set->records[record_set->_cursor++]; /* Advance head */
+  return record_set->entries[record_set->_cursor++].record; /* Advance head */
+}
+
+ipmeta_record_t *
+ipmeta_record_set_next_provider(ipmeta_record_set_t *record_set,
+                                uint32_t *num_ips, uint32_t *provider_id)
+{
+  if (record_set->n_recs > record_set->_cursor && provider_id != NULL) {
+    *provider_id = record_set->entries[record_set->_cursor].provider_id;
+  }
+  return ipmeta_record_set_next(record_set, num_ips);
 }
 
 int ipmeta_record_set_add_record(ipmeta_record_set_t *record_set,
-                                 ipmeta_record_t *rec, int num_ips)
+                                 ipmeta_record_t *rec, uint32_t provider_id,
+                                 int num_ips)
 {
-  record_set->n_recs++;
+  ipmeta_record_set_entry_t *entries;
+  int alloc_size;
 
-  /* Realloc if necessary */
-  if (record_set->_alloc_size < record_set->n_recs) {
+  /* Spill to the heap (or realloc) if necessary */
+  if (record_set->n_recs == record_set->_alloc_size) {
     /* round n_recs up to next pow 2 */
-    record_set->_alloc_size = record_set->n_recs;
-    kroundup32(record_set->_alloc_size);
-
-    if ((record_set->records =
-           realloc(record_set->records, sizeof(ipmeta_record_t *) *
-                                          record_set->_alloc_size)) == NULL) {
-      ipmeta_log(__func__, "could not realloc records in record set");
-      return -1;
+    alloc_size = record_set->n_recs + 1;
+    kroundup32(alloc_size);
+
+    if (record_set->entries == record_set->_inline) {
+      if ((entries = malloc(sizeof(ipmeta_record_set_entry_t) * alloc_size)) !=
+          NULL) {
+        memcpy(entries, record_set->_inline, sizeof(record_set->_inline));
+      }
+    } else {
+      entries = realloc(record_set->entries,
+                        sizeof(ipmeta_record_set_entry_t) * alloc_size);
     }
-
-    if ((record_set->ip_cnts =
-           realloc(record_set->ip_cnts,
-                   sizeof(uint32_t) * record_set->_alloc_size)) == NULL) {
-      ipmeta_log(__func__, "could not realloc ip_cnts in record set");
+    if (entries == NULL) {
+      ipmeta_log(__func__, "could not realloc entries in record set");
       return -1;
     }
+    record_set->entries = entries;
+    record_set->_alloc_size = alloc_size;
   }
 
-  record_set->records[record_set->n_recs - 1] = rec;
-  record_set->ip_cnts[record_set->n_recs - 1] = num_ips;
+  record_set->entries[record_set->n_recs].record = rec;
+  record_set->entries[record_set->n_recs].ip_cnt = num_ips;
+  record_set->entries[record_set->n_recs].provider_id = provider_id;
+  record_set->n_recs++;
 
   return 0;
 }
@@ -330,11 +836,12 @@ void ipmeta_dump_record_set_by_provider(ipmeta_record_set_t *this, char *ip_str,
                                         int provid)
 {
   ipmeta_record_t *rec;
-  uint32_t num_ips = 0;
+  uint32_t num_ips = 0, found_provid;
   ipmeta_record_set_rewind(this);
   int dumped = 0;
-  while ((rec = ipmeta_record_set_next(this, &num_ips))) {
-    if (rec->source != provid)
+  while ((rec = ipmeta_record_set_next_provider(this, &num_ips,
+                                                &found_provid))) {
+    if (found_provid != (uint32_t)provid)
       continue;
     ipmeta_dump_record(rec, ip_str, num_ips);
     dumped++;
@@ -348,11 +855,12 @@ void ipmeta_write_record_set_by_provider(ipmeta_record_set_t *this, iow_t *file,
                                          char *ip_str, int provid)
 {
   ipmeta_record_t *rec;
-  uint32_t num_ips = 0;
+  uint32_t num_ips = 0, found_provid;
   ipmeta_record_set_rewind(this);
   int dumped = 0;
-  while ((rec = ipmeta_record_set_next(this, &num_ips))) {
-    if (rec->source != provid)
+  while ((rec = ipmeta_record_set_next_provider(this, &num_ips,
+                                                &found_provid))) {
+    if (found_provid != (uint32_t)provid)
       continue;
     ipmeta_write_record(file, rec, ip_str, num_ips);
     dumped++;
@@ -397,7 +905,7 @@ void ipmeta_write_record_set_by_provider(ipmeta_record_set_t *this, iow_t *file,
         if (i < record->asn_cnt - 1)                                           \
           function(file, "_");                                                 \
       }                                                                        \
-      function(file, "|%" PRIu32 "\n", record->asn_ip_cnt);                    \
+      function(file, "|%" PRIu64 "\n", record->asn_ip_cnt);                    \
     } else {                                                                   \
       function(file, "|\n");                                                   \
     }                                                                          \
@@ -0,0 +1,218 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * libipmeta is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libipmeta is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libipmeta.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+#include "libipmeta_int.h"
+#include "ipmeta_ds.h"
+
+/** Largest supported number of cache entries per thread */
+#define CACHE_ENTRIES_MAX (1 << 24)
+
+/** Map an address and provider mask to a cache slot */
+static inline uint32_t cache_slot(ipmeta_cache_t *cache, uint32_t addr,
+                                  uint32_t providermask)
+{
+  uint32_t h = (addr ^ (providermask << 24)) * 2654435761U;
+
+  /* the high bits of the product are the well-mixed ones */
+  return (h ^ (h >> 16)) & (cache->entries_cnt - 1);
+}
+
+/** Get (creating or resizing if needed) the lookup cache of the calling
+    thread */
+static ipmeta_cache_t *get_cache(ipmeta_t *ipmeta)
+{
+  ipmeta_cache_t *cache;
+  void *entries;
+
+  if ((cache = pthread_getspecific(ipmeta->cache_key)) == NULL) {
+    if ((cache = malloc_zero(sizeof(ipmeta_cache_t))) == NULL) {
+      return NULL;
+    }
+    if (pthread_setspecific(ipmeta->cache_key, cache) != 0) {
+      free(cache);
+      return NULL;
+    }
+    /* caches outlive their threads so that their counts are not lost */
+    pthread_mutex_lock(&ipmeta->cache_lock);
+    cache->next = ipmeta->caches;
+    ipmeta->caches = cache;
+    pthread_mutex_unlock(&ipmeta->cache_lock);
+  }
+
+  if (cache->entries_cnt == ipmeta->cache_entries) {
+    return cache;
+  }
+
+  /* the cache has been resized since this thread last used it */
+  if (posix_memalign(&entries, IPMETA_CACHE_LINE_SIZE,
+                     sizeof(ipmeta_cache_entry_t) * ipmeta->cache_entries) !=
+      0) {
+    return NULL;
+  }
+  memset(entries, 0, sizeof(ipmeta_cache_entry_t) * ipmeta->cache_entries);
+  free(cache->entries);
+  cache->entries = entries;
+  cache->entries_cnt = ipmeta->cache_entries;
+
+  return cache;
+}
+
+int ipmeta_cache_lookup_single(ipmeta_t *ipmeta, uint32_t addr,
+                               uint32_t providermask,
+                               ipmeta_record_set_t *found)
+{
+  ipmeta_cache_t *cache;
+  ipmeta_cache_entry_t *entry;
+  uint32_t i;
+  int rc;
+
+  if ((cache = get_cache(ipmeta)) == NULL) {
+    /* no cache for this thread, but the lookup can still be done */
+    return ipmeta->datastore->lookup_record_single(ipmeta->datastore, addr,
+                                                   providermask, found);
+  }
+
+  entry = &cache->entries[cache_slot(cache, addr, providermask)];
+  if (entry->generation == ipmeta->generation && entry->addr == addr &&
+      entry->providermask == providermask) {
+    cache->hits++;
+    for (i = 0; i < entry->n_recs; i++) {
+      if (ipmeta_record_set_add_record(found, entry->records[i],
+                                       entry->provider_ids[i],
+                                       entry->ip_cnts[i]) != 0) {
+        return -1;
+      }
+    }
+    return found->n_recs;
+  }
+
+  cache->misses++;
+  if ((rc = ipmeta->datastore->lookup_record_single(
+         ipmeta->datastore, addr, providermask, found)) < 0) {
+    return rc;
+  }
+
+  /* results with more records than fit in an entry (only possible with
+     extra provider instances, or datastructures that allow overlapping
+     ranges) are not cached */
+  if (found->n_recs > IPMETA_PROVIDER_MAX) {
+    entry->generation = 0;
+    return rc;
+  }
+  entry->addr = addr;
+  entry->providermask = providermask;
+  entry->generation = ipmeta->generation;
+  entry->n_recs = found->n_recs;
+  for (i = 0; i < entry->n_recs; i++) {
+    entry->records[i] = found->entries[i].record;
+    entry->ip_cnts[i] = found->entries[i].ip_cnt;
+    entry->provider_ids[i] = found->entries[i].provider_id;
+  }
+
+  return rc;
+}
+
+void ipmeta_cache_free(ipmeta_t *ipmeta)
+{
+  ipmeta_cache_t *cache;
+
+  if (ipmeta->cache_ready == 0) {
+    return;
+  }
+
+  while ((cache = ipmeta->caches) != NULL) {
+    ipmeta->caches = cache->next;
+    free(cache->entries);
+    free(cache);
+  }
+  pthread_key_delete(ipmeta->cache_key);
+  pthread_mutex_destroy(&ipmeta->cache_lock);
+  ipmeta->cache_ready = 0;
+  ipmeta->cache_entries = 0;
+}
+
+int ipmeta_set_lookup_cache(ipmeta_t *ipmeta, uint32_t entries)
+{
+  assert(ipmeta != NULL);
+
+  if (entries > CACHE_ENTRIES_MAX) {
+    ipmeta_log(__func__, "lookup cache cannot have more than %d entries",
+               CACHE_ENTRIES_MAX);
+    return -1;
+  }
+
+  if (entries != 0 && ipmeta->cache_ready == 0) {
+    if (pthread_key_create(&ipmeta->cache_key, NULL) != 0) {
+      ipmeta_log(__func__, "could not create lookup cache key");
+      return -1;
+    }
+    if (pthread_mutex_init(&ipmeta->cache_lock, NULL) != 0) {
+      ipmeta_log(__func__, "could not create lookup cache lock");
+      pthread_key_delete(ipmeta->cache_key);
+      return -1;
+    }
+    ipmeta->caches = NULL;
+    ipmeta->cache_ready = 1;
+  }
+
+  kroundup32(entries);
+  /* each thread resizes its own cache on its next lookup */
+  ipmeta->cache_entries = entries;
+
+  return 0;
+}
+
+int ipmeta_get_lookup_cache_stats(ipmeta_t *ipmeta, uint64_t *hits,
+                                  uint64_t *misses)
+{
+  ipmeta_cache_t *cache;
+
+  assert(ipmeta != NULL);
+
+  *hits = 0;
+  *misses = 0;
+
+  if (ipmeta->cache_ready == 0) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&ipmeta->cache_lock);
+  for (cache = ipmeta->caches; cache != NULL; cache = cache->next) {
+    *hits += cache->hits;
+    *misses += cache->misses;
+  }
+  pthread_mutex_unlock(&ipmeta->cache_lock);
+
+  return 0;
+}
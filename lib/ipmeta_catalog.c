@@ -0,0 +1,568 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * libipmeta is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libipmeta is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libipmeta.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "utils.h"
+
+#include "libipmeta_int.h"
+
+/** Build the options to load the given snapshot with, by replacing the "%s"
+    in the catalog options with the file name of the snapshot */
+static char *snapshot_options(ipmeta_catalog_t *catalog,
+                              ipmeta_catalog_snapshot_t *snap)
+{
+  char *pos = strstr(catalog->options, "%s");
+  size_t pre = pos - catalog->options;
+  char *options;
+
+  if ((options = malloc(strlen(catalog->options) + strlen(snap->filename) -
+                        1)) == NULL) {
+    return NULL;
+  }
+  memcpy(options, catalog->options, pre);
+  strcpy(options + pre, snap->filename);
+  strcat(options, pos + 2);
+
+  return options;
+}
+
+/** Load a snapshot into a new ipmeta instance (without holding the catalog
+    lock) */
+static ipmeta_t *load_snapshot(ipmeta_catalog_t *catalog,
+                               ipmeta_catalog_snapshot_t *snap,
+                               uint64_t *memory)
+{
+  ipmeta_memory_usage_t usage;
+  ipmeta_provider_t *provider;
+  ipmeta_t *ipmeta;
+  char *options;
+  int rc;
+
+  if ((options = snapshot_options(catalog, snap)) == NULL) {
+    ipmeta_log(__func__, "could not build options for %s", snap->filename);
+    return NULL;
+  }
+
+  if ((ipmeta = ipmeta_init(catalog->dstype)) == NULL) {
+    free(options);
+    return NULL;
+  }
+
+  if ((provider = ipmeta_get_provider_by_name(
+         ipmeta, catalog->provider_name)) == NULL) {
+    ipmeta_log(__func__, "invalid provider name (%s)",
+               catalog->provider_name);
+    goto err;
+  }
+
+  rc = ipmeta_enable_provider(ipmeta, provider, options,
+                              IPMETA_PROVIDER_DEFAULT_YES);
+  if (rc != 0) {
+    ipmeta_log(__func__, "could not load snapshot from %s", snap->filename);
+    goto err;
+  }
+  free(options);
+
+  if (ipmeta_get_memory_usage(ipmeta, &usage) != 0) {
+    ipmeta_free(ipmeta);
+    return NULL;
+  }
+  *memory = usage.total;
+
+  return ipmeta;
+
+err:
+  free(options);
+  ipmeta_free(ipmeta);
+  return NULL;
+}
+
+/** Free the least recently used snapshots until the loaded snapshots fit in
+    the memory budget, never freeing the given snapshot (-1 for none), the
+    current one, or one a caller is waiting for. If those do not fit on their
+    own, they stay loaded over the budget. Must be called with the catalog
+    lock held. */
+static void evict_snapshots(ipmeta_catalog_t *catalog, int keep)
+{
+  ipmeta_catalog_snapshot_t *snap, *victim;
+  int i;
+
+  if (catalog->memory_budget == 0) {
+    return;
+  }
+
+  while (catalog->memory > catalog->memory_budget) {
+    victim = NULL;
+    for (i = 0; i < catalog->snapshots_cnt; i++) {
+      snap = &catalog->snapshots[i];
+      /* the current snapshot may still be in use by the caller, and the one
+         it waits for has not been handed to it yet */
+      if (snap->state != IPMETA_CATALOG_LOADED || i == keep ||
+          i == catalog->current || i == catalog->waiting) {
+        continue;
+      }
+      if (victim == NULL || snap->last_used < victim->last_used) {
+        victim = snap;
+      }
+    }
+    if (victim == NULL) {
+      break;
+    }
+
+    ipmeta_free(victim->ipmeta);
+    victim->ipmeta = NULL;
+    victim->state = IPMETA_CATALOG_UNLOADED;
+    catalog->memory -= victim->memory;
+    victim->memory = 0;
+  }
+}
+
+/** Body of the loader thread, which performs every load of the catalog (one
+    at a time, with demand loads taking priority over prefetches) */
+static void *loader_thread(void *arg)
+{
+  ipmeta_catalog_t *catalog = (ipmeta_catalog_t *)arg;
+  ipmeta_catalog_snapshot_t *snap;
+  ipmeta_t *ipmeta;
+  uint64_t memory = 0;
+  int idx, is_demand;
+
+  pthread_mutex_lock(&catalog->lock);
+  while (1) {
+    while (catalog->shutdown == 0 && catalog->demand < 0 &&
+           catalog->prefetch < 0) {
+      pthread_cond_wait(&catalog->cond, &catalog->lock);
+    }
+    if (catalog->shutdown != 0) {
+      break;
+    }
+
+    if ((is_demand = (catalog->demand >= 0)) != 0) {
+      idx = catalog->demand;
+      catalog->demand = -1;
+    } else {
+      idx = catalog->prefetch;
+      catalog->prefetch = -1;
+    }
+    snap = &catalog->snapshots[idx];
+    if (snap->state != IPMETA_CATALOG_UNLOADED) {
+      continue;
+    }
+    snap->state = IPMETA_CATALOG_LOADING;
+
+    pthread_mutex_unlock(&catalog->lock);
+    ipmeta = load_snapshot(catalog, snap, &memory);
+    pthread_mutex_lock(&catalog->lock);
+
+    if (ipmeta == NULL) {
+      snap->state = IPMETA_CATALOG_FAILED;
+    } else {
+      snap->ipmeta = ipmeta;
+      snap->memory = memory;
+      /* a demand load is about to be used, so it is the most recent */
+      snap->last_used = is_demand ? ++catalog->clock : catalog->clock;
+      snap->state = IPMETA_CATALOG_LOADED;
+      catalog->memory += memory;
+      /* evicting the snapshot that was just loaded would only load it again
+         (and again) */
+      evict_snapshots(catalog, idx);
+    }
+    pthread_cond_broadcast(&catalog->cond);
+  }
+  pthread_mutex_unlock(&catalog->lock);
+
+  return NULL;
+}
+
+static int snapshot_cmp(const void *a, const void *b)
+{
+  const ipmeta_catalog_snapshot_t *sa = a, *sb = b;
+
+  return (sa->valid_from > sb->valid_from) - (sa->valid_from < sb->valid_from);
+}
+
+/** Find the index of the last snapshot that is valid from at or before the
+    given time, -1 if there is none */
+static int find_snapshot(ipmeta_catalog_t *catalog, time_t timestamp)
+{
+  int lo = 0, hi = catalog->snapshots_cnt - 1, mid;
+  int found = -1;
+
+  while (lo <= hi) {
+    mid = lo + (hi - lo) / 2;
+    if (catalog->snapshots[mid].valid_from <= timestamp) {
+      found = mid;
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
+    }
+  }
+
+  return found;
+}
+
+/** Check for a run of exactly cnt digits at str (not followed by another
+    digit), and parse it */
+static int parse_digits(const char *str, int cnt, int *value)
+{
+  int i;
+
+  *value = 0;
+  for (i = 0; i < cnt; i++) {
+    if (!isdigit((unsigned char)str[i])) {
+      return -1;
+    }
+    *value = *value * 10 + (str[i] - '0');
+  }
+  return isdigit((unsigned char)str[cnt]) ? -1 : 0;
+}
+
+/** Parse a date (YYYYMMDD or YYYY-MM-DD), optionally followed by a time of
+    day (HHMM), that starts at the given position of a file name */
+static int parse_date_at(const char *str, time_t *timestamp)
+{
+  struct tm tm;
+  int year, month, day, hour = 0, min = 0;
+  int len;
+
+  if (parse_digits(str, 8, &year) == 0) {
+    day = year % 100;
+    month = (year / 100) % 100;
+    year /= 10000;
+    len = 8;
+  } else if (parse_digits(str, 4, &year) == 0 && str[4] == '-' &&
+             parse_digits(str + 5, 2, &month) == 0 && str[7] == '-' &&
+             parse_digits(str + 8, 2, &day) == 0) {
+    len = 10;
+  } else {
+    return -1;
+  }
+  if (year < 1970 || month < 1 || month > 12 || day < 1 || day > 31) {
+    return -1;
+  }
+
+  if ((str[len] == '-' || str[len] == '_' || str[len] == 'T' ||
+       str[len] == '.') &&
+      parse_digits(str + len + 1, 4, &hour) == 0) {
+    min = hour % 100;
+    hour /= 100;
+    if (hour > 23 || min > 59) {
+      hour = min = 0;
+    }
+  }
+
+  memset(&tm, 0, sizeof(tm));
+  tm.tm_year = year - 1900;
+  tm.tm_mon = month - 1;
+  tm.tm_mday = day;
+  tm.tm_hour = hour;
+  tm.tm_min = min;
+  if ((*timestamp = timegm(&tm)) <= 0) {
+    return -1;
+  }
+
+  return 0;
+}
+
+/** Find the first date in a file name */
+static int parse_filename_date(const char *name, time_t *timestamp)
+{
+  const char *p;
+
+  for (p = name; *p != '\0'; p++) {
+    /* dates must start at the beginning of a run of digits */
+    if (isdigit((unsigned char)*p) &&
+        (p == name || !isdigit((unsigned char)p[-1])) &&
+        parse_date_at(p, timestamp) == 0) {
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+ipmeta_catalog_t *ipmeta_catalog_init(const char *provider_name,
+                                      const char *options,
+                                      enum ipmeta_ds_id dstype,
+                                      uint64_t memory_budget)
+{
+  ipmeta_catalog_t *catalog;
+
+  assert(provider_name != NULL && options != NULL);
+
+  if (strstr(options, "%s") == NULL) {
+    ipmeta_log(__func__, "options (%s) must contain %%s", options);
+    return NULL;
+  }
+
+  if ((catalog = malloc_zero(sizeof(ipmeta_catalog_t))) == NULL) {
+    ipmeta_log(__func__, "could not malloc ipmeta_catalog_t");
+    return NULL;
+  }
+
+  if ((catalog->provider_name = strdup(provider_name)) == NULL ||
+      (catalog->options = strdup(options)) == NULL) {
+    ipmeta_log(__func__, "could not copy catalog options");
+    goto err;
+  }
+  catalog->dstype = dstype;
+  catalog->memory_budget = memory_budget;
+  catalog->current = -1;
+  catalog->demand = -1;
+  catalog->waiting = -1;
+  catalog->prefetch = -1;
+
+  if (pthread_mutex_init(&catalog->lock, NULL) != 0) {
+    ipmeta_log(__func__, "could not create catalog lock");
+    goto err;
+  }
+  if (pthread_cond_init(&catalog->cond, NULL) != 0) {
+    ipmeta_log(__func__, "could not create catalog condition");
+    pthread_mutex_destroy(&catalog->lock);
+    goto err;
+  }
+  if (pthread_create(&catalog->loader, NULL, loader_thread, catalog) != 0) {
+    ipmeta_log(__func__, "could not start catalog loader thread");
+    pthread_cond_destroy(&catalog->cond);
+    pthread_mutex_destroy(&catalog->lock);
+    goto err;
+  }
+
+  return catalog;
+
+err:
+  free(catalog->provider_name);
+  free(catalog->options);
+  free(catalog);
+  return NULL;
+}
+
+void ipmeta_catalog_free(ipmeta_catalog_t *catalog)
+{
+  int i;
+
+  if (catalog == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&catalog->lock);
+  catalog->shutdown = 1;
+  pthread_cond_broadcast(&catalog->cond);
+  pthread_mutex_unlock(&catalog->lock);
+  pthread_join(catalog->loader, NULL);
+
+  for (i = 0; i < catalog->snapshots_cnt; i++) {
+    if (catalog->snapshots[i].ipmeta != NULL) {
+      ipmeta_free(catalog->snapshots[i].ipmeta);
+    }
+    free(catalog->snapshots[i].filename);
+  }
+  free(catalog->snapshots);
+
+  pthread_cond_destroy(&catalog->cond);
+  pthread_mutex_destroy(&catalog->lock);
+  free(catalog->provider_name);
+  free(catalog->options);
+  free(catalog);
+}
+
+int ipmeta_catalog_add_file(ipmeta_catalog_t *catalog, const char *filename,
+                            time_t valid_from)
+{
+  ipmeta_catalog_snapshot_t *snap;
+  int i;
+
+  assert(catalog != NULL && filename != NULL);
+
+  if (catalog->sealed != 0) {
+    ipmeta_log(__func__, "catalog is already in use");
+    return -1;
+  }
+  if (valid_from <= 0) {
+    ipmeta_log(__func__, "invalid snapshot time for %s", filename);
+    return -1;
+  }
+  for (i = 0; i < catalog->snapshots_cnt; i++) {
+    if (catalog->snapshots[i].valid_from == valid_from) {
+      ipmeta_log(__func__, "%s and %s are valid from the same time",
+                 catalog->snapshots[i].filename, filename);
+      return -1;
+    }
+  }
+
+  if (catalog->snapshots_cnt == catalog->snapshots_alloc) {
+    catalog->snapshots_alloc =
+      catalog->snapshots_alloc == 0 ? 64 : catalog->snapshots_alloc * 2;
+    if ((snap = realloc(catalog->snapshots,
+                        sizeof(ipmeta_catalog_snapshot_t) *
+                          catalog->snapshots_alloc)) == NULL) {
+      ipmeta_log(__func__, "could not realloc snapshots");
+      return -1;
+    }
+    catalog->snapshots = snap;
+  }
+
+  snap = &catalog->snapshots[catalog->snapshots_cnt];
+  memset(snap, 0, sizeof(ipmeta_catalog_snapshot_t));
+  if ((snap->filename = strdup(filename)) == NULL) {
+    ipmeta_log(__func__, "could not copy file name");
+    return -1;
+  }
+  snap->valid_from = valid_from;
+  snap->state = IPMETA_CATALOG_UNLOADED;
+  catalog->snapshots_cnt++;
+
+  return 0;
+}
+
+int ipmeta_catalog_add_dir(ipmeta_catalog_t *catalog, const char *dirname)
+{
+  struct dirent *ent;
+  DIR *dir;
+  char *path;
+  time_t valid_from;
+  int cnt = 0;
+
+  assert(catalog != NULL && dirname != NULL);
+
+  if ((dir = opendir(dirname)) == NULL) {
+    ipmeta_log(__func__, "could not open directory %s", dirname);
+    return -1;
+  }
+
+  while ((ent = readdir(dir)) != NULL) {
+    if (ent->d_name[0] == '.' ||
+        parse_filename_date(ent->d_name, &valid_from) != 0) {
+      continue;
+    }
+    if ((path = malloc(strlen(dirname) + strlen(ent->d_name) + 2)) == NULL) {
+      ipmeta_log(__func__, "could not malloc path");
+      goto err;
+    }
+    sprintf(path, "%s/%s", dirname, ent->d_name);
+    if (ipmeta_catalog_add_file(catalog, path, valid_from) != 0) {
+      free(path);
+      goto err;
+    }
+    free(path);
+    cnt++;
+  }
+
+  closedir(dir);
+  return cnt;
+
+err:
+  closedir(dir);
+  return -1;
+}
+
+ipmeta_t *ipmeta_catalog_get(ipmeta_catalog_t *catalog, time_t timestamp)
+{
+  ipmeta_catalog_snapshot_t *snap;
+  int idx;
+
+  assert(catalog != NULL);
+
+  /* fast path: the snapshot that was returned last is still valid, and can
+     not have been evicted */
+  if (catalog->current >= 0 && timestamp >= catalog->current_from &&
+      (catalog->current_until == 0 || timestamp < catalog->current_until)) {
+    return catalog->snapshots[catalog->current].ipmeta;
+  }
+
+  if (catalog->sealed == 0) {
+    qsort(catalog->snapshots, catalog->snapshots_cnt,
+          sizeof(ipmeta_catalog_snapshot_t), snapshot_cmp);
+    catalog->sealed = 1;
+  }
+
+  if ((idx = find_snapshot(catalog, timestamp)) < 0) {
+    return NULL;
+  }
+  snap = &catalog->snapshots[idx];
+
+  pthread_mutex_lock(&catalog->lock);
+  catalog->waiting = idx;
+  while (snap->state == IPMETA_CATALOG_UNLOADED ||
+         snap->state == IPMETA_CATALOG_LOADING) {
+    if (snap->state == IPMETA_CATALOG_UNLOADED && catalog->demand != idx) {
+      catalog->demand = idx;
+      pthread_cond_broadcast(&catalog->cond);
+    }
+    pthread_cond_wait(&catalog->cond, &catalog->lock);
+  }
+  catalog->waiting = -1;
+
+  if (snap->state == IPMETA_CATALOG_FAILED) {
+    pthread_mutex_unlock(&catalog->lock);
+    return NULL;
+  }
+
+  snap->last_used = ++catalog->clock;
+  catalog->current = idx;
+  catalog->current_from = snap->valid_from;
+  /* the last snapshot stays valid forever */
+  catalog->current_until = idx + 1 < catalog->snapshots_cnt
+                             ? catalog->snapshots[idx + 1].valid_from
+                             : 0;
+
+  /* load the next snapshot while this one is being used */
+  if (idx + 1 < catalog->snapshots_cnt &&
+      catalog->snapshots[idx + 1].state == IPMETA_CATALOG_UNLOADED) {
+    catalog->prefetch = idx + 1;
+    pthread_cond_broadcast(&catalog->cond);
+  }
+
+  evict_snapshots(catalog, -1);
+  pthread_mutex_unlock(&catalog->lock);
+
+  return snap->ipmeta;
+}
+
+int ipmeta_catalog_lookup(ipmeta_catalog_t *catalog, uint32_t addr,
+                          time_t timestamp, ipmeta_record_set_t *found)
+{
+  ipmeta_t *ipmeta;
+
+  if ((ipmeta = ipmeta_catalog_get(catalog, timestamp)) == NULL) {
+    ipmeta_record_set_clear(found);
+    if (catalog->sealed != 0 && find_snapshot(catalog, timestamp) < 0) {
+      return 0;
+    }
+    return -1;
+  }
+
+  return ipmeta_lookup_single(ipmeta, addr, 0, found);
+}
@@ -0,0 +1,921 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * libipmeta is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libipmeta is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libipmeta.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "csv.h"
+#include "utils.h"
+#include "wandio_utils.h"
+
+#include "libipmeta_int.h"
+#include "ipmeta_ds.h"
+#include "ipmeta_provider.h"
+
+#define BUFFER_LEN 1024
+
+/** Number of header rows at the top of a Net Acuity Edge blocks file */
+#define NETACQ_EDGE_HEADER_ROW_CNT 1
+
+/** Number of header rows at the top of a MaxMind blocks file */
+#define MAXMIND_HEADER_ROW_CNT 2
+
+/** Netmask of a prefix of the given length, in host byte order */
+#define NETMASK(len) ((len) == 0 ? 0 : ~0U << (32 - (len)))
+
+/** Map from a value string to its index in the value table */
+KHASH_MAP_INIT_STR(strid, uint32_t)
+
+/** Map from a canonical ASN string to the record of the ASN */
+KHASH_MAP_INIT_STR(asnrec, ipmeta_record_t *)
+
+/** The distinct values (ASN strings or record ids) of the prefixes in a
+    diff. Prefixes refer to values by index, so values can be compared by
+    index. */
+typedef struct diff_values {
+  khash_t(strid) * ids;
+  char **strs;
+  uint32_t cnt;
+  uint32_t alloc;
+} diff_values_t;
+
+/** A prefix of a provider file */
+typedef struct diff_prefix {
+  /** First address of the prefix (host byte order) */
+  uint32_t addr;
+
+  /** Index of the value of the prefix in the value table */
+  uint32_t value;
+
+  /** Line the prefix was read from, so the last one of a prefix wins */
+  uint32_t seq;
+
+  /** Prefix length */
+  uint8_t mask;
+} diff_prefix_t;
+
+/** The prefixes of a provider file */
+typedef struct diff_prefixes {
+  diff_prefix_t *pfxs;
+  uint32_t cnt;
+  uint32_t alloc;
+} diff_prefixes_t;
+
+/** An operation of a diff */
+typedef struct diff_op {
+  /** Network address of the prefix (network byte order) */
+  uint32_t addr;
+
+  /** Index of the value the prefix had (if any) */
+  uint32_t old_value;
+
+  /** Index of the value the prefix has now (if any) */
+  uint32_t new_value;
+
+  /** Prefix length */
+  uint8_t mask;
+
+  /** '+' for an added prefix, '-' for a removed prefix, and '~' for a prefix
+      whose value changed */
+  char op;
+} diff_op_t;
+
+/** Get the index of the given value, adding it to the table if needed.
+    Returns -1 on failure. */
+static int64_t intern_value(diff_values_t *values, const char *str)
+{
+  khiter_t khiter;
+  char **tmp;
+  int khret;
+
+  if ((khiter = kh_get(strid, values->ids, str)) != kh_end(values->ids)) {
+    return kh_value(values->ids, khiter);
+  }
+
+  if (values->cnt == values->alloc) {
+    values->alloc = (values->alloc == 0) ? 1024 : values->alloc * 2;
+    if ((tmp = realloc(values->strs, sizeof(char *) * values->alloc)) ==
+        NULL) {
+      ipmeta_log(__func__, "could not realloc value table");
+      return -1;
+    }
+    values->strs = tmp;
+  }
+  if ((values->strs[values->cnt] = strdup(str)) == NULL) {
+    ipmeta_log(__func__, "could not copy value");
+    return -1;
+  }
+  khiter = kh_put(strid, values->ids, values->strs[values->cnt], &khret);
+  if (khret < 0) {
+    free(values->strs[values->cnt]);
+    ipmeta_log(__func__, "could not add value to table");
+    return -1;
+  }
+  kh_value(values->ids, khiter) = values->cnt;
+
+  return values->cnt++;
+}
+
+/** Free the strings of a value table */
+static void free_values(diff_values_t *values)
+{
+  uint32_t i;
+
+  /* the hash keys are the strings in the table */
+  if (values->ids != NULL) {
+    kh_destroy(strid, values->ids);
+  }
+  for (i = 0; i < values->cnt; i++) {
+    free(values->strs[i]);
+  }
+  free(values->strs);
+}
+
+/** Append a prefix with the given value to the list */
+static int add_prefix(diff_prefixes_t *list, diff_values_t *values,
+                      uint32_t addr, uint8_t mask, const char *value)
+{
+  diff_prefix_t *tmp;
+  int64_t idx;
+
+  if ((idx = intern_value(values, value)) < 0) {
+    return -1;
+  }
+  if (list->cnt == list->alloc) {
+    list->alloc = (list->alloc == 0) ? 1024 : list->alloc * 2;
+    if ((tmp = realloc(list->pfxs, sizeof(diff_prefix_t) * list->alloc)) ==
+        NULL) {
+      ipmeta_log(__func__, "could not realloc prefix list");
+      return -1;
+    }
+    list->pfxs = tmp;
+  }
+  list->pfxs[list->cnt].addr = addr & NETMASK(mask);
+  list->pfxs[list->cnt].mask = mask;
+  list->pfxs[list->cnt].value = idx;
+  list->pfxs[list->cnt].seq = list->cnt;
+  list->cnt++;
+
+  return 0;
+}
+
+/** Read the IPv4 prefixes of a pfx2as file (IPv6 prefixes are skipped) */
+static int read_pfx2as(io_t *file, diff_prefixes_t *list,
+                       diff_values_t *values)
+{
+  char buffer[BUFFER_LEN];
+  char *rowp, *net, *len, *asn, *c;
+  struct in_addr addr;
+  uint64_t skipped = 0;
+  int mask;
+
+  while (wandio_fgets(file, buffer, BUFFER_LEN, 1) > 0) {
+    rowp = buffer;
+    if ((net = strsep(&rowp, "\t")) == NULL ||
+        (len = strsep(&rowp, "\t")) == NULL ||
+        (asn = strsep(&rowp, "\t")) == NULL || rowp != NULL) {
+      ipmeta_log(__func__, "invalid pfx2as file");
+      return -1;
+    }
+    if (strchr(net, ':') != NULL) {
+      skipped++;
+      continue;
+    }
+    mask = atoi(len);
+    if (inet_pton(AF_INET, net, &addr) != 1 || mask < 0 || mask > 32) {
+      ipmeta_log(__func__, "invalid prefix %s/%s", net, len);
+      return -1;
+    }
+    /* AS sets are handled as MOAS (as the provider does) */
+    for (c = asn; *c != '\0'; c++) {
+      if (*c == ',') {
+        *c = '_';
+      }
+    }
+    if (add_prefix(list, values, ntohl(addr.s_addr), mask, asn) != 0) {
+      return -1;
+    }
+  }
+
+  if (skipped > 0) {
+    ipmeta_log(__func__, "skipped %" PRIu64 " IPv6 prefixes", skipped);
+  }
+  return 0;
+}
+
+/** Columns of a blocks file (the same for both providers that use them) */
+typedef enum blocks_cols {
+  /** Range Start IP */
+  BLOCKS_COL_STARTIP = 0,
+  /** Range End IP */
+  BLOCKS_COL_ENDIP = 1,
+  /** Record ID */
+  BLOCKS_COL_ID = 2,
+  /** Total number of columns in blocks table */
+  BLOCKS_COL_COUNT = 3
+} blocks_cols_t;
+
+/** State of the parser of a blocks file */
+typedef struct blocks_state {
+  /* csv parser for the file */
+  struct csv_parser parser;
+
+  /* number of header rows to skip */
+  int header_rows;
+
+  /* the current line number */
+  int current_line;
+
+  /* the current column number */
+  int current_column;
+
+  /* first address of the current range (host byte order) */
+  uint32_t block_lower;
+
+  /* last address of the current range (host byte order) */
+  uint32_t block_upper;
+
+  /* record id of the current range */
+  char block_id[BUFFER_LEN];
+
+  /* where to add the prefixes of the ranges */
+  diff_prefixes_t *list;
+  diff_values_t *values;
+} blocks_state_t;
+
+/** Parse a blocks cell */
+static void parse_blocks_cell(void *s, size_t i, void *data)
+{
+  blocks_state_t *state = (blocks_state_t *)data;
+  char *tok = (char *)s;
+  char *end;
+
+  /* skip the first lines */
+  if (state->current_line < state->header_rows) {
+    return;
+  }
+
+  switch (state->current_column) {
+  case BLOCKS_COL_STARTIP:
+    /* start ip */
+    errno = 0;
+    if (tok != NULL) {
+      state->block_lower = strtoul(tok, &end, 10);
+    }
+    if (tok == NULL || end == tok || *end != '\0' || errno == ERANGE) {
+      ipmeta_log(__func__, "Invalid Start IP Value (%s)", tok);
+      state->parser.status = CSV_EUSER;
+    }
+    break;
+
+  case BLOCKS_COL_ENDIP:
+    /* end ip */
+    errno = 0;
+    if (tok != NULL) {
+      state->block_upper = strtoul(tok, &end, 10);
+    }
+    if (tok == NULL || end == tok || *end != '\0' || errno == ERANGE) {
+      ipmeta_log(__func__, "Invalid End IP Value (%s)", tok);
+      state->parser.status = CSV_EUSER;
+    }
+    break;
+
+  case BLOCKS_COL_ID:
+    /* id (kept as a string, to be compared with the other file's) */
+    if (tok == NULL || i >= sizeof(state->block_id)) {
+      ipmeta_log(__func__, "Invalid ID Value (%s)", tok);
+      state->parser.status = CSV_EUSER;
+      break;
+    }
+    memcpy(state->block_id, tok, i + 1);
+    break;
+
+  default:
+    ipmeta_log(__func__, "Invalid Blocks Column (%d:%d)", state->current_line,
+               state->current_column);
+    state->parser.status = CSV_EUSER;
+    break;
+  }
+
+  /* move on to the next column */
+  state->current_column++;
+}
+
+/** Parse a blocks row, adding the prefixes that the provider would split its
+    range into */
+static void parse_blocks_row(int c, void *data)
+{
+  blocks_state_t *state = (blocks_state_t *)data;
+  uint64_t start, end, size;
+  uint8_t mask;
+
+  if (state->current_line < state->header_rows) {
+    state->current_line++;
+    return;
+  }
+
+  /* make sure we parsed exactly as many columns as we anticipated */
+  if (state->current_column != BLOCKS_COL_COUNT) {
+    ipmeta_log(__func__,
+               "ERROR: Expecting %d columns in the blocks file, "
+               "but actually got %d",
+               BLOCKS_COL_COUNT, state->current_column);
+    state->parser.status = CSV_EUSER;
+    return;
+  }
+
+  if (state->block_lower > state->block_upper) {
+    ipmeta_log(__func__, "ERROR: Invalid range (line %d)",
+               state->current_line);
+    state->parser.status = CSV_EUSER;
+    return;
+  }
+
+  start = state->block_lower;
+  end = (uint64_t)state->block_upper + 1;
+  while (start < end) {
+    mask = ipmeta_range_next_prefix(start, end, &size);
+    if (add_prefix(state->list, state->values, (uint32_t)start, mask,
+                   state->block_id) != 0) {
+      state->parser.status = CSV_EUSER;
+      return;
+    }
+    start += size;
+  }
+
+  /* increment the current line */
+  state->current_line++;
+  /* reset the current column */
+  state->current_column = 0;
+}
+
+/** Read the ranges of a blocks file, as the prefixes that the provider would
+    split them into */
+static int read_blocks(io_t *file, int header_rows, diff_prefixes_t *list,
+                       diff_values_t *values)
+{
+  blocks_state_t state;
+  char buffer[BUFFER_LEN];
+  int read = 0;
+
+  memset(&state, 0, sizeof(state));
+  state.header_rows = header_rows;
+  state.list = list;
+  state.values = values;
+
+  /* options for the csv parser */
+  int options = CSV_STRICT | CSV_REPALL_NL | CSV_STRICT_FINI | CSV_APPEND_NULL |
+                CSV_EMPTY_IS_NULL;
+
+  csv_init(&state.parser, options);
+
+  while ((read = wandio_read(file, &buffer, BUFFER_LEN)) > 0) {
+    if (csv_parse(&state.parser, buffer, read, parse_blocks_cell,
+                  parse_blocks_row, &state) != read) {
+      ipmeta_log(__func__, "Error parsing Blocks file");
+      ipmeta_log(__func__, "CSV Error: %s",
+                 csv_strerror(csv_error(&state.parser)));
+      csv_free(&state.parser);
+      return -1;
+    }
+  }
+
+  if (csv_fini(&state.parser, parse_blocks_cell, parse_blocks_row, &state) !=
+      0) {
+    ipmeta_log(__func__, "Error parsing Blocks file");
+    ipmeta_log(__func__, "CSV Error: %s",
+               csv_strerror(csv_error(&state.parser)));
+    csv_free(&state.parser);
+    return -1;
+  }
+
+  csv_free(&state.parser);
+
+  return read < 0 ? -1 : 0;
+}
+
+/** Order prefixes by address, then length, then the line they were read
+    from */
+static int prefix_cmp(const void *a, const void *b)
+{
+  const diff_prefix_t *pa = (const diff_prefix_t *)a;
+  const diff_prefix_t *pb = (const diff_prefix_t *)b;
+
+  if (pa->addr != pb->addr) {
+    return (pa->addr < pb->addr) ? -1 : 1;
+  }
+  if (pa->mask != pb->mask) {
+    return (pa->mask < pb->mask) ? -1 : 1;
+  }
+  return (pa->seq > pb->seq) - (pa->seq < pb->seq);
+}
+
+/** Read the prefixes of a provider file of the given type, sorted, and with
+    only the last value of each prefix */
+static int read_prefixes(ipmeta_provider_id_t type, const char *filename,
+                         diff_prefixes_t *list, diff_values_t *values)
+{
+  io_t *file;
+  uint32_t i, n = 0;
+  int rc;
+
+  if ((file = wandio_create(filename)) == NULL) {
+    ipmeta_log(__func__, "could not open %s", filename);
+    return -1;
+  }
+
+  switch (type) {
+  case IPMETA_PROVIDER_PFX2AS:
+    rc = read_pfx2as(file, list, values);
+    break;
+  case IPMETA_PROVIDER_NETACQ_EDGE:
+    rc = read_blocks(file, NETACQ_EDGE_HEADER_ROW_CNT, list, values);
+    break;
+  case IPMETA_PROVIDER_MAXMIND:
+    rc = read_blocks(file, MAXMIND_HEADER_ROW_CNT, list, values);
+    break;
+  default:
+    ipmeta_log(__func__, "unsupported provider type (%d)", type);
+    rc = -1;
+    break;
+  }
+  wandio_destroy(file);
+  if (rc != 0) {
+    ipmeta_log(__func__, "failed to parse %s", filename);
+    return -1;
+  }
+
+  if (list->cnt > 0) {
+    qsort(list->pfxs, list->cnt, sizeof(diff_prefix_t), prefix_cmp);
+  }
+  for (i = 0; i < list->cnt; i++) {
+    if (i + 1 < list->cnt && list->pfxs[i + 1].addr == list->pfxs[i].addr &&
+        list->pfxs[i + 1].mask == list->pfxs[i].mask) {
+      continue;
+    }
+    list->pfxs[n++] = list->pfxs[i];
+  }
+  list->cnt = n;
+
+  return 0;
+}
+
+/** Write an operation to the diff file */
+static void write_op(iow_t *file, char op, const diff_prefix_t *pfx,
+                     const char *old_value, const char *new_value)
+{
+  struct in_addr addr;
+  char addr_str[INET_ADDRSTRLEN];
+
+  addr.s_addr = htonl(pfx->addr);
+  inet_ntop(AF_INET, &addr, addr_str, sizeof(addr_str));
+
+  if (op == '~') {
+    wandio_printf(file, "%c\t%s\t%d\t%s\t%s\n", op, addr_str, pfx->mask,
+                  old_value, new_value);
+  } else {
+    wandio_printf(file, "%c\t%s\t%d\t%s\n", op, addr_str, pfx->mask,
+                  (op == '-') ? old_value : new_value);
+  }
+}
+
+int ipmeta_diff_files(ipmeta_provider_id_t type, const char *old_file,
+                      const char *new_file, const char *diff_file)
+{
+  diff_values_t values = {NULL, NULL, 0, 0};
+  diff_prefixes_t old_list = {NULL, 0, 0};
+  diff_prefixes_t new_list = {NULL, 0, 0};
+  diff_prefix_t *o, *n;
+  iow_t *file = NULL;
+  uint32_t i = 0, j = 0;
+  int ops = 0, cmp;
+
+  if ((values.ids = kh_init(strid)) == NULL) {
+    ipmeta_log(__func__, "could not create value table");
+    goto err;
+  }
+  if (read_prefixes(type, old_file, &old_list, &values) != 0 ||
+      read_prefixes(type, new_file, &new_list, &values) != 0) {
+    goto err;
+  }
+
+  if ((file = wandio_wcreate(diff_file,
+                             wandio_detect_compression_type(diff_file), 6,
+                             O_CREAT)) == NULL) {
+    ipmeta_log(__func__, "could not open %s for writing", diff_file);
+    goto err;
+  }
+
+  /* both lists are sorted, so walk them together */
+  while (i < old_list.cnt || j < new_list.cnt) {
+    if (j == new_list.cnt) {
+      cmp = -1;
+    } else if (i == old_list.cnt) {
+      cmp = 1;
+    } else {
+      cmp = prefix_cmp(&old_list.pfxs[i], &new_list.pfxs[j]);
+      /* the lines the prefixes were read from do not matter here */
+      if (old_list.pfxs[i].addr == new_list.pfxs[j].addr &&
+          old_list.pfxs[i].mask == new_list.pfxs[j].mask) {
+        cmp = 0;
+      }
+    }
+
+    if (cmp < 0) {
+      o = &old_list.pfxs[i++];
+      write_op(file, '-', o, values.strs[o->value], NULL);
+    } else if (cmp > 0) {
+      n = &new_list.pfxs[j++];
+      write_op(file, '+', n, NULL, values.strs[n->value]);
+    } else {
+      o = &old_list.pfxs[i++];
+      n = &new_list.pfxs[j++];
+      if (o->value == n->value) {
+        continue;
+      }
+      write_op(file, '~', n, values.strs[o->value], values.strs[n->value]);
+    }
+    ops++;
+  }
+
+  wandio_wdestroy(file);
+  free(old_list.pfxs);
+  free(new_list.pfxs);
+  free_values(&values);
+  return ops;
+
+err:
+  free(old_list.pfxs);
+  free(new_list.pfxs);
+  free_values(&values);
+  return -1;
+}
+
+/** Parse an operation line of a diff file */
+static int parse_op(char *line, diff_values_t *values, diff_op_t *op)
+{
+  char *rowp = line, *op_str, *net, *len, *value, *new_value = NULL;
+  struct in_addr addr;
+  int64_t idx;
+  int mask;
+
+  if ((op_str = strsep(&rowp, "\t")) == NULL || strlen(op_str) != 1 ||
+      strchr("+-~", op_str[0]) == NULL || (net = strsep(&rowp, "\t")) == NULL ||
+      (len = strsep(&rowp, "\t")) == NULL ||
+      (value = strsep(&rowp, "\t")) == NULL) {
+    return -1;
+  }
+  if (rowp != NULL) {
+    new_value = strsep(&rowp, "\t");
+  }
+  op->op = op_str[0];
+  if (rowp != NULL || (op->op == '~') != (new_value != NULL)) {
+    return -1;
+  }
+
+  mask = atoi(len);
+  if (inet_pton(AF_INET, net, &addr) != 1 || mask < 0 || mask > 32) {
+    return -1;
+  }
+  op->addr = addr.s_addr & htonl(NETMASK(mask));
+  op->mask = mask;
+
+  if ((idx = intern_value(values, value)) < 0) {
+    return -1;
+  }
+  op->old_value = op->new_value = idx;
+  if (new_value != NULL) {
+    if ((idx = intern_value(values, new_value)) < 0) {
+      return -1;
+    }
+    op->new_value = idx;
+  }
+
+  return 0;
+}
+
+/** Read all the operations of a diff file */
+static int read_ops(const char *filename, diff_values_t *values,
+                    diff_op_t **ops, uint32_t *ops_cnt)
+{
+  char buffer[BUFFER_LEN];
+  uint32_t alloc = 0;
+  diff_op_t *tmp;
+  io_t *file;
+  int line = 0;
+
+  if ((file = wandio_create(filename)) == NULL) {
+    ipmeta_log(__func__, "could not open %s", filename);
+    return -1;
+  }
+
+  while (wandio_fgets(file, buffer, BUFFER_LEN, 1) > 0) {
+    line++;
+    if (buffer[0] == '\0' || buffer[0] == '#') {
+      continue;
+    }
+    if (*ops_cnt == alloc) {
+      alloc = (alloc == 0) ? 1024 : alloc * 2;
+      if ((tmp = realloc(*ops, sizeof(diff_op_t) * alloc)) == NULL) {
+        ipmeta_log(__func__, "could not realloc operation list");
+        goto err;
+      }
+      *ops = tmp;
+    }
+    if (parse_op(buffer, values, &(*ops)[*ops_cnt]) != 0) {
+      ipmeta_log(__func__, "invalid diff operation (line %d)", line);
+      goto err;
+    }
+    (*ops_cnt)++;
+  }
+
+  wandio_destroy(file);
+  return 0;
+
+err:
+  wandio_destroy(file);
+  return -1;
+}
+
+/** Parse an underscore-separated list of ASNs (in the same way as the pfx2as
+    provider) */
+static int parse_asn(const char *str, uint32_t **asn_arr)
+{
+  char *copy, *rowp, *tok, *period;
+  uint32_t *asn = NULL, *tmp;
+  int asn_cnt = 0;
+
+  if ((copy = rowp = strdup(str)) == NULL) {
+    return -1;
+  }
+  while ((tok = strsep(&rowp, "_")) != NULL) {
+    if ((tmp = realloc(asn, sizeof(uint32_t) * (asn_cnt + 1))) == NULL) {
+      free(asn);
+      free(copy);
+      return -1;
+    }
+    asn = tmp;
+    /* 32 bit ASNs may be given in asdot notation */
+    if ((period = strchr(tok, '.')) != NULL) {
+      *period = '\0';
+      asn[asn_cnt] = (atoi(tok) << 16) | atoi(period + 1);
+    } else {
+      asn[asn_cnt] = atoi(tok);
+    }
+    asn_cnt++;
+  }
+  free(copy);
+
+  *asn_arr = asn;
+  return asn_cnt;
+}
+
+/** Write the canonical string of a list of ASNs (which does not depend on
+    the notation the ASNs were given in) */
+static void asn_key(const uint32_t *asn, int asn_cnt, char *buf, size_t len)
+{
+  size_t off = 0;
+  int i;
+
+  buf[0] = '\0';
+  for (i = 0; i < asn_cnt && off < len; i++) {
+    off += snprintf(buf + off, len - off, "%s%" PRIu32, (i == 0) ? "" : "_",
+                    asn[i]);
+  }
+}
+
+/** Free a string (for use with the map) */
+static inline void str_free(const char *str)
+{
+  free((char *)str);
+}
+
+/** Find the records of the given ASN values, creating records for the ones
+    that are needed but do not exist yet */
+static int resolve_asns(ipmeta_provider_t *provider, diff_values_t *values,
+                        const uint8_t *needed, ipmeta_record_t **records)
+{
+  khash_t(asnrec) *table;
+  char key[BUFFER_LEN * 4];
+  char *key_copy;
+  ipmeta_record_t *record;
+  uint32_t *asn = NULL;
+  uint32_t i, next_id = 0;
+  khiter_t khiter;
+  int asn_cnt, khret;
+  int rc = -1;
+
+  if ((table = kh_init(asnrec)) == NULL) {
+    ipmeta_log(__func__, "could not create ASN table");
+    return -1;
+  }
+
+  /* the provider gives each ASN string its own record */
+  for (i = 0; i < provider->all_records_cnt; i++) {
+    record = provider->all_records[i];
+    if (record->id >= next_id) {
+      next_id = record->id + 1;
+    }
+    asn_key(record->asn, record->asn_cnt, key, sizeof(key));
+    if (kh_get(asnrec, table, key) != kh_end(table)) {
+      continue;
+    }
+    if ((key_copy = strdup(key)) == NULL) {
+      ipmeta_log(__func__, "could not copy ASN string");
+      goto out;
+    }
+    khiter = kh_put(asnrec, table, key_copy, &khret);
+    if (khret < 0) {
+      free(key_copy);
+      ipmeta_log(__func__, "could not add ASN to table");
+      goto out;
+    }
+    kh_value(table, khiter) = record;
+  }
+
+  for (i = 0; i < values->cnt; i++) {
+    if ((asn_cnt = parse_asn(values->strs[i], &asn)) <= 0) {
+      ipmeta_log(__func__, "could not parse ASN string '%s'", values->strs[i]);
+      goto out;
+    }
+    asn_key(asn, asn_cnt, key, sizeof(key));
+    if ((khiter = kh_get(asnrec, table, key)) != kh_end(table)) {
+      records[i] = kh_value(table, khiter);
+    } else if (needed[i]) {
+      if ((record = ipmeta_provider_init_record(provider, next_id++)) ==
+          NULL) {
+        ipmeta_log(__func__, "could not create record for AS %s",
+                   values->strs[i]);
+        goto out;
+      }
+      record->asn = asn;
+      record->asn_cnt = asn_cnt;
+      asn = NULL;
+      records[i] = record;
+    }
+    free(asn);
+    asn = NULL;
+  }
+  rc = 0;
+
+out:
+  free(asn);
+  kh_free(asnrec, table, str_free);
+  kh_destroy(asnrec, table);
+  return rc;
+}
+
+/** Find the records of the given record id values */
+static int resolve_ids(ipmeta_provider_t *provider, diff_values_t *values,
+                       const uint8_t *needed, ipmeta_record_t **records)
+{
+  unsigned long id;
+  char *end;
+  uint32_t i;
+
+  for (i = 0; i < values->cnt; i++) {
+    id = strtoul(values->strs[i], &end, 10);
+    if (end == values->strs[i] || *end != '\0' || id > UINT32_MAX) {
+      ipmeta_log(__func__, "invalid record id '%s'", values->strs[i]);
+      return -1;
+    }
+    records[i] = ipmeta_provider_get_record(provider, id);
+    if (records[i] == NULL && needed[i]) {
+      ipmeta_log(__func__, "missing record for location %lu", id);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int ipmeta_apply_diff(ipmeta_t *ipmeta, ipmeta_provider_t *provider,
+                      const char *diff_file)
+{
+  diff_values_t values = {NULL, NULL, 0, 0};
+  ipmeta_record_t **records = NULL;
+  uint8_t *needed = NULL;
+  diff_op_t *ops = NULL, *op;
+  uint32_t ops_cnt = 0, i;
+  uint64_t size;
+  ipmeta_ds_t *ds;
+  int rc = -1, err;
+
+  if (!ipmeta_is_provider_enabled(provider)) {
+    ipmeta_log(__func__, "provider %s is not enabled", provider->name);
+    return -1;
+  }
+  if (provider->snapshot_time != 0) {
+    /* snapshots share records, which must not change under the others */
+    ipmeta_log(__func__, "diffs cannot be applied to snapshots");
+    return -1;
+  }
+  if (provider->type != IPMETA_PROVIDER_PFX2AS &&
+      provider->type != IPMETA_PROVIDER_NETACQ_EDGE &&
+      provider->type != IPMETA_PROVIDER_MAXMIND) {
+    ipmeta_log(__func__, "diffs are not supported by the %s provider",
+               provider->name);
+    return -1;
+  }
+  ds = provider->ds;
+
+  if ((values.ids = kh_init(strid)) == NULL) {
+    ipmeta_log(__func__, "could not create value table");
+    goto out;
+  }
+
+  /* everything is checked before the datastructure is changed */
+  if (read_ops(diff_file, &values, &ops, &ops_cnt) != 0) {
+    goto out;
+  }
+  if ((needed = malloc_zero(values.cnt + 1)) == NULL ||
+      (records = malloc_zero(sizeof(ipmeta_record_t *) * (values.cnt + 1))) ==
+        NULL) {
+    ipmeta_log(__func__, "could not malloc record table");
+    goto out;
+  }
+  for (i = 0; i < ops_cnt; i++) {
+    if (ops[i].op != '-') {
+      needed[ops[i].new_value] = 1;
+    }
+  }
+  if (provider->type == IPMETA_PROVIDER_PFX2AS) {
+    if (resolve_asns(provider, &values, needed, records) != 0) {
+      goto out;
+    }
+  } else if (resolve_ids(provider, &values, needed, records) != 0) {
+    goto out;
+  }
+
+  for (i = 0; i < ops_cnt; i++) {
+    op = &ops[i];
+    if (op->op == '-') {
+      err = ds->remove_prefix(ds, op->addr, op->mask, provider->id);
+    } else {
+      err = ds->update_prefix(ds, op->addr, op->mask, provider->id,
+                              records[op->new_value]);
+    }
+    if (err != 0) {
+      ipmeta_log(__func__, "failed to apply operation %" PRIu32, i + 1);
+      break;
+    }
+
+    /* keep the address counts of the ASNs up to date */
+    if (provider->type == IPMETA_PROVIDER_PFX2AS) {
+      size = (uint64_t)1 << (32 - op->mask);
+      if (op->op != '+' && records[op->old_value] != NULL) {
+        records[op->old_value]->asn_ip_cnt -= size;
+      }
+      if (op->op != '-') {
+        records[op->new_value]->asn_ip_cnt += size;
+      }
+    }
+  }
+
+  /* the operations applied before a failure are finalized too, otherwise
+     their queued changes would be applied by some later finalize */
+  if (ds->finalize(ds) != 0) {
+    ipmeta_log(__func__, "failed to finalize datastructure");
+  } else if (i == ops_cnt) {
+    rc = ops_cnt;
+  }
+
+  /* whatever was applied may be visible to lookups now */
+  ipmeta->generation++;
+
+out:
+  free(records);
+  free(needed);
+  free(ops);
+  free_values(&values);
+  return rc;
+}
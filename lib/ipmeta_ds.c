@@ -26,10 +26,17 @@
 #include "config.h"
 
 #include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "ipmeta_ds_intervaltree.h"
 #include "ipmeta_ds_bigarray.h"
+#include "ipmeta_ds_cpatricia.h"
 #include "ipmeta_ds_patricia.h"
+#include "ipmeta_ds_treebitmap.h"
 #include "utils.h"
 
 #include "ipmeta_ds.h"
@@ -45,9 +52,11 @@ typedef ipmeta_ds_t *(*ds_alloc_func_t)();
  */
 static const ds_alloc_func_t ds_alloc_functions[] = {
   NULL, ipmeta_ds_patricia_alloc, ipmeta_ds_bigarray_alloc,
-  ipmeta_ds_intervaltree_alloc};
+  ipmeta_ds_intervaltree_alloc, ipmeta_ds_treebitmap_alloc,
+  ipmeta_ds_cpatricia_alloc};
 
-int ipmeta_ds_init(struct ipmeta_ds **ds, ipmeta_ds_id_t ds_id)
+int ipmeta_ds_init(struct ipmeta_ds **ds, ipmeta_ds_id_t ds_id,
+                   uint32_t flags)
 {
   assert(ARR_CNT(ds_alloc_functions) == IPMETA_DS_MAX + 1);
   assert(ds_id > 0 && ds_id <= IPMETA_DS_MAX);
@@ -63,6 +72,8 @@ int ipmeta_ds_init(struct ipmeta_ds **ds, ipmeta_ds_id_t ds_id)
 
   assert(*ds != NULL);
 
+  (*ds)->flags = flags;
+
   /** init the ds */
   if ((*ds)->init(*ds) != 0) {
     return -1;
@@ -71,7 +82,8 @@ int ipmeta_ds_init(struct ipmeta_ds **ds, ipmeta_ds_id_t ds_id)
   return 0;
 }
 
-int ipmeta_ds_init_by_name(struct ipmeta_ds **ds, const char *name)
+int ipmeta_ds_init_by_name(struct ipmeta_ds **ds, const char *name,
+                           uint32_t flags)
 {
   int i;
   ipmeta_ds_t *tmp_ds;
@@ -84,7 +96,7 @@ int ipmeta_ds_init_by_name(struct ipmeta_ds **ds, const char *name)
     assert(tmp_ds != NULL);
 
     if (strcmp(tmp_ds->name, name) == 0) {
-      return ipmeta_ds_init(ds, i);
+      return ipmeta_ds_init(ds, i, flags);
     }
   }
 
@@ -111,3 +123,392 @@ const char **ipmeta_ds_get_all()
 
   return names;
 }
+
+/** Size of the huge pages that we try to use for large tables */
+#define HUGEPAGE_1G_SIZE ((size_t)1 << 30)
+#define HUGEPAGE_2M_SIZE ((size_t)1 << 21)
+
+/** Round size up to a multiple of the (power of two) page size */
+#define ROUND_UP(size, page) (((size) + (page)-1) & ~((page)-1))
+
+/** Try to map an anonymous region of the given size, NULL on failure */
+static void *map_anon(size_t size, int extra_flags)
+{
+  void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | extra_flags, -1, 0);
+  return (ptr == MAP_FAILED) ? NULL : ptr;
+}
+
+void *ipmeta_ds_large_alloc(ipmeta_ds_t *ds, size_t size, size_t *alloc_size)
+{
+  void *ptr = NULL;
+  int populate = 0;
+
+#ifdef MAP_POPULATE
+  if (ds->flags & IPMETA_FLAG_PREFAULT) {
+    populate = MAP_POPULATE;
+  }
+#endif
+
+#ifdef MAP_HUGETLB
+  if (ds->flags & IPMETA_FLAG_HUGEPAGES) {
+#ifdef MAP_HUGE_1GB
+    /* only worth using 1 GB pages if we fill most of the last page */
+    if (size >= HUGEPAGE_1G_SIZE) {
+      *alloc_size = ROUND_UP(size, HUGEPAGE_1G_SIZE);
+      if ((ptr = map_anon(*alloc_size, MAP_HUGETLB | MAP_HUGE_1GB |
+                                         populate)) != NULL) {
+        return ptr;
+      }
+    }
+#endif
+    /* the default huge page size (usually 2 MB) */
+    *alloc_size = ROUND_UP(size, HUGEPAGE_2M_SIZE);
+    if ((ptr = map_anon(*alloc_size, MAP_HUGETLB | populate)) != NULL) {
+      return ptr;
+    }
+    ipmeta_log(__func__, "no huge pages available, falling back to THP");
+  }
+#endif
+
+  /* regular pages. we rely on the kernel to lazily allocate (zeroed) pages,
+     so tell it not to reserve swap for the whole region */
+  *alloc_size = ROUND_UP(size, HUGEPAGE_2M_SIZE);
+  if ((ptr = map_anon(*alloc_size, MAP_NORESERVE | populate)) == NULL) {
+    ipmeta_log(__func__, "could not map %zu bytes", *alloc_size);
+    *alloc_size = 0;
+    return NULL;
+  }
+
+#ifdef MADV_HUGEPAGE
+  if ((ds->flags & IPMETA_FLAG_HUGEPAGES) &&
+      madvise(ptr, *alloc_size, MADV_HUGEPAGE) != 0) {
+    ipmeta_log(__func__, "transparent huge pages are not available");
+  }
+#endif
+
+  return ptr;
+}
+
+void ipmeta_ds_large_free(void *ptr, size_t alloc_size)
+{
+  if (ptr != NULL) {
+    munmap(ptr, alloc_size);
+  }
+}
+
+/** Number of pages checked by each call to mincore */
+#define RESIDENT_CHUNK_PAGES 65536
+
+uint64_t ipmeta_ds_large_resident(void *ptr, size_t alloc_size)
+{
+  unsigned char vec[RESIDENT_CHUNK_PAGES];
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t off, len, i;
+  uint64_t resident = 0;
+
+  if (ptr == NULL) {
+    return 0;
+  }
+
+  for (off = 0; off < alloc_size; off += len) {
+    len = alloc_size - off;
+    if (len > RESIDENT_CHUNK_PAGES * page_size) {
+      len = RESIDENT_CHUNK_PAGES * page_size;
+    }
+    if (mincore((char *)ptr + off, len, vec) != 0) {
+      /* assume the worst */
+      return alloc_size;
+    }
+    for (i = 0; i < (len + page_size - 1) / page_size; i++) {
+      if (vec[i] & 1) {
+        resident += page_size;
+      }
+    }
+  }
+
+  return resident;
+}
+
+/** State shared by the worker threads of ipmeta_ds_parallel_for */
+typedef struct parallel_for_state {
+  int (*job)(void *user, int job_idx);
+  void *user;
+  int job_cnt;
+  int next_job;
+  int failed;
+} parallel_for_state_t;
+
+static void *parallel_for_worker(void *arg)
+{
+  parallel_for_state_t *pf = (parallel_for_state_t *)arg;
+  int job_idx;
+
+  while ((job_idx = __sync_fetch_and_add(&pf->next_job, 1)) < pf->job_cnt) {
+    if (pf->job(pf->user, job_idx) != 0) {
+      __sync_fetch_and_or(&pf->failed, 1);
+    }
+  }
+
+  return NULL;
+}
+
+int ipmeta_ds_parallel_for(int job_cnt, int (*job)(void *user, int job_idx),
+                           void *user)
+{
+  parallel_for_state_t pf = {job, user, job_cnt, 0, 0};
+  pthread_t *threads = NULL;
+  long thread_cnt;
+  int started = 0;
+  int i;
+
+  if ((thread_cnt = sysconf(_SC_NPROCESSORS_ONLN)) < 1) {
+    thread_cnt = 1;
+  }
+  if (thread_cnt > job_cnt) {
+    thread_cnt = job_cnt;
+  }
+
+  /* the calling thread is one of the workers */
+  if (thread_cnt > 1 &&
+      (threads = malloc(sizeof(pthread_t) * (thread_cnt - 1))) != NULL) {
+    for (i = 0; i < thread_cnt - 1; i++) {
+      if (pthread_create(&threads[i], NULL, parallel_for_worker, &pf) != 0) {
+        break;
+      }
+      started++;
+    }
+  }
+
+  /* the calling thread always helps out (and does all the work if we could
+     not start any threads) */
+  parallel_for_worker(&pf);
+
+  for (i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+
+  return pf.failed ? -1 : 0;
+}
+
+int ipmeta_ds_slots_set(ipmeta_ds_slots_t **slots, int idx,
+                        ipmeta_record_t *record)
+{
+  ipmeta_record_t *recs[IPMETA_PROVIDER_ID_MAX];
+  ipmeta_record_t *prev = NULL;
+  ipmeta_ds_slots_t *tmp;
+  uint32_t providers = 0, runs = 0, left;
+  int i, cnt = 0;
+
+  if (ipmeta_ds_slots_get(*slots, idx) == record) {
+    return 0;
+  }
+
+  /* expand the runs, replace the record, and pack them again */
+  if (*slots != NULL) {
+    providers = (*slots)->providers;
+    for (left = providers; left != 0; left &= left - 1) {
+      i = __builtin_ctz(left);
+      recs[i] = ipmeta_ds_slots_get(*slots, i);
+    }
+  }
+  recs[idx] = record;
+  providers |= 1U << idx;
+
+  for (left = providers; left != 0; left &= left - 1) {
+    i = __builtin_ctz(left);
+    if (recs[i] != prev) {
+      runs |= 1U << i;
+      recs[cnt++] = prev = recs[i];
+    }
+  }
+
+  if ((tmp = realloc(*slots, sizeof(ipmeta_ds_slots_t) +
+                               cnt * sizeof(ipmeta_record_t *))) == NULL) {
+    ipmeta_log(__func__, "could not realloc record slots");
+    return -1;
+  }
+  tmp->providers = providers;
+  tmp->runs = runs;
+  memcpy(tmp->records, recs, cnt * sizeof(ipmeta_record_t *));
+  *slots = tmp;
+
+  return 0;
+}
+
+int ipmeta_ds_slots_clear(ipmeta_ds_slots_t **slots, int idx)
+{
+  ipmeta_record_t *recs[IPMETA_PROVIDER_ID_MAX];
+  ipmeta_record_t *prev = NULL;
+  uint32_t providers, runs = 0, left;
+  int i, cnt = 0;
+
+  if (ipmeta_ds_slots_get(*slots, idx) == NULL) {
+    return 0;
+  }
+  if ((providers = (*slots)->providers & ~(1U << idx)) == 0) {
+    free(*slots);
+    *slots = NULL;
+    return 0;
+  }
+
+  /* removing a record can only merge runs, so the slots shrink in place */
+  for (left = providers; left != 0; left &= left - 1) {
+    i = __builtin_ctz(left);
+    recs[i] = ipmeta_ds_slots_get(*slots, i);
+  }
+  for (left = providers; left != 0; left &= left - 1) {
+    i = __builtin_ctz(left);
+    if (recs[i] != prev) {
+      runs |= 1U << i;
+      recs[cnt++] = prev = recs[i];
+    }
+  }
+  (*slots)->providers = providers;
+  (*slots)->runs = runs;
+  memcpy((*slots)->records, recs, cnt * sizeof(ipmeta_record_t *));
+
+  return 0;
+}
+
+int ipmeta_ds_slots_extract(const ipmeta_ds_slots_t *slots, uint32_t provmask,
+                            uint32_t *foundsofar, uint32_t ip_cnt,
+                            ipmeta_record_set_t *found)
+{
+  uint32_t wanted;
+  int idx;
+
+  if (slots == NULL) {
+    return 0;
+  }
+  wanted = slots->providers & provmask & ~*foundsofar;
+  while (wanted != 0) {
+    idx = __builtin_ctz(wanted);
+    wanted &= wanted - 1;
+    if (ipmeta_record_set_add_record(found, ipmeta_ds_slots_get(slots, idx),
+                                     idx + 1, ip_cnt) != 0) {
+      return -1;
+    }
+    *foundsofar |= 1U << idx;
+  }
+  return 0;
+}
+
+/** Resize the rows of a slot table to the given number of rows and columns,
+    and move the existing rows so that the column of the provider with the
+    given index is empty (if new_col is not negative) */
+static int slot_table_resize(ipmeta_ds_slot_table_t *table, uint32_t alloc,
+                             int width, int new_col)
+{
+  ipmeta_record_t **tmp;
+  uint32_t row;
+
+  if ((uint64_t)alloc * width == 0) {
+    free(table->records);
+    table->records = NULL;
+  } else {
+    if ((tmp = realloc(table->records, (uint64_t)alloc * width *
+                                         sizeof(ipmeta_record_t *))) == NULL) {
+      ipmeta_log(__func__, "could not realloc record slot table");
+      return -1;
+    }
+    table->records = tmp;
+  }
+
+  /* widening the rows moves them towards the end, so start at the last */
+  if (new_col >= 0) {
+    for (row = table->rows_cnt; row > 0; row--) {
+      memmove(&table->records[(uint64_t)(row - 1) * width + new_col + 1],
+              &table->records[(uint64_t)(row - 1) * table->width + new_col],
+              (table->width - new_col) * sizeof(ipmeta_record_t *));
+      table->records[(uint64_t)(row - 1) * width + new_col] = NULL;
+      memmove(&table->records[(uint64_t)(row - 1) * width],
+              &table->records[(uint64_t)(row - 1) * table->width],
+              new_col * sizeof(ipmeta_record_t *));
+    }
+  }
+
+  table->rows_alloc = alloc;
+  table->width = width;
+  return 0;
+}
+
+int ipmeta_ds_slot_table_alloc(ipmeta_ds_slot_table_t *table, uint32_t cnt,
+                               uint32_t *first)
+{
+  uint32_t alloc = table->rows_alloc;
+
+  while (alloc < table->rows_cnt + cnt) {
+    alloc = (alloc == 0) ? 1024 : alloc * 2;
+  }
+  if (alloc != table->rows_alloc &&
+      slot_table_resize(table, alloc, table->width, -1) != 0) {
+    return -1;
+  }
+  if (table->width > 0) {
+    memset(&table->records[(uint64_t)table->rows_cnt * table->width], 0,
+           (uint64_t)cnt * table->width * sizeof(ipmeta_record_t *));
+  }
+  *first = table->rows_cnt;
+  table->rows_cnt += cnt;
+
+  return 0;
+}
+
+int ipmeta_ds_slot_table_set(ipmeta_ds_slot_table_t *table, uint32_t row,
+                             int idx, ipmeta_record_t *record)
+{
+  int col = __builtin_popcount(table->providers & ((1U << idx) - 1));
+
+  assert(row < table->rows_cnt);
+
+  /* the first record of a provider adds a column to every row */
+  if (((table->providers >> idx) & 1) == 0) {
+    if (slot_table_resize(table, table->rows_alloc, table->width + 1, col) !=
+        0) {
+      return -1;
+    }
+    table->providers |= 1U << idx;
+  }
+  table->records[(uint64_t)row * table->width + col] = record;
+
+  return 0;
+}
+
+int ipmeta_ds_slot_table_extract(const ipmeta_ds_slot_table_t *table,
+                                 uint32_t row, uint32_t provmask,
+                                 uint32_t *foundsofar, uint32_t ip_cnt,
+                                 ipmeta_record_set_t *found)
+{
+  uint32_t wanted = table->providers & provmask & ~*foundsofar;
+  ipmeta_record_t *rec;
+  int idx;
+
+  while (wanted != 0) {
+    idx = __builtin_ctz(wanted);
+    wanted &= wanted - 1;
+    if ((rec = ipmeta_ds_slot_table_get(table, row, idx)) == NULL) {
+      continue;
+    }
+    if (ipmeta_record_set_add_record(found, rec, idx + 1, ip_cnt) != 0) {
+      return -1;
+    }
+    *foundsofar |= 1U << idx;
+  }
+  return 0;
+}
+
+void ipmeta_ds_slot_table_trim(ipmeta_ds_slot_table_t *table)
+{
+  /* shrinking cannot fail in a way that matters, the rows just stay */
+  if (table->rows_cnt < table->rows_alloc) {
+    slot_table_resize(table, table->rows_cnt, table->width, -1);
+  }
+}
+
+void ipmeta_ds_slot_table_free(ipmeta_ds_slot_table_t *table)
+{
+  free(table->records);
+  memset(table, 0, sizeof(*table));
+}
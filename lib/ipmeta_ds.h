@@ -50,13 +50,36 @@
   int ipmeta_ds_##datastructure##_init(ipmeta_ds_t *ds);                       \
   void ipmeta_ds_##datastructure##_free(ipmeta_ds_t *ds);                      \
   int ipmeta_ds_##datastructure##_add_prefix(                                  \
-    ipmeta_ds_t *ds, uint32_t addr, uint8_t mask, ipmeta_record_t *record);    \
+    ipmeta_ds_t *ds, uint32_t addr, uint8_t mask, uint32_t provider_id,        \
+    ipmeta_record_t *record);                                                  \
+  int ipmeta_ds_##datastructure##_finalize(ipmeta_ds_t *ds);                   \
   int ipmeta_ds_##datastructure##_lookup_records(                              \
     ipmeta_ds_t *ds, uint32_t addr, uint8_t mask, uint32_t providermask,       \
     ipmeta_record_set_t *records);                                             \
   int ipmeta_ds_##datastructure##_lookup_record_single(                        \
     ipmeta_ds_t *ds, uint32_t addr, uint32_t providermask,                     \
-    ipmeta_record_set_t *found);
+    ipmeta_record_set_t *found);                                               \
+  int ipmeta_ds_##datastructure##_lookup_record_range(                         \
+    ipmeta_ds_t *ds, uint32_t addr, uint32_t providermask,                     \
+    ipmeta_record_set_t *found, uint32_t *first, uint32_t *last);              \
+  ipmeta_record_t *ipmeta_ds_##datastructure##_lookup_record_provider(         \
+    ipmeta_ds_t *ds, uint32_t addr, uint32_t provider_id);                     \
+  int ipmeta_ds_##datastructure##_add_prefix6(                                 \
+    ipmeta_ds_t *ds, const struct in6_addr *addr, uint8_t mask,                \
+    uint32_t provider_id, ipmeta_record_t *record);                            \
+  int ipmeta_ds_##datastructure##_lookup_records6(                             \
+    ipmeta_ds_t *ds, const struct in6_addr *addr, uint8_t mask,                \
+    uint32_t providermask, ipmeta_record_set_t *records);                      \
+  int ipmeta_ds_##datastructure##_lookup_record_single6(                       \
+    ipmeta_ds_t *ds, const struct in6_addr *addr, uint32_t providermask,       \
+    ipmeta_record_set_t *found);                                               \
+  void ipmeta_ds_##datastructure##_memory_usage(ipmeta_ds_t *ds,               \
+                                                ipmeta_memory_usage_t *usage); \
+  int ipmeta_ds_##datastructure##_remove_prefix(                               \
+    ipmeta_ds_t *ds, uint32_t addr, uint8_t mask, uint32_t provider_id);       \
+  int ipmeta_ds_##datastructure##_update_prefix(                               \
+    ipmeta_ds_t *ds, uint32_t addr, uint8_t mask, uint32_t provider_id,        \
+    ipmeta_record_t *record);
 
 /** Convenience macro that defines all the function pointers for the ipmeta
  * datastructure API
@@ -64,8 +87,17 @@
 #define IPMETA_DS_GENERATE_PTRS(datastructure)                                 \
   ipmeta_ds_##datastructure##_init, ipmeta_ds_##datastructure##_free,          \
     ipmeta_ds_##datastructure##_add_prefix,                                    \
+    ipmeta_ds_##datastructure##_finalize,                                      \
     ipmeta_ds_##datastructure##_lookup_records,                                \
-    ipmeta_ds_##datastructure##_lookup_record_single,
+    ipmeta_ds_##datastructure##_lookup_record_single,                          \
+    ipmeta_ds_##datastructure##_lookup_record_range,                           \
+    ipmeta_ds_##datastructure##_lookup_record_provider,                        \
+    ipmeta_ds_##datastructure##_add_prefix6,                                   \
+    ipmeta_ds_##datastructure##_lookup_records6,                               \
+    ipmeta_ds_##datastructure##_lookup_record_single6,                         \
+    ipmeta_ds_##datastructure##_memory_usage,                                  \
+    ipmeta_ds_##datastructure##_remove_prefix,                                 \
+    ipmeta_ds_##datastructure##_update_prefix,
 
 /** Structure which represents a metadata datastructure */
 struct ipmeta_ds {
@@ -81,9 +113,22 @@ struct ipmeta_ds {
   /** Pointer to free function */
   void (*free)(struct ipmeta_ds *ds);
 
-  /** Pointer to add prefix function */
+  /** Pointer to add prefix function
+   *
+   * Stores the record in the slot of the given provider, which is not
+   * necessarily the source of the record (snapshots of a provider share the
+   * records that did not change).
+   */
   int (*add_prefix)(struct ipmeta_ds *ds, uint32_t addr, uint8_t mask,
-                    struct ipmeta_record *record);
+                    uint32_t provider_id, struct ipmeta_record *record);
+
+  /** Pointer to finalize function
+   *
+   * Called once a provider has finished adding prefixes. Datastructures that
+   * defer (or batch) insertion must ensure that all prefixes added so far are
+   * visible to lookups when this returns.
+   */
+  int (*finalize)(struct ipmeta_ds *ds);
 
   /** Pointer to lookup records function */
   int (*lookup_records)(struct ipmeta_ds *ds, uint32_t addr, uint8_t mask,
@@ -94,25 +139,102 @@ struct ipmeta_ds {
                               uint32_t providermask,
                               ipmeta_record_set_t *found);
 
+  /** Pointer to lookup record range function
+   *
+   * Behaves like lookup_record_single, and also sets first and last (host
+   * byte order) to a range around the address over which the result (for
+   * the given provider mask) does not change. The range does not have to be
+   * maximal, but it must always contain the address.
+   */
+  int (*lookup_record_range)(struct ipmeta_ds *ds, uint32_t addr,
+                             uint32_t providermask, ipmeta_record_set_t *found,
+                             uint32_t *first, uint32_t *last);
+
+  /** Pointer to lookup record provider function
+   *
+   * Returns the (most specific) record of the given provider for the given
+   * address, or NULL if there is none.
+   */
+  ipmeta_record_t *(*lookup_record_provider)(struct ipmeta_ds *ds,
+                                             uint32_t addr,
+                                             uint32_t provider_id);
+
+  /** Pointer to IPv6 add prefix function
+   *
+   * Datastructures that do not support IPv6 log an error and return -1 from
+   * all of the IPv6 functions.
+   */
+  int (*add_prefix6)(struct ipmeta_ds *ds, const struct in6_addr *addr,
+                     uint8_t mask, uint32_t provider_id,
+                     struct ipmeta_record *record);
+
+  /** Pointer to IPv6 lookup records function */
+  int (*lookup_records6)(struct ipmeta_ds *ds, const struct in6_addr *addr,
+                         uint8_t mask, uint32_t providermask,
+                         ipmeta_record_set_t *records);
+
+  /** Pointer to IPv6 lookup record single function */
+  int (*lookup_record_single6)(struct ipmeta_ds *ds,
+                               const struct in6_addr *addr,
+                               uint32_t providermask,
+                               ipmeta_record_set_t *found);
+
+  /** Pointer to memory usage function
+   *
+   * Adds the memory used by the datastructure to the given usage structure.
+   * Memory that belongs to a single provider should be added to that
+   * provider's breakdown, everything else to the shared ds breakdown.
+   */
+  void (*memory_usage)(struct ipmeta_ds *ds, ipmeta_memory_usage_t *usage);
+
+  /** Pointer to remove prefix function
+   *
+   * Removes the record of the given provider from the given prefix (which
+   * must be added already, and finalized), so that lookups fall back to the
+   * covering prefixes of the provider. Removing a prefix that the provider
+   * has no record for is not an error. Like add_prefix, this may be deferred
+   * until the next finalize.
+   */
+  int (*remove_prefix)(struct ipmeta_ds *ds, uint32_t addr, uint8_t mask,
+                       uint32_t provider_id);
+
+  /** Pointer to update prefix function
+   *
+   * Stores the record in the slot of the given provider for the given
+   * prefix, replacing any record the provider already has for it. Unlike
+   * add_prefix, this may be used once the provider has been finalized: more
+   * specific prefixes of the provider inside the prefix keep their records.
+   * Like add_prefix, this may be deferred until the next finalize.
+   */
+  int (*update_prefix)(struct ipmeta_ds *ds, uint32_t addr, uint8_t mask,
+                       uint32_t provider_id, struct ipmeta_record *record);
+
   /** Pointer to a instance-specific state object */
   void *state;
+
+  /** OR'd set of ipmeta_flags_t values that control memory allocation */
+  uint32_t flags;
 };
 
 /** Initialize the given datastructure and associate it with the given provider
  *
  * @param provider      pointer to provider instance to associate ds with
  * @param ds_id         id of the datastructure to initialize
+ * @param flags         OR'd set of ipmeta_flags_t values
  * @return 0 if initialization was successful, -1 otherwise
  */
-int ipmeta_ds_init(struct ipmeta_ds **ds, ipmeta_ds_id_t ds_id);
+int ipmeta_ds_init(struct ipmeta_ds **ds, ipmeta_ds_id_t ds_id,
+                   uint32_t flags);
 
 /** Search for a datastructure with the given name and then initialize it
  *
  * @param provider      pointer to provider instance to associate ds with
  * @param name          name of the datastructure to initialize
+ * @param flags         OR'd set of ipmeta_flags_t values
  * @return 0 if initialization was successful, -1 otherwise
  */
-int ipmeta_ds_init_by_name(struct ipmeta_ds **ds, const char *name);
+int ipmeta_ds_init_by_name(struct ipmeta_ds **ds, const char *name,
+                           uint32_t flags);
 
 /** Get an array of all available datastructure names
  *
@@ -123,4 +245,206 @@ int ipmeta_ds_init_by_name(struct ipmeta_ds **ds, const char *name);
  */
 const char **ipmeta_ds_get_all();
 
+/** Run a job function for each job index in [0, job_cnt) using a pool of
+ * worker threads (one per online CPU, at most job_cnt)
+ *
+ * @param job_cnt       number of jobs to run
+ * @param job           function to run for each job index
+ * @param user          opaque pointer passed to each job
+ * @return 0 if all jobs succeeded, -1 otherwise
+ *
+ * Jobs are handed out dynamically, so they must be independent of each other.
+ * If only a single CPU is available, the jobs are run in the calling thread.
+ */
+int ipmeta_ds_parallel_for(int job_cnt, int (*job)(void *user, int job_idx),
+                           void *user);
+
+/** Allocate a large, zeroed table for the given datastructure
+ *
+ * @param ds            datastructure that will own the table
+ * @param size          minimum size of the table in bytes
+ * @param[out] alloc_size  set to the actual size of the mapping, which must
+ *                      be passed to ipmeta_ds_large_free
+ * @return pointer to the table, NULL if it could not be allocated
+ *
+ * Depending on the flags of the datastructure, the table is backed by
+ * explicit huge pages (1 GB, then 2 MB), or by regular pages with
+ * transparent huge pages requested, and may be pre-faulted. Pages that are
+ * never touched do not consume memory.
+ */
+void *ipmeta_ds_large_alloc(ipmeta_ds_t *ds, size_t size, size_t *alloc_size);
+
+/** Free a table allocated with ipmeta_ds_large_alloc
+ *
+ * @param ptr           pointer to the table (may be NULL)
+ * @param alloc_size    size of the mapping as returned by
+ *                      ipmeta_ds_large_alloc
+ */
+void ipmeta_ds_large_free(void *ptr, size_t alloc_size);
+
+/** Get the number of resident bytes of a table allocated with
+ * ipmeta_ds_large_alloc
+ *
+ * @param ptr           pointer to the table (may be NULL)
+ * @param alloc_size    size of the mapping as returned by
+ *                      ipmeta_ds_large_alloc
+ * @return the number of bytes of the table that are backed by memory
+ */
+uint64_t ipmeta_ds_large_resident(void *ptr, size_t alloc_size);
+
+/** Sparse record storage for one prefix
+ *
+ * Holds one record for each provider that has one, packed in provider order,
+ * so that a prefix of a single provider costs one pointer however many
+ * providers libipmeta supports. Consecutive providers (in providers) that
+ * share a record also share its pointer, so a prefix that is unchanged
+ * across the snapshots of a provider costs one pointer too. Slots are
+ * allocated (and grown) by ipmeta_ds_slots_set, and freed with free().
+ */
+typedef struct ipmeta_ds_slots {
+  /** Bit i is set if provider i + 1 has a record */
+  uint32_t providers;
+
+  /** Bit i is set if the record of provider i + 1 is stored in records, i.e.,
+   * if it differs from the record of the previous provider that has one */
+  uint32_t runs;
+
+  /** The records, one for each bit set in runs */
+  ipmeta_record_t *records[];
+} ipmeta_ds_slots_t;
+
+/** Number of bytes used by the given (non-NULL) slots */
+#define IPMETA_DS_SLOTS_SIZE(slots)                                            \
+  (sizeof(ipmeta_ds_slots_t) +                                                 \
+   __builtin_popcount((slots)->runs) * sizeof(ipmeta_record_t *))
+
+/** Store a record in the slot of the provider with the given index (i.e.,
+ * id - 1)
+ *
+ * @param slots         pointer to the slots (which may point to NULL), which
+ *                      is updated if they have to be reallocated
+ * @param idx           index of the provider
+ * @param record        record to store, replacing any record of the same
+ *                      provider
+ * @return 0 if the record was stored, -1 otherwise
+ */
+int ipmeta_ds_slots_set(ipmeta_ds_slots_t **slots, int idx,
+                        ipmeta_record_t *record);
+
+/** Remove the record of the provider with the given index (i.e., id - 1)
+ *
+ * @param slots         pointer to the slots (which may point to NULL), which
+ *                      is set to NULL (and the slots free'd) once no provider
+ *                      has a record in them
+ * @param idx           index of the provider
+ * @return 0 if the record was removed (or there was none), -1 otherwise
+ */
+int ipmeta_ds_slots_clear(ipmeta_ds_slots_t **slots, int idx);
+
+/** Get the record of the provider with the given index (i.e., id - 1)
+ *
+ * @param slots         slots to look in (may be NULL)
+ * @param idx           index of the provider
+ * @return the record of the provider, or NULL if it has none
+ */
+static inline ipmeta_record_t *ipmeta_ds_slots_get(
+  const ipmeta_ds_slots_t *slots, int idx)
+{
+  if (slots == NULL || ((slots->providers >> idx) & 1) == 0) {
+    return NULL;
+  }
+  /* the record is in the last run that starts at or before idx (the shift
+     wraps to 0 for idx 31, which selects all of the runs) */
+  return slots
+    ->records[__builtin_popcount(slots->runs & ((2U << idx) - 1)) - 1];
+}
+
+/** Add the records of the given slots to a record set
+ *
+ * @param slots         slots to take records from (may be NULL)
+ * @param provmask      mask of the providers to add records for
+ * @param[in,out] foundsofar  mask of the providers that already have a
+ *                      record in the set, updated with the ones added
+ * @param ip_cnt        number of addresses to count for each record
+ * @param found         record set to add the records to
+ * @return 0 if successful, -1 otherwise
+ */
+int ipmeta_ds_slots_extract(const ipmeta_ds_slots_t *slots, uint32_t provmask,
+                            uint32_t *foundsofar, uint32_t ip_cnt,
+                            ipmeta_record_set_t *found);
+
+/** A pool of record slots for datastructures that refer to prefixes by index
+ *
+ * The pool is a table with one row per prefix, and one column per provider
+ * that has stored a record in it, so rows only grow when a new provider
+ * starts using the datastructure (at which point the table is re-laid out).
+ */
+typedef struct ipmeta_ds_slot_table {
+  /** The rows, each of them with width records */
+  ipmeta_record_t **records;
+
+  /** Number of rows in use, and allocated */
+  uint32_t rows_cnt;
+  uint32_t rows_alloc;
+
+  /** Bit i is set if provider i + 1 has a column */
+  uint32_t providers;
+
+  /** Number of columns */
+  int width;
+} ipmeta_ds_slot_table_t;
+
+/** Allocate empty rows at the end of a slot table
+ *
+ * @param table         table to allocate rows in
+ * @param cnt           number of rows to allocate
+ * @param[out] first    set to the index of the first row
+ * @return 0 if successful, -1 otherwise
+ */
+int ipmeta_ds_slot_table_alloc(ipmeta_ds_slot_table_t *table, uint32_t cnt,
+                               uint32_t *first);
+
+/** Store a record in the slot of the provider with the given index (i.e.,
+ * id - 1) in the given row
+ *
+ * @param table         table to store the record in
+ * @param row           index of the row
+ * @param idx           index of the provider
+ * @param record        record to store, replacing any record of the same
+ *                      provider
+ * @return 0 if the record was stored, -1 otherwise
+ */
+int ipmeta_ds_slot_table_set(ipmeta_ds_slot_table_t *table, uint32_t row,
+                             int idx, ipmeta_record_t *record);
+
+/** Get the record of the provider with the given index (i.e., id - 1) in the
+ * given row, or NULL if it has none */
+static inline ipmeta_record_t *ipmeta_ds_slot_table_get(
+  const ipmeta_ds_slot_table_t *table, uint32_t row, int idx)
+{
+  if (((table->providers >> idx) & 1) == 0) {
+    return NULL;
+  }
+  return table->records[(uint64_t)row * table->width +
+                        __builtin_popcount(table->providers &
+                                           ((1U << idx) - 1))];
+}
+
+/** Add the records of the given row to a record set (see
+ * ipmeta_ds_slots_extract) */
+int ipmeta_ds_slot_table_extract(const ipmeta_ds_slot_table_t *table,
+                                 uint32_t row, uint32_t provmask,
+                                 uint32_t *foundsofar, uint32_t ip_cnt,
+                                 ipmeta_record_set_t *found);
+
+/** Release the unused rows of a slot table */
+void ipmeta_ds_slot_table_trim(ipmeta_ds_slot_table_t *table);
+
+/** Free the rows of a slot table, and reset it to an empty table */
+void ipmeta_ds_slot_table_free(ipmeta_ds_slot_table_t *table);
+
+/** Number of bytes used by the rows of a slot table */
+#define IPMETA_DS_SLOT_TABLE_SIZE(table)                                       \
+  ((uint64_t)(table)->rows_alloc * (table)->width * sizeof(ipmeta_record_t *))
+
 #endif /* __IPMETA_DS_H */
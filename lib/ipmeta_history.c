@@ -0,0 +1,274 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * libipmeta is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libipmeta is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libipmeta.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <stdlib.h>
+
+#include "utils.h"
+
+#include "libipmeta_int.h"
+#include "ipmeta_ds.h"
+#include "ipmeta_provider.h"
+
+/** Get the enabled snapshots of the given type, sorted by time */
+static int get_snapshots(ipmeta_t *ipmeta, ipmeta_provider_id_t type,
+                         ipmeta_provider_t **snaps)
+{
+  ipmeta_provider_t *provider;
+  int cnt = 0;
+  int i, j;
+
+  for (i = 0; i < IPMETA_PROVIDER_ID_MAX; i++) {
+    if ((provider = ipmeta->providers[i]) == NULL || provider->type != type ||
+        provider->enabled == 0 || provider->snapshot_time == 0) {
+      continue;
+    }
+    for (j = cnt; j > 0 && snaps[j - 1]->snapshot_time >
+                             provider->snapshot_time;
+         j--) {
+      snaps[j] = snaps[j - 1];
+    }
+    snaps[j] = provider;
+    cnt++;
+  }
+
+  return cnt;
+}
+
+/** Append a change to a history */
+static int add_change(ipmeta_history_t *history, time_t from,
+                      ipmeta_record_t *record)
+{
+  ipmeta_history_entry_t *tmp;
+  ipmeta_history_entry_t *change;
+
+  if (history->changes_cnt == history->changes_alloc) {
+    history->changes_alloc =
+      history->changes_alloc == 0 ? 1024 : history->changes_alloc * 2;
+    if ((tmp = realloc(history->changes, sizeof(ipmeta_history_entry_t) *
+                                           history->changes_alloc)) == NULL) {
+      ipmeta_log(__func__, "could not realloc changes");
+      return -1;
+    }
+    history->changes = tmp;
+  }
+
+  change = &history->changes[history->changes_cnt++];
+  change->from = from;
+  change->until = 0;
+  change->record = record;
+  return 0;
+}
+
+/** Append a range to a history (along with the end of its changes) */
+static int add_range(ipmeta_history_t *history, uint32_t first)
+{
+  uint32_t *tmp;
+
+  /* starts has an extra element, for the end of the last range */
+  if (history->ranges_cnt + 1 >= history->ranges_alloc) {
+    history->ranges_alloc =
+      history->ranges_alloc == 0 ? 1024 : history->ranges_alloc * 2;
+    if ((tmp = realloc(history->ranges,
+                       sizeof(uint32_t) * history->ranges_alloc)) == NULL) {
+      ipmeta_log(__func__, "could not realloc ranges");
+      return -1;
+    }
+    history->ranges = tmp;
+    if ((tmp = realloc(history->starts,
+                       sizeof(uint32_t) * history->ranges_alloc)) == NULL) {
+      ipmeta_log(__func__, "could not realloc ranges");
+      return -1;
+    }
+    history->starts = tmp;
+  }
+
+  history->ranges[history->ranges_cnt++] = first;
+  return 0;
+}
+
+/** Check if two records (which may be NULL) have the same metadata. Their
+    ASN IP counts are not compared, they change with every prefix of the
+    AS */
+static int same_record(const ipmeta_record_t *a, const ipmeta_record_t *b)
+{
+  return a == b ||
+         (a != NULL && b != NULL && ipmeta_record_content_equal(a, b) != 0);
+}
+
+/** Check whether the changes from start to the end of the list are the same
+    as the changes of the last range */
+static int same_as_last_range(ipmeta_history_t *history, uint32_t start)
+{
+  ipmeta_history_entry_t *a, *b;
+  uint32_t prev, i;
+
+  if (history->ranges_cnt == 0) {
+    return 0;
+  }
+  prev = history->starts[history->ranges_cnt - 1];
+  if (start - prev != history->changes_cnt - start) {
+    return 0;
+  }
+  for (i = 0; i < start - prev; i++) {
+    a = &history->changes[prev + i];
+    b = &history->changes[start + i];
+    if (!same_record(a->record, b->record) || a->from != b->from ||
+        a->until != b->until) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+ipmeta_history_t *ipmeta_history_init(ipmeta_t *ipmeta,
+                                      ipmeta_provider_id_t type)
+{
+  ipmeta_provider_t *snaps[IPMETA_PROVIDER_ID_MAX];
+  ipmeta_ds_t *ds = ipmeta->datastore;
+  ipmeta_history_t *history = NULL;
+  ipmeta_record_set_t *found = NULL;
+  ipmeta_record_t *record, *cur;
+  uint32_t providermask = 0;
+  uint32_t addr = 0, first, last, start;
+  int snaps_cnt, i;
+
+  assert(ipmeta != NULL);
+
+  if ((snaps_cnt = get_snapshots(ipmeta, type, snaps)) == 0) {
+    ipmeta_log(__func__, "provider type %d has no enabled snapshots", type);
+    return NULL;
+  }
+  for (i = 0; i < snaps_cnt; i++) {
+    providermask |= 1U << (snaps[i]->id - 1);
+  }
+
+  if ((history = malloc_zero(sizeof(ipmeta_history_t))) == NULL) {
+    ipmeta_log(__func__, "could not malloc ipmeta_history_t");
+    return NULL;
+  }
+  history->ipmeta = ipmeta;
+  history->generation = ipmeta->generation;
+
+  if ((found = ipmeta_record_set_init()) == NULL) {
+    goto err;
+  }
+
+  /* walk the ranges over which none of the snapshots change, and build the
+     list of changes (over time) of each of them */
+  do {
+    ipmeta_record_set_clear(found);
+    if (ds->lookup_record_range(ds, htonl(addr), providermask, found, &first,
+                                &last) < 0) {
+      goto err;
+    }
+    if (last < addr) {
+      ipmeta_log(__func__, "invalid range for %08" PRIx32, addr);
+      goto err;
+    }
+
+    start = history->changes_cnt;
+    cur = NULL;
+    for (i = 0; i < snaps_cnt; i++) {
+      record = ds->lookup_record_provider(ds, htonl(addr), snaps[i]->id);
+      if (same_record(record, cur)) {
+        continue;
+      }
+      if (cur != NULL) {
+        history->changes[history->changes_cnt - 1].until =
+          snaps[i]->snapshot_time;
+      }
+      if (record != NULL &&
+          add_change(history, snaps[i]->snapshot_time, record) != 0) {
+        goto err;
+      }
+      cur = record;
+    }
+
+    /* datastructures may split ranges further than needed */
+    if (same_as_last_range(history, start) != 0) {
+      history->changes_cnt = start;
+    } else {
+      if (add_range(history, addr) != 0) {
+        goto err;
+      }
+      history->starts[history->ranges_cnt - 1] = start;
+    }
+    addr = last + 1;
+  } while (last != UINT32_MAX);
+  history->starts[history->ranges_cnt] = history->changes_cnt;
+
+  ipmeta_record_set_free(&found);
+  return history;
+
+err:
+  ipmeta_record_set_free(&found);
+  ipmeta_history_free(history);
+  return NULL;
+}
+
+void ipmeta_history_free(ipmeta_history_t *history)
+{
+  if (history == NULL) {
+    return;
+  }
+
+  free(history->ranges);
+  free(history->starts);
+  free(history->changes);
+  free(history);
+}
+
+int ipmeta_history_lookup(ipmeta_history_t *history, uint32_t addr,
+                          const ipmeta_history_entry_t **entries)
+{
+  uint32_t haddr = ntohl(addr);
+  uint32_t lo = 0, hi, mid;
+
+  assert(history != NULL);
+
+  if (history->generation != history->ipmeta->generation) {
+    ipmeta_log(__func__, "history is stale, it must be built again");
+    return -1;
+  }
+
+  /* find the last range that starts at or before the address (the first
+     range starts at 0) */
+  hi = history->ranges_cnt - 1;
+  while (lo < hi) {
+    mid = lo + (hi - lo + 1) / 2;
+    if (history->ranges[mid] <= haddr) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+
+  *entries = &history->changes[history->starts[lo]];
+  return history->starts[lo + 1] - history->starts[lo];
+}
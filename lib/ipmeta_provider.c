@@ -25,13 +25,19 @@
 
 #include "config.h"
 
+#include <arpa/inet.h>
 #include <assert.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "utils.h"
+#include "wandio.h"
+#include "wandio_utils.h"
 
 #include "libipmeta_int.h"
 #include "ipmeta_ds.h"
@@ -69,6 +75,18 @@ static const provider_alloc_func_t provider_alloc_functions[] = {
   ipmeta_provider_pfx2as_alloc,
 };
 
+#define record_ptr_hash(rec) kh_int64_hash_func((khint64_t)(uintptr_t)(rec))
+#define record_ptr_equal(a, b) ((a) == (b))
+KHASH_INIT(recptr, ipmeta_record_t *, ipmeta_record_t *, 1, record_ptr_hash,
+           record_ptr_equal)
+
+/** Record ids below this value can always be stored in the dense id index */
+#define RECORDS_DENSE_MIN 65536
+
+/** The dense id index may grow to at most this many slots per record before
+    ids are considered too sparse and are stored in the hash instead */
+#define RECORDS_DENSE_FACTOR 4
+
 static void free_record(ipmeta_record_t *record)
 {
   if (record == NULL) {
@@ -98,6 +116,363 @@ static void free_record(ipmeta_record_t *record)
   return;
 }
 
+/** Check if two strings (which may be NULL) are equal */
+static int str_equal(const char *a, const char *b)
+{
+  return (a == NULL || b == NULL) ? a == b : strcmp(a, b) == 0;
+}
+
+int ipmeta_record_content_equal(const ipmeta_record_t *a,
+                                const ipmeta_record_t *b)
+{
+  return strcmp(a->country_code, b->country_code) == 0 &&
+         strcmp(a->continent_code, b->continent_code) == 0 &&
+         str_equal(a->region, b->region) && str_equal(a->city, b->city) &&
+         str_equal(a->post_code, b->post_code) &&
+         a->latitude == b->latitude && a->longitude == b->longitude &&
+         a->metro_code == b->metro_code && a->area_code == b->area_code &&
+         a->region_code == b->region_code &&
+         str_equal(a->conn_speed, b->conn_speed) &&
+         a->asn_cnt == b->asn_cnt &&
+         (a->asn_cnt == 0 ||
+          memcmp(a->asn, b->asn, sizeof(uint32_t) * a->asn_cnt) == 0) &&
+         a->polygon_ids_cnt == b->polygon_ids_cnt &&
+         (a->polygon_ids_cnt == 0 ||
+          memcmp(a->polygon_ids, b->polygon_ids,
+                 sizeof(uint32_t) * a->polygon_ids_cnt) == 0);
+}
+
+/** Grow the dense id index so that it can hold the given id, moving any
+    records that were previously stored in the sparse hash */
+static int grow_records_by_id(ipmeta_provider_t *provider, uint32_t id)
+{
+  ipmeta_record_t **tmp;
+  ipmeta_record_t *record;
+  uint32_t new_cnt = id + 1;
+  khiter_t khiter;
+
+  kroundup32(new_cnt);
+
+  if ((tmp = realloc(provider->records_by_id,
+                     sizeof(ipmeta_record_t *) * new_cnt)) == NULL) {
+    ipmeta_log(__func__, "could not realloc record id index");
+    return -1;
+  }
+  memset(&tmp[provider->records_by_id_cnt], 0,
+         sizeof(ipmeta_record_t *) * (new_cnt - provider->records_by_id_cnt));
+  provider->records_by_id = tmp;
+  provider->records_by_id_cnt = new_cnt;
+
+  if (provider->sparse_records == NULL) {
+    return 0;
+  }
+
+  /* any sparse ids that now fit in the array must be moved, otherwise
+     ipmeta_provider_get_record will not find them */
+  for (khiter = kh_begin(provider->sparse_records);
+       khiter != kh_end(provider->sparse_records); ++khiter) {
+    if (!kh_exist(provider->sparse_records, khiter) ||
+        kh_key(provider->sparse_records, khiter) >= new_cnt) {
+      continue;
+    }
+    record = kh_value(provider->sparse_records, khiter);
+    provider->records_by_id[record->id] = record;
+    kh_del(ipmeta_rechash, provider->sparse_records, khiter);
+  }
+
+  return 0;
+}
+
+/** Add the given record to the list of all records and to the id index */
+static int add_record(ipmeta_provider_t *provider, ipmeta_record_t *record)
+{
+  ipmeta_record_t **tmp;
+  uint64_t dense_max;
+  khiter_t khiter;
+  int khret;
+
+  /* first, add it to the list of all records */
+  if (provider->all_records_cnt == provider->all_records_alloc) {
+    provider->all_records_alloc =
+      (provider->all_records_alloc == 0) ? 1024
+                                         : provider->all_records_alloc * 2;
+    if ((tmp = realloc(provider->all_records, sizeof(ipmeta_record_t *) *
+                                                provider->all_records_alloc)) ==
+        NULL) {
+      ipmeta_log(__func__, "could not realloc records array");
+      return -1;
+    }
+    provider->all_records = tmp;
+  }
+
+  /* now index it by id. ids that are reasonably dense go in the array,
+     anything else goes in the hash */
+  dense_max = (uint64_t)RECORDS_DENSE_FACTOR * (provider->all_records_cnt + 1);
+  if (dense_max < RECORDS_DENSE_MIN) {
+    dense_max = RECORDS_DENSE_MIN;
+  }
+  if (record->id >= provider->records_by_id_cnt && record->id < dense_max &&
+      grow_records_by_id(provider, record->id) != 0) {
+    return -1;
+  }
+
+  if (record->id < provider->records_by_id_cnt) {
+    assert(provider->records_by_id[record->id] == NULL);
+    provider->records_by_id[record->id] = record;
+  } else {
+    if (provider->sparse_records == NULL &&
+        (provider->sparse_records = kh_init(ipmeta_rechash)) == NULL) {
+      ipmeta_log(__func__, "could not create sparse record hash");
+      return -1;
+    }
+    assert(kh_get(ipmeta_rechash, provider->sparse_records, record->id) ==
+           kh_end(provider->sparse_records));
+    khiter = kh_put(ipmeta_rechash, provider->sparse_records, record->id,
+                    &khret);
+    if (khret < 0) {
+      ipmeta_log(__func__, "could not insert record in sparse record hash");
+      return -1;
+    }
+    kh_value(provider->sparse_records, khiter) = record;
+  }
+
+  provider->all_records[provider->all_records_cnt++] = record;
+
+  return 0;
+}
+
+/** Read a clock as a number of seconds */
+static double clock_seconds(clockid_t clk)
+{
+  struct timespec ts;
+
+  if (clock_gettime(clk, &ts) != 0) {
+    return 0;
+  }
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Get the current resident set size of the process in KB (0 if unknown) */
+static int64_t current_rss_kb(void)
+{
+  FILE *fh;
+  long size, resident;
+  int64_t rss = 0;
+
+  if ((fh = fopen("/proc/self/statm", "r")) == NULL) {
+    return 0;
+  }
+  if (fscanf(fh, "%ld %ld", &size, &resident) == 2) {
+    rss = (int64_t)resident * (sysconf(_SC_PAGESIZE) / 1024);
+  }
+  fclose(fh);
+  return rss;
+}
+
+/** Snapshot the current resource usage of the process and provider */
+static void load_mark(ipmeta_provider_t *provider, ipmeta_load_mark_t *mark)
+{
+  mark->wall_time = clock_seconds(CLOCK_MONOTONIC);
+  mark->cpu_time = clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+  mark->rss_kb = current_rss_kb();
+  mark->records = provider->all_records_cnt;
+  mark->prefixes = provider->load_stats.prefixes;
+}
+
+/** Free the filenames held by the load statistics and reset them */
+static void load_stats_reset(ipmeta_provider_t *provider)
+{
+  int i;
+
+  for (i = 0; i < provider->load_stats.files_cnt; i++) {
+    free(provider->load_stats.files[i].filename);
+  }
+  memset(&provider->load_stats, 0, sizeof(provider->load_stats));
+  provider->load_file_idx = -1;
+}
+
+/** Queue up a prefix of a snapshot until its records are complete */
+static int snapshot_add_prefix(ipmeta_provider_t *provider,
+                               const ipmeta_snapshot_prefix_t *pfx)
+{
+  ipmeta_snapshot_prefix_t *tmp;
+
+  if (provider->snapshot_pfxs_cnt == provider->snapshot_pfxs_alloc) {
+    provider->snapshot_pfxs_alloc = (provider->snapshot_pfxs_alloc == 0)
+                                      ? 1024
+                                      : provider->snapshot_pfxs_alloc * 2;
+    if ((tmp = realloc(provider->snapshot_pfxs,
+                       sizeof(ipmeta_snapshot_prefix_t) *
+                         provider->snapshot_pfxs_alloc)) == NULL) {
+      ipmeta_log(__func__, "could not realloc snapshot prefix list");
+      return -1;
+    }
+    provider->snapshot_pfxs = tmp;
+  }
+  provider->snapshot_pfxs[provider->snapshot_pfxs_cnt++] = *pfx;
+
+  return 0;
+}
+
+/** Add an IPv4 prefix to the datastructure (or to the queue of a snapshot) */
+static int insert_prefix(ipmeta_provider_t *provider, uint32_t addr,
+                         uint8_t mask, ipmeta_record_t *record)
+{
+  ipmeta_snapshot_prefix_t pfx;
+
+  if (provider->snapshot_time == 0) {
+    return provider->ds->add_prefix(provider->ds, addr, mask, provider->id,
+                                    record);
+  }
+  memset(&pfx, 0, sizeof(pfx));
+  pfx.addr.v4 = addr;
+  pfx.mask = mask;
+  pfx.record = record;
+  return snapshot_add_prefix(provider, &pfx);
+}
+
+/** Point the id index entry of the given id at another record */
+static void replace_record_by_id(ipmeta_provider_t *provider, uint32_t id,
+                                 ipmeta_record_t *record)
+{
+  khiter_t khiter;
+
+  if (id < provider->records_by_id_cnt) {
+    provider->records_by_id[id] = record;
+    return;
+  }
+  khiter = kh_get(ipmeta_rechash, provider->sparse_records, id);
+  assert(khiter != kh_end(provider->sparse_records));
+  kh_value(provider->sparse_records, khiter) = record;
+}
+
+/** Insert the queued prefixes of a snapshot into the datastructure
+ *
+ * A record with the same id and contents as the record of the snapshot of the
+ * type that was enabled before is replaced by that record, so the snapshots
+ * share them, and in the datastructure slots, the pointers to them.
+ */
+static int snapshot_commit(ipmeta_t *ipmeta, ipmeta_provider_t *provider)
+{
+  khash_t(recptr) *replaced = NULL;
+  ipmeta_provider_t *prev = NULL;
+  ipmeta_snapshot_prefix_t *pfx;
+  ipmeta_record_t *record, *shared;
+  ipmeta_ds_t *ds = provider->ds;
+  khiter_t khiter;
+  uint32_t i, cnt;
+  int khret, rc = -1;
+
+  /* providers are never enabled concurrently, so there is at most one */
+  for (i = 0; i < IPMETA_PROVIDER_ID_MAX; i++) {
+    if (ipmeta->providers[i] != NULL &&
+        ipmeta->providers[i]->type == provider->type &&
+        ipmeta->providers[i]->snapshot_latest != 0) {
+      prev = ipmeta->providers[i];
+      break;
+    }
+  }
+
+  if ((replaced = kh_init(recptr)) == NULL) {
+    ipmeta_log(__func__, "could not create snapshot record hash");
+    goto out;
+  }
+
+  for (i = 0; prev != NULL && i < provider->all_records_cnt; i++) {
+    record = provider->all_records[i];
+    if ((shared = ipmeta_provider_get_record(prev, record->id)) == NULL ||
+        ipmeta_record_content_equal(shared, record) == 0) {
+      continue;
+    }
+    khiter = kh_put(recptr, replaced, record, &khret);
+    if (khret < 0) {
+      ipmeta_log(__func__, "could not insert record in snapshot hash");
+      goto out;
+    }
+    kh_value(replaced, khiter) = shared;
+    replace_record_by_id(provider, record->id, shared);
+
+    /* the count of the addresses of an ASN changes with any of its prefixes,
+       so it is kept by the snapshot rather than in the shared record */
+    if (shared->asn_ip_cnt != record->asn_ip_cnt) {
+      if (provider->asn_ip_cnts == NULL &&
+          (provider->asn_ip_cnts = kh_init(ipmeta_ipcnt)) == NULL) {
+        ipmeta_log(__func__, "could not create ASN IP count hash");
+        goto out;
+      }
+      khiter = kh_put(ipmeta_ipcnt, provider->asn_ip_cnts, record->id, &khret);
+      if (khret < 0) {
+        ipmeta_log(__func__, "could not insert ASN IP count");
+        goto out;
+      }
+      kh_value(provider->asn_ip_cnts, khiter) = record->asn_ip_cnt;
+    }
+  }
+
+  for (i = 0; i < provider->snapshot_pfxs_cnt; i++) {
+    pfx = &provider->snapshot_pfxs[i];
+    if ((khiter = kh_get(recptr, replaced, pfx->record)) != kh_end(replaced)) {
+      pfx->record = kh_value(replaced, khiter);
+    }
+    if ((pfx->is_v6 ? ds->add_prefix6(ds, &pfx->addr.v6, pfx->mask,
+                                      provider->id, pfx->record)
+                    : ds->add_prefix(ds, pfx->addr.v4, pfx->mask,
+                                     provider->id, pfx->record)) != 0) {
+      goto out;
+    }
+  }
+  free(provider->snapshot_pfxs);
+  provider->snapshot_pfxs = NULL;
+  provider->snapshot_pfxs_cnt = 0;
+  provider->snapshot_pfxs_alloc = 0;
+
+  /* keep the records the snapshot owns (in allocation order), followed by
+     the ones it shares */
+  cnt = 0;
+  for (i = 0; i < provider->all_records_cnt; i++) {
+    record = provider->all_records[i];
+    if (kh_get(recptr, replaced, record) == kh_end(replaced)) {
+      provider->all_records[cnt++] = record;
+    }
+  }
+  for (khiter = kh_begin(replaced); khiter != kh_end(replaced); ++khiter) {
+    if (kh_exist(replaced, khiter)) {
+      provider->all_records[cnt++] = kh_value(replaced, khiter);
+      provider->shared_records_cnt++;
+      free_record(kh_key(replaced, khiter));
+    }
+  }
+  provider->all_records_cnt = cnt;
+
+  /* the next snapshot of the type shares records with this one */
+  if (prev != NULL) {
+    prev->snapshot_latest = 0;
+  }
+  provider->snapshot_latest = 1;
+  rc = 0;
+
+out:
+  if (replaced != NULL) {
+    kh_destroy(recptr, replaced);
+  }
+  return rc;
+}
+
+/** Free the snapshot state of a provider */
+static void snapshot_free(ipmeta_provider_t *provider)
+{
+  free(provider->snapshot_pfxs);
+  provider->snapshot_pfxs = NULL;
+  provider->snapshot_pfxs_cnt = 0;
+  provider->snapshot_pfxs_alloc = 0;
+  provider->snapshot_latest = 0;
+
+  if (provider->asn_ip_cnts != NULL) {
+    kh_destroy(ipmeta_ipcnt, provider->asn_ip_cnts);
+    provider->asn_ip_cnts = NULL;
+  }
+}
+
 /* --- Public functions below here -- */
 
 int ipmeta_provider_alloc_all(ipmeta_t *ipmeta)
@@ -118,6 +493,8 @@ int ipmeta_provider_alloc_all(ipmeta_t *ipmeta)
 
     /* get the core provider details (id, name) from the provider plugin */
     memcpy(provider, provider_alloc_functions[i](), sizeof(ipmeta_provider_t));
+    provider->type = i;
+    provider->load_file_idx = -1;
 
     /* poke it into ipmeta */
     ipmeta->providers[i - 1] = provider;
@@ -126,10 +503,64 @@ int ipmeta_provider_alloc_all(ipmeta_t *ipmeta)
   return 0;
 }
 
+ipmeta_provider_t *ipmeta_provider_alloc_instance(ipmeta_t *ipmeta,
+                                                  ipmeta_provider_id_t type,
+                                                  const char *name)
+{
+  ipmeta_provider_t *provider;
+  char buf[64];
+  int id;
+
+  assert(ipmeta != NULL);
+  assert(type > 0 && type <= IPMETA_PROVIDER_MAX);
+
+  /* the IDs of the built-in providers are never reused */
+  for (id = IPMETA_PROVIDER_MAX + 1; id <= IPMETA_PROVIDER_ID_MAX; id++) {
+    if (ipmeta->providers[id - 1] == NULL) {
+      break;
+    }
+  }
+  if (id > IPMETA_PROVIDER_ID_MAX) {
+    ipmeta_log(__func__, "all %d provider IDs are in use",
+               IPMETA_PROVIDER_ID_MAX);
+    return NULL;
+  }
+
+  if ((provider = malloc_zero(sizeof(ipmeta_provider_t))) == NULL) {
+    ipmeta_log(__func__, "could not malloc ipmeta_provider_t");
+    return NULL;
+  }
+
+  /* the instance shares the implementation of the type, but has its own id,
+     name and state */
+  memcpy(provider, provider_alloc_functions[type](),
+         sizeof(ipmeta_provider_t));
+  if (name == NULL) {
+    snprintf(buf, sizeof(buf), "%s-%d", provider->name, id);
+    name = buf;
+  }
+  if ((provider->instance_name = strdup(name)) == NULL) {
+    ipmeta_log(__func__, "could not copy provider name");
+    free(provider);
+    return NULL;
+  }
+  provider->id = id;
+  provider->name = provider->instance_name;
+  provider->type = type;
+  provider->load_file_idx = -1;
+
+  ipmeta->providers[id - 1] = provider;
+
+  return provider;
+}
+
 int ipmeta_provider_init(ipmeta_t *ipmeta, ipmeta_provider_t *provider,
                          int argc, char **argv,
                          ipmeta_provider_default_t set_default)
 {
+  ipmeta_load_mark_t start, finalize, end;
+  ipmeta_load_stats_t *stats;
+
   assert(ipmeta != NULL);
   assert(provider != NULL);
 
@@ -144,14 +575,16 @@ int ipmeta_provider_init(ipmeta_t *ipmeta, ipmeta_provider_t *provider,
 
   /* otherwise, we need to init this plugin */
 
-  /* initialize the record hash */
-  provider->all_records = kh_init(ipmeta_rechash);
+  /* the record array and id index are allocated on demand */
   provider->ds = ipmeta->datastore;
 
   if (set_default == IPMETA_PROVIDER_DEFAULT_YES) {
     ipmeta->provider_default = provider;
   }
 
+  load_stats_reset(provider);
+  load_mark(provider, &start);
+
   /* now that we have set up the datastructure stuff, ask the provider to
      initialize. this will normally mean that it reads in some database and
      populates the datatructures */
@@ -159,6 +592,29 @@ int ipmeta_provider_init(ipmeta_t *ipmeta, ipmeta_provider_t *provider,
     goto err;
   }
 
+  /* let the datastructure complete any deferred insertions (which includes
+     all of the prefixes of a snapshot) */
+  load_mark(provider, &finalize);
+  if (provider->snapshot_time != 0 && snapshot_commit(ipmeta, provider) != 0) {
+    ipmeta_log(__func__, "could not insert snapshot prefixes for provider (%s)",
+               provider->name);
+    goto err;
+  }
+  if (provider->ds->finalize(provider->ds) != 0) {
+    ipmeta_log(__func__, "could not finalize datastructure for provider (%s)",
+               provider->name);
+    goto err;
+  }
+  load_mark(provider, &end);
+
+  stats = &provider->load_stats;
+  stats->records = provider->all_records_cnt;
+  stats->wall_time = end.wall_time - start.wall_time;
+  stats->cpu_time = end.cpu_time - start.cpu_time;
+  stats->finalize_wall_time = end.wall_time - finalize.wall_time;
+  stats->finalize_cpu_time = end.cpu_time - finalize.cpu_time;
+  stats->rss_delta_kb = end.rss_kb - start.rss_kb;
+
   /* 2017-03-31 AK moves this to after a successful init, otherwise the provider
      is marked as enabled even when it is not. But I'm not sure if this leads to
      a memory leak :/ */
@@ -168,6 +624,7 @@ int ipmeta_provider_init(ipmeta_t *ipmeta, ipmeta_provider_t *provider,
 
 err:
   if (provider != NULL) {
+    snapshot_free(provider);
     provider->ds = NULL;
     /* do not free the provider as we did not alloc it */
   }
@@ -176,6 +633,8 @@ err:
 
 void ipmeta_provider_free(ipmeta_t *ipmeta, ipmeta_provider_t *provider)
 {
+  uint32_t i;
+
   assert(ipmeta != NULL);
   assert(provider != NULL);
 
@@ -189,24 +648,84 @@ void ipmeta_provider_free(ipmeta_t *ipmeta, ipmeta_provider_t *provider)
     /* ask the provider to free it's own state */
     provider->free(provider);
 
-    /* remove the pointer from ipmeta */
-    ipmeta->providers[provider->id - 1] = NULL;
-
-    /* free the records hash */
-    if (provider->all_records != NULL) {
-      /* this is where the records are free'd */
-      kh_free_vals(ipmeta_rechash, provider->all_records, free_record);
-      kh_destroy(ipmeta_rechash, provider->all_records);
-      provider->all_records = NULL;
+    /* this is where the records are free'd (except the ones shared with an
+       earlier snapshot, which owns them) */
+    for (i = 0; i < provider->all_records_cnt - provider->shared_records_cnt;
+         i++) {
+      free_record(provider->all_records[i]);
+    }
+    free(provider->all_records);
+    provider->all_records = NULL;
+    provider->all_records_cnt = 0;
+    provider->all_records_alloc = 0;
+    provider->shared_records_cnt = 0;
+
+    /* the id index only holds pointers to the records free'd above */
+    free(provider->records_by_id);
+    provider->records_by_id = NULL;
+    provider->records_by_id_cnt = 0;
+
+    if (provider->sparse_records != NULL) {
+      kh_destroy(ipmeta_rechash, provider->sparse_records);
+      provider->sparse_records = NULL;
     }
   }
 
+  load_stats_reset(provider);
+  snapshot_free(provider);
+
+  /* remove the pointer from ipmeta (which also frees the ID for reuse) */
+  if (ipmeta->providers[provider->id - 1] == provider) {
+    ipmeta->providers[provider->id - 1] = NULL;
+  }
+
   /* finally, free the actual provider structure */
+  free(provider->instance_name);
   free(provider);
 
   return;
 }
 
+void ipmeta_provider_memory_usage(ipmeta_provider_t *provider,
+                                  uint64_t *usage)
+{
+  ipmeta_record_t *record;
+  uint32_t i;
+
+  usage[IPMETA_MEM_OTHER] += sizeof(ipmeta_provider_t);
+  for (i = 0; i < (uint32_t)provider->load_stats.files_cnt; i++) {
+    usage[IPMETA_MEM_STRINGS] +=
+      IPMETA_STR_MEMORY(provider->load_stats.files[i].filename);
+  }
+
+  if (provider->enabled == 0) {
+    return;
+  }
+
+  /* shared records are accounted to the snapshot that owns them */
+  for (i = 0; i < provider->all_records_cnt - provider->shared_records_cnt;
+       i++) {
+    record = provider->all_records[i];
+    usage[IPMETA_MEM_RECORDS] += sizeof(ipmeta_record_t) +
+                                 record->asn_cnt * sizeof(uint32_t) +
+                                 record->polygon_ids_cnt * sizeof(uint32_t);
+    usage[IPMETA_MEM_STRINGS] += IPMETA_STR_MEMORY(record->region) +
+                                 IPMETA_STR_MEMORY(record->city) +
+                                 IPMETA_STR_MEMORY(record->post_code) +
+                                 IPMETA_STR_MEMORY(record->conn_speed);
+  }
+
+  usage[IPMETA_MEM_HASHES] +=
+    (uint64_t)provider->all_records_alloc * sizeof(ipmeta_record_t *) +
+    (uint64_t)provider->records_by_id_cnt * sizeof(ipmeta_record_t *) +
+    IPMETA_KH_MEMORY(provider->sparse_records, sizeof(khint32_t),
+                     sizeof(ipmeta_record_t *)) +
+    IPMETA_KH_MEMORY(provider->asn_ip_cnts, sizeof(khint32_t),
+                     sizeof(uint64_t));
+
+  provider->memory_usage(provider, usage);
+}
+
 void ipmeta_provider_register_state(ipmeta_provider_t *provider, void *state)
 {
   assert(provider != NULL);
@@ -223,12 +742,116 @@ void ipmeta_provider_free_state(ipmeta_provider_t *provider)
   provider->state = NULL;
 }
 
+io_t *ipmeta_provider_open_file(ipmeta_provider_t *provider,
+                                const char *filename)
+{
+  ipmeta_load_stats_t *stats = &provider->load_stats;
+  ipmeta_load_file_stats_t *fstats;
+  struct stat st;
+  io_t *file;
+
+  assert(provider->load_file_idx == -1);
+
+  if ((file = wandio_create(filename)) == NULL) {
+    return NULL;
+  }
+
+  load_mark(provider, &provider->load_file_mark);
+
+  /* files beyond the limit only contribute to the totals */
+  if (stats->files_cnt == IPMETA_LOAD_FILES_MAX) {
+    return file;
+  }
+
+  fstats = &stats->files[stats->files_cnt];
+  memset(fstats, 0, sizeof(*fstats));
+  if ((fstats->filename = strdup(filename)) == NULL) {
+    ipmeta_log(__func__, "could not copy filename");
+    wandio_destroy(file);
+    return NULL;
+  }
+  /* remote files (and stdin) have no size on disk */
+  if (stat(filename, &st) == 0) {
+    fstats->compressed_bytes = st.st_size;
+  }
+  provider->load_file_idx = stats->files_cnt++;
+
+  return file;
+}
+
+int64_t ipmeta_provider_read_file(ipmeta_provider_t *provider, io_t *file,
+                                  void *buffer, int64_t len)
+{
+  ipmeta_load_file_stats_t *fstats;
+  const char *p, *end;
+  int64_t rc;
+
+  if ((rc = wandio_read(file, buffer, len)) <= 0) {
+    return rc;
+  }
+
+  provider->load_stats.bytes_read += rc;
+  if (provider->load_file_idx >= 0) {
+    fstats = &provider->load_stats.files[provider->load_file_idx];
+    fstats->bytes_read += rc;
+    end = (const char *)buffer + rc;
+    for (p = buffer; (p = memchr(p, '\n', end - p)) != NULL; p++) {
+      fstats->rows++;
+    }
+  }
+
+  return rc;
+}
+
+int64_t ipmeta_provider_fgets_file(ipmeta_provider_t *provider, io_t *file,
+                                   char *buffer, int len, int chomp)
+{
+  ipmeta_load_file_stats_t *fstats;
+  int64_t rc;
+
+  if ((rc = wandio_fgets(file, buffer, len, chomp)) <= 0) {
+    return rc;
+  }
+
+  provider->load_stats.bytes_read += rc;
+  if (provider->load_file_idx >= 0) {
+    fstats = &provider->load_stats.files[provider->load_file_idx];
+    fstats->bytes_read += rc;
+    fstats->rows++;
+  }
+
+  return rc;
+}
+
+void ipmeta_provider_close_file(ipmeta_provider_t *provider, io_t *file)
+{
+  ipmeta_load_file_stats_t *fstats;
+  ipmeta_load_mark_t end;
+
+  if (file == NULL) {
+    return;
+  }
+  wandio_destroy(file);
+
+  if (provider->load_file_idx < 0) {
+    return;
+  }
+
+  load_mark(provider, &end);
+  fstats = &provider->load_stats.files[provider->load_file_idx];
+  fstats->records = end.records - provider->load_file_mark.records;
+  fstats->prefixes = end.prefixes - provider->load_file_mark.prefixes;
+  fstats->wall_time = end.wall_time - provider->load_file_mark.wall_time;
+  fstats->cpu_time = end.cpu_time - provider->load_file_mark.cpu_time;
+  fstats->rss_delta_kb = end.rss_kb - provider->load_file_mark.rss_kb;
+
+  provider->load_file_idx = -1;
+}
+
 ipmeta_record_t *ipmeta_provider_init_record(ipmeta_provider_t *provider,
                                              uint32_t id)
 {
   ipmeta_record_t *record;
-  khiter_t khiter;
-  int khret;
 
   if ((record = malloc_zero(sizeof(ipmeta_record_t))) == NULL) {
     return NULL;
@@ -237,14 +860,12 @@ ipmeta_record_t *ipmeta_provider_init_record(ipmeta_provider_t *provider,
   record->id = id;
   record->source = provider->id;
 
-  assert(kh_get(ipmeta_rechash, provider->all_records, id) ==
-         kh_end(provider->all_records));
-
-  khiter = kh_put(ipmeta_rechash, provider->all_records, id, &khret);
-  kh_value(provider->all_records, khiter) = record;
+  if (add_record(provider, record) != 0) {
+    free(record);
+    return NULL;
+  }
 
-  assert(kh_get(ipmeta_rechash, provider->all_records, id) !=
-         kh_end(provider->all_records));
+  assert(ipmeta_provider_get_record(provider, id) == record);
 
   return record;
 }
@@ -254,46 +875,31 @@ ipmeta_record_t *ipmeta_provider_get_record(ipmeta_provider_t *provider,
 {
   khiter_t khiter;
 
-  /* grab the corresponding record from the hash */
-  if ((khiter = kh_get(ipmeta_rechash, provider->all_records, id)) ==
-      kh_end(provider->all_records)) {
+  /* almost all ids will be in the dense index */
+  if (id < provider->records_by_id_cnt) {
+    return provider->records_by_id[id];
+  }
+
+  /* otherwise grab the corresponding record from the hash */
+  if (provider->sparse_records == NULL ||
+      (khiter = kh_get(ipmeta_rechash, provider->sparse_records, id)) ==
+        kh_end(provider->sparse_records)) {
     return NULL;
   }
-  return kh_val(provider->all_records, khiter);
+  return kh_val(provider->sparse_records, khiter);
 }
 
 int ipmeta_provider_get_all_records(ipmeta_provider_t *provider,
                                     ipmeta_record_t ***records)
 {
-  ipmeta_record_t **rec_arr = NULL;
-  ipmeta_record_t **rec_ptr = NULL;
-  int rec_cnt = kh_size(provider->all_records);
-  khiter_t i;
-
   /* if there are no records in the array, don't bother */
-  if (rec_cnt == 0) {
+  if (provider->all_records_cnt == 0) {
     *records = NULL;
     return 0;
   }
 
-  /* first we malloc an array to hold all the records */
-  if ((rec_arr = malloc(sizeof(ipmeta_record_t *) * rec_cnt)) == NULL) {
-    return -1;
-  }
-
-  rec_ptr = rec_arr;
-  /* insert all the records into the array */
-  for (i = kh_begin(provider->all_records); i != kh_end(provider->all_records);
-       ++i) {
-    if (kh_exist(provider->all_records, i)) {
-      *rec_ptr = kh_value(provider->all_records, i);
-      rec_ptr++;
-    }
-  }
-
-  /* return the array and the count */
-  *records = rec_arr;
-  return rec_cnt;
+  *records = provider->all_records;
+  return provider->all_records_cnt;
 }
 
 int ipmeta_provider_associate_record(ipmeta_provider_t *provider, uint32_t addr,
@@ -302,14 +908,69 @@ int ipmeta_provider_associate_record(ipmeta_provider_t *provider, uint32_t addr,
   assert(provider != NULL && record != NULL);
   assert(provider->ds != NULL);
 
-  return provider->ds->add_prefix(provider->ds, addr, mask, record);
+  provider->load_stats.prefixes++;
+  return insert_prefix(provider, addr, mask, record);
+}
+
+int ipmeta_provider_associate_record6(ipmeta_provider_t *provider,
+                                      const struct in6_addr *addr,
+                                      uint8_t mask, ipmeta_record_t *record)
+{
+  ipmeta_snapshot_prefix_t pfx;
+
+  assert(provider != NULL && record != NULL);
+  assert(provider->ds != NULL);
+
+  provider->load_stats.prefixes++;
+  if (provider->snapshot_time == 0) {
+    return provider->ds->add_prefix6(provider->ds, addr, mask, provider->id,
+                                     record);
+  }
+  memset(&pfx, 0, sizeof(pfx));
+  pfx.addr.v6 = *addr;
+  pfx.mask = mask;
+  pfx.is_v6 = 1;
+  pfx.record = record;
+  return snapshot_add_prefix(provider, &pfx);
+}
+
+int ipmeta_provider_associate_range(ipmeta_provider_t *provider,
+                                    uint32_t first_addr, uint32_t last_addr,
+                                    ipmeta_record_t *record)
+{
+  uint64_t start = first_addr;
+  uint64_t end = (uint64_t)last_addr + 1;
+  uint64_t size;
+  uint8_t mask;
+
+  assert(provider != NULL && record != NULL);
+  assert(provider->ds != NULL);
+
+  if (first_addr > last_addr) {
+    ipmeta_log(__func__, "invalid range (first address > last address)");
+    return -1;
+  }
+
+  /* greedily emit the largest aligned prefix that starts at 'start' and does
+     not extend past the end of the range */
+  while (start < end) {
+    mask = ipmeta_range_next_prefix(start, end, &size);
+    if (insert_prefix(provider, htonl((uint32_t)start), mask, record) != 0) {
+      return -1;
+    }
+    provider->load_stats.prefixes++;
+
+    start += size;
+  }
+
+  return 0;
 }
 
 int ipmeta_provider_lookup_records(ipmeta_provider_t *provider, uint32_t addr,
                                    uint8_t mask, ipmeta_record_set_t *records)
 {
   return provider->ds->lookup_records(provider->ds, addr, mask,
-                                      (1 << (provider->id - 1)), records);
+                                      (1U << (provider->id - 1)), records);
 }
 
 int ipmeta_provider_lookup_record_single(ipmeta_provider_t *provider,
@@ -317,5 +978,5 @@ int ipmeta_provider_lookup_record_single(ipmeta_provider_t *provider,
                                          ipmeta_record_set_t *found)
 {
   return provider->ds->lookup_record_single(provider->ds, addr,
-                                            (1 << (provider->id - 1)), found);
+                                            (1U << (provider->id - 1)), found);
 }
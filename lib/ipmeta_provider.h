@@ -56,7 +56,9 @@
                                           uint32_t addr, uint8_t mask,         \
                                           ipmeta_record_set_t *records);       \
   int ipmeta_provider_##provname##_lookup_single(                              \
-    ipmeta_provider_t *provider, uint32_t addr, ipmeta_record_set_t *found);
+    ipmeta_provider_t *provider, uint32_t addr, ipmeta_record_set_t *found);   \
+  void ipmeta_provider_##provname##_memory_usage(ipmeta_provider_t *provider,  \
+                                                 uint64_t *usage);
 
 /** Convenience macro that defines all the function pointers for the ipmeta
  * provider API
@@ -64,7 +66,47 @@
 #define IPMETA_PROVIDER_GENERATE_PTRS(provname)                                \
   ipmeta_provider_##provname##_init, ipmeta_provider_##provname##_free,        \
     ipmeta_provider_##provname##_lookup,                                       \
-    ipmeta_provider_##provname##_lookup_single, 0, NULL, NULL, NULL
+    ipmeta_provider_##provname##_lookup_single,                                \
+    ipmeta_provider_##provname##_memory_usage,
+
+/** Snapshot of the resources used by the process, taken at the start of a
+ * load phase so that the deltas can be computed when it ends */
+typedef struct ipmeta_load_mark {
+  /** Monotonic wall-clock time (seconds) */
+  double wall_time;
+
+  /** Process CPU time (seconds) */
+  double cpu_time;
+
+  /** Resident set size (KB) */
+  int64_t rss_kb;
+
+  /** Number of records the provider had created */
+  uint64_t records;
+
+  /** Number of prefixes the provider had inserted */
+  uint64_t prefixes;
+
+} ipmeta_load_mark_t;
+
+/** A prefix added while a snapshot is loaded */
+typedef struct ipmeta_snapshot_prefix {
+  /** The address of the prefix (network byte ordering) */
+  union {
+    uint32_t v4;
+    struct in6_addr v6;
+  } addr;
+
+  /** The prefix length */
+  uint8_t mask;
+
+  /** Set if the prefix is an IPv6 prefix */
+  uint8_t is_v6;
+
+  /** The record associated with the prefix */
+  ipmeta_record_t *record;
+
+} ipmeta_snapshot_prefix_t;
 
 /** Structure which represents a metadata provider */
 struct ipmeta_provider {
@@ -144,6 +186,39 @@ struct ipmeta_provider {
   int (*lookup_single)(ipmeta_provider_t *provider, uint32_t addr,
                        ipmeta_record_set_t *found);
 
+  /** Add the memory used by provider-specific state to the given usage
+   *
+   * @param provider      The provider to account memory for
+   * @param usage         Array of IPMETA_MEM_CATEGORY_CNT byte counts to add
+   *                      to
+   *
+   * @note records (and their strings) are accounted for by the provider
+   * manager, so providers only need to count their own state.
+   */
+  void (*memory_usage)(ipmeta_provider_t *provider, uint64_t *usage);
+
+  /** }@ */
+
+  /**
+   * @name Provider instance fields
+   *
+   * These fields are set by the provider manager when the provider is
+   * allocated.
+   *
+   * @{ */
+
+  /** The type of the provider (the ID of the built-in instance that this
+      provider shares its implementation with) */
+  ipmeta_provider_id_t type;
+
+  /** Copy of the name of an extra instance, which name points to (NULL for
+      built-in providers, whose name is owned by the implementation) */
+  char *instance_name;
+
+  /** Time from which the provider is the valid snapshot of its type (0 if
+      the provider is not a snapshot) */
+  time_t snapshot_time;
+
   /** }@ */
 
   /**
@@ -158,8 +233,36 @@ struct ipmeta_provider {
 
   int enabled;
 
-  /** A hash of id => record for all allocated records of this provider */
-  khash_t(ipmeta_rechash) * all_records;
+  /** Array of all allocated records of this provider (in allocation order)
+   *
+   * Once a snapshot is loaded, this also holds the records that it shares
+   * with earlier snapshots (whose source is the snapshot that owns them).
+   */
+  ipmeta_record_t **all_records;
+
+  /** Number of records in the all_records array */
+  uint32_t all_records_cnt;
+
+  /** Number of slots allocated for the all_records array */
+  uint32_t all_records_alloc;
+
+  /** Number of records at the end of the all_records array that are shared
+   * with (and owned by) earlier snapshots */
+  uint32_t shared_records_cnt;
+
+  /** Dense array of id => record, indexed directly by record id
+   *
+   * Record ids are usually small and dense (location ids, sequential ASN ids)
+   * so this avoids hashing for the common case.
+   */
+  ipmeta_record_t **records_by_id;
+
+  /** Number of slots in the records_by_id array */
+  uint32_t records_by_id_cnt;
+
+  /** A hash of id => record for records whose ids are too sparse to be stored
+   * in the records_by_id array (NULL until needed) */
+  khash_t(ipmeta_rechash) * sparse_records;
 
   /** The datastructure that will be used to perform IP => record lookups */
   struct ipmeta_ds *ds;
@@ -167,6 +270,36 @@ struct ipmeta_provider {
   /** An opaque pointer to provider-specific state if needed by the provider */
   void *state;
 
+  /** Statistics collected while the provider was loaded */
+  ipmeta_load_stats_t load_stats;
+
+  /** Resource snapshot taken when the current input file was opened */
+  ipmeta_load_mark_t load_file_mark;
+
+  /** Index into load_stats.files of the currently open input file (-1 if the
+   * file is not tracked individually) */
+  int load_file_idx;
+
+  /** Prefixes added while a snapshot is loaded. They are only inserted into
+   * the datastructure once the records of the snapshot are complete, and the
+   * ones that did not change have been replaced with the shared records. */
+  ipmeta_snapshot_prefix_t *snapshot_pfxs;
+
+  /** Number of prefixes in the snapshot_pfxs array */
+  uint32_t snapshot_pfxs_cnt;
+
+  /** Number of slots allocated for the snapshot_pfxs array */
+  uint32_t snapshot_pfxs_alloc;
+
+  /** Non-zero for the snapshot of each type that was enabled last, whose
+   * records the next snapshot of the type may share */
+  int snapshot_latest;
+
+  /** Record id => asn_ip_cnt of the records this snapshot shares whose count
+   * differs from the one of the snapshot that owns them (NULL if there are
+   * none) */
+  khash_t(ipmeta_ipcnt) * asn_ip_cnts;
+
   /** }@ */
 };
 
@@ -185,6 +318,19 @@ struct ipmeta_provider {
  */
 int ipmeta_provider_alloc_all(ipmeta_t *ipmeta);
 
+/** Allocate an extra instance of the given provider type
+ *
+ * @param ipmeta        The ipmeta object to allocate the instance for
+ * @param type          The type of the provider
+ * @param name          The name of the instance (copied), or NULL to use the
+ *                      name of the type followed by the ID of the instance
+ * @return the provider object created (and added to ipmeta), NULL if an error
+ * occurred (including if all provider IDs are in use)
+ */
+ipmeta_provider_t *ipmeta_provider_alloc_instance(ipmeta_t *ipmeta,
+                                                  ipmeta_provider_id_t type,
+                                                  const char *name);
+
 /** Initialize a provider object
  *
  * @param ipmeta        The ipmeta object to initialize the provider for
@@ -211,6 +357,19 @@ int ipmeta_provider_init(ipmeta_t *ipmeta, ipmeta_provider_t *provider,
  */
 void ipmeta_provider_free(ipmeta_t *ipmeta, ipmeta_provider_t *provider);
 
+/** Add the memory used by the given provider to the given usage
+ *
+ * @param provider        The provider to account memory for
+ * @param usage           Array of IPMETA_MEM_CATEGORY_CNT byte counts to add
+ *                        to
+ *
+ * This counts the records and indexes held by the provider manager, as well
+ * as the provider-specific state. Memory in the datastructure is not
+ * included.
+ */
+void ipmeta_provider_memory_usage(ipmeta_provider_t *provider,
+                                  uint64_t *usage);
+
 /** }@ */
 
 /**
@@ -234,6 +393,53 @@ void ipmeta_provider_register_state(ipmeta_provider_t *provider, void *state);
  */
 void ipmeta_provider_free_state(ipmeta_provider_t *provider);
 
+/** Open an input file for reading and start collecting load statistics
+ * for it
+ *
+ * @param provider      The provider that is opening the file
+ * @param filename      The name of the file to open
+ * @return a wandio reader for the file, NULL if an error occurred
+ *
+ * Providers should read their input files using the
+ * ipmeta_provider_read_file and ipmeta_provider_fgets_file functions, and
+ * close them with ipmeta_provider_close_file so that the bytes and rows read
+ * are accounted to the file. Only one file may be open at a time.
+ */
+io_t *ipmeta_provider_open_file(ipmeta_provider_t *provider,
+                                const char *filename);
+
+/** Read a block of data from an input file opened by the provider
+ *
+ * @param provider      The provider that opened the file
+ * @param file          The file to read from
+ * @param buffer        The buffer to read into
+ * @param len           The size of the buffer
+ * @return the number of bytes read, 0 at EOF, or -1 if an error occurred
+ */
+int64_t ipmeta_provider_read_file(ipmeta_provider_t *provider, io_t *file,
+                                  void *buffer, int64_t len);
+
+/** Read a line from an input file opened by the provider
+ *
+ * @param provider      The provider that opened the file
+ * @param file          The file to read from
+ * @param buffer        The buffer to read into
+ * @param len           The size of the buffer
+ * @param chomp         If non-zero, strip the trailing newline
+ * @return the number of bytes read, 0 at EOF, or -1 if an error occurred
+ *
+ * @note this is a counting wrapper around wandio_fgets
+ */
+int64_t ipmeta_provider_fgets_file(ipmeta_provider_t *provider, io_t *file,
+                                   char *buffer, int len, int chomp);
+
+/** Close an input file opened by the provider and finish its load statistics
+ *
+ * @param provider      The provider that opened the file
+ * @param file          The file to close
+ */
+void ipmeta_provider_close_file(ipmeta_provider_t *provider, io_t *file);
+
 /** Allocate an empty metadata record for the given id
  *
  * @param provider      The metadata provider to associate the record with
@@ -272,6 +478,35 @@ ipmeta_record_t *ipmeta_provider_get_record(ipmeta_provider_t *provider,
 int ipmeta_provider_associate_record(ipmeta_provider_t *provider, uint32_t addr,
                                      uint8_t mask, ipmeta_record_t *record);
 
+/** Register a new IPv6 prefix to record mapping for the given provider
+ *
+ * @param provider      The provider to register the mapping with
+ * @param addr          The network address component of the prefix
+ * @param mask          The mask component of the prefix (0-128)
+ * @param record        The record to associate with the prefix
+ * @return 0 if the prefix is successfully associated with the prefix, -1 if an
+ * error occurs (including if the datastructure does not support IPv6)
+ */
+int ipmeta_provider_associate_record6(ipmeta_provider_t *provider,
+                                      const struct in6_addr *addr,
+                                      uint8_t mask, ipmeta_record_t *record);
+
+/** Register a new range to record mapping for the given provider
+ *
+ * @param provider      The provider to register the mapping with
+ * @param first_addr    The first address in the range (host byte order)
+ * @param last_addr     The last address in the range (host byte order)
+ * @param record        The record to associate with the range
+ * @return 0 if the range is successfully associated with the record, -1 if an
+ * error occurs
+ *
+ * The range is decomposed into the minimal set of CIDR prefixes on the fly,
+ * and each prefix is inserted into the datastructure as it is generated.
+ */
+int ipmeta_provider_associate_range(ipmeta_provider_t *provider,
+                                    uint32_t first_addr, uint32_t last_addr,
+                                    ipmeta_record_t *record);
+
 /** Retrieves the records that correspond to the given prefix from the
  * associated datastructure.
  *
@@ -0,0 +1,287 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * libipmeta is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libipmeta is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libipmeta.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "utils.h"
+
+#include "libipmeta_int.h"
+
+/* The public helpers for interpreting statistics are always available, even
+   if libipmeta was built without collecting them */
+
+uint64_t ipmeta_stats_latency_bucket_ns(int bucket)
+{
+  const int sub_cnt = 1 << IPMETA_STATS_LATENCY_SUB_BITS;
+  int exp;
+
+  if (bucket < sub_cnt) {
+    return bucket;
+  }
+  exp = bucket / sub_cnt + IPMETA_STATS_LATENCY_SUB_BITS - 1;
+  return (uint64_t)(sub_cnt + bucket % sub_cnt)
+         << (exp - IPMETA_STATS_LATENCY_SUB_BITS);
+}
+
+uint64_t ipmeta_stats_latency_percentile(const ipmeta_stats_t *stats,
+                                         double percentile)
+{
+  uint64_t target;
+  uint64_t seen = 0;
+  int i;
+
+  if (stats->latency_samples == 0) {
+    return 0;
+  }
+
+  target = (uint64_t)(stats->latency_samples * (percentile / 100.0));
+  if (target >= stats->latency_samples) {
+    target = stats->latency_samples - 1;
+  }
+
+  for (i = 0; i < IPMETA_STATS_LATENCY_BUCKETS; i++) {
+    seen += stats->latency_hist[i];
+    if (seen > target) {
+      return ipmeta_stats_latency_bucket_ns(i);
+    }
+  }
+
+  return ipmeta_stats_latency_bucket_ns(IPMETA_STATS_LATENCY_BUCKETS - 1);
+}
+
+#ifndef WITH_LOOKUP_STATS
+
+int ipmeta_get_stats(ipmeta_t *ipmeta, ipmeta_stats_t *stats)
+{
+  ipmeta_log(__func__, "libipmeta was built without lookup statistics "
+                       "(use --enable-lookup-stats)");
+  return -1;
+}
+
+void ipmeta_reset_stats(ipmeta_t *ipmeta)
+{
+  return;
+}
+
+#else
+
+/** Map a latency (in nanoseconds) to its histogram bucket */
+static int latency_bucket(uint64_t ns)
+{
+  const int sub_cnt = 1 << IPMETA_STATS_LATENCY_SUB_BITS;
+  int exp, bucket;
+
+  if (ns < (uint64_t)sub_cnt) {
+    return ns;
+  }
+  exp = 63 - __builtin_clzll(ns);
+  bucket = (exp - IPMETA_STATS_LATENCY_SUB_BITS + 1) * sub_cnt +
+           ((ns >> (exp - IPMETA_STATS_LATENCY_SUB_BITS)) & (sub_cnt - 1));
+
+  return bucket < IPMETA_STATS_LATENCY_BUCKETS
+           ? bucket
+           : IPMETA_STATS_LATENCY_BUCKETS - 1;
+}
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Get (creating if needed) the statistics block of the calling thread */
+static ipmeta_stats_block_t *get_block(ipmeta_t *ipmeta)
+{
+  ipmeta_stats_block_t *block;
+
+  if ((block = pthread_getspecific(ipmeta->stats_key)) != NULL) {
+    return block;
+  }
+
+  if ((block = malloc_zero(sizeof(ipmeta_stats_block_t))) == NULL) {
+    return NULL;
+  }
+  if (pthread_setspecific(ipmeta->stats_key, block) != 0) {
+    free(block);
+    return NULL;
+  }
+
+  /* blocks outlive their threads so that their counts are not lost */
+  pthread_mutex_lock(&ipmeta->stats_lock);
+  block->next = ipmeta->stats_blocks;
+  ipmeta->stats_blocks = block;
+  pthread_mutex_unlock(&ipmeta->stats_lock);
+
+  return block;
+}
+
+int ipmeta_stats_init(ipmeta_t *ipmeta)
+{
+  if (pthread_key_create(&ipmeta->stats_key, NULL) != 0) {
+    ipmeta_log(__func__, "could not create statistics key");
+    return -1;
+  }
+  if (pthread_mutex_init(&ipmeta->stats_lock, NULL) != 0) {
+    ipmeta_log(__func__, "could not create statistics lock");
+    pthread_key_delete(ipmeta->stats_key);
+    return -1;
+  }
+  ipmeta->stats_blocks = NULL;
+
+  return 0;
+}
+
+void ipmeta_stats_free(ipmeta_t *ipmeta)
+{
+  ipmeta_stats_block_t *block;
+
+  while ((block = ipmeta->stats_blocks) != NULL) {
+    ipmeta->stats_blocks = block->next;
+    free(block);
+  }
+  pthread_key_delete(ipmeta->stats_key);
+  pthread_mutex_destroy(&ipmeta->stats_lock);
+}
+
+void ipmeta_stats_lookup_begin(ipmeta_t *ipmeta, ipmeta_stats_sample_t *sample)
+{
+  sample->start_ns = 0;
+  if ((sample->block = get_block(ipmeta)) == NULL) {
+    return;
+  }
+
+  if (++sample->block->sample_cnt == IPMETA_STATS_LATENCY_SAMPLE_RATE) {
+    sample->block->sample_cnt = 0;
+    sample->start_ns = now_ns();
+  }
+}
+
+void ipmeta_stats_lookup_end(ipmeta_stats_sample_t *sample, int single,
+                             uint32_t providermask,
+                             ipmeta_record_set_t *records)
+{
+  ipmeta_stats_t *stats;
+  ipmeta_provider_lookup_stats_t *pstats;
+  uint32_t cnts[IPMETA_PROVIDER_ID_MAX];
+  uint32_t wanted;
+  int i;
+
+  if (sample->block == NULL) {
+    return;
+  }
+  stats = &sample->block->stats;
+
+  /* time first so that the accounting below is not measured */
+  if (sample->start_ns != 0) {
+    stats->latency_hist[latency_bucket(now_ns() - sample->start_ns)]++;
+    stats->latency_samples++;
+  }
+
+  if (single != 0) {
+    stats->single_lookups++;
+  } else {
+    stats->prefix_lookups++;
+    stats->prefix_records += records->n_recs;
+    if ((uint64_t)records->n_recs > stats->prefix_records_max) {
+      stats->prefix_records_max = records->n_recs;
+    }
+  }
+
+  memset(cnts, 0, sizeof(cnts));
+  for (i = 0; i < records->n_recs; i++) {
+    cnts[records->entries[i].provider_id - 1]++;
+  }
+
+  /* only visit the providers that were queried */
+  for (wanted = providermask; wanted != 0; wanted &= wanted - 1) {
+    i = __builtin_ctz(wanted);
+    pstats = &stats->providers[i];
+    pstats->lookups++;
+    if (cnts[i] != 0) {
+      pstats->hits++;
+      pstats->records += cnts[i];
+    } else {
+      pstats->misses++;
+    }
+  }
+}
+
+int ipmeta_get_stats(ipmeta_t *ipmeta, ipmeta_stats_t *stats)
+{
+  ipmeta_stats_block_t *block;
+  const ipmeta_stats_t *bs;
+  int i;
+
+  assert(ipmeta != NULL && stats != NULL);
+
+  memset(stats, 0, sizeof(ipmeta_stats_t));
+
+  pthread_mutex_lock(&ipmeta->stats_lock);
+  for (block = ipmeta->stats_blocks; block != NULL; block = block->next) {
+    bs = &block->stats;
+    stats->single_lookups += bs->single_lookups;
+    stats->prefix_lookups += bs->prefix_lookups;
+    stats->prefix_records += bs->prefix_records;
+    if (bs->prefix_records_max > stats->prefix_records_max) {
+      stats->prefix_records_max = bs->prefix_records_max;
+    }
+    for (i = 0; i < IPMETA_PROVIDER_ID_MAX; i++) {
+      stats->providers[i].lookups += bs->providers[i].lookups;
+      stats->providers[i].hits += bs->providers[i].hits;
+      stats->providers[i].misses += bs->providers[i].misses;
+      stats->providers[i].records += bs->providers[i].records;
+    }
+    stats->latency_samples += bs->latency_samples;
+    for (i = 0; i < IPMETA_STATS_LATENCY_BUCKETS; i++) {
+      stats->latency_hist[i] += bs->latency_hist[i];
+    }
+  }
+  pthread_mutex_unlock(&ipmeta->stats_lock);
+
+  return 0;
+}
+
+void ipmeta_reset_stats(ipmeta_t *ipmeta)
+{
+  ipmeta_stats_block_t *block;
+
+  assert(ipmeta != NULL);
+
+  pthread_mutex_lock(&ipmeta->stats_lock);
+  for (block = ipmeta->stats_blocks; block != NULL; block = block->next) {
+    memset(&block->stats, 0, sizeof(block->stats));
+  }
+  pthread_mutex_unlock(&ipmeta->stats_lock);
+}
+
+#endif /* WITH_LOOKUP_STATS */
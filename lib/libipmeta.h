@@ -26,7 +26,9 @@
 #ifndef __LIBIPMETA_H
 #define __LIBIPMETA_H
 
+#include <netinet/in.h>
 #include <stdint.h>
+#include <time.h>
 #include <wandio.h>
 
 /** @file
@@ -54,6 +56,15 @@ typedef struct ipmeta_ds ipmeta_ds_t;
 /** Opaque struct holding a set of records */
 typedef struct ipmeta_record_set ipmeta_record_set_t;
 
+/** Opaque struct holding the state of a sorted lookup stream */
+typedef struct ipmeta_sorted_stream ipmeta_sorted_stream_t;
+
+/** Opaque struct holding a catalog of dated snapshots */
+typedef struct ipmeta_catalog ipmeta_catalog_t;
+
+/** Opaque struct holding the change history of the snapshots of a provider */
+typedef struct ipmeta_history ipmeta_history_t;
+
 /** @} */
 
 /**
@@ -83,6 +94,15 @@ typedef enum ipmeta_provider_id {
 
 } ipmeta_provider_id_t;
 
+/** Highest ID that a provider instance can have
+ *
+ * The built-in instance of each provider type has the ID of the type (up to
+ * IPMETA_PROVIDER_MAX), and extra instances created with
+ * ipmeta_add_provider_instance are given the IDs above that. Provider masks
+ * have one bit per ID, so there can be at most 32 instances.
+ */
+#define IPMETA_PROVIDER_ID_MAX 32
+
 /** A unique identifier for each metadata ds that libipmeta supports.
  *
  * @note When adding a datastructure to this list, there must also be a
@@ -98,8 +118,14 @@ typedef enum ipmeta_ds_id {
   /** Interval-Tree */
   IPMETA_DS_INTERVALTREE = 3,
 
+  /** Tree Bitmap (multibit trie with popcount-indexed nodes) */
+  IPMETA_DS_TREEBITMAP = 4,
+
+  /** Compact Patricia Trie (pooled nodes linked by 32 bit indexes) */
+  IPMETA_DS_CPATRICIA = 5,
+
   /** Highest numbered ds ID */
-  IPMETA_DS_MAX = IPMETA_DS_INTERVALTREE,
+  IPMETA_DS_MAX = IPMETA_DS_CPATRICIA,
 
   /** Default Geolocation data-structure */
   IPMETA_DS_DEFAULT = IPMETA_DS_PATRICIA,
@@ -122,7 +148,13 @@ typedef struct ipmeta_record {
    */
   uint32_t id;
 
-  /** The provider that this record came from */
+  /** The provider that this record came from
+   *
+   * Records that are shared by several snapshots of a provider (see
+   * ipmeta_set_snapshot_time) came from the first snapshot that had them, use
+   * ipmeta_record_set_next_provider to find which provider a record in a
+   * lookup result was found for.
+   */
   ipmeta_provider_id_t source;
 
   /** 2 character string which holds the ISO2 country code */
@@ -169,8 +201,13 @@ typedef struct ipmeta_record {
   /** Number of ASNs in the asn array */
   int asn_cnt;
 
-  /** Number of IP addresses that this ASN (or ASN group) 'owns' */
-  uint32_t asn_ip_cnt;
+  /** Number of IP addresses that this ASN (or ASN group) 'owns'
+   *
+   * For records shared by several snapshots, this is the count of the
+   * snapshot that owns the record, use ipmeta_get_asn_ip_cnt for the count
+   * of a given snapshot.
+   */
+  uint64_t asn_ip_cnt;
 
   /** Polygon IDs. Indexes SHOULD correspond to those in the polygon table list
       obtained from the provider */
@@ -180,12 +217,216 @@ typedef struct ipmeta_record {
   int polygon_ids_cnt;
 
   /* -- ADD NEW FIELDS ABOVE HERE -- */
+  /* (and compare them in ipmeta_record_content_equal) */
 
   /** The next record in the list */
   struct ipmeta_record *next;
 
 } ipmeta_record_t;
 
+/** Maximum number of input files that load statistics are kept for (per
+ * provider). Files opened beyond this are still counted in the totals. */
+#define IPMETA_LOAD_FILES_MAX 16
+
+/** Load statistics for a single input file read by a provider
+ *
+ * The record, prefix, time and memory figures cover everything the provider
+ * did while the file was open (i.e. parsing and inserting its contents).
+ */
+typedef struct ipmeta_load_file_stats {
+  /** Name of the file as given to the provider */
+  char *filename;
+
+  /** Number of (decompressed) bytes read from the file */
+  uint64_t bytes_read;
+
+  /** Size of the file on disk (0 if it could not be determined, e.g. for
+   * remote files) */
+  uint64_t compressed_bytes;
+
+  /** Number of rows (lines) read from the file */
+  uint64_t rows;
+
+  /** Number of records created while the file was being read */
+  uint64_t records;
+
+  /** Number of prefixes inserted while the file was being read */
+  uint64_t prefixes;
+
+  /** Wall-clock time spent reading the file (seconds) */
+  double wall_time;
+
+  /** CPU time (all threads) spent reading the file (seconds) */
+  double cpu_time;
+
+  /** Change in process RSS while the file was being read (KB) */
+  int64_t rss_delta_kb;
+
+} ipmeta_load_file_stats_t;
+
+/** Load statistics for a provider */
+typedef struct ipmeta_load_stats {
+  /** Per-file statistics, in the order the files were opened */
+  ipmeta_load_file_stats_t files[IPMETA_LOAD_FILES_MAX];
+
+  /** Number of valid entries in the files array */
+  int files_cnt;
+
+  /** Total number of bytes read from all files */
+  uint64_t bytes_read;
+
+  /** Total number of records created by the provider */
+  uint64_t records;
+
+  /** Total number of prefixes inserted by the provider */
+  uint64_t prefixes;
+
+  /** Wall-clock time for the whole load, including finalization (seconds) */
+  double wall_time;
+
+  /** CPU time for the whole load, including finalization (seconds) */
+  double cpu_time;
+
+  /** Wall-clock time spent finalizing the datastructure (seconds) */
+  double finalize_wall_time;
+
+  /** CPU time spent finalizing the datastructure (seconds) */
+  double finalize_cpu_time;
+
+  /** Change in process RSS over the whole load (KB) */
+  int64_t rss_delta_kb;
+
+} ipmeta_load_stats_t;
+
+/** Number of buckets in the lookup latency histogram
+ *
+ * Buckets are log-linear: each power of two is split into
+ * 2^IPMETA_STATS_LATENCY_SUB_BITS buckets, so the relative error of a bucket
+ * is at most 25%. Use ipmeta_stats_latency_bucket_ns to find the lower bound
+ * of a bucket. The last bucket also counts all larger values.
+ */
+#define IPMETA_STATS_LATENCY_BUCKETS 96
+
+/** Number of bits of sub-bucket precision in the latency histogram */
+#define IPMETA_STATS_LATENCY_SUB_BITS 2
+
+/** Only one in this many lookups (per thread) has its latency measured */
+#define IPMETA_STATS_LATENCY_SAMPLE_RATE 64
+
+/** Lookup statistics for a single provider */
+typedef struct ipmeta_provider_lookup_stats {
+  /** Number of lookups that queried this provider */
+  uint64_t lookups;
+
+  /** Number of lookups that returned at least one record of this provider */
+  uint64_t hits;
+
+  /** Number of lookups that returned no records of this provider */
+  uint64_t misses;
+
+  /** Total number of records of this provider returned by lookups */
+  uint64_t records;
+
+} ipmeta_provider_lookup_stats_t;
+
+/** Lookup statistics for a libipmeta instance (see ipmeta_get_stats) */
+typedef struct ipmeta_stats {
+  /** Number of calls to ipmeta_lookup_single */
+  uint64_t single_lookups;
+
+  /** Number of calls to ipmeta_lookup */
+  uint64_t prefix_lookups;
+
+  /** Total number of records returned by ipmeta_lookup (the sum of the
+   * fan-out of all prefix queries) */
+  uint64_t prefix_records;
+
+  /** Largest number of records returned by a single ipmeta_lookup call */
+  uint64_t prefix_records_max;
+
+  /** Per-provider statistics
+   * @note index of provider is given by (ipmeta_provider_id_t - 1)
+   */
+  ipmeta_provider_lookup_stats_t providers[IPMETA_PROVIDER_ID_MAX];
+
+  /** Number of lookups whose latency was measured */
+  uint64_t latency_samples;
+
+  /** Histogram of sampled lookup latencies (nanoseconds) */
+  uint64_t latency_hist[IPMETA_STATS_LATENCY_BUCKETS];
+
+} ipmeta_stats_t;
+
+/** A change in the history of an address (see ipmeta_history_lookup) */
+typedef struct ipmeta_history_entry {
+  /** Time from which the record is valid (the time of the first snapshot
+   * that has it) */
+  time_t from;
+
+  /** Time until which the record is valid (the time of the first snapshot
+   * that does not have it), 0 if it is valid in the last snapshot */
+  time_t until;
+
+  /** The record of the address */
+  ipmeta_record_t *record;
+
+} ipmeta_history_entry_t;
+
+/** Categories of memory reported by ipmeta_get_memory_usage */
+typedef enum ipmeta_mem_category {
+  /** Trie nodes (and their prefixes) */
+  IPMETA_MEM_TRIE_NODES = 0,
+
+  /** Per-prefix arrays of records (one slot per provider) */
+  IPMETA_MEM_NODE_RECORDS = 1,
+
+  /** Large lookup tables (e.g. the big array). Only resident pages are
+   * counted */
+  IPMETA_MEM_TABLES = 2,
+
+  /** Interval tree nodes */
+  IPMETA_MEM_INTERVAL_NODES = 3,
+
+  /** Metadata records (and the arrays attached to them) */
+  IPMETA_MEM_RECORDS = 4,
+
+  /** Strings owned by records and provider tables */
+  IPMETA_MEM_STRINGS = 5,
+
+  /** Polygon tables (and other provider lookup tables) */
+  IPMETA_MEM_POLYGONS = 6,
+
+  /** Hash tables and id indexes */
+  IPMETA_MEM_HASHES = 7,
+
+  /** Anything else (e.g. buffers used while loading) */
+  IPMETA_MEM_OTHER = 8,
+
+  /** Number of memory categories */
+  IPMETA_MEM_CATEGORY_CNT = 9,
+
+} ipmeta_mem_category_t;
+
+/** Memory used by a libipmeta instance (see ipmeta_get_memory_usage)
+ *
+ * All values are in bytes, and only count the memory requested from the
+ * allocator (i.e. allocator overhead is not included).
+ */
+typedef struct ipmeta_memory_usage {
+  /** Memory used by the datastructure that is shared by all providers */
+  uint64_t ds[IPMETA_MEM_CATEGORY_CNT];
+
+  /** Memory used by each provider, including any part of the datastructure
+   * that belongs to a single provider
+   * @note index of provider is given by (ipmeta_provider_id_t - 1)
+   */
+  uint64_t providers[IPMETA_PROVIDER_ID_MAX][IPMETA_MEM_CATEGORY_CNT];
+
+  /** Total memory used by the instance */
+  uint64_t total;
+
+} ipmeta_memory_usage_t;
+
 /** @} */
 
 /**
@@ -205,6 +446,22 @@ typedef enum ipmeta_provider_default {
 
 } ipmeta_provider_default_t;
 
+/** Flags that control how a libipmeta instance allocates memory (these may
+ * be OR'd together and passed to ipmeta_init_flags) */
+typedef enum ipmeta_flags {
+  /** Back large datastructure tables with huge pages (2 MB or 1 GB) if the
+   * system supports them, falling back to transparent huge pages */
+  IPMETA_FLAG_HUGEPAGES = 0x01,
+
+  /** Pre-fault large datastructure tables when they are allocated, so that
+   * the first lookups do not take page faults
+   * @note this commits memory for the whole table (16 GB per provider for the
+   * bigarray datastructure)
+   */
+  IPMETA_FLAG_PREFAULT = 0x02,
+
+} ipmeta_flags_t;
+
 /** @} */
 
 /** Initialize a new libipmeta instance
@@ -216,6 +473,18 @@ typedef enum ipmeta_provider_default {
  */
 ipmeta_t *ipmeta_init(enum ipmeta_ds_id dstype);
 
+/** Initialize a new libipmeta instance with the given flags
+ *
+ * @param dstype        The data structure to use for storing prefixes
+ * @param flags         OR'd set of ipmeta_flags_t values
+ *
+ * @return the ipmeta instance created, NULL if an error occurs
+ *
+ * @note ipmeta_init(dstype) is equivalent to ipmeta_init_flags(dstype, 0).
+ * Flags that the system does not support are silently ignored.
+ */
+ipmeta_t *ipmeta_init_flags(enum ipmeta_ds_id dstype, uint32_t flags);
+
 /** Free a libipmeta instance
  *
  * @param               The ipmeta instance to free
@@ -250,6 +519,45 @@ int ipmeta_enable_provider(ipmeta_t *ipmeta, ipmeta_provider_t *provider,
                            const char *options,
                            ipmeta_provider_default_t set_default);
 
+/** Create another instance of the type of the given provider
+ *
+ * @param ipmeta        The ipmeta object to add the instance to
+ * @param provider      A provider of the type to create an instance of
+ * @param name          Name of the new instance (must not be the name of
+ *                      another provider). If NULL, the name of the type
+ *                      followed by the ID of the instance is used.
+ * @return the new (not yet enabled) provider, NULL if an error occurred
+ *
+ * Each instance has its own ID (and bit in provider masks) and its own
+ * records, but they all share the datastructure of the ipmeta object, so a
+ * single lookup returns the records of every instance in the provider mask
+ * (e.g. pfx2as data for several days). The new instance is enabled with
+ * ipmeta_enable_provider, like the built-in ones, and is free'd along with
+ * the ipmeta object.
+ */
+ipmeta_provider_t *ipmeta_add_provider_instance(ipmeta_t *ipmeta,
+                                                ipmeta_provider_t *provider,
+                                                const char *name);
+
+/** Make the given provider a dated snapshot of its type
+ *
+ * @param provider      The (not yet enabled) provider to date
+ * @param valid_from    Time (in seconds since the epoch) from which the
+ *                      snapshot is valid (until the next snapshot of the
+ *                      type)
+ * @return 0 if the time was set, -1 if the provider is already enabled or the
+ * time is not positive
+ *
+ * The snapshots of a type are instances of it (see
+ * ipmeta_add_provider_instance), and ipmeta_lookup_at picks the one that was
+ * valid at the time of the lookup. All snapshots share the prefixes of the
+ * datastructure, and a snapshot shares the records whose id and contents did
+ * not change with the snapshot of its type that was enabled before it, so
+ * loading the snapshots in time order costs memory in proportion to the
+ * day-to-day churn rather than to the number of snapshots.
+ */
+int ipmeta_set_snapshot_time(ipmeta_provider_t *provider, time_t valid_from);
+
 /** Retrieve the provider object for the default metadata provider
  *
  * @param ipmeta       The ipmeta object to retrieve the provider object from
@@ -305,6 +613,244 @@ int ipmeta_lookup(ipmeta_t *ipmeta, uint32_t addr, uint8_t mask,
 int ipmeta_lookup_single(ipmeta_t *ipmeta, uint32_t addr, uint32_t providermask,
                          ipmeta_record_set_t *found);
 
+/** Look up the given IPv6 prefix using a set of known providers
+ *
+ * @param ipmeta        The ipmeta instance to use for the lookup
+ * @param addr          The IPv6 network address part to lookup
+ * @param mask          The IPv6 network mask defining the prefix length
+ *                       (0-128)
+ * @param provmask      A bitmask indicating which providers should be used.
+ *                       Set to '0' to automatically use all active providers.
+ * @param records       Pointer to a record set to use for matches
+ * @return              The number of (matched) records in the result set, or
+ *                      -1 if an error occurred (including if the datastructure
+ *                      does not support IPv6)
+ *
+ * @note the number of matched IPs of each record is saturated at UINT32_MAX
+ */
+int ipmeta_lookup6(ipmeta_t *ipmeta, const struct in6_addr *addr, uint8_t mask,
+                   uint32_t provmask, ipmeta_record_set_t *records);
+
+/** Look up the given single IPv6 address for a set of providers
+ *
+ * @param ipmeta        The ipmeta instance to use for the lookup
+ * @param addr          The address to retrieve the record for
+ * @param providermask  A bitmask describing which providers to perform the
+ *                       lookup with. Set to '0' to automatically use all
+ *                       active providers.
+ * @param found         Pointer to a record set to use for storing matches
+ * @return The number of providers which we were able to successfully find a
+ *         match for, or -1 if an error occured (including if the
+ *         datastructure does not support IPv6).
+ */
+int ipmeta_lookup_single6(ipmeta_t *ipmeta, const struct in6_addr *addr,
+                          uint32_t providermask, ipmeta_record_set_t *found);
+
+/** Look up the record of a single provider for the given single IP address
+ *
+ * @param ipmeta        The ipmeta instance to use for the lookup
+ * @param addr          The address to retrieve the record for
+ *                       (network byte ordering)
+ * @param provider_id   The ID of the provider to retrieve the record of
+ * @return a pointer to the (most specific) matching record of the provider,
+ *         NULL if there is none
+ *
+ * This is a faster alternative to ipmeta_lookup_single for callers that only
+ * need the record of one provider, as it does not use a record set. The
+ * lookup cache is not used by this function.
+ */
+ipmeta_record_t *
+ipmeta_lookup_single_provider(ipmeta_t *ipmeta, uint32_t addr,
+                              ipmeta_provider_id_t provider_id);
+
+/** Get the providers of a provider mask that are valid at the given time
+ *
+ * @param ipmeta        The ipmeta instance to get the providers of
+ * @param timestamp     The time (in seconds since the epoch)
+ * @param providermask  A bitmask describing the providers to choose from. Set
+ *                       to '0' to choose from all active providers.
+ * @return a bitmask with the providers of providermask that are not
+ *         snapshots, and for each provider type, the snapshot of
+ *         providermask with the latest time that is not after timestamp (if
+ *         there is one)
+ */
+uint32_t ipmeta_get_snapshot_mask(ipmeta_t *ipmeta, time_t timestamp,
+                                  uint32_t providermask);
+
+/** Look up the given single IP address in the snapshots that were valid at
+ * the given time
+ *
+ * @param ipmeta        The ipmeta instance to use for the lookup
+ * @param addr          The address to retrieve the record for
+ *                       (network byte ordering)
+ * @param timestamp     The time (in seconds since the epoch) to look the
+ *                       address up at
+ * @param providermask  A bitmask describing the providers to choose from (see
+ *                       ipmeta_get_snapshot_mask). Set to '0' to choose from
+ *                       all active providers.
+ * @param found         Pointer to a record set to use for storing matches
+ * @return The number of providers which we were able to successfully find a
+ *         match for, or -1 if an error occured.
+ *
+ * This is a single lookup (see ipmeta_lookup_single) with the mask returned
+ * by ipmeta_get_snapshot_mask, so callers that look up many addresses at the
+ * same time can get the mask once and use ipmeta_lookup_single instead.
+ */
+int ipmeta_lookup_at(ipmeta_t *ipmeta, uint32_t addr, time_t timestamp,
+                     uint32_t providermask, ipmeta_record_set_t *found);
+
+/** Look up the given single IP address, and get the range of addresses
+ * around it that share the same result
+ *
+ * @param ipmeta        The ipmeta instance to use for the lookup
+ * @param addr          The address to retrieve the record for
+ *                       (network byte ordering)
+ * @param providermask  A bitmask describing which providers to perform the
+ *                       lookup with. Set to '0' to automatically use all
+ *                       active providers.
+ * @param found         Pointer to a record set to use for storing matches
+ * @param[out] first    Set to the first address of the range
+ *                       (host byte ordering)
+ * @param[out] last     Set to the last address of the range
+ *                       (host byte ordering)
+ * @return The number of providers which we were able to successfully find a
+ *         match for, or -1 if an error occured.
+ *
+ * A lookup of any address in [first, last] with the same provider mask
+ * returns the same records (although num_ips may differ), so callers that
+ * process clustered or sorted addresses can skip those lookups. The range
+ * always contains addr, and is usually (but not always) the maximal such
+ * range. The lookup cache is not used by this function.
+ */
+int ipmeta_lookup_single_range(ipmeta_t *ipmeta, uint32_t addr,
+                               uint32_t providermask,
+                               ipmeta_record_set_t *found, uint32_t *first,
+                               uint32_t *last);
+
+/** Create a stream for looking up addresses in ascending order
+ *
+ * @param ipmeta        The ipmeta instance to use for the lookups
+ * @param providermask  A bitmask describing which providers to perform the
+ *                       lookups with. Set to '0' to automatically use all
+ *                       active providers.
+ * @return a pointer to the stream, NULL if an error occurred
+ *
+ * The stream walks the datastructure's address ranges in step with the
+ * (sorted) addresses given to ipmeta_lookup_sorted_stream, in the manner of
+ * a merge join: only the first address in each range is actually looked up,
+ * every following address in that range reuses the result.
+ */
+ipmeta_sorted_stream_t *ipmeta_sorted_stream_init(ipmeta_t *ipmeta,
+                                                  uint32_t providermask);
+
+/** Free a sorted lookup stream
+ *
+ * @param stream        The stream to free
+ */
+void ipmeta_sorted_stream_free(ipmeta_sorted_stream_t *stream);
+
+/** Look up the next address of a sorted lookup stream
+ *
+ * @param stream        The stream to use for the lookup
+ * @param addr          The address to retrieve the record for
+ *                       (network byte ordering)
+ * @param found         Pointer to a record set to use for storing matches
+ * @return The number of providers which we were able to successfully find a
+ *         match for, or -1 if an error occured (including if addr is lower
+ *         than the previous address given to the stream)
+ *
+ * Addresses must be given in ascending numeric order, duplicates are
+ * allowed.
+ */
+int ipmeta_lookup_sorted_stream(ipmeta_sorted_stream_t *stream, uint32_t addr,
+                                ipmeta_record_set_t *found);
+
+/** Enable (or resize, or disable) the single lookup result cache
+ *
+ * @param ipmeta        The ipmeta instance to configure
+ * @param entries       Number of entries in each thread's cache (rounded up
+ *                      to a power of two), 0 to disable the cache
+ * @return 0 if the cache was configured, -1 otherwise
+ *
+ * When enabled, each thread that calls ipmeta_lookup_single gets its own
+ * direct-mapped cache of recent results, keyed by address and provider
+ * mask, so repeated lookups of the same address are answered with a single
+ * cache line probe. Caches are invalidated whenever a provider is enabled or
+ * free'd. Each entry uses 64 bytes (with the default set of providers).
+ *
+ * @note this must not be called while other threads are performing lookups
+ */
+int ipmeta_set_lookup_cache(ipmeta_t *ipmeta, uint32_t entries);
+
+/** Get the hit and miss counts of the single lookup result cache
+ *
+ * @param ipmeta        The ipmeta instance to retrieve counts for
+ * @param[out] hits     Set to the number of lookups answered from the cache
+ * @param[out] misses   Set to the number of lookups that missed the cache
+ * @return 0 if successful, -1 if the cache has never been enabled
+ *
+ * Counts are summed over all threads that have performed lookups.
+ */
+int ipmeta_get_lookup_cache_stats(ipmeta_t *ipmeta, uint64_t *hits,
+                                  uint64_t *misses);
+
+/** Get the lookup statistics collected by the given libipmeta instance
+ *
+ * @param ipmeta        The ipmeta instance to retrieve statistics for
+ * @param[out] stats    Pointer to a structure to fill with the statistics
+ * @return 0 if the statistics were retrieved, -1 if libipmeta was built
+ * without lookup statistics (--enable-lookup-stats)
+ *
+ * Statistics are collected per-thread without locking, and are summed over
+ * all threads that have performed lookups when this function is called.
+ * Values read while other threads are performing lookups may be slightly
+ * stale.
+ */
+int ipmeta_get_stats(ipmeta_t *ipmeta, ipmeta_stats_t *stats);
+
+/** Reset the lookup statistics of the given libipmeta instance
+ *
+ * @param ipmeta        The ipmeta instance to reset statistics for
+ *
+ * @note this should not be called while other threads are performing lookups
+ */
+void ipmeta_reset_stats(ipmeta_t *ipmeta);
+
+/** Get the lower bound (in nanoseconds) of a latency histogram bucket
+ *
+ * @param bucket        The index of the bucket in ipmeta_stats_t.latency_hist
+ * @return the smallest latency that is counted in the bucket
+ */
+uint64_t ipmeta_stats_latency_bucket_ns(int bucket);
+
+/** Estimate a percentile of the sampled lookup latency
+ *
+ * @param stats         The statistics to compute the percentile from
+ * @param percentile    The percentile to compute (0-100)
+ * @return the lower bound (in nanoseconds) of the histogram bucket that holds
+ * the requested percentile, 0 if no latencies were sampled
+ */
+uint64_t ipmeta_stats_latency_percentile(const ipmeta_stats_t *stats,
+                                         double percentile);
+
+/** Get the memory used by the given libipmeta instance
+ *
+ * @param ipmeta        The ipmeta instance to account memory for
+ * @param[out] usage    Pointer to a structure to fill with the memory usage
+ * @return 0 if the memory usage was computed, -1 otherwise
+ *
+ * @note this walks the datastructure, so it may take a while for large
+ * instances, and must not be called while providers are being loaded.
+ */
+int ipmeta_get_memory_usage(ipmeta_t *ipmeta, ipmeta_memory_usage_t *usage);
+
+/** Get the name of a memory category
+ *
+ * @param category      The category to get the name of
+ * @return a short name for the category, NULL if the category is invalid
+ */
+const char *ipmeta_get_memory_category_name(ipmeta_mem_category_t category);
+
 /** Check if the given provider is enabled already
  *
  * @param provider      The provider to check the status of
@@ -319,6 +865,34 @@ int ipmeta_is_provider_enabled(ipmeta_provider_t *provider);
  */
 int ipmeta_get_provider_id(ipmeta_provider_t *provider);
 
+/** Get the type of the given provider
+ *
+ * @param provider      The provider object to retrieve the type from
+ * @return the ID of the built-in provider of the same type (which is also the
+ * ID of the given provider, unless it was created by
+ * ipmeta_add_provider_instance)
+ */
+ipmeta_provider_id_t ipmeta_get_provider_type(ipmeta_provider_t *provider);
+
+/** Get the snapshot time of the given provider
+ *
+ * @param provider      The provider object to retrieve the time from
+ * @return the time from which the provider is valid (see
+ * ipmeta_set_snapshot_time), 0 if it is not a snapshot
+ */
+time_t ipmeta_get_snapshot_time(ipmeta_provider_t *provider);
+
+/** Get the number of IP addresses that the ASN (or ASN group) of a record
+ * 'owns' according to the given provider
+ *
+ * @param provider      The provider object the record was found for
+ * @param record        The record to retrieve the count of
+ * @return the asn_ip_cnt of the record, or if the record is shared by several
+ * snapshots, the count of the given snapshot
+ */
+uint64_t ipmeta_get_asn_ip_cnt(ipmeta_provider_t *provider,
+                               ipmeta_record_t *record);
+
 /** Get the provider name for the given ID
  *
  * @param id            The provider ID to retrieve the name for
@@ -332,7 +906,9 @@ const char *ipmeta_get_provider_name(ipmeta_provider_t *provider);
  * @return an array of provider objects
  *
  * @note the number of elements in the array will be exactly
- * IPMETA_PROVIDER_MAX.
+ * IPMETA_PROVIDER_ID_MAX, indexed by provider ID - 1. The first
+ * IPMETA_PROVIDER_MAX elements are the built-in providers, the others are
+ * NULL unless an instance with that ID has been added.
  * @note not all providers in the list may be enabled. use
  * ipmeta_is_provider_enabled to check.
  */
@@ -382,6 +958,24 @@ void ipmeta_record_set_rewind(ipmeta_record_set_t *record_set);
 ipmeta_record_t *ipmeta_record_set_next(ipmeta_record_set_t *record_set,
                                         uint32_t *num_ips);
 
+/** Get the next record in the record set iterator, along with the provider
+ * it was found for
+ *
+ * @param record_set    The record set instance
+ * @param[out] num_ips  Pointer to an int set to the number of matched IPs
+ *                      (optional)
+ * @param[out] provider_id  Pointer to an int set to the ID of the provider
+ *                          whose data matched (optional)
+ *
+ * @return a pointer to the record
+ *
+ * The provider is the source of the record, unless the record is shared by
+ * several snapshots of a provider.
+ */
+ipmeta_record_t *
+ipmeta_record_set_next_provider(ipmeta_record_set_t *record_set,
+                                uint32_t *num_ips, uint32_t *provider_id);
+
 /** Dump the given metadata record set to stdout
  *
  * @param record_set    The record set to dump
@@ -479,13 +1073,205 @@ void ipmeta_write_record_header(iow_t *file);
  * @param[out] records  Returns an array of metadata records
  * @return the number of records in the array, -1 if an error occurs
  *
- * @note This function allocates and populates the array dynamically, so do not
- * call repeatedly. Also, it is the caller's responsibility to free the array.
- * DO NOT free the records contained in the array.
+ * @note The returned array is owned by the provider and is only valid until
+ * the provider is free'd. DO NOT free the array, or the records contained in
+ * the array.
  */
 int ipmeta_provider_get_all_records(ipmeta_provider_t *provider,
                                     ipmeta_record_t ***records);
 
+/** Get the statistics collected while the given provider was loaded
+ *
+ * @param provider      The provider to retrieve load statistics for
+ * @return a pointer to the load statistics, NULL if the provider is not
+ * enabled
+ *
+ * @note The returned structure is owned by the provider and is only valid
+ * until the provider is free'd.
+ */
+const ipmeta_load_stats_t *ipmeta_get_load_stats(ipmeta_provider_t *provider);
+
+/** Build the change history of the snapshots of a provider type
+ *
+ * @param ipmeta        The ipmeta instance that holds the snapshots
+ * @param type          The provider type (ipmeta_provider_id_t) whose
+ *                      snapshots (see ipmeta_set_snapshot_time) to use
+ * @return a pointer to the history, NULL if an error occurred (or the type
+ * has no enabled snapshots)
+ *
+ * The address space is split into the ranges over which no snapshot
+ * changes, and each range stores the list of changes of its record over
+ * time, so a history lookup costs one binary search plus the number of
+ * changes, whatever the number of snapshots. Building the history walks all
+ * of the ranges once.
+ *
+ * @note The history refers to the records of the snapshots, so it must be
+ * free'd before the ipmeta instance. Once another provider is enabled, the
+ * history is stale and lookups fail until it is built again.
+ */
+ipmeta_history_t *ipmeta_history_init(ipmeta_t *ipmeta,
+                                      ipmeta_provider_id_t type);
+
+/** Free a history
+ *
+ * @param history       The history to free
+ */
+void ipmeta_history_free(ipmeta_history_t *history);
+
+/** Look up how the record of the given address changed over time
+ *
+ * @param history       The history to perform the lookup with
+ * @param addr          The address to retrieve the history of
+ *                       (network byte ordering)
+ * @param[out] entries  Set to point to the changes of the address, in time
+ *                      order
+ * @return the number of changes, -1 if the history is stale
+ *
+ * Consecutive snapshots whose records for the address are the same (other
+ * than their ids and ASN IP counts) make up a single entry, and
+ * snapshots that do not cover the address have no entries (so there may be
+ * gaps between the entries).
+ *
+ * @note The entries are owned by the history, and are valid until it is
+ * free'd.
+ */
+int ipmeta_history_lookup(ipmeta_history_t *history, uint32_t addr,
+                          const ipmeta_history_entry_t **entries);
+
+/** Create a catalog of dated snapshots of a provider
+ *
+ * @param provider_name The name of the provider that loads each snapshot
+ * @param options       Options for the provider, in which "%s" is replaced
+ *                      by the file of the snapshot (e.g. "-f %s")
+ * @param dstype        The datastructure to load each snapshot into
+ * @param memory_budget Number of bytes (as reported by
+ *                      ipmeta_get_memory_usage) that loaded snapshots may
+ *                      use, 0 for no limit
+ * @return a pointer to the catalog, NULL if an error occurred
+ *
+ * Each snapshot is a separate ipmeta instance that is loaded the first time
+ * a timestamp within it is asked for. Loads are done by a background thread,
+ * which also loads the snapshot that follows the one most recently asked
+ * for, so that moving through the snapshots in time order does not stall at
+ * each boundary. Once the loaded snapshots use more than the memory budget,
+ * the least recently used ones are free'd. The budget should fit at least
+ * two snapshots for the prefetching to be of use.
+ */
+ipmeta_catalog_t *ipmeta_catalog_init(const char *provider_name,
+                                      const char *options,
+                                      enum ipmeta_ds_id dstype,
+                                      uint64_t memory_budget);
+
+/** Free a catalog, along with all of its loaded snapshots
+ *
+ * @param catalog       The catalog to free
+ */
+void ipmeta_catalog_free(ipmeta_catalog_t *catalog);
+
+/** Add a snapshot to a catalog
+ *
+ * @param catalog       The catalog to add the snapshot to
+ * @param filename      The file to load the snapshot from
+ * @param valid_from    Time (in seconds since the epoch) from which the
+ *                      snapshot is valid (until the next snapshot)
+ * @return 0 if the snapshot was added, -1 if the catalog is already in use,
+ * the time is not positive, or the catalog already has a snapshot valid from
+ * the same time
+ *
+ * @note snapshots can only be added before the first call to
+ * ipmeta_catalog_get (or ipmeta_catalog_lookup)
+ */
+int ipmeta_catalog_add_file(ipmeta_catalog_t *catalog, const char *filename,
+                            time_t valid_from);
+
+/** Add all the dated files in a directory to a catalog
+ *
+ * @param catalog       The catalog to add the snapshots to
+ * @param dirname       The directory to scan
+ * @return the number of snapshots added, -1 if an error occurred
+ *
+ * The time of each snapshot is taken from the first date in its file name,
+ * given as either YYYYMMDD or YYYY-MM-DD (in UTC), and optionally followed
+ * by a time of day as HHMM (e.g. routeviews-rv2-20200101-1200.pfx2as.gz).
+ * Files without a date in their name, and hidden files, are skipped.
+ */
+int ipmeta_catalog_add_dir(ipmeta_catalog_t *catalog, const char *dirname);
+
+/** Get the snapshot that was valid at the given time, loading it if needed
+ *
+ * @param catalog       The catalog to get the snapshot from
+ * @param timestamp     Time (in seconds since the epoch)
+ * @return the ipmeta instance of the snapshot, NULL if no snapshot was valid
+ * at the given time, or it could not be loaded
+ *
+ * @note The returned instance is owned by the catalog, and is only valid
+ * until the next call to this function (or ipmeta_catalog_lookup). A catalog
+ * must only be used by one thread at a time.
+ */
+ipmeta_t *ipmeta_catalog_get(ipmeta_catalog_t *catalog, time_t timestamp);
+
+/** Look up the given single IP address in the snapshot that was valid at the
+ * given time
+ *
+ * @param catalog       The catalog to perform the lookup with
+ * @param addr          The address to retrieve the record for
+ *                       (network byte ordering)
+ * @param timestamp     Time (in seconds since the epoch)
+ * @param found         Pointer to a record set to use for storing matches
+ * @return the number of records found, -1 if an error occurred (including
+ * if the snapshot could not be loaded)
+ *
+ * If no snapshot was valid at the given time, the record set is emptied and
+ * 0 is returned. Records are only valid until the next call to
+ * ipmeta_catalog_get or ipmeta_catalog_lookup.
+ */
+int ipmeta_catalog_lookup(ipmeta_catalog_t *catalog, uint32_t addr,
+                          time_t timestamp, ipmeta_record_set_t *found);
+
+/** Write the differences between two files of a provider to a diff file
+ *
+ * @param type          The type of provider that reads the files (only
+ *                      pfx2as, netacq-edge and maxmind are supported)
+ * @param old_file      The older file (for netacq-edge and maxmind, the
+ *                      blocks file)
+ * @param new_file      The newer file
+ * @param diff_file     The diff file to write (compressed according to its
+ *                      extension)
+ * @return the number of operations written to the diff, -1 if an error
+ * occurred
+ *
+ * Each line of the diff is an operation on one prefix, with tab-separated
+ * fields: "+ network length value" for a prefix that was added, "- network
+ * length value" for one that was removed, and "~ network length old-value
+ * new-value" for one whose value changed. The value is the ASN string of a
+ * pfx2as prefix, and the location id of a blocks range (ranges are split
+ * into prefixes as the provider does). Only IPv4 prefixes are compared.
+ */
+int ipmeta_diff_files(ipmeta_provider_id_t type, const char *old_file,
+                      const char *new_file, const char *diff_file);
+
+/** Apply a diff (see ipmeta_diff_files) to a loaded provider in place
+ *
+ * @param ipmeta        The ipmeta instance that holds the provider
+ * @param provider      The provider to update, which must have been loaded
+ *                      from the old file of the diff
+ * @param diff_file     The diff file to apply
+ * @return the number of operations applied, -1 if an error occurred
+ *
+ * The prefixes of the provider are updated in the datastructure, so moving
+ * to a newer file costs time in proportion to what changed, rather than a
+ * reload. Records for ASNs that the provider has not seen are created as
+ * needed, while locations must exist already. Records that are no longer
+ * used are kept. The diff is read and checked before anything is changed,
+ * but if the datastructure fails part way, the provider is left with only
+ * some of the operations applied.
+ *
+ * @note Lookups must not run concurrently with this function. Diffs cannot
+ * be applied to snapshots (see ipmeta_set_snapshot_time).
+ */
+int ipmeta_apply_diff(ipmeta_t *ipmeta, ipmeta_provider_t *provider,
+                      const char *diff_file);
+
 /**
  * @name Logging functions
  *
@@ -27,6 +27,7 @@
 #define __LIBIPMETA_INT_H
 
 #include <inttypes.h>
+#include <pthread.h>
 
 #include "khash.h"
 
@@ -41,6 +42,46 @@
  */
 
 KHASH_MAP_INIT_INT(ipmeta_rechash, struct ipmeta_record *)
+KHASH_MAP_INIT_INT(ipmeta_ipcnt, uint64_t)
+
+/** Check if two records have the same contents (everything but their ids,
+ * sources and ASN IP counts), in which case one can be used in place of the
+ * other */
+int ipmeta_record_content_equal(const struct ipmeta_record *a,
+                                const struct ipmeta_record *b);
+
+/** Approximate number of bytes allocated by the given khash table, whose
+ * keys and values are of the given sizes */
+#define IPMETA_KH_MEMORY(h, keysize, valsize)                                  \
+  ((h) == NULL ? 0                                                             \
+               : sizeof(*(h)) +                                                \
+                   (uint64_t)kh_n_buckets(h) * ((keysize) + (valsize)) +       \
+                   ((kh_n_buckets(h) + 15) / 16) * sizeof(khint32_t))
+
+/** Number of bytes used by the given string (0 if it is NULL) */
+#define IPMETA_STR_MEMORY(str) ((str) == NULL ? 0 : strlen(str) + 1)
+
+/** Get the largest prefix that starts at the given address and does not
+ * extend past the given end of a range (both in host byte order, with the end
+ * one past the last address of the range). Returns the length of the prefix
+ * and sets size to its number of addresses.
+ *
+ * Stepping through a range this way splits it into the fewest prefixes. */
+static inline uint8_t ipmeta_range_next_prefix(uint64_t start, uint64_t end,
+                                               uint64_t *size)
+{
+  /* the largest block that is aligned at start */
+  uint64_t sz = (start == 0) ? ((uint64_t)1 << 32) : (start & (~start + 1));
+  uint8_t mask = 32 - __builtin_ctzll(sz);
+
+  /* shrink it until it fits inside the range */
+  while (start + sz > end) {
+    sz >>= 1;
+    mask++;
+  }
+  *size = sz;
+  return mask;
+}
 
 /**
  * @name Internal Datastructures
@@ -53,10 +94,10 @@ KHASH_MAP_INIT_INT(ipmeta_rechash, struct ipmeta_record *)
 /** Structure which holds state for a libipmeta instance */
 struct ipmeta {
 
-  /** Array of metadata providers
+  /** Array of metadata providers (NULL for IDs that have no instance)
    * @note index of provider is given by (ipmeta_provider_id_t - 1)
    */
-  struct ipmeta_provider *providers[IPMETA_PROVIDER_MAX];
+  struct ipmeta_provider *providers[IPMETA_PROVIDER_ID_MAX];
 
   /** Default metadata provider */
   struct ipmeta_provider *provider_default;
@@ -64,16 +105,289 @@ struct ipmeta {
   struct ipmeta_ds *datastore;
 
   uint32_t all_provmask;
+
+  /** Generation of the datastore, incremented whenever its contents change
+   * (cached lookup results from older generations are stale) */
+  uint32_t generation;
+
+  /** Number of entries in each thread's lookup cache (0 if disabled) */
+  uint32_t cache_entries;
+
+  /** Non-zero once cache_key and cache_lock have been created */
+  int cache_ready;
+
+  /** Thread-specific key that maps to each thread's lookup cache */
+  pthread_key_t cache_key;
+
+  /** Protects the list of lookup caches */
+  pthread_mutex_t cache_lock;
+
+  /** List of the lookup caches of all threads that have done lookups */
+  struct ipmeta_cache *caches;
+
+#ifdef WITH_LOOKUP_STATS
+  /** Thread-specific key that maps to each thread's statistics block */
+  pthread_key_t stats_key;
+
+  /** Protects the list of statistics blocks */
+  pthread_mutex_t stats_lock;
+
+  /** List of the statistics blocks of all threads that have done lookups */
+  struct ipmeta_stats_block *stats_blocks;
+#endif
+};
+
+#ifdef WITH_LOOKUP_STATS
+/** Lookup statistics collected by a single thread */
+typedef struct ipmeta_stats_block {
+  /** The statistics (only updated by the owning thread) */
+  ipmeta_stats_t stats;
+
+  /** Number of lookups since the last latency sample */
+  uint32_t sample_cnt;
+
+  /** Next block in the list of all blocks */
+  struct ipmeta_stats_block *next;
+
+} ipmeta_stats_block_t;
+
+/** State carried from the start to the end of an instrumented lookup */
+typedef struct ipmeta_stats_sample {
+  /** The statistics block of the calling thread (NULL if unavailable) */
+  ipmeta_stats_block_t *block;
+
+  /** Time the lookup started (ns), 0 if this lookup is not being timed */
+  uint64_t start_ns;
+
+} ipmeta_stats_sample_t;
+#endif
+
+/** Size of a CPU cache line */
+#define IPMETA_CACHE_LINE_SIZE 64
+
+/** A single cached lookup result (aligned to a cache line) */
+typedef struct ipmeta_cache_entry {
+  /** The address that was looked up (network byte order) */
+  uint32_t addr;
+
+  /** The provider mask used for the lookup */
+  uint32_t providermask;
+
+  /** The datastore generation this result is valid for (0 if empty) */
+  uint32_t generation;
+
+  /** Number of records in the result */
+  uint32_t n_recs;
+
+  /** The records found */
+  struct ipmeta_record *records[IPMETA_PROVIDER_MAX];
+
+  /** Number of IPs matched by each record */
+  uint32_t ip_cnts[IPMETA_PROVIDER_MAX];
+
+  /** The provider each record was found for */
+  uint8_t provider_ids[IPMETA_PROVIDER_MAX];
+
+} __attribute__((aligned(IPMETA_CACHE_LINE_SIZE))) ipmeta_cache_entry_t;
+
+/** A direct-mapped cache of single lookup results, owned by one thread */
+typedef struct ipmeta_cache {
+  /** Array of cache entries */
+  ipmeta_cache_entry_t *entries;
+
+  /** Number of entries (a power of two) */
+  uint32_t entries_cnt;
+
+  /** Number of lookups answered from the cache */
+  uint64_t hits;
+
+  /** Number of lookups that had to query the datastore */
+  uint64_t misses;
+
+  /** Next cache in the list of all caches */
+  struct ipmeta_cache *next;
+
+} ipmeta_cache_t;
+
+/** State of a sorted lookup stream */
+struct ipmeta_sorted_stream {
+  /** The ipmeta instance that lookups are performed on */
+  ipmeta_t *ipmeta;
+
+  /** Providers to perform the lookups with */
+  uint32_t providermask;
+
+  /** Datastore generation that the current range was looked up in */
+  uint32_t generation;
+
+  /** Records of the current range */
+  ipmeta_record_set_t *records;
+
+  /** The current range (host byte order, empty if first > last) */
+  uint32_t first;
+  uint32_t last;
+
+  /** The previous address given to the stream (host byte order) */
+  uint32_t prev_addr;
+};
+
+/** Load state of a snapshot in a catalog */
+typedef enum ipmeta_catalog_state {
+  /** Not loaded (or evicted) */
+  IPMETA_CATALOG_UNLOADED = 0,
+
+  /** Being loaded by the loader thread */
+  IPMETA_CATALOG_LOADING = 1,
+
+  /** Loaded and ready for lookups */
+  IPMETA_CATALOG_LOADED = 2,
+
+  /** Loading failed (it is not retried) */
+  IPMETA_CATALOG_FAILED = 3,
+
+} ipmeta_catalog_state_t;
+
+/** A dated snapshot in a catalog */
+typedef struct ipmeta_catalog_snapshot {
+  /** Time from which the snapshot is valid */
+  time_t valid_from;
+
+  /** File to load the snapshot from */
+  char *filename;
+
+  /** The loaded snapshot (NULL unless state is IPMETA_CATALOG_LOADED) */
+  ipmeta_t *ipmeta;
+
+  /** Memory used by the loaded snapshot */
+  uint64_t memory;
+
+  /** Catalog clock value when the snapshot was last used (or loaded) */
+  uint64_t last_used;
+
+  /** Load state of the snapshot */
+  ipmeta_catalog_state_t state;
+
+} ipmeta_catalog_snapshot_t;
+
+/** State of a catalog of dated snapshots */
+struct ipmeta_catalog {
+  /** Name of the provider that loads the snapshots */
+  char *provider_name;
+
+  /** Provider options ("%s" is replaced by the file name) */
+  char *options;
+
+  /** Datastructure to load the snapshots into */
+  enum ipmeta_ds_id dstype;
+
+  /** Memory that loaded snapshots may use (0 for no limit) */
+  uint64_t memory_budget;
+
+  /** Snapshots, sorted by time once the catalog is sealed */
+  ipmeta_catalog_snapshot_t *snapshots;
+  int snapshots_cnt;
+  int snapshots_alloc;
+
+  /** Non-zero once the catalog has been used (no more snapshots can be
+   * added) */
+  int sealed;
+
+  /** Index of the snapshot most recently returned (-1 if none), along with
+   * the range of times it is valid for ([current_from, current_until), where
+   * an until of 0 means forever). These are only written by the catalog's
+   * user thread */
+  int current;
+  time_t current_from;
+  time_t current_until;
+
+  /** Clock used to order snapshots by when they were last used */
+  uint64_t clock;
+
+  /** Memory used by all loaded snapshots */
+  uint64_t memory;
+
+  /** Snapshot requested by the user thread (-1 if none) */
+  int demand;
+
+  /** Snapshot the user thread is waiting for (-1 if none). It must not be
+   * evicted between being loaded and being handed to the user thread */
+  int waiting;
+
+  /** Snapshot requested for prefetching (-1 if none) */
+  int prefetch;
+
+  /** Non-zero once the loader thread should exit */
+  int shutdown;
+
+  /** Thread that loads the snapshots */
+  pthread_t loader;
+
+  /** Protects everything the loader thread shares with the user thread */
+  pthread_mutex_t lock;
+
+  /** Signalled when a load is requested, or finishes */
+  pthread_cond_t cond;
+};
+
+/** Change history of the snapshots of a provider type */
+struct ipmeta_history {
+  /** The ipmeta instance the history was built from */
+  ipmeta_t *ipmeta;
+
+  /** Generation of the datastore the history was built from */
+  uint32_t generation;
+
+  /** First address (host byte order) of each range. Ranges are sorted, and
+   * cover the whole address space (the first one starts at 0) */
+  uint32_t *ranges;
+
+  /** Index of the first change of each range (in changes), with an extra
+   * element at the end, so range i has changes [starts[i], starts[i + 1]) */
+  uint32_t *starts;
+
+  /** Number of ranges, and number of ranges allocated */
+  uint32_t ranges_cnt;
+  uint32_t ranges_alloc;
+
+  /** The changes of all ranges */
+  ipmeta_history_entry_t *changes;
+
+  /** Number of changes, and number of changes allocated */
+  uint32_t changes_cnt;
+  uint32_t changes_alloc;
 };
 
-/** Structure which holds a set of records, returned by a query */
+/** A record in a record set, along with the number of IPs it matched and the
+    provider whose slot it was found in (which is not the source of the record
+    if it is shared by snapshots) */
+typedef struct ipmeta_record_set_entry {
+  ipmeta_record_t *record;
+  uint32_t ip_cnt;
+  uint32_t provider_id;
+} ipmeta_record_set_entry_t;
+
+/** Number of entries stored inside a record set (enough for one record per
+    provider), larger sets spill to the heap */
+#define IPMETA_RECORD_SET_INLINE_CNT IPMETA_PROVIDER_MAX
+
+/** Structure which holds a set of records, returned by a query
+ *
+ * The inline entries and the fields used by lookups and iteration come
+ * first, so that the result of a single address lookup is held in one cache
+ * line.
+ */
 struct ipmeta_record_set {
 
-  ipmeta_record_t **records;
-  uint32_t *ip_cnts;
+  /** Storage for small sets */
+  ipmeta_record_set_entry_t _inline[IPMETA_RECORD_SET_INLINE_CNT];
+
+  /** The entries of the set (either _inline, or a heap array) */
+  ipmeta_record_set_entry_t *entries;
   int n_recs;
 
   int _cursor;
+
+  /** Number of entries that fit in the entries array */
   int _alloc_size;
 };
 
@@ -84,12 +398,14 @@ struct ipmeta_record_set {
  *
  * @param record_set    The record set instance to add the record to
  * @param rec           The record to add
+ * @param provider_id   The ID of the provider the record was found for
  * @param num_ips       The number of IPs matched in this record
  *
  * @return 0 if insertion was successful, or -1 if realloc failed
  */
 int ipmeta_record_set_add_record(ipmeta_record_set_t *record_set,
-                                 ipmeta_record_t *rec, int num_ips);
+                                 ipmeta_record_t *rec, uint32_t provider_id,
+                                 int num_ips);
 
 /** Empties the set.
  *
@@ -99,4 +415,72 @@ int ipmeta_record_set_add_record(ipmeta_record_set_t *record_set,
  */
 void ipmeta_record_set_clear(ipmeta_record_set_t *record_set);
 
+/**
+ * @name Lookup cache functions
+ *
+ * @{ */
+
+/** Perform a single address lookup through the calling thread's cache
+ *
+ * @param ipmeta        The ipmeta instance to perform the lookup with
+ * @param addr          The address to look up (network byte order)
+ * @param providermask  The providers to look up
+ * @param found         The record set to add the results to
+ * @return the number of records found, -1 if an error occurred
+ */
+int ipmeta_cache_lookup_single(ipmeta_t *ipmeta, uint32_t addr,
+                               uint32_t providermask,
+                               ipmeta_record_set_t *found);
+
+/** Free the lookup cache state of an ipmeta instance
+ *
+ * @param ipmeta        The ipmeta instance to free caches for
+ */
+void ipmeta_cache_free(ipmeta_t *ipmeta);
+
+/** @} */
+
+#ifdef WITH_LOOKUP_STATS
+/**
+ * @name Lookup statistics functions
+ *
+ * These are only compiled in when libipmeta is configured with
+ * --enable-lookup-stats.
+ *
+ * @{ */
+
+/** Initialize the lookup statistics state of an ipmeta instance
+ *
+ * @param ipmeta        The ipmeta instance to initialize
+ * @return 0 if successful, -1 otherwise
+ */
+int ipmeta_stats_init(ipmeta_t *ipmeta);
+
+/** Free the lookup statistics state of an ipmeta instance
+ *
+ * @param ipmeta        The ipmeta instance to free statistics for
+ */
+void ipmeta_stats_free(ipmeta_t *ipmeta);
+
+/** Mark the start of a lookup
+ *
+ * @param ipmeta        The ipmeta instance performing the lookup
+ * @param sample        Sample state to pass to ipmeta_stats_lookup_end
+ */
+void ipmeta_stats_lookup_begin(ipmeta_t *ipmeta, ipmeta_stats_sample_t *sample);
+
+/** Mark the end of a lookup and account for its results
+ *
+ * @param sample        Sample state filled by ipmeta_stats_lookup_begin
+ * @param single        Non-zero if this was a single address lookup
+ * @param providermask  The providers that were queried
+ * @param records       The record set returned by the lookup
+ */
+void ipmeta_stats_lookup_end(ipmeta_stats_sample_t *sample, int single,
+                             uint32_t providermask,
+                             ipmeta_record_set_t *records);
+
+/** @} */
+#endif
+
 #endif /* __LIBIPMETA_INT_H */
@@ -40,7 +40,6 @@
 #include "khash.h"
 #include "utils.h"
 #include "csv.h"
-#include "ip_utils.h"
 
 #include "ipmeta_ds.h"
 #include "ipmeta_provider_maxmind.h"
@@ -78,8 +77,8 @@ typedef struct ipmeta_provider_maxmind_state {
   ipmeta_record_t tmp_record;
   uint16_t cntry_code;
   uint32_t block_id;
-  ip_prefix_t block_lower;
-  ip_prefix_t block_upper;
+  uint32_t block_lower;
+  uint32_t block_upper;
 
   /* hash that maps from country code to continent code */
   khash_t(u16u16) * country_continent;
@@ -456,7 +455,8 @@ static int read_locations(ipmeta_provider_t *provider, io_t *file)
 
   csv_init(&(state->parser), options);
 
-  while ((read = wandio_read(file, &buffer, BUFFER_LEN)) > 0) {
+  while ((read = ipmeta_provider_read_file(provider, file, &buffer,
+                                           BUFFER_LEN)) > 0) {
     if (csv_parse(&(state->parser), buffer, read, parse_maxmind_location_cell,
                   parse_maxmind_location_row, provider) != read) {
       ipmeta_log(__func__, "Error parsing %s Location file", provider->name);
@@ -495,7 +495,7 @@ static void parse_blocks_cell(void *s, size_t i, void *data)
   switch (state->current_column) {
   case BLOCKS_COL_STARTIP:
     /* start ip */
-    state->block_lower.addr = strtol(tok, &end, 10);
+    state->block_lower = strtol(tok, &end, 10);
     if (end == tok || *end != '\0' || errno == ERANGE) {
       ipmeta_log(__func__, "Invalid Start IP Value (%s)", tok);
       state->parser.status = CSV_EUSER;
@@ -504,7 +504,7 @@ static void parse_blocks_cell(void *s, size_t i, void *data)
 
   case BLOCKS_COL_ENDIP:
     /* end ip */
-    state->block_upper.addr = strtol(tok, &end, 10);
+    state->block_upper = strtol(tok, &end, 10);
     if (end == tok || *end != '\0' || errno == ERANGE) {
       ipmeta_log(__func__, "Invalid End IP Value (%s)", tok);
       state->parser.status = CSV_EUSER;
@@ -536,8 +536,6 @@ static void parse_blocks_row(int c, void *data)
   ipmeta_provider_t *provider = (ipmeta_provider_t *)data;
   ipmeta_provider_maxmind_state_t *state = STATE(provider);
 
-  ip_prefix_list_t *pfx_list = NULL;
-  ip_prefix_list_t *temp = NULL;
   ipmeta_record_t *record = NULL;
 
   if (state->current_line < HEADER_ROW_CNT) {
@@ -559,15 +557,6 @@ static void parse_blocks_row(int c, void *data)
 
   assert(state->block_id > 0);
 
-  /* convert the range to prefixes */
-  if (ip_range_to_prefix(state->block_lower, state->block_upper, &pfx_list) !=
-      0) {
-    ipmeta_log(__func__, "ERROR: Could not convert range to pfxs");
-    state->parser.status = CSV_EUSER;
-    return;
-  }
-  assert(pfx_list != NULL);
-
   /* get the record from the provider */
   if ((record = ipmeta_provider_get_record(provider, state->block_id)) ==
       NULL) {
@@ -577,22 +566,12 @@ static void parse_blocks_row(int c, void *data)
     return;
   }
 
-  /* iterate over and add each prefix to the trie */
-  while (pfx_list != NULL) {
-    if (ipmeta_provider_associate_record(provider, htonl(pfx_list->prefix.addr),
-                                         pfx_list->prefix.masklen,
-                                         record) != 0) {
-      ipmeta_log(__func__, "ERROR: Failed to associate record");
-      state->parser.status = CSV_EUSER;
-      return;
-    }
-
-    /* store this node so we can free it */
-    temp = pfx_list;
-    /* move on to the next pfx */
-    pfx_list = pfx_list->next;
-    /* free this node (saves us walking the list twice) */
-    free(temp);
+  /* convert the range to prefixes and add each one to the ds */
+  if (ipmeta_provider_associate_range(provider, state->block_lower,
+                                      state->block_upper, record) != 0) {
+    ipmeta_log(__func__, "ERROR: Failed to associate record with range");
+    state->parser.status = CSV_EUSER;
+    return;
   }
 
   /* increment the current line */
@@ -612,8 +591,8 @@ static int read_blocks(ipmeta_provider_t *provider, io_t *file)
   state->current_column = 0;
   state->current_line = 0;
   state->block_id = 0;
-  state->block_lower.masklen = 32;
-  state->block_upper.masklen = 32;
+  state->block_lower = 0;
+  state->block_upper = 0;
 
   /* options for the csv parser */
   int options = CSV_STRICT | CSV_REPALL_NL | CSV_STRICT_FINI | CSV_APPEND_NULL |
@@ -621,7 +600,8 @@ static int read_blocks(ipmeta_provider_t *provider, io_t *file)
 
   csv_init(&(state->parser), options);
 
-  while ((read = wandio_read(file, &buffer, BUFFER_LEN)) > 0) {
+  while ((read = ipmeta_provider_read_file(provider, file, &buffer,
+                                           BUFFER_LEN)) > 0) {
     if (csv_parse(&(state->parser), buffer, read, parse_blocks_cell,
                   parse_blocks_row, provider) != read) {
       ipmeta_log(__func__, "Error parsing Blocks file");
@@ -1353,7 +1333,8 @@ int ipmeta_provider_maxmind_init(ipmeta_provider_t *provider, int argc,
   }
 
   /* open the locations file */
-  if ((file = wandio_create(state->locations_file)) == NULL) {
+  if ((file = ipmeta_provider_open_file(provider, state->locations_file)) ==
+      NULL) {
     ipmeta_log(__func__, "failed to open location file '%s'",
                state->locations_file);
     return -1;
@@ -1366,11 +1347,12 @@ int ipmeta_provider_maxmind_init(ipmeta_provider_t *provider, int argc,
   }
 
   /* close the locations file */
-  wandio_destroy(file);
+  ipmeta_provider_close_file(provider, file);
   file = NULL;
 
   /* open the blocks file */
-  if ((file = wandio_create(state->blocks_file)) == NULL) {
+  if ((file = ipmeta_provider_open_file(provider, state->blocks_file)) ==
+      NULL) {
     ipmeta_log(__func__, "failed to open blocks file '%s'", state->blocks_file);
     goto err;
   }
@@ -1382,7 +1364,7 @@ int ipmeta_provider_maxmind_init(ipmeta_provider_t *provider, int argc,
   }
 
   /* close the blocks file */
-  wandio_destroy(file);
+  ipmeta_provider_close_file(provider, file);
 
   /* ready to rock n roll */
 
@@ -1390,7 +1372,7 @@ int ipmeta_provider_maxmind_init(ipmeta_provider_t *provider, int argc,
 
 err:
   if (file != NULL) {
-    wandio_destroy(file);
+    ipmeta_provider_close_file(provider, file);
   }
   usage(provider);
   return -1;
@@ -1435,6 +1417,22 @@ int ipmeta_provider_maxmind_lookup_single(ipmeta_provider_t *provider,
   return ipmeta_provider_lookup_record_single(provider, addr, found);
 }
 
+void ipmeta_provider_maxmind_memory_usage(ipmeta_provider_t *provider,
+                                          uint64_t *usage)
+{
+  ipmeta_provider_maxmind_state_t *state = STATE(provider);
+
+  if (state == NULL) {
+    return;
+  }
+
+  usage[IPMETA_MEM_OTHER] += sizeof(ipmeta_provider_maxmind_state_t);
+  usage[IPMETA_MEM_STRINGS] += IPMETA_STR_MEMORY(state->locations_file) +
+                               IPMETA_STR_MEMORY(state->blocks_file);
+  usage[IPMETA_MEM_HASHES] += IPMETA_KH_MEMORY(
+    state->country_continent, sizeof(uint16_t), sizeof(uint16_t));
+}
+
 /* ========== HELPER FUNCTIONS ========== */
 
 int ipmeta_provider_maxmind_get_iso2_list(const char ***countries)
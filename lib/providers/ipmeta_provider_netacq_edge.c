@@ -41,7 +41,6 @@
 #include "khash.h"
 #include "utils.h"
 #include "csv.h"
-#include "ip_utils.h"
 
 #include "ipmeta_ds.h"
 #include "ipmeta_provider_netacq_edge.h"
@@ -103,8 +102,8 @@ typedef struct ipmeta_provider_netacq_edge_state {
   int current_column;
   ipmeta_record_t tmp_record;
   uint32_t block_id;
-  ip_prefix_t block_lower;
-  ip_prefix_t block_upper;
+  uint32_t block_lower;
+  uint32_t block_upper;
   ipmeta_provider_netacq_edge_region_t tmp_region;
   int tmp_region_ignore;
   ipmeta_provider_netacq_edge_country_t tmp_country;
@@ -607,7 +606,8 @@ static int read_locations(ipmeta_provider_t *provider, io_t *file)
 
   csv_init(&(state->parser), options);
 
-  while ((read = wandio_read(file, &buffer, BUFFER_LEN)) > 0) {
+  while ((read = ipmeta_provider_read_file(provider, file, &buffer,
+                                           BUFFER_LEN)) > 0) {
     if (csv_parse(&(state->parser), buffer, read,
                   parse_netacq_edge_location_cell,
                   parse_netacq_edge_location_row, provider) != read) {
@@ -647,7 +647,7 @@ static void parse_blocks_cell(void *s, size_t i, void *data)
   switch (state->current_column) {
   case BLOCKS_COL_STARTIP:
     /* start ip */
-    state->block_lower.addr = strtoul(tok, &end, 10);
+    state->block_lower = strtoul(tok, &end, 10);
     if (end == tok || *end != '\0' || errno == ERANGE) {
       ipmeta_log(__func__, "Invalid Start IP Value (%s)", tok);
       state->parser.status = CSV_EUSER;
@@ -656,7 +656,7 @@ static void parse_blocks_cell(void *s, size_t i, void *data)
 
   case BLOCKS_COL_ENDIP:
     /* end ip */
-    state->block_upper.addr = strtoul(tok, &end, 10);
+    state->block_upper = strtoul(tok, &end, 10);
     if (end == tok || *end != '\0' || errno == ERANGE) {
       ipmeta_log(__func__, "Invalid End IP Value (%s)", tok);
       state->parser.status = CSV_EUSER;
@@ -688,8 +688,6 @@ static void parse_blocks_row(int c, void *data)
   ipmeta_provider_t *provider = (ipmeta_provider_t *)data;
   ipmeta_provider_netacq_edge_state_t *state = STATE(provider);
 
-  ip_prefix_list_t *pfx_list = NULL;
-  ip_prefix_list_t *temp = NULL;
   ipmeta_record_t *record = NULL;
 
   if (state->current_line < HEADER_ROW_CNT) {
@@ -711,15 +709,6 @@ static void parse_blocks_row(int c, void *data)
 
   assert(state->block_id > 0);
 
-  /* convert the range to prefixes */
-  if (ip_range_to_prefix(state->block_lower, state->block_upper, &pfx_list) !=
-      0) {
-    ipmeta_log(__func__, "ERROR: Could not convert range to pfxs");
-    state->parser.status = CSV_EUSER;
-    return;
-  }
-  assert(pfx_list != NULL);
-
   /* get the record from the provider */
   if ((record = ipmeta_provider_get_record(provider, state->block_id)) ==
       NULL) {
@@ -729,22 +718,12 @@ static void parse_blocks_row(int c, void *data)
     return;
   }
 
-  /* iterate over and add each prefix to the trie */
-  while (pfx_list != NULL) {
-    if (ipmeta_provider_associate_record(provider, htonl(pfx_list->prefix.addr),
-                                         pfx_list->prefix.masklen,
-                                         record) != 0) {
-      ipmeta_log(__func__, "ERROR: Failed to associate record");
-      state->parser.status = CSV_EUSER;
-      return;
-    }
-
-    /* store this node so we can free it */
-    temp = pfx_list;
-    /* move on to the next pfx */
-    pfx_list = pfx_list->next;
-    /* free this node (saves us walking the list twice) */
-    free(temp);
+  /* convert the range to prefixes and add each one to the ds */
+  if (ipmeta_provider_associate_range(provider, state->block_lower,
+                                      state->block_upper, record) != 0) {
+    ipmeta_log(__func__, "ERROR: Failed to associate record with range");
+    state->parser.status = CSV_EUSER;
+    return;
   }
 
   /* increment the current line */
@@ -764,8 +743,8 @@ static int read_blocks(ipmeta_provider_t *provider, io_t *file)
   state->current_column = 0;
   state->current_line = 0;
   state->block_id = 0;
-  state->block_lower.masklen = 32;
-  state->block_upper.masklen = 32;
+  state->block_lower = 0;
+  state->block_upper = 0;
 
   /* options for the csv parser */
   int options = CSV_STRICT | CSV_REPALL_NL | CSV_STRICT_FINI | CSV_APPEND_NULL |
@@ -773,7 +752,8 @@ static int read_blocks(ipmeta_provider_t *provider, io_t *file)
 
   csv_init(&(state->parser), options);
 
-  while ((read = wandio_read(file, &buffer, BUFFER_LEN)) > 0) {
+  while ((read = ipmeta_provider_read_file(provider, file, &buffer,
+                                           BUFFER_LEN)) > 0) {
     if (csv_parse(&(state->parser), buffer, read, parse_blocks_cell,
                   parse_blocks_row, provider) != read) {
       ipmeta_log(__func__, "Error parsing Blocks file");
@@ -972,7 +952,8 @@ static int read_regions(ipmeta_provider_t *provider, io_t *file)
 
   csv_init(&(state->parser), options);
 
-  while ((read = wandio_read(file, &buffer, BUFFER_LEN)) > 0) {
+  while ((read = ipmeta_provider_read_file(provider, file, &buffer,
+                                           BUFFER_LEN)) > 0) {
     if (csv_parse(&(state->parser), buffer, read, parse_regions_cell,
                   parse_regions_row, provider) != read) {
       ipmeta_log(__func__, "Error parsing regions file");
@@ -1223,7 +1204,8 @@ static int read_countries(ipmeta_provider_t *provider, io_t *file)
 
   csv_init(&(state->parser), options);
 
-  while ((read = wandio_read(file, &buffer, BUFFER_LEN)) > 0) {
+  while ((read = ipmeta_provider_read_file(provider, file, &buffer,
+                                           BUFFER_LEN)) > 0) {
     if (csv_parse(&(state->parser), buffer, read, parse_country_cell,
                   parse_country_row, provider) != read) {
       ipmeta_log(__func__, "Error parsing country file");
@@ -1418,7 +1400,8 @@ static int read_polygons(ipmeta_provider_t *provider, io_t *file)
 
   csv_init(&(state->parser), options);
 
-  while ((read = wandio_read(file, &buffer, BUFFER_LEN)) > 0) {
+  while ((read = ipmeta_provider_read_file(provider, file, &buffer,
+                                           BUFFER_LEN)) > 0) {
     if (csv_parse(&(state->parser), buffer, read, parse_polygons_cell,
                   parse_polygons_row, provider) != read) {
       ipmeta_log(__func__, "Error parsing polygon decode file");
@@ -1604,7 +1587,8 @@ static int read_na_to_polygon(ipmeta_provider_t *provider, io_t *file)
 
   csv_init(&(state->parser), options);
 
-  while ((read = wandio_read(file, &buffer, BUFFER_LEN)) > 0) {
+  while ((read = ipmeta_provider_read_file(provider, file, &buffer,
+                                           BUFFER_LEN)) > 0) {
     if (csv_parse(&(state->parser), buffer, read, parse_na_to_polygon_cell,
                   parse_na_to_polygon_row, provider) != read) {
       ipmeta_log(__func__, "Error parsing netacq2polygon file");
@@ -1673,7 +1657,8 @@ int ipmeta_provider_netacq_edge_init(ipmeta_provider_t *provider, int argc,
   /* if provided, open the region decode file and populate the lookup arrays */
   if (state->region_file != NULL) {
     ipmeta_log(__func__, "processing region file (%s)", state->region_file);
-    if ((file = wandio_create(state->region_file)) == NULL) {
+    if ((file = ipmeta_provider_open_file(provider, state->region_file)) ==
+        NULL) {
       ipmeta_log(__func__, "failed to open region decode file '%s'",
                  state->region_file);
       return -1;
@@ -1686,13 +1671,14 @@ int ipmeta_provider_netacq_edge_init(ipmeta_provider_t *provider, int argc,
     }
 
     /* close it... */
-    wandio_destroy(file);
+    ipmeta_provider_close_file(provider, file);
   }
 
   /* if provided, open the country decode file and populate the lookup arrays */
   if (state->country_file != NULL) {
     ipmeta_log(__func__, "processing country file (%s)", state->country_file);
-    if ((file = wandio_create(state->country_file)) == NULL) {
+    if ((file = ipmeta_provider_open_file(provider, state->country_file)) ==
+        NULL) {
       ipmeta_log(__func__, "failed to open country decode file '%s'",
                  state->country_file);
       return -1;
@@ -1705,7 +1691,7 @@ int ipmeta_provider_netacq_edge_init(ipmeta_provider_t *provider, int argc,
     }
 
     /* close it... */
-    wandio_destroy(file);
+    ipmeta_provider_close_file(provider, file);
   }
 
   /* open each polygon decode file and populate the lookup arrays */
@@ -1713,7 +1699,8 @@ int ipmeta_provider_netacq_edge_init(ipmeta_provider_t *provider, int argc,
     assert(state->polygon_files[i] != NULL);
     ipmeta_log(__func__, "processing polygon table (%s)",
                state->polygon_files[i]);
-    if ((file = wandio_create(state->polygon_files[i])) == NULL) {
+    if ((file = ipmeta_provider_open_file(provider, state->polygon_files[i])) ==
+        NULL) {
       ipmeta_log(__func__, "failed to open Polygon decode file '%s'",
                  state->polygon_files[i]);
       return -1;
@@ -1726,7 +1713,7 @@ int ipmeta_provider_netacq_edge_init(ipmeta_provider_t *provider, int argc,
     }
 
     /* close it... */
-    wandio_destroy(file);
+    ipmeta_provider_close_file(provider, file);
   }
 
   /* if provided, open the netacq2polygon mapping file and populate the
@@ -1734,7 +1721,8 @@ int ipmeta_provider_netacq_edge_init(ipmeta_provider_t *provider, int argc,
   if (state->na_to_polygon_file != NULL) {
     ipmeta_log(__func__, "processing na2poly table (%s)",
                state->na_to_polygon_file);
-    if ((file = wandio_create(state->na_to_polygon_file)) == NULL) {
+    if ((file = ipmeta_provider_open_file(provider,
+                                          state->na_to_polygon_file)) == NULL) {
       ipmeta_log(__func__,
                  "failed to open Net Acuity to Polygon mapping file '%s'",
                  state->na_to_polygon_file);
@@ -1749,13 +1737,14 @@ int ipmeta_provider_netacq_edge_init(ipmeta_provider_t *provider, int argc,
     }
 
     /* close it... */
-    wandio_destroy(file);
+    ipmeta_provider_close_file(provider, file);
   }
 
   ipmeta_log(__func__, "processing locations file (%s)", state->locations_file);
 
   /* open the locations file */
-  if ((file = wandio_create(state->locations_file)) == NULL) {
+  if ((file = ipmeta_provider_open_file(provider, state->locations_file)) ==
+      NULL) {
     ipmeta_log(__func__, "failed to open location file '%s'",
                state->locations_file);
     return -1;
@@ -1768,13 +1757,14 @@ int ipmeta_provider_netacq_edge_init(ipmeta_provider_t *provider, int argc,
   }
 
   /* close the locations file */
-  wandio_destroy(file);
+  ipmeta_provider_close_file(provider, file);
   file = NULL;
 
   ipmeta_log(__func__, "processing blocks file (%s)", state->blocks_file);
 
   /* open the blocks file */
-  if ((file = wandio_create(state->blocks_file)) == NULL) {
+  if ((file = ipmeta_provider_open_file(provider, state->blocks_file)) ==
+      NULL) {
     ipmeta_log(__func__, "failed to open blocks file '%s'", state->blocks_file);
     goto err;
   }
@@ -1786,7 +1776,7 @@ int ipmeta_provider_netacq_edge_init(ipmeta_provider_t *provider, int argc,
   }
 
   /* close the blocks file */
-  wandio_destroy(file);
+  ipmeta_provider_close_file(provider, file);
 
   /* free the netacq 2 polygon temporary mapping table */
   na_to_polygon_free(state);
@@ -1797,7 +1787,7 @@ int ipmeta_provider_netacq_edge_init(ipmeta_provider_t *provider, int argc,
 
 err:
   if (file != NULL) {
-    wandio_destroy(file);
+    ipmeta_provider_close_file(provider, file);
   }
   usage(provider);
   return -1;
@@ -1918,6 +1908,67 @@ int ipmeta_provider_netacq_edge_lookup_single(ipmeta_provider_t *provider,
   return ipmeta_provider_lookup_record_single(provider, addr, found);
 }
 
+void ipmeta_provider_netacq_edge_memory_usage(ipmeta_provider_t *provider,
+                                              uint64_t *usage)
+{
+  ipmeta_provider_netacq_edge_state_t *state = STATE(provider);
+  ipmeta_polygon_table_t *table;
+  ipmeta_polygon_t *polygon;
+  int i, j;
+
+  if (state == NULL) {
+    return;
+  }
+
+  usage[IPMETA_MEM_OTHER] += sizeof(ipmeta_provider_netacq_edge_state_t);
+  usage[IPMETA_MEM_STRINGS] += IPMETA_STR_MEMORY(state->locations_file) +
+                               IPMETA_STR_MEMORY(state->blocks_file) +
+                               IPMETA_STR_MEMORY(state->region_file) +
+                               IPMETA_STR_MEMORY(state->country_file) +
+                               IPMETA_STR_MEMORY(state->na_to_polygon_file);
+  for (i = 0; i < state->polygon_files_cnt; i++) {
+    usage[IPMETA_MEM_STRINGS] += IPMETA_STR_MEMORY(state->polygon_files[i]);
+  }
+
+  /* region and country decode tables */
+  usage[IPMETA_MEM_POLYGONS] +=
+    state->regions_cnt * (sizeof(ipmeta_provider_netacq_edge_region_t *) +
+                          sizeof(ipmeta_provider_netacq_edge_region_t)) +
+    state->countries_cnt * (sizeof(ipmeta_provider_netacq_edge_country_t *) +
+                            sizeof(ipmeta_provider_netacq_edge_country_t));
+  for (i = 0; i < state->regions_cnt; i++) {
+    usage[IPMETA_MEM_STRINGS] += IPMETA_STR_MEMORY(state->regions[i]->name);
+  }
+  for (i = 0; i < state->countries_cnt; i++) {
+    usage[IPMETA_MEM_STRINGS] += IPMETA_STR_MEMORY(state->countries[i]->name);
+  }
+
+  /* polygon tables */
+  for (i = 0; i < state->polygon_tables_cnt; i++) {
+    table = state->polygon_tables[i];
+    usage[IPMETA_MEM_POLYGONS] +=
+      sizeof(ipmeta_polygon_table_t *) + sizeof(ipmeta_polygon_table_t) +
+      table->polygons_cnt *
+        (sizeof(ipmeta_polygon_t *) + sizeof(ipmeta_polygon_t));
+    usage[IPMETA_MEM_STRINGS] += IPMETA_STR_MEMORY(table->ascii_id);
+    for (j = 0; j < table->polygons_cnt; j++) {
+      polygon = table->polygons[j];
+      usage[IPMETA_MEM_STRINGS] += IPMETA_STR_MEMORY(polygon->name) +
+                                   IPMETA_STR_MEMORY(polygon->fqid) +
+                                   IPMETA_STR_MEMORY(polygon->usercode);
+    }
+  }
+
+  /* the temporary netacq to polygon mapping (normally free'd after init) */
+  usage[IPMETA_MEM_OTHER] +=
+    state->na_to_polygons_cnt * sizeof(na_to_polygon_t *);
+  for (i = 0; i < state->na_to_polygons_cnt; i++) {
+    if (state->na_to_polygons[i] != NULL) {
+      usage[IPMETA_MEM_OTHER] += sizeof(na_to_polygon_t);
+    }
+  }
+}
+
 int ipmeta_provider_netacq_edge_get_regions(
   ipmeta_provider_t *provider, ipmeta_provider_netacq_edge_region_t ***regions)
 {
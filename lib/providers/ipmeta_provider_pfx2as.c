@@ -52,6 +52,10 @@
 
 #define BUFFER_LEN 1024
 
+/** Maximum number of pfx2as files that can be given to one instance (e.g., a
+    CAIDA IPv4 file and the matching IPv6 file) */
+#define PFX2AS_FILES_MAX 8
+
 /** Initialize the map type (string keys, geo_record values */
 KHASH_MAP_INIT_STR(strrec, ipmeta_record_t *)
 
@@ -63,8 +67,11 @@ static ipmeta_provider_t ipmeta_provider_pfx2as = {
 typedef struct ipmeta_provider_pfx2as_state {
   /* info extracted from args */
 
-  /** The filename of the CAIDA pfx2as database to use */
-  char *pfx2as_file;
+  /** The filenames of the CAIDA pfx2as databases to use */
+  char *pfx2as_files[PFX2AS_FILES_MAX];
+
+  /** The number of files in pfx2as_files */
+  int pfx2as_files_cnt;
 
 } ipmeta_provider_pfx2as_state_t;
 
@@ -73,9 +80,14 @@ typedef struct ipmeta_provider_pfx2as_state {
 /** Print usage information to stderr */
 static void usage(ipmeta_provider_t *provider)
 {
-  fprintf(stderr, "provider usage: %s -f pfx2as-file\n", provider->name);
-
-  fprintf(stderr, "       -f            pfx2as file to use for lookups\n");
+  fprintf(stderr, "provider usage: %s -f pfx2as-file [-f pfx2as-file]\n",
+          provider->name);
+
+  fprintf(stderr,
+          "       -f            pfx2as file to use for lookups. files may\n"
+          "                     contain IPv4 and/or IPv6 prefixes, and -f\n"
+          "                     can be used up to %d times\n",
+          PFX2AS_FILES_MAX);
 }
 
 /** Parse the arguments given to the provider
@@ -105,7 +117,12 @@ static int parse_args(ipmeta_provider_t *provider, int argc, char **argv)
         "WARNING: -D option is no longer supported by individual providers.\n");
       break;
     case 'f':
-      state->pfx2as_file = strdup(optarg);
+      if (state->pfx2as_files_cnt == PFX2AS_FILES_MAX) {
+        fprintf(stderr, "ERROR: %s accepts at most %d files\n",
+                provider->name, PFX2AS_FILES_MAX);
+        return -1;
+      }
+      state->pfx2as_files[state->pfx2as_files_cnt++] = strdup(optarg);
       break;
 
     case '?':
@@ -116,7 +133,7 @@ static int parse_args(ipmeta_provider_t *provider, int argc, char **argv)
     }
   }
 
-  if (state->pfx2as_file == NULL) {
+  if (state->pfx2as_files_cnt == 0) {
     fprintf(stderr, "ERROR: %s requires '-f'\n", provider->name);
     usage(provider);
     return -1;
@@ -182,38 +199,50 @@ static inline void str_free(const char *str)
   free((char *)str);
 }
 
-/** Read the prefix2as file */
-static int read_pfx2as(ipmeta_provider_t *provider, io_t *file)
+/** Read a prefix2as file, which may hold IPv4 and/or IPv6 prefixes
+ *
+ * ASN strings are interned in asn_table (which is shared by all files given
+ * to this instance), so a v4 and a v6 prefix originated by the same AS map to
+ * the same record. asn_id is the id to give the next new record.
+ */
+static int read_pfx2as(ipmeta_provider_t *provider, io_t *file,
+                       khash_t(strrec) *asn_table, int *asn_id)
 {
-  /* we have to normalize the asns on the fly */
-  /* so we read the file, reading records into here */
   int khret;
   khiter_t khiter;
-  khash_t(strrec) *asn_table = kh_init(strrec);
 
   char buffer[BUFFER_LEN];
   char *rowp;
   char *tok = NULL;
   int tokc = 0;
 
-  int asn_id = 0;
   in_addr_t addr = 0;
-  uint8_t mask = 0;
+  struct in6_addr addr6;
+  int is_v6 = 0;
+  int mask = 0;
   uint32_t *asn = NULL;
   char *asn_str = NULL;
   int asn_cnt = 0;
 
   ipmeta_record_t *record;
 
-  while (wandio_fgets(file, &buffer, BUFFER_LEN, 1) > 0) {
+  while (ipmeta_provider_fgets_file(provider, file, buffer, BUFFER_LEN,
+                                    1) > 0) {
     rowp = buffer;
     tokc = 0;
 
     while ((tok = strsep(&rowp, "\t")) != NULL) {
       switch (tokc) {
       case 0:
-        /* network */
-        addr = inet_addr(tok);
+        /* network (v6 networks are told apart by their colons) */
+        if ((is_v6 = (strchr(tok, ':') != NULL)) != 0) {
+          if (inet_pton(AF_INET6, tok, &addr6) != 1) {
+            ipmeta_log(__func__, "invalid IPv6 network '%s'", tok);
+            return -1;
+          }
+        } else {
+          addr = inet_addr(tok);
+        }
         break;
 
       case 1:
@@ -240,6 +269,11 @@ static int read_pfx2as(ipmeta_provider_t *provider, io_t *file)
       return -1;
     }
 
+    if (mask < 0 || mask > (is_v6 ? 128 : 32)) {
+      ipmeta_log(__func__, "invalid prefix length %d", mask);
+      return -1;
+    }
+
     if (asn_cnt <= 0 || asn_str == NULL) {
       ipmeta_log(__func__, "could not parse asn string");
       return -1;
@@ -248,7 +282,8 @@ static int read_pfx2as(ipmeta_provider_t *provider, io_t *file)
     /* check our hash for this asn */
     if ((khiter = kh_get(strrec, asn_table, asn_str)) == kh_end(asn_table)) {
       /* need to create a record for this asn */
-      if ((record = ipmeta_provider_init_record(provider, asn_id)) == NULL) {
+      if ((record = ipmeta_provider_init_record(provider, *asn_id)) ==
+          NULL) {
         ipmeta_log(__func__, "could not alloc geo record");
         return -1;
       }
@@ -262,7 +297,7 @@ static int read_pfx2as(ipmeta_provider_t *provider, io_t *file)
       kh_value(asn_table, khiter) = record;
 
       /* move on to the next id */
-      asn_id++;
+      (*asn_id)++;
     } else {
       /* we've seen this ASN before, just use that! */
       record = kh_value(asn_table, khiter);
@@ -277,11 +312,24 @@ static int read_pfx2as(ipmeta_provider_t *provider, io_t *file)
 
     assert(record != NULL);
 
+    if (is_v6) {
+      /* asn_ip_cnt counts IPv4 addresses only (a single /64 would overflow
+         it), so v6 prefixes do not contribute to the 'biggest' ASes */
+      if (ipmeta_provider_associate_record6(provider, &addr6, mask, record) !=
+          0) {
+        ipmeta_log(__func__, "failed to associate IPv6 record (does the "
+                             "datastructure support IPv6?)");
+        return -1;
+      }
+      continue;
+    }
+
     /* how many IP addresses does this prefix cover ? */
     /* we will add this to the record and then use the total count for the asn
        to find the 'biggest' ASes */
     record->asn_ip_cnt +=
-      (ip_broadcast_addr(addr, mask) - ip_network_addr(addr, mask)) + 1;
+      (uint64_t)(ip_broadcast_addr(addr, mask) - ip_network_addr(addr, mask)) +
+      1;
 
     /* by here record is the right asn record, associate it with this pfx */
     if (ipmeta_provider_associate_record(provider, addr, mask, record) != 0) {
@@ -290,10 +338,6 @@ static int read_pfx2as(ipmeta_provider_t *provider, io_t *file)
     }
   }
 
-  /* free our asn_table hash */
-  kh_free(strrec, asn_table, str_free);
-  kh_destroy(strrec, asn_table);
-
   return 0;
 }
 
@@ -309,6 +353,10 @@ int ipmeta_provider_pfx2as_init(ipmeta_provider_t *provider, int argc,
 {
   ipmeta_provider_pfx2as_state_t *state;
   io_t *file = NULL;
+  /* we have to normalize the asns on the fly, across all files */
+  khash_t(strrec) *asn_table = NULL;
+  int asn_id = 0;
+  int i;
 
   /* allocate our state */
   if ((state = malloc_zero(sizeof(ipmeta_provider_pfx2as_state_t))) == NULL) {
@@ -322,23 +370,37 @@ int ipmeta_provider_pfx2as_init(ipmeta_provider_t *provider, int argc,
     return -1;
   }
 
-  assert(state->pfx2as_file != NULL);
+  assert(state->pfx2as_files_cnt > 0);
 
-  /* open the pfx2as file */
-  if ((file = wandio_create(state->pfx2as_file)) == NULL) {
-    ipmeta_log(__func__, "failed to open pfx2as file '%s'", state->pfx2as_file);
+  if ((asn_table = kh_init(strrec)) == NULL) {
+    ipmeta_log(__func__, "could not allocate asn table");
     return -1;
   }
 
-  /* populate the locations hash */
-  if (read_pfx2as(provider, file) != 0) {
-    ipmeta_log(__func__, "failed to parse pfx2as file");
-    goto err;
+  for (i = 0; i < state->pfx2as_files_cnt; i++) {
+    /* open the pfx2as file */
+    if ((file = ipmeta_provider_open_file(provider, state->pfx2as_files[i])) ==
+        NULL) {
+      ipmeta_log(__func__, "failed to open pfx2as file '%s'",
+                 state->pfx2as_files[i]);
+      goto err;
+    }
+
+    /* populate the asn table and the datastructure */
+    if (read_pfx2as(provider, file, asn_table, &asn_id) != 0) {
+      ipmeta_log(__func__, "failed to parse pfx2as file '%s'",
+                 state->pfx2as_files[i]);
+      goto err;
+    }
+
+    /* close the pfx2as file */
+    ipmeta_provider_close_file(provider, file);
+    file = NULL;
   }
 
-  /* close the locations file */
-  wandio_destroy(file);
-  file = NULL;
+  /* free our asn_table hash */
+  kh_free(strrec, asn_table, str_free);
+  kh_destroy(strrec, asn_table);
 
   /* ready to rock n roll */
 
@@ -346,8 +408,10 @@ int ipmeta_provider_pfx2as_init(ipmeta_provider_t *provider, int argc,
 
 err:
   if (file != NULL) {
-    wandio_destroy(file);
+    ipmeta_provider_close_file(provider, file);
   }
+  kh_free(strrec, asn_table, str_free);
+  kh_destroy(strrec, asn_table);
   usage(provider);
   return -1;
 }
@@ -355,11 +419,14 @@ err:
 void ipmeta_provider_pfx2as_free(ipmeta_provider_t *provider)
 {
   ipmeta_provider_pfx2as_state_t *state = STATE(provider);
+  int i;
+
   if (state != NULL) {
-    if (state->pfx2as_file != NULL) {
-      free(state->pfx2as_file);
-      state->pfx2as_file = NULL;
+    for (i = 0; i < state->pfx2as_files_cnt; i++) {
+      free(state->pfx2as_files[i]);
+      state->pfx2as_files[i] = NULL;
     }
+    state->pfx2as_files_cnt = 0;
 
     ipmeta_provider_free_state(provider);
   }
@@ -380,3 +447,19 @@ int ipmeta_provider_pfx2as_lookup_single(ipmeta_provider_t *provider,
   /* just call the lookup helper func in provider manager */
   return ipmeta_provider_lookup_record_single(provider, addr, found);
 }
+
+void ipmeta_provider_pfx2as_memory_usage(ipmeta_provider_t *provider,
+                                         uint64_t *usage)
+{
+  ipmeta_provider_pfx2as_state_t *state = STATE(provider);
+  int i;
+
+  if (state == NULL) {
+    return;
+  }
+
+  usage[IPMETA_MEM_OTHER] += sizeof(ipmeta_provider_pfx2as_state_t);
+  for (i = 0; i < state->pfx2as_files_cnt; i++) {
+    usage[IPMETA_MEM_STRINGS] += IPMETA_STR_MEMORY(state->pfx2as_files[i]);
+  }
+}
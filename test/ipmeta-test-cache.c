@@ -0,0 +1,140 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * libipmeta is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libipmeta is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libipmeta.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "ipmeta_test.h"
+
+/** @file
+ *
+ * @brief Check that the lookup cache is invalidated when providers change
+ *
+ * A cached result must be used until a provider is enabled, and must not be
+ * used after, while a provider that fails to load must leave the cache (and
+ * the providers used by lookups) as they were.
+ *
+ */
+
+/** The pfx2as files of the two providers */
+static const char *first_pfx2as = "10.0.0.0\t8\t100\n";
+static const char *second_pfx2as = "10.0.0.0\t16\t200\n";
+
+/** Look up 10.0.0.1, and check the number of records found, and the cache
+    hits and misses so far */
+static int check_lookup(ipmeta_t *ipmeta, ipmeta_record_set_t *found,
+                        int records_cnt, uint64_t hits, uint64_t misses)
+{
+  uint64_t cache_hits, cache_misses;
+
+  CHECK(ipmeta_lookup_single(ipmeta, htonl(0x0a000001), 0, found) ==
+        records_cnt);
+  CHECK(ipmeta_get_lookup_cache_stats(ipmeta, &cache_hits, &cache_misses) ==
+        0);
+  CHECK(cache_hits == hits);
+  CHECK(cache_misses == misses);
+  return 0;
+}
+
+/** Write a string to a new file */
+static int write_file(char *filename, const char *str)
+{
+  FILE *file;
+
+  CHECK(test_tmpfile(filename) == 0);
+  CHECK((file = fopen(filename, "w")) != NULL);
+  fputs(str, file);
+  fclose(file);
+  return 0;
+}
+
+static int check_cache(ipmeta_t *ipmeta, const char *filename)
+{
+  ipmeta_provider_t *pfx2as, *instance;
+  ipmeta_record_set_t *found;
+  char options[TEST_FILENAME_LEN + 4];
+  uint64_t hits, misses;
+
+  CHECK((found = ipmeta_record_set_init()) != NULL);
+  CHECK(ipmeta_get_lookup_cache_stats(ipmeta, &hits, &misses) == -1);
+  CHECK(ipmeta_set_lookup_cache(ipmeta, 64) == 0);
+
+  /* the second lookup of an address is a hit */
+  CHECK(check_lookup(ipmeta, found, 1, 0, 1) == 0);
+  CHECK(check_lookup(ipmeta, found, 1, 1, 1) == 0);
+
+  /* a provider that could not be loaded changes nothing */
+  pfx2as = ipmeta_get_provider_by_name(ipmeta, "pfx2as");
+  CHECK((instance = ipmeta_add_provider_instance(ipmeta, pfx2as, NULL)) !=
+        NULL);
+  CHECK(ipmeta_enable_provider(ipmeta, instance, "-f /nonexistent/pfx2as",
+                               IPMETA_PROVIDER_DEFAULT_NO) != 0);
+  CHECK(check_lookup(ipmeta, found, 1, 2, 1) == 0);
+
+  /* but once another provider is loaded, the cached result is stale */
+  snprintf(options, sizeof(options), "-f %s", filename);
+  CHECK((instance = ipmeta_add_provider_instance(ipmeta, pfx2as, NULL)) !=
+        NULL);
+  CHECK(ipmeta_enable_provider(ipmeta, instance, options,
+                               IPMETA_PROVIDER_DEFAULT_NO) == 0);
+  CHECK(check_lookup(ipmeta, found, 2, 2, 2) == 0);
+  CHECK(check_lookup(ipmeta, found, 2, 3, 2) == 0);
+
+  ipmeta_record_set_free(&found);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  ipmeta_t *ipmeta = NULL;
+  char first_file[TEST_FILENAME_LEN];
+  char second_file[TEST_FILENAME_LEN];
+  int rc = 1;
+
+  first_file[0] = second_file[0] = '\0';
+  if (write_file(first_file, first_pfx2as) != 0 ||
+      write_file(second_file, second_pfx2as) != 0 ||
+      (ipmeta = test_load_pfx2as(IPMETA_DS_PATRICIA, first_file, NULL)) ==
+        NULL ||
+      check_cache(ipmeta, second_file) != 0) {
+    goto out;
+  }
+
+  rc = 0;
+
+out:
+  if (ipmeta != NULL) {
+    ipmeta_free(ipmeta);
+  }
+  if (first_file[0] != '\0') {
+    unlink(first_file);
+  }
+  if (second_file[0] != '\0') {
+    unlink(second_file);
+  }
+  return rc;
+}
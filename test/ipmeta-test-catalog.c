@@ -0,0 +1,220 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * libipmeta is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libipmeta is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libipmeta.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "libipmeta_int.h"
+#include "ipmeta_test.h"
+
+/** @file
+ *
+ * @brief Check which snapshots a catalog keeps loaded
+ *
+ * Five days of pfx2as files are added to a catalog whose memory budget only
+ * fits three of their snapshots. The days are then looked up out of order,
+ * and the snapshots that are loaded after each lookup are compared with the
+ * ones that least-recently-used eviction (and prefetching of the next day)
+ * should keep.
+ *
+ */
+
+/** Time of the first snapshot (2020-01-01) */
+#define DAY1 1577836800
+
+/** Length of a day */
+#define DAY 86400
+
+/** Number of days in the catalog */
+#define DAY_CNT 5
+
+/** ASN of 10/8 on the given day */
+#define DAY_ASN(day) (100 + (day))
+
+/** Wait until the loader thread has no loads to perform, and check that the
+    snapshots that are loaded are exactly the days set in the given mask */
+static int check_loaded(ipmeta_catalog_t *catalog, unsigned int loaded)
+{
+  int i, busy;
+
+  pthread_mutex_lock(&catalog->lock);
+  do {
+    busy = catalog->demand >= 0 || catalog->prefetch >= 0;
+    for (i = 0; i < catalog->snapshots_cnt; i++) {
+      if (catalog->snapshots[i].state == IPMETA_CATALOG_LOADING) {
+        busy = 1;
+      }
+    }
+    if (busy != 0) {
+      pthread_cond_wait(&catalog->cond, &catalog->lock);
+    }
+  } while (busy != 0);
+
+  for (i = 0; i < catalog->snapshots_cnt; i++) {
+    if ((catalog->snapshots[i].state == IPMETA_CATALOG_LOADED) !=
+        ((loaded & (1 << i)) != 0)) {
+      fprintf(stderr, "day %d is %sloaded\n", i,
+              (loaded & (1 << i)) != 0 ? "not " : "");
+      pthread_mutex_unlock(&catalog->lock);
+      return -1;
+    }
+  }
+  busy = catalog->memory > catalog->memory_budget;
+  pthread_mutex_unlock(&catalog->lock);
+
+  CHECK(busy == 0);
+  return 0;
+}
+
+/** Look up 10.0.0.1 on the given day, and check the ASN it is mapped to */
+static int check_day(ipmeta_catalog_t *catalog, ipmeta_record_set_t *records,
+                     int day)
+{
+  ipmeta_record_t *rec;
+  uint32_t num_ips;
+
+  CHECK(ipmeta_catalog_lookup(catalog, htonl(0x0a000001), DAY1 + day * DAY,
+                              records) == 1);
+  CHECK((rec = ipmeta_record_set_next(records, &num_ips)) != NULL);
+  CHECK(rec->asn_cnt == 1 && rec->asn[0] == DAY_ASN(day));
+  return 0;
+}
+
+static int check_catalog(ipmeta_catalog_t *catalog,
+                         ipmeta_record_set_t *records)
+{
+  /* nothing is loaded until the catalog is used */
+  CHECK(check_loaded(catalog, 0x00) == 0);
+
+  /* no snapshot is valid before the first day */
+  CHECK(ipmeta_catalog_lookup(catalog, htonl(0x0a000001), DAY1 - 1,
+                              records) == 0);
+  CHECK(ipmeta_catalog_get(catalog, DAY1 - 1) == NULL);
+
+  /* each day that is used prefetches the next one */
+  CHECK(check_day(catalog, records, 0) == 0);
+  CHECK(check_loaded(catalog, 0x03) == 0);
+  CHECK(check_day(catalog, records, 1) == 0);
+  CHECK(check_loaded(catalog, 0x07) == 0);
+
+  /* prefetching day 3 evicts day 0, the least recently used */
+  CHECK(check_day(catalog, records, 2) == 0);
+  CHECK(check_loaded(catalog, 0x0e) == 0);
+
+  /* prefetching day 4 evicts day 1 */
+  CHECK(check_day(catalog, records, 3) == 0);
+  CHECK(check_loaded(catalog, 0x1c) == 0);
+
+  /* the last day stays valid forever, and there is nothing to prefetch */
+  CHECK(check_day(catalog, records, 4) == 0);
+  CHECK(ipmeta_catalog_lookup(catalog, htonl(0x0a000001),
+                              DAY1 + 365 * DAY, records) == 1);
+  CHECK(check_loaded(catalog, 0x1c) == 0);
+
+  /* loading day 0 again evicts day 2, and prefetching day 1 evicts day 3
+     (but never day 4, which is in use until day 0 is returned) */
+  CHECK(check_day(catalog, records, 0) == 0);
+  CHECK(check_loaded(catalog, 0x13) == 0);
+
+  /* a snapshot can not be added once the catalog is in use */
+  CHECK(ipmeta_catalog_add_file(catalog, "unused", DAY1 + 10 * DAY) != 0);
+
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  ipmeta_t *ipmeta = NULL;
+  ipmeta_catalog_t *catalog = NULL;
+  ipmeta_record_set_t *records = NULL;
+  ipmeta_memory_usage_t usage;
+  char filenames[DAY_CNT][TEST_FILENAME_LEN];
+  FILE *file;
+  int i;
+  int rc = 1;
+
+  for (i = 0; i < DAY_CNT; i++) {
+    filenames[i][0] = '\0';
+  }
+
+  for (i = 0; i < DAY_CNT; i++) {
+    if (test_tmpfile(filenames[i]) != 0 ||
+        (file = fopen(filenames[i], "w")) == NULL) {
+      goto out;
+    }
+    fprintf(file, "10.0.0.0\t8\t%d\n20.0.0.0\t8\t200\n", DAY_ASN(i));
+    fclose(file);
+  }
+
+  /* every day uses as much memory as the first one */
+  if ((ipmeta = test_load_pfx2as(IPMETA_DS_PATRICIA, filenames[0], NULL)) ==
+        NULL ||
+      ipmeta_get_memory_usage(ipmeta, &usage) != 0) {
+    goto out;
+  }
+
+  /* the budget fits three snapshots, but not four */
+  if ((catalog = ipmeta_catalog_init("pfx2as", "-f %s", IPMETA_DS_PATRICIA,
+                                     usage.total * 7 / 2)) == NULL ||
+      (records = ipmeta_record_set_init()) == NULL) {
+    goto out;
+  }
+  /* snapshots may be added in any order */
+  for (i = DAY_CNT - 1; i >= 0; i--) {
+    if (ipmeta_catalog_add_file(catalog, filenames[i], DAY1 + i * DAY) != 0) {
+      goto out;
+    }
+  }
+  if (ipmeta_catalog_add_file(catalog, filenames[0], DAY1) == 0) {
+    fprintf(stderr, "two snapshots are valid from the same time\n");
+    goto out;
+  }
+
+  if (check_catalog(catalog, records) != 0) {
+    goto out;
+  }
+
+  rc = 0;
+
+out:
+  if (records != NULL) {
+    ipmeta_record_set_free(&records);
+  }
+  if (catalog != NULL) {
+    ipmeta_catalog_free(catalog);
+  }
+  if (ipmeta != NULL) {
+    ipmeta_free(ipmeta);
+  }
+  for (i = 0; i < DAY_CNT; i++) {
+    if (filenames[i][0] != '\0') {
+      unlink(filenames[i]);
+    }
+  }
+  return rc;
+}
@@ -0,0 +1,325 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * libipmeta is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libipmeta is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libipmeta.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ipmeta_test.h"
+
+/** @file
+ *
+ * @brief Check that applying a diff reproduces the newer file
+ *
+ * A generated pfx2as file is changed (prefixes are removed, added, and given
+ * other ASNs, some of which are new), and the diff between the two files is
+ * applied to the older file loaded into each datastructure. Lookups must
+ * then give the same ASNs as the newer file loaded into patricia. The diff
+ * of two blocks files (whose ranges are split into prefixes) is also checked
+ * line by line.
+ *
+ */
+
+/** Number of prefixes in the older file */
+#define PFX_CNT 2000
+
+/** Number of distinct ASNs in the older file (the newer file also uses
+    ASN_NEW_CNT ASNs that the older one does not) */
+#define ASN_CNT 100
+#define ASN_NEW_CNT 20
+
+/** Number of random addresses to look up (in addition to the prefix
+    boundaries) */
+#define RANDOM_ADDR_CNT 5000
+
+/** The datastructures to apply the diff to */
+static const enum ipmeta_ds_id ds_ids[] = {
+  IPMETA_DS_PATRICIA,    IPMETA_DS_BIGARRAY,  IPMETA_DS_INTERVALTREE,
+  IPMETA_DS_TREEBITMAP, IPMETA_DS_CPATRICIA,
+};
+
+/** Older and newer blocks files, and the diff between them: the first range
+    is split in two (with a new location for the second half), the second
+    range is unchanged, and the third (quoted, as in MaxMind files) is
+    removed */
+static const char *old_blocks = "startIpNum,endIpNum,locId\n"
+                                "0,255,1\n"
+                                "256,511,2\n"
+                                "\"1024\",\"1279\",\"3\"\n";
+static const char *new_blocks = "startIpNum,endIpNum,locId\n"
+                                "0,127,1\n"
+                                "128,255,3\n"
+                                "256,511,2\n";
+static const char *blocks_diff = "-\t0.0.0.0\t24\t1\n"
+                                 "+\t0.0.0.0\t25\t1\n"
+                                 "+\t0.0.0.128\t25\t3\n"
+                                 "-\t0.0.4.0\t24\t3\n";
+
+/** Write a string to a new file */
+static int write_file(const char *filename, const char *str)
+{
+  FILE *file;
+
+  CHECK((file = fopen(filename, "w")) != NULL);
+  fputs(str, file);
+  fclose(file);
+  return 0;
+}
+
+/** Check that a file holds the given string */
+static int check_file(const char *filename, const char *str)
+{
+  char buf[1024];
+  FILE *file;
+  size_t len;
+
+  CHECK((file = fopen(filename, "r")) != NULL);
+  len = fread(buf, 1, sizeof(buf) - 1, file);
+  fclose(file);
+  buf[len] = '\0';
+  CHECK(strcmp(buf, str) == 0);
+  return 0;
+}
+
+/** Generate the newer file from the older one, and get the number of
+    operations of the diff between them */
+static int change_prefixes(const test_pfx_t *old_pfxs, test_pfx_t *new_pfxs,
+                           int *new_cnt)
+{
+  int i, cnt = 0, ops = 0;
+
+  for (i = 0; i < PFX_CNT; i++) {
+    switch (test_rand() % 10) {
+    case 0:
+      /* removed */
+      ops++;
+      continue;
+
+    case 1:
+      /* moved to another ASN (which may be a new one) */
+      new_pfxs[cnt] = old_pfxs[i];
+      snprintf(new_pfxs[cnt].asn, sizeof(new_pfxs[cnt].asn), "%u",
+               1 + test_rand() % (ASN_CNT + ASN_NEW_CNT));
+      ops += strcmp(new_pfxs[cnt].asn, old_pfxs[i].asn) != 0;
+      break;
+
+    default:
+      new_pfxs[cnt] = old_pfxs[i];
+      break;
+    }
+    cnt++;
+  }
+
+  /* and new prefixes, which may also be new ASNs */
+  while (cnt < PFX_CNT) {
+    test_gen_prefixes(&new_pfxs[cnt], 1, ASN_CNT + ASN_NEW_CNT);
+    if (test_has_prefix(old_pfxs, PFX_CNT, new_pfxs[cnt].addr,
+                        new_pfxs[cnt].mask) ||
+        test_has_prefix(new_pfxs, cnt, new_pfxs[cnt].addr,
+                        new_pfxs[cnt].mask)) {
+      continue;
+    }
+    cnt++;
+    ops++;
+  }
+
+  *new_cnt = cnt;
+  return ops;
+}
+
+/** Apply the diff to the older file loaded into a datastructure, and compare
+    it with the newer file loaded into patricia */
+static int check_apply(enum ipmeta_ds_id dstype, const char *old_file,
+                       const char *diff_file, int ops_cnt,
+                       ipmeta_t *reference, const uint32_t *addrs,
+                       int addrs_cnt)
+{
+  ipmeta_t *ipmeta;
+  ipmeta_provider_t *provider, *ref_provider;
+  ipmeta_record_t **records, **ref_records;
+  int records_cnt, ref_records_cnt;
+  int pid, i, j, rc = -1;
+
+  if ((ipmeta = test_load_pfx2as(dstype, old_file, &provider)) == NULL) {
+    return -1;
+  }
+  pid = ipmeta_get_provider_id(provider);
+
+  if (ipmeta_apply_diff(ipmeta, provider, diff_file) != ops_cnt) {
+    fprintf(stderr, "%s: could not apply the diff\n", test_ds_name(dstype));
+    goto out;
+  }
+
+  for (i = 0; i < addrs_cnt; i++) {
+    uint32_t addr = htonl(addrs[i]);
+
+    if (!test_same_asns(ipmeta_lookup_single_provider(ipmeta, addr, pid),
+                        ipmeta_lookup_single_provider(reference, addr,
+                                                      pid))) {
+      fprintf(stderr, "%s: %s differs after the diff\n", test_ds_name(dstype),
+              inet_ntoa(*(struct in_addr *)&addr));
+      goto out;
+    }
+  }
+
+  /* the ASN IP counts must follow the prefixes (records that are no longer
+     used are kept, with a count of 0) */
+  ref_provider = ipmeta_get_provider_by_id(reference, pid);
+  records_cnt = ipmeta_provider_get_all_records(provider, &records);
+  ref_records_cnt = ipmeta_provider_get_all_records(ref_provider, &ref_records);
+  for (i = 0; i < records_cnt; i++) {
+    for (j = 0; j < ref_records_cnt; j++) {
+      if (test_same_asns(records[i], ref_records[j])) {
+        break;
+      }
+    }
+    if ((j == ref_records_cnt && records[i]->asn_ip_cnt != 0) ||
+        (j < ref_records_cnt &&
+         records[i]->asn_ip_cnt != ref_records[j]->asn_ip_cnt)) {
+      fprintf(stderr, "%s: wrong ASN IP count after the diff\n",
+              test_ds_name(dstype));
+      goto out;
+    }
+  }
+
+  rc = 0;
+
+out:
+  ipmeta_free(ipmeta);
+  return rc;
+}
+
+/** Check the diff of the blocks files */
+static int check_blocks(const char *old_file, const char *new_file,
+                        const char *diff_file)
+{
+  CHECK(write_file(old_file, old_blocks) == 0);
+  CHECK(write_file(new_file, new_blocks) == 0);
+  CHECK(ipmeta_diff_files(IPMETA_PROVIDER_NETACQ_EDGE, old_file, new_file,
+                          diff_file) == 4);
+  CHECK(check_file(diff_file, blocks_diff) == 0);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  test_pfx_t *old_pfxs = NULL, *new_pfxs = NULL;
+  uint32_t *addrs = NULL;
+  ipmeta_t *reference = NULL;
+  char old_file[TEST_FILENAME_LEN];
+  char new_file[TEST_FILENAME_LEN];
+  char diff_file[TEST_FILENAME_LEN];
+  int new_cnt, ops_cnt;
+  int addrs_cnt = 0;
+  int i, rc = 1;
+
+  old_file[0] = new_file[0] = diff_file[0] = '\0';
+  if (test_tmpfile(old_file) != 0 || test_tmpfile(new_file) != 0 ||
+      test_tmpfile(diff_file) != 0) {
+    goto out;
+  }
+
+  if (check_blocks(old_file, new_file, diff_file) != 0) {
+    goto out;
+  }
+  fprintf(stderr, "blocks diff: ok\n");
+
+  if ((old_pfxs = malloc(sizeof(*old_pfxs) * PFX_CNT)) == NULL ||
+      (new_pfxs = malloc(sizeof(*new_pfxs) * PFX_CNT)) == NULL ||
+      (addrs = malloc(sizeof(*addrs) * (PFX_CNT * 8 + RANDOM_ADDR_CNT))) ==
+        NULL) {
+    goto out;
+  }
+  test_gen_prefixes(old_pfxs, PFX_CNT, ASN_CNT);
+  ops_cnt = change_prefixes(old_pfxs, new_pfxs, &new_cnt);
+  if (test_write_pfx2as(old_file, old_pfxs, PFX_CNT) != 0 ||
+      test_write_pfx2as(new_file, new_pfxs, new_cnt) != 0) {
+    goto out;
+  }
+
+  /* a file has no differences with itself */
+  if (ipmeta_diff_files(IPMETA_PROVIDER_PFX2AS, old_file, old_file,
+                        diff_file) != 0 ||
+      ipmeta_diff_files(IPMETA_PROVIDER_PFX2AS, old_file, new_file,
+                        diff_file) != ops_cnt) {
+    fprintf(stderr, "wrong number of diff operations\n");
+    goto out;
+  }
+
+  /* the boundaries of the prefixes of both files, and random addresses */
+  for (i = 0; i < PFX_CNT; i++) {
+    uint32_t last = old_pfxs[i].addr | ~(~0U << (32 - old_pfxs[i].mask));
+    addrs[addrs_cnt++] = old_pfxs[i].addr - 1;
+    addrs[addrs_cnt++] = old_pfxs[i].addr;
+    addrs[addrs_cnt++] = last;
+    addrs[addrs_cnt++] = last + 1;
+  }
+  for (i = 0; i < new_cnt; i++) {
+    uint32_t last = new_pfxs[i].addr | ~(~0U << (32 - new_pfxs[i].mask));
+    addrs[addrs_cnt++] = new_pfxs[i].addr - 1;
+    addrs[addrs_cnt++] = new_pfxs[i].addr;
+    addrs[addrs_cnt++] = last;
+    addrs[addrs_cnt++] = last + 1;
+  }
+  for (i = 0; i < RANDOM_ADDR_CNT; i++) {
+    addrs[addrs_cnt++] = test_rand_addr();
+  }
+
+  if ((reference = test_load_pfx2as(IPMETA_DS_PATRICIA, new_file, NULL)) ==
+      NULL) {
+    goto out;
+  }
+
+  for (i = 0; i < (int)(sizeof(ds_ids) / sizeof(ds_ids[0])); i++) {
+    if (check_apply(ds_ids[i], old_file, diff_file, ops_cnt, reference, addrs,
+                    addrs_cnt) != 0) {
+      goto out;
+    }
+    fprintf(stderr, "%s: ok\n", test_ds_name(ds_ids[i]));
+  }
+
+  rc = 0;
+
+out:
+  if (reference != NULL) {
+    ipmeta_free(reference);
+  }
+  if (old_file[0] != '\0') {
+    unlink(old_file);
+  }
+  if (new_file[0] != '\0') {
+    unlink(new_file);
+  }
+  if (diff_file[0] != '\0') {
+    unlink(diff_file);
+  }
+  free(old_pfxs);
+  free(new_pfxs);
+  free(addrs);
+  return rc;
+}
@@ -0,0 +1,268 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * libipmeta is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libipmeta is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libipmeta.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ipmeta_test.h"
+
+/** @file
+ *
+ * @brief Check that every datastructure gives the same answers as patricia
+ *
+ * A generated pfx2as file (with nested prefixes and MOAS prefixes) is loaded
+ * into each datastructure, and then the records of the first and last
+ * addresses of every prefix (and their neighbours), and of random addresses,
+ * are compared with the records that patricia returns for them.
+ *
+ */
+
+/** Number of prefixes in the generated file */
+#define PFX_CNT 2000
+
+/** Number of distinct ASNs in the generated file */
+#define ASN_CNT 200
+
+/** Number of random addresses to look up (in addition to the prefix
+    boundaries) */
+#define RANDOM_ADDR_CNT 5000
+
+/** Maximum number of records in the result of a single lookup (the interval
+    tree returns a record for each prefix that covers the address) */
+#define RECORDS_MAX 64
+
+/** The datastructures to compare with patricia */
+static const enum ipmeta_ds_id ds_ids[] = {
+  IPMETA_DS_BIGARRAY,
+  IPMETA_DS_INTERVALTREE,
+  IPMETA_DS_TREEBITMAP,
+  IPMETA_DS_CPATRICIA,
+};
+
+/** Order addresses numerically */
+static int addr_cmp(const void *a, const void *b)
+{
+  uint32_t aa = *(const uint32_t *)a;
+  uint32_t bb = *(const uint32_t *)b;
+
+  return (aa > bb) - (aa < bb);
+}
+
+/** Check that two records are the same record of the same file */
+static int same_record(const ipmeta_record_t *a, const ipmeta_record_t *b)
+{
+  if (a == NULL || b == NULL) {
+    return a == b;
+  }
+  /* the same file gives the same ids in every instance */
+  return a->id == b->id && test_same_asns(a, b);
+}
+
+/** Get the records of a record set (at most RECORDS_MAX of them) */
+static int get_records(ipmeta_record_set_t *set, ipmeta_record_t **records)
+{
+  int cnt = 0;
+
+  ipmeta_record_set_rewind(set);
+  while (cnt < RECORDS_MAX &&
+         (records[cnt] = ipmeta_record_set_next(set, NULL)) != NULL) {
+    cnt++;
+  }
+  return cnt;
+}
+
+/** Count the copies of the given record in an array of records */
+static int count_record(ipmeta_record_t **records, int cnt,
+                        const ipmeta_record_t *record)
+{
+  int i, n = 0;
+
+  for (i = 0; i < cnt; i++) {
+    n += same_record(records[i], record);
+  }
+  return n;
+}
+
+/** Check that two record sets have the same records (in any order, but with
+    as many copies of each) */
+static int same_record_set(ipmeta_record_set_t *a, ipmeta_record_set_t *b)
+{
+  ipmeta_record_t *ra[RECORDS_MAX], *rb[RECORDS_MAX];
+  int na = get_records(a, ra);
+  int nb = get_records(b, rb);
+  int i;
+
+  CHECK(na < RECORDS_MAX && na == nb);
+  for (i = 0; i < na; i++) {
+    CHECK(count_record(ra, na, ra[i]) == count_record(rb, nb, ra[i]));
+  }
+  return 0;
+}
+
+/** Compare the answers of a datastructure for the given addresses (host byte
+    order, sorted) with patricia's */
+static int compare_ds(enum ipmeta_ds_id dstype, const char *filename,
+                      ipmeta_t *reference, const uint32_t *addrs,
+                      int addrs_cnt)
+{
+  ipmeta_t *ipmeta;
+  ipmeta_provider_t *provider;
+  ipmeta_record_set_t *expected = NULL, *single = NULL, *found = NULL;
+  ipmeta_sorted_stream_t *stream = NULL;
+  ipmeta_record_t *record;
+  uint32_t first, last;
+  int pid, i, rc = -1;
+
+  if ((ipmeta = test_load_pfx2as(dstype, filename, &provider)) == NULL) {
+    return -1;
+  }
+  pid = ipmeta_get_provider_id(provider);
+
+  if ((expected = ipmeta_record_set_init()) == NULL ||
+      (single = ipmeta_record_set_init()) == NULL ||
+      (found = ipmeta_record_set_init()) == NULL ||
+      (stream = ipmeta_sorted_stream_init(ipmeta, 0)) == NULL) {
+    goto out;
+  }
+
+  for (i = 0; i < addrs_cnt; i++) {
+    uint32_t addr = htonl(addrs[i]);
+
+    record = ipmeta_lookup_single_provider(reference, addr, pid);
+    if (!same_record(ipmeta_lookup_single_provider(ipmeta, addr, pid),
+                     record)) {
+      fprintf(stderr, "%s: single provider lookup of %s differs\n",
+              test_ds_name(dstype), inet_ntoa(*(struct in_addr *)&addr));
+      goto out;
+    }
+
+    /* the interval tree returns every prefix that covers the address, rather
+       than only the most specific one */
+    if (ipmeta_lookup_single(ipmeta, addr, 0, single) < 0 ||
+        (dstype != IPMETA_DS_INTERVALTREE &&
+         (ipmeta_lookup_single(reference, addr, 0, expected) < 0 ||
+          same_record_set(expected, single) != 0))) {
+      fprintf(stderr, "%s: single lookup of %s differs\n",
+              test_ds_name(dstype), inet_ntoa(*(struct in_addr *)&addr));
+      goto out;
+    }
+
+    /* every address of the range must have the records of the address */
+    if (ipmeta_lookup_single_range(ipmeta, addr, 0, found, &first, &last) <
+          0 ||
+        same_record_set(single, found) != 0 || first > addrs[i] ||
+        last < addrs[i] ||
+        ipmeta_lookup_single(ipmeta, htonl(first), 0, found) < 0 ||
+        same_record_set(single, found) != 0 ||
+        ipmeta_lookup_single(ipmeta, htonl(last), 0, found) < 0 ||
+        same_record_set(single, found) != 0) {
+      fprintf(stderr, "%s: range lookup of %s is wrong\n",
+              test_ds_name(dstype), inet_ntoa(*(struct in_addr *)&addr));
+      goto out;
+    }
+
+    if (ipmeta_lookup_sorted_stream(stream, addr, found) < 0 ||
+        same_record_set(single, found) != 0) {
+      fprintf(stderr, "%s: sorted stream lookup of %s differs\n",
+              test_ds_name(dstype), inet_ntoa(*(struct in_addr *)&addr));
+      goto out;
+    }
+  }
+
+  rc = 0;
+
+out:
+  ipmeta_sorted_stream_free(stream);
+  ipmeta_record_set_free(&expected);
+  ipmeta_record_set_free(&single);
+  ipmeta_record_set_free(&found);
+  ipmeta_free(ipmeta);
+  return rc;
+}
+
+int main(int argc, char **argv)
+{
+  test_pfx_t *pfxs = NULL;
+  uint32_t *addrs = NULL;
+  ipmeta_t *reference = NULL;
+  char filename[TEST_FILENAME_LEN];
+  int addrs_cnt = 0;
+  int i, rc = 1;
+
+  filename[0] = '\0';
+  if ((pfxs = malloc(sizeof(*pfxs) * PFX_CNT)) == NULL ||
+      (addrs = malloc(sizeof(*addrs) * (PFX_CNT * 4 + RANDOM_ADDR_CNT))) ==
+        NULL) {
+    goto out;
+  }
+
+  test_gen_prefixes(pfxs, PFX_CNT, ASN_CNT);
+  if (test_tmpfile(filename) != 0 ||
+      test_write_pfx2as(filename, pfxs, PFX_CNT) != 0) {
+    goto out;
+  }
+
+  /* the boundaries of every prefix, and random addresses */
+  for (i = 0; i < PFX_CNT; i++) {
+    uint32_t last = pfxs[i].addr | ~(~0U << (32 - pfxs[i].mask));
+    addrs[addrs_cnt++] = pfxs[i].addr - 1;
+    addrs[addrs_cnt++] = pfxs[i].addr;
+    addrs[addrs_cnt++] = last;
+    addrs[addrs_cnt++] = last + 1;
+  }
+  for (i = 0; i < RANDOM_ADDR_CNT; i++) {
+    addrs[addrs_cnt++] = test_rand_addr();
+  }
+  qsort(addrs, addrs_cnt, sizeof(*addrs), addr_cmp);
+
+  if ((reference = test_load_pfx2as(IPMETA_DS_PATRICIA, filename, NULL)) ==
+      NULL) {
+    goto out;
+  }
+
+  for (i = 0; i < (int)(sizeof(ds_ids) / sizeof(ds_ids[0])); i++) {
+    if (compare_ds(ds_ids[i], filename, reference, addrs, addrs_cnt) != 0) {
+      goto out;
+    }
+    fprintf(stderr, "%s: ok\n", test_ds_name(ds_ids[i]));
+  }
+
+  rc = 0;
+
+out:
+  if (reference != NULL) {
+    ipmeta_free(reference);
+  }
+  if (filename[0] != '\0') {
+    unlink(filename);
+  }
+  free(pfxs);
+  free(addrs);
+  return rc;
+}
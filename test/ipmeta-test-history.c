@@ -0,0 +1,195 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * libipmeta is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libipmeta is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libipmeta.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "ipmeta_test.h"
+
+/** @file
+ *
+ * @brief Check the history of addresses over dated snapshots
+ *
+ * Three days of pfx2as files are loaded as snapshots, and the history of
+ * addresses inside, outside and at the edges of their prefixes is compared
+ * with the changes that were made from one day to the next.
+ *
+ */
+
+/** Time of the first snapshot (2020-01-01) */
+#define DAY1 1577836800
+
+/** Length of a day */
+#define DAY 86400
+
+/** The pfx2as files of the three days. On the second day, 10.2/16 moves to
+    another ASN and 30/8 appears. On the third day, 30/8 is gone, and the
+    records are listed in another order, so that their ids change (which is
+    not a change of their contents) */
+static const char *days[] = {
+  "10.0.0.0\t8\t100\n"
+  "10.2.0.0\t16\t300\n",
+
+  "10.0.0.0\t8\t100\n"
+  "10.2.0.0\t16\t301\n"
+  "30.0.0.0\t8\t500\n",
+
+  "10.2.0.0\t16\t301\n"
+  "10.0.0.0\t8\t100\n",
+};
+
+#define DAY_CNT (sizeof(days) / sizeof(days[0]))
+
+/** An entry of the expected history of an address */
+typedef struct expected_entry {
+  time_t from;
+  time_t until;
+  uint32_t asn;
+} expected_entry_t;
+
+/** Check the history of an address (as a string) */
+static int check_address(ipmeta_history_t *history, const char *addr_str,
+                         const expected_entry_t *expected, int expected_cnt)
+{
+  const ipmeta_history_entry_t *entries;
+  struct in_addr addr;
+  int i;
+
+  inet_pton(AF_INET, addr_str, &addr);
+  if (ipmeta_history_lookup(history, addr.s_addr, &entries) != expected_cnt) {
+    fprintf(stderr, "wrong number of changes for %s\n", addr_str);
+    return -1;
+  }
+  for (i = 0; i < expected_cnt; i++) {
+    CHECK(entries[i].from == expected[i].from);
+    CHECK(entries[i].until == expected[i].until);
+    CHECK(entries[i].record->asn[0] == expected[i].asn);
+  }
+  return 0;
+}
+
+static int check_history(ipmeta_history_t *history)
+{
+  const expected_entry_t in_10_8[] = {{DAY1, 0, 100}};
+  const expected_entry_t in_10_2_16[] = {{DAY1, DAY1 + DAY, 300},
+                                         {DAY1 + DAY, 0, 301}};
+  const expected_entry_t in_30_8[] = {{DAY1 + DAY, DAY1 + 2 * DAY, 500}};
+
+  /* the ids of the records change on the third day, but not their
+     contents */
+  CHECK(check_address(history, "10.0.0.0", in_10_8, 1) == 0);
+  CHECK(check_address(history, "10.1.255.255", in_10_8, 1) == 0);
+  CHECK(check_address(history, "10.3.0.0", in_10_8, 1) == 0);
+  CHECK(check_address(history, "10.255.255.255", in_10_8, 1) == 0);
+
+  CHECK(check_address(history, "10.2.0.0", in_10_2_16, 2) == 0);
+  CHECK(check_address(history, "10.2.128.1", in_10_2_16, 2) == 0);
+  CHECK(check_address(history, "10.2.255.255", in_10_2_16, 2) == 0);
+
+  CHECK(check_address(history, "30.0.0.0", in_30_8, 1) == 0);
+  CHECK(check_address(history, "30.255.255.255", in_30_8, 1) == 0);
+
+  /* addresses that no snapshot covers have no history */
+  CHECK(check_address(history, "0.0.0.0", NULL, 0) == 0);
+  CHECK(check_address(history, "9.255.255.255", NULL, 0) == 0);
+  CHECK(check_address(history, "11.0.0.0", NULL, 0) == 0);
+  CHECK(check_address(history, "31.0.0.0", NULL, 0) == 0);
+  CHECK(check_address(history, "255.255.255.255", NULL, 0) == 0);
+
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  ipmeta_t *ipmeta = NULL;
+  ipmeta_history_t *history = NULL;
+  const ipmeta_history_entry_t *entries;
+  char filenames[DAY_CNT][TEST_FILENAME_LEN];
+  FILE *file;
+  unsigned int i;
+  int rc = 1;
+
+  for (i = 0; i < DAY_CNT; i++) {
+    filenames[i][0] = '\0';
+  }
+
+  if ((ipmeta = ipmeta_init(IPMETA_DS_PATRICIA)) == NULL) {
+    goto out;
+  }
+  for (i = 0; i < DAY_CNT; i++) {
+    if (test_tmpfile(filenames[i]) != 0 ||
+        (file = fopen(filenames[i], "w")) == NULL) {
+      goto out;
+    }
+    fputs(days[i], file);
+    fclose(file);
+    /* the last day is loaded once the history has been checked */
+    if (i < DAY_CNT - 1 &&
+        test_load_snapshot(ipmeta, filenames[i], DAY1 + i * DAY) == NULL) {
+      goto out;
+    }
+  }
+
+  /* snapshots of another type do not make a history */
+  if (ipmeta_history_init(ipmeta, IPMETA_PROVIDER_MAXMIND) != NULL) {
+    fprintf(stderr, "history of a type without snapshots\n");
+    goto out;
+  }
+
+  /* a history is stale once another snapshot is enabled */
+  if ((history = ipmeta_history_init(ipmeta, IPMETA_PROVIDER_PFX2AS)) ==
+        NULL ||
+      test_load_snapshot(ipmeta, filenames[DAY_CNT - 1],
+                         DAY1 + (DAY_CNT - 1) * DAY) == NULL ||
+      ipmeta_history_lookup(history, htonl(0x0a000001), &entries) != -1) {
+    fprintf(stderr, "history is not stale after a snapshot was added\n");
+    goto out;
+  }
+  ipmeta_history_free(history);
+
+  if ((history = ipmeta_history_init(ipmeta, IPMETA_PROVIDER_PFX2AS)) ==
+        NULL ||
+      check_history(history) != 0) {
+    goto out;
+  }
+
+  rc = 0;
+
+out:
+  if (history != NULL) {
+    ipmeta_history_free(history);
+  }
+  if (ipmeta != NULL) {
+    ipmeta_free(ipmeta);
+  }
+  for (i = 0; i < DAY_CNT; i++) {
+    if (filenames[i][0] != '\0') {
+      unlink(filenames[i]);
+    }
+  }
+  return rc;
+}
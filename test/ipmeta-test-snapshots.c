@@ -0,0 +1,201 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * libipmeta is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libipmeta is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libipmeta.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "ipmeta_test.h"
+
+/** @file
+ *
+ * @brief Check lookups in dated snapshots, and the records they share
+ *
+ * Three days of pfx2as files are loaded as snapshots. A snapshot must share
+ * the records of the previous one whose ids and contents did not change
+ * (even if their ASN IP counts did), and only those.
+ *
+ */
+
+/** Time of the first snapshot (2020-01-01) */
+#define DAY1 1577836800
+
+/** Length of a day */
+#define DAY 86400
+
+/** The pfx2as files of the three days. On the second day, 10.2/16 moves to
+    another ASN and AS100 gets another prefix. On the third day, the records
+    are the same, but AS400 comes first, and so gets another id */
+static const char *days[] = {
+  "10.0.0.0\t8\t100\n"
+  "10.1.0.0\t16\t200\n"
+  "10.2.0.0\t16\t300\n"
+  "20.0.0.0\t8\t400\n",
+
+  "10.0.0.0\t8\t100\n"
+  "10.1.0.0\t16\t200\n"
+  "10.2.0.0\t16\t301\n"
+  "20.0.0.0\t8\t400\n"
+  "30.0.0.0\t8\t100\n",
+
+  "20.0.0.0\t8\t400\n"
+  "10.0.0.0\t8\t100\n"
+  "10.1.0.0\t16\t200\n",
+};
+
+#define DAY_CNT (sizeof(days) / sizeof(days[0]))
+
+/** Get the record of a snapshot for the given address (as a string) */
+static ipmeta_record_t *lookup(ipmeta_t *ipmeta, ipmeta_provider_t *snapshot,
+                               const char *addr_str)
+{
+  struct in_addr addr;
+
+  inet_pton(AF_INET, addr_str, &addr);
+  return ipmeta_lookup_single_provider(ipmeta, addr.s_addr,
+                                       ipmeta_get_provider_id(snapshot));
+}
+
+/** Get the first ASN of the record that was valid for the given address (as
+    a string) at the given time (0 if there was none), and the provider it
+    was found for */
+static uint32_t lookup_at(ipmeta_t *ipmeta, ipmeta_record_set_t *found,
+                          const char *addr_str, time_t timestamp,
+                          uint32_t *provider_id)
+{
+  struct in_addr addr;
+  ipmeta_record_t *record;
+
+  inet_pton(AF_INET, addr_str, &addr);
+  if (ipmeta_lookup_at(ipmeta, addr.s_addr, timestamp, 0, found) != 1) {
+    return 0;
+  }
+  ipmeta_record_set_rewind(found);
+  record = ipmeta_record_set_next_provider(found, NULL, provider_id);
+  return record->asn[0];
+}
+
+static int check_snapshots(ipmeta_t *ipmeta, ipmeta_provider_t **snaps)
+{
+  ipmeta_record_set_t *found;
+  ipmeta_record_t *rec;
+  uint32_t provider_id;
+
+  CHECK((found = ipmeta_record_set_init()) != NULL);
+
+  /* each lookup uses the snapshot that was valid at the time */
+  CHECK(lookup_at(ipmeta, found, "10.2.0.1", DAY1 - 1, &provider_id) == 0);
+  CHECK(lookup_at(ipmeta, found, "10.2.0.1", DAY1, &provider_id) == 300);
+  CHECK(lookup_at(ipmeta, found, "10.2.0.1", DAY1 + DAY - 1, &provider_id) ==
+        300);
+  CHECK(lookup_at(ipmeta, found, "10.2.0.1", DAY1 + DAY, &provider_id) ==
+        301);
+  CHECK(lookup_at(ipmeta, found, "10.2.0.1", DAY1 + 2 * DAY, &provider_id) ==
+        100);
+  CHECK(lookup_at(ipmeta, found, "30.0.0.1", DAY1, &provider_id) == 0);
+  CHECK(lookup_at(ipmeta, found, "30.0.0.1", DAY1 + DAY, &provider_id) ==
+        100);
+
+  /* a shared record is reported for the snapshot it was found in */
+  CHECK(lookup_at(ipmeta, found, "20.0.0.1", DAY1 + DAY, &provider_id) ==
+        400);
+  CHECK(provider_id == (uint32_t)ipmeta_get_provider_id(snaps[1]));
+
+  /* records whose id and contents did not change are shared, even if their
+     ASN IP counts did */
+  CHECK((rec = lookup(ipmeta, snaps[0], "20.0.0.1")) != NULL);
+  CHECK(lookup(ipmeta, snaps[1], "20.0.0.1") == rec);
+  CHECK(lookup(ipmeta, snaps[1], "10.1.0.1") ==
+        lookup(ipmeta, snaps[0], "10.1.0.1"));
+  CHECK((rec = lookup(ipmeta, snaps[0], "10.0.0.1")) != NULL);
+  CHECK(lookup(ipmeta, snaps[1], "10.0.0.1") == rec);
+  CHECK(ipmeta_get_asn_ip_cnt(snaps[0], rec) == 1 << 24);
+  CHECK(ipmeta_get_asn_ip_cnt(snaps[1], rec) == 2 << 24);
+
+  /* records whose contents changed are not */
+  CHECK(lookup(ipmeta, snaps[1], "10.2.0.1") !=
+        lookup(ipmeta, snaps[0], "10.2.0.1"));
+
+  /* and neither are records whose ids changed, as the ids of a snapshot
+     must not change */
+  CHECK((rec = lookup(ipmeta, snaps[2], "20.0.0.1")) != NULL);
+  CHECK(rec != lookup(ipmeta, snaps[1], "20.0.0.1"));
+  CHECK(test_same_asns(rec, lookup(ipmeta, snaps[1], "20.0.0.1")));
+  CHECK(rec->id != lookup(ipmeta, snaps[1], "20.0.0.1")->id);
+  CHECK(lookup(ipmeta, snaps[2], "10.0.0.1")->id !=
+        lookup(ipmeta, snaps[1], "10.0.0.1")->id);
+  CHECK(ipmeta_get_asn_ip_cnt(snaps[2], rec) == 1 << 24);
+
+  ipmeta_record_set_free(&found);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  ipmeta_t *ipmeta = NULL;
+  ipmeta_provider_t *snaps[DAY_CNT];
+  char filenames[DAY_CNT][TEST_FILENAME_LEN];
+  FILE *file;
+  unsigned int i;
+  int rc = 1;
+
+  for (i = 0; i < DAY_CNT; i++) {
+    filenames[i][0] = '\0';
+  }
+
+  if ((ipmeta = ipmeta_init(IPMETA_DS_PATRICIA)) == NULL) {
+    goto out;
+  }
+  for (i = 0; i < DAY_CNT; i++) {
+    if (test_tmpfile(filenames[i]) != 0 ||
+        (file = fopen(filenames[i], "w")) == NULL) {
+      goto out;
+    }
+    fputs(days[i], file);
+    fclose(file);
+    if ((snaps[i] = test_load_snapshot(ipmeta, filenames[i],
+                                       DAY1 + i * DAY)) == NULL) {
+      goto out;
+    }
+  }
+
+  if (check_snapshots(ipmeta, snaps) != 0) {
+    goto out;
+  }
+
+  rc = 0;
+
+out:
+  if (ipmeta != NULL) {
+    ipmeta_free(ipmeta);
+  }
+  for (i = 0; i < DAY_CNT; i++) {
+    if (filenames[i][0] != '\0') {
+      unlink(filenames[i]);
+    }
+  }
+  return rc;
+}
@@ -0,0 +1,207 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * libipmeta is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libipmeta is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libipmeta.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ipmeta_test.h"
+
+/** Shortest generated prefix (longer prefixes keep the tables of the big
+    array datastructure small) */
+#define MASK_MIN 14
+
+/** The blocks (of MASK_MIN bits) that most generated prefixes fall in, so
+    that they overlap */
+static const uint32_t clusters[] = {0x0a000000, 0x2c400000, 0xac100000,
+                                    0xc8800000};
+
+/** State of the pseudo-random sequence */
+static uint32_t rand_state = 2463534242U;
+
+uint32_t test_rand(void)
+{
+  /* xorshift32, so that every run (and platform) tests the same data */
+  rand_state ^= rand_state << 13;
+  rand_state ^= rand_state >> 17;
+  rand_state ^= rand_state << 5;
+  return rand_state;
+}
+
+uint32_t test_rand_addr(void)
+{
+  /* one in eight addresses is anywhere in the address space */
+  if (test_rand() % 8 == 0) {
+    return test_rand();
+  }
+  return clusters[test_rand() % 4] | (test_rand() >> MASK_MIN);
+}
+
+int test_tmpfile(char *filename)
+{
+  int fd;
+
+  strcpy(filename, "ipmeta-test-XXXXXX");
+  if ((fd = mkstemp(filename)) < 0) {
+    fprintf(stderr, "could not create a file in the current directory\n");
+    return -1;
+  }
+  close(fd);
+  return 0;
+}
+
+void test_gen_prefixes(test_pfx_t *pfxs, int cnt, int asn_cnt)
+{
+  uint32_t addr;
+  uint8_t mask;
+  int i = 0;
+
+  while (i < cnt) {
+    addr = test_rand_addr();
+    mask = MASK_MIN + test_rand() % (33 - MASK_MIN);
+    addr &= ~0U << (32 - mask);
+    if (test_has_prefix(pfxs, i, addr, mask)) {
+      continue;
+    }
+    pfxs[i].addr = addr;
+    pfxs[i].mask = mask;
+    if (test_rand() % 10 == 0) {
+      snprintf(pfxs[i].asn, sizeof(pfxs[i].asn), "%u_%u",
+               1 + test_rand() % asn_cnt, 1 + test_rand() % asn_cnt);
+    } else {
+      snprintf(pfxs[i].asn, sizeof(pfxs[i].asn), "%u",
+               1 + test_rand() % asn_cnt);
+    }
+    i++;
+  }
+}
+
+int test_has_prefix(const test_pfx_t *pfxs, int cnt, uint32_t addr,
+                    uint8_t mask)
+{
+  int i;
+
+  for (i = 0; i < cnt; i++) {
+    if (pfxs[i].addr == addr && pfxs[i].mask == mask) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int test_write_pfx2as(const char *filename, const test_pfx_t *pfxs, int cnt)
+{
+  FILE *file;
+  int i;
+
+  if ((file = fopen(filename, "w")) == NULL) {
+    fprintf(stderr, "could not open %s\n", filename);
+    return -1;
+  }
+  for (i = 0; i < cnt; i++) {
+    fprintf(file, "%u.%u.%u.%u\t%u\t%s\n", pfxs[i].addr >> 24,
+            (pfxs[i].addr >> 16) & 0xff, (pfxs[i].addr >> 8) & 0xff,
+            pfxs[i].addr & 0xff, pfxs[i].mask, pfxs[i].asn);
+  }
+  fclose(file);
+  return 0;
+}
+
+ipmeta_t *test_load_pfx2as(enum ipmeta_ds_id dstype, const char *filename,
+                           ipmeta_provider_t **provider)
+{
+  ipmeta_t *ipmeta;
+  ipmeta_provider_t *pfx2as;
+  char options[TEST_FILENAME_LEN + 4];
+
+  if ((ipmeta = ipmeta_init(dstype)) == NULL) {
+    fprintf(stderr, "could not create an ipmeta instance (%s)\n",
+            test_ds_name(dstype));
+    return NULL;
+  }
+
+  pfx2as = ipmeta_get_provider_by_name(ipmeta, "pfx2as");
+  snprintf(options, sizeof(options), "-f %s", filename);
+  if (pfx2as == NULL ||
+      ipmeta_enable_provider(ipmeta, pfx2as, options,
+                             IPMETA_PROVIDER_DEFAULT_YES) != 0) {
+    fprintf(stderr, "could not load %s (%s)\n", filename,
+            test_ds_name(dstype));
+    ipmeta_free(ipmeta);
+    return NULL;
+  }
+
+  if (provider != NULL) {
+    *provider = pfx2as;
+  }
+  return ipmeta;
+}
+
+ipmeta_provider_t *test_load_snapshot(ipmeta_t *ipmeta, const char *filename,
+                                      time_t valid_from)
+{
+  ipmeta_provider_t *snapshot;
+  char options[TEST_FILENAME_LEN + 4];
+
+  snprintf(options, sizeof(options), "-f %s", filename);
+  if ((snapshot = ipmeta_add_provider_instance(
+         ipmeta, ipmeta_get_provider_by_name(ipmeta, "pfx2as"), NULL)) ==
+        NULL ||
+      ipmeta_set_snapshot_time(snapshot, valid_from) != 0 ||
+      ipmeta_enable_provider(ipmeta, snapshot, options,
+                             IPMETA_PROVIDER_DEFAULT_NO) != 0) {
+    fprintf(stderr, "could not load %s as a snapshot\n", filename);
+    return NULL;
+  }
+  return snapshot;
+}
+
+int test_same_asns(const ipmeta_record_t *a, const ipmeta_record_t *b)
+{
+  if (a == NULL || b == NULL) {
+    return a == b;
+  }
+  return a->asn_cnt == b->asn_cnt &&
+         memcmp(a->asn, b->asn, sizeof(*a->asn) * a->asn_cnt) == 0;
+}
+
+const char *test_ds_name(enum ipmeta_ds_id dstype)
+{
+  switch (dstype) {
+  case IPMETA_DS_PATRICIA:
+    return "patricia";
+  case IPMETA_DS_BIGARRAY:
+    return "bigarray";
+  case IPMETA_DS_INTERVALTREE:
+    return "intervaltree";
+  case IPMETA_DS_TREEBITMAP:
+    return "treebitmap";
+  case IPMETA_DS_CPATRICIA:
+    return "cpatricia";
+  }
+  return "unknown";
+}
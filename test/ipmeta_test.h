@@ -0,0 +1,132 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * libipmeta is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libipmeta is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libipmeta.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __IPMETA_TEST_H
+#define __IPMETA_TEST_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "libipmeta.h"
+
+/** @file
+ *
+ * @brief Helpers shared by the libipmeta tests
+ *
+ * Each test is a program that exits with 0 if all of its checks pass, and 1
+ * otherwise. Tests generate their input files in the current directory, and
+ * remove them before exiting.
+ *
+ */
+
+/** Fail the enclosing function (which must return an int) if the given
+ * condition does not hold */
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__,         \
+              #cond);                                                          \
+      return -1;                                                               \
+    }                                                                          \
+  } while (0)
+
+/** Maximum length of a filename created by test_tmpfile */
+#define TEST_FILENAME_LEN 64
+
+/** A prefix of a generated pfx2as file */
+typedef struct test_pfx {
+  /** Network address (host byte order) */
+  uint32_t addr;
+
+  /** Prefix length */
+  uint8_t mask;
+
+  /** ASN string (e.g. "100", or "100_200" for a MOAS prefix) */
+  char asn[32];
+} test_pfx_t;
+
+/** Get the next number of the (deterministic) pseudo-random sequence */
+uint32_t test_rand(void);
+
+/** Get a random address (host byte order), which is usually in one of the
+ * blocks that most generated prefixes fall in */
+uint32_t test_rand_addr(void);
+
+/** Create an empty file with a unique name in the current directory
+ *
+ * @param[out] filename Set to the name of the file (at least
+ *                      TEST_FILENAME_LEN bytes)
+ * @return 0 if the file was created, -1 otherwise
+ */
+int test_tmpfile(char *filename);
+
+/** Generate random, distinct IPv4 prefixes, many of which are nested
+ *
+ * @param[out] pfxs     Array to fill with the prefixes
+ * @param cnt           Number of prefixes to generate
+ * @param asn_cnt       Number of distinct ASNs to pick from (one in ten
+ *                      prefixes is a MOAS of two of them)
+ */
+void test_gen_prefixes(test_pfx_t *pfxs, int cnt, int asn_cnt);
+
+/** Check if the given prefix is one of the given prefixes */
+int test_has_prefix(const test_pfx_t *pfxs, int cnt, uint32_t addr,
+                    uint8_t mask);
+
+/** Write the given prefixes to a pfx2as file
+ *
+ * @return 0 if the file was written, -1 otherwise
+ */
+int test_write_pfx2as(const char *filename, const test_pfx_t *pfxs, int cnt);
+
+/** Create an ipmeta instance that uses the given datastructure, and load a
+ * pfx2as file with its pfx2as provider
+ *
+ * @param dstype        The datastructure to use
+ * @param filename      The pfx2as file to load
+ * @param[out] provider Set to the pfx2as provider (optional)
+ * @return the ipmeta instance, NULL if an error occurred
+ */
+ipmeta_t *test_load_pfx2as(enum ipmeta_ds_id dstype, const char *filename,
+                           ipmeta_provider_t **provider);
+
+/** Load a pfx2as file as a dated snapshot (see ipmeta_set_snapshot_time)
+ *
+ * @param ipmeta        The ipmeta instance to add the snapshot to
+ * @param filename      The pfx2as file to load
+ * @param valid_from    Time from which the snapshot is valid
+ * @return the provider of the snapshot, NULL if an error occurred
+ */
+ipmeta_provider_t *test_load_snapshot(ipmeta_t *ipmeta, const char *filename,
+                                      time_t valid_from);
+
+/** Check if two records have the same ASNs (either may be NULL) */
+int test_same_asns(const ipmeta_record_t *a, const ipmeta_record_t *b);
+
+/** Get the name of the given datastructure, for messages */
+const char *test_ds_name(enum ipmeta_ds_id dstype);
+
+#endif /* __IPMETA_TEST_H */
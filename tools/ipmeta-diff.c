@@ -0,0 +1,106 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * libipmeta is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libipmeta is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libipmeta.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libipmeta.h"
+
+/** @file
+ *
+ * @brief Writes the differences between two files of a provider, which can
+ * then be applied to an instance that has the older file loaded (see
+ * ipmeta_apply_diff)
+ */
+
+static void usage(const char *name)
+{
+  fprintf(stderr,
+          "usage: %s -p provider -o diff-file old-file new-file\n"
+          "       -o <file>     diff file to write (compressed according "
+          "to its\n"
+          "                     extension)\n"
+          "       -p <name>     provider that reads the files: pfx2as, or\n"
+          "                     netacq-edge or maxmind (blocks files)\n",
+          name);
+}
+
+int main(int argc, char **argv)
+{
+  ipmeta_provider_id_t type = 0;
+  const char *diff_file = NULL;
+  int opt, ops;
+
+  while ((opt = getopt(argc, argv, ":o:p:?")) >= 0) {
+    switch (opt) {
+    case 'o':
+      diff_file = optarg;
+      break;
+
+    case 'p':
+      if (strcmp(optarg, "pfx2as") == 0) {
+        type = IPMETA_PROVIDER_PFX2AS;
+      } else if (strcmp(optarg, "netacq-edge") == 0) {
+        type = IPMETA_PROVIDER_NETACQ_EDGE;
+      } else if (strcmp(optarg, "maxmind") == 0) {
+        type = IPMETA_PROVIDER_MAXMIND;
+      } else {
+        fprintf(stderr, "ERROR: Unsupported provider %s\n", optarg);
+        usage(argv[0]);
+        return -1;
+      }
+      break;
+
+    case ':':
+      fprintf(stderr, "ERROR: Missing option argument for -%c\n", optopt);
+      usage(argv[0]);
+      return -1;
+
+    case '?':
+    default:
+      usage(argv[0]);
+      return -1;
+    }
+  }
+
+  if (type == 0 || diff_file == NULL || argc - optind != 2) {
+    usage(argv[0]);
+    return -1;
+  }
+
+  if ((ops = ipmeta_diff_files(type, argv[optind], argv[optind + 1],
+                               diff_file)) < 0) {
+    fprintf(stderr, "ERROR: Could not diff %s and %s\n", argv[optind],
+            argv[optind + 1]);
+    return -1;
+  }
+  fprintf(stderr, "INFO: Wrote %d operations to %s\n", ops, diff_file);
+
+  return 0;
+}
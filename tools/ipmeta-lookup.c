@@ -27,6 +27,8 @@
 
 #include <assert.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -50,18 +52,22 @@
 
 ipmeta_t *ipmeta = NULL;
 uint32_t providermask = 0;
-ipmeta_provider_t *enabled_providers[IPMETA_PROVIDER_MAX];
-char *provider_prefixes[IPMETA_PROVIDER_MAX];
+ipmeta_provider_t *enabled_providers[IPMETA_PROVIDER_ID_MAX];
+char *provider_prefixes[IPMETA_PROVIDER_ID_MAX];
 int enabled_providers_cnt = 0;
 ipmeta_record_set_t *records;
+ipmeta_sorted_stream_t *sorted_stream = NULL;
 
-static void lookup(char *addr_str, iow_t *outfile)
+static int lookup(char *addr_str, iow_t *outfile)
 {
   char orig_str[BUFFER_LEN];
 
   char *mask_str = addr_str;
   uint32_t addr;
+  struct in6_addr addr6;
+  int is_v6 = (strchr(addr_str, ':') != NULL);
   uint8_t mask;
+  int rc;
   int i;
 
   /* preserve the original string for dumping */
@@ -73,20 +79,41 @@ static void lookup(char *addr_str, iow_t *outfile)
     mask_str++;
     mask = atoi(mask_str);
   } else {
-    mask = 32;
+    mask = is_v6 ? 128 : 32;
   }
 
-  addr = inet_addr(addr_str);
-
-  if (mask == 32) {
-    ipmeta_lookup_single(ipmeta, addr, providermask, records);
+  if (is_v6) {
+    if (inet_pton(AF_INET6, addr_str, &addr6) != 1) {
+      fprintf(stderr, "WARN: Skipping invalid IPv6 address %s\n", orig_str);
+      return 0;
+    }
+    if (mask == 128) {
+      rc = ipmeta_lookup_single6(ipmeta, &addr6, providermask, records);
+    } else {
+      rc = ipmeta_lookup6(ipmeta, &addr6, mask, providermask, records);
+    }
+    if (rc < 0) {
+      fprintf(stderr, "ERROR: Lookup of %s failed\n", orig_str);
+      return -1;
+    }
   } else {
-    ipmeta_lookup(ipmeta, addr, mask, providermask, records);
+    addr = inet_addr(addr_str);
+
+    if (mask == 32 && sorted_stream != NULL) {
+      if (ipmeta_lookup_sorted_stream(sorted_stream, addr, records) < 0) {
+        fprintf(stderr, "ERROR: Lookup of %s failed\n", orig_str);
+        return -1;
+      }
+    } else if (mask == 32) {
+      ipmeta_lookup_single(ipmeta, addr, providermask, records);
+    } else {
+      ipmeta_lookup(ipmeta, addr, mask, providermask, records);
+    }
   }
 
   /* look it up using each provider */
-  for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
-    if ((providermask & (1 << (i))) == 0) {
+  for (i = 0; i < IPMETA_PROVIDER_ID_MAX; i++) {
+    if ((providermask & (1U << (i))) == 0) {
       continue;
     }
 
@@ -96,12 +123,121 @@ static void lookup(char *addr_str, iow_t *outfile)
         ipmeta_get_provider_name(ipmeta_get_provider_by_id(ipmeta, i + 1)));
       ipmeta_dump_record_set_by_provider(records, orig_str, i + 1);
     } else {
-      wandio_printf(outfile, "%s|", ipmeta_get_provider_by_id(ipmeta, i + 1));
+      wandio_printf(
+        outfile, "%s|",
+        ipmeta_get_provider_name(ipmeta_get_provider_by_id(ipmeta, i + 1)));
       ipmeta_write_record_set_by_provider(records, outfile, orig_str, i + 1);
     }
   }
 
-  return;
+  return 0;
+}
+
+static void dump_load_stats(ipmeta_provider_t *provider)
+{
+  const ipmeta_load_stats_t *stats;
+  const ipmeta_load_file_stats_t *file;
+  int i;
+
+  if ((stats = ipmeta_get_load_stats(provider)) == NULL) {
+    return;
+  }
+
+  fprintf(stderr,
+          "%s: loaded %" PRIu64 " records, %" PRIu64 " prefixes in %.3fs "
+          "(cpu %.3fs, finalize %.3fs, rss %+" PRId64 " KB)\n",
+          ipmeta_get_provider_name(provider), stats->records, stats->prefixes,
+          stats->wall_time, stats->cpu_time, stats->finalize_wall_time,
+          stats->rss_delta_kb);
+
+  for (i = 0; i < stats->files_cnt; i++) {
+    file = &stats->files[i];
+    fprintf(stderr,
+            "  %s: %" PRIu64 " bytes (%" PRIu64 " on disk), %" PRIu64
+            " rows, %" PRIu64 " records, %" PRIu64 " prefixes, %.3fs "
+            "(cpu %.3fs, %.1f MB/s), rss %+" PRId64 " KB\n",
+            file->filename, file->bytes_read, file->compressed_bytes,
+            file->rows, file->records, file->prefixes, file->wall_time,
+            file->cpu_time,
+            file->wall_time > 0 ? file->bytes_read / file->wall_time / 1e6
+                                : 0,
+            file->rss_delta_kb);
+  }
+}
+
+static void dump_memory_usage(void)
+{
+  ipmeta_memory_usage_t usage;
+  const uint64_t *pusage;
+  int i, j;
+
+  if (ipmeta_get_memory_usage(ipmeta, &usage) != 0) {
+    return;
+  }
+
+  fprintf(stderr, "memory: %.1f MB total\n", usage.total / 1048576.0);
+  for (j = 0; j < IPMETA_MEM_CATEGORY_CNT; j++) {
+    if (usage.ds[j] != 0) {
+      fprintf(stderr, "  ds|%s|%" PRIu64 "\n",
+              ipmeta_get_memory_category_name(j), usage.ds[j]);
+    }
+  }
+  for (i = 0; i < enabled_providers_cnt; i++) {
+    pusage = usage.providers[ipmeta_get_provider_id(enabled_providers[i]) - 1];
+    for (j = 0; j < IPMETA_MEM_CATEGORY_CNT; j++) {
+      if (pusage[j] != 0) {
+        fprintf(stderr, "  %s|%s|%" PRIu64 "\n",
+                ipmeta_get_provider_name(enabled_providers[i]),
+                ipmeta_get_memory_category_name(j), pusage[j]);
+      }
+    }
+  }
+}
+
+static void dump_lookup_stats(void)
+{
+  ipmeta_stats_t stats;
+  const ipmeta_provider_lookup_stats_t *pstats;
+  int i;
+
+  /* fails (and says why) if libipmeta was built without lookup stats */
+  if (ipmeta_get_stats(ipmeta, &stats) != 0) {
+    return;
+  }
+
+  fprintf(stderr,
+          "lookups: %" PRIu64 " single, %" PRIu64 " prefix (%" PRIu64
+          " records, max fan-out %" PRIu64 ")\n",
+          stats.single_lookups, stats.prefix_lookups, stats.prefix_records,
+          stats.prefix_records_max);
+  for (i = 0; i < enabled_providers_cnt; i++) {
+    pstats = &stats.providers[ipmeta_get_provider_id(enabled_providers[i]) - 1];
+    fprintf(stderr,
+            "  %s: %" PRIu64 " lookups, %" PRIu64 " hits, %" PRIu64
+            " misses, %" PRIu64 " records\n",
+            ipmeta_get_provider_name(enabled_providers[i]), pstats->lookups,
+            pstats->hits, pstats->misses, pstats->records);
+  }
+  fprintf(stderr,
+          "latency (%" PRIu64 " samples): p50 %" PRIu64 "ns, p99 %" PRIu64
+          "ns, p99.9 %" PRIu64 "ns\n",
+          stats.latency_samples, ipmeta_stats_latency_percentile(&stats, 50),
+          ipmeta_stats_latency_percentile(&stats, 99),
+          ipmeta_stats_latency_percentile(&stats, 99.9));
+}
+
+static void dump_cache_stats(void)
+{
+  uint64_t hits, misses;
+
+  if (ipmeta_get_lookup_cache_stats(ipmeta, &hits, &misses) != 0 ||
+      hits + misses == 0) {
+    return;
+  }
+
+  fprintf(stderr,
+          "lookup cache: %" PRIu64 " hits, %" PRIu64 " misses (%.1f%%)\n",
+          hits, misses, 100.0 * hits / (hits + misses));
 }
 
 static void usage(const char *name)
@@ -111,17 +247,30 @@ static void usage(const char *name)
   int i;
 
   fprintf(stderr,
-          "usage: %s [-h] -p provider [-p provider] [-o outfile] [-f "
-          "iplist]|[ip1 ip2...ipN]\n"
+          "usage: %s [-hHPSV] [-C entries] -p provider [-p provider] "
+          "[-o outfile]\n"
+          "       [-f iplist]|[ip1 ip2...ipN]\n"
           "       -c <level>    the compression level to use (default: %d)\n"
-          "       -d <struct>   data structure to use for storing prefixes\n"
+          "       -C <entries>  cache results of single-address lookups in a\n"
+          "                     per-thread cache of the given size\n"
+          "       -d <struct>   data structure to use for storing prefixes:\n"
+          "                     patricia, cpatricia, bigarray or treebitmap\n"
           "                     (default: patricia)\n"
           "       -f <iplist>   perform lookups on IP addresses listed in "
           "the given file\n"
           "       -h            write out a header row with field names\n"
+          "       -H            back large tables with huge pages\n"
           "       -o <outfile>  write results to the given file\n"
+          "       -P            pre-fault large tables when they are "
+          "allocated\n"
+          "       -S, --sorted  the addresses are sorted in ascending order,\n"
+          "                     look them up with a single pass over the\n"
+          "                     datastructure\n"
+          "       -V            print load, memory (and lookup) "
+          "statistics\n"
           "       -p <provider> enable the given provider,\n"
-          "                     -p can be used multiple times\n"
+          "                     -p can be used multiple times (giving a\n"
+          "                     provider again loads another instance)\n"
           "                     available providers:\n",
           name, DEFAULT_COMPRESS_LEVEL);
   /* get the available plugins from ipmeta */
@@ -150,7 +299,7 @@ int main(int argc, char **argv)
   char *p = NULL;
   char buffer[BUFFER_LEN];
 
-  char *providers[IPMETA_PROVIDER_MAX];
+  char *providers[IPMETA_PROVIDER_ID_MAX];
   int providers_cnt = 0;
   char *provider_arg_ptr = NULL;
   ipmeta_provider_t *provider = NULL;
@@ -165,12 +314,20 @@ int main(int argc, char **argv)
   iow_t *outfile = NULL;
   char *ds_name = NULL;
   ipmeta_ds_id_t dstype = IPMETA_DS_DEFAULT;
+  uint32_t ipmeta_flags = 0;
+  int verbose = 0;
+  uint32_t cache_entries = 0;
+  int sorted = 0;
+
+  struct option long_options[] = {{"sorted", no_argument, NULL, 'S'},
+                                  {NULL, 0, NULL, 0}};
 
   /* initialize the providers array to NULL first */
-  memset(providers, 0, sizeof(char *) * IPMETA_PROVIDER_MAX);
+  memset(providers, 0, sizeof(char *) * IPMETA_PROVIDER_ID_MAX);
 
   while (prevoptind = optind,
-         (opt = getopt(argc, argv, ":D:c:f:o:p:hv?")) >= 0) {
+         (opt = getopt_long(argc, argv, ":C:D:c:f:o:p:hHPSVv?", long_options,
+                            NULL)) >= 0) {
     if (optind == prevoptind + 2 && optarg && *optarg == '-' &&
         *(optarg + 1) != '\0') {
       opt = ':';
@@ -181,6 +338,10 @@ int main(int argc, char **argv)
       compress_level = atoi(optarg);
       break;
 
+    case 'C':
+      cache_entries = strtoul(optarg, NULL, 10);
+      break;
+
     case 'D':
       ds_name = optarg;
       break;
@@ -193,20 +354,41 @@ int main(int argc, char **argv)
       headers_enabled = 1;
       break;
 
+    case 'H':
+      ipmeta_flags |= IPMETA_FLAG_HUGEPAGES;
+      break;
+
     case 'o':
       outfile_name = strdup(optarg);
       break;
 
     case 'p':
+      if (providers_cnt == IPMETA_PROVIDER_ID_MAX) {
+        fprintf(stderr, "ERROR: At most %d providers can be enabled\n",
+                IPMETA_PROVIDER_ID_MAX);
+        goto quit;
+      }
       providers[providers_cnt++] = strdup(optarg);
       break;
 
+    case 'P':
+      ipmeta_flags |= IPMETA_FLAG_PREFAULT;
+      break;
+
+    case 'S':
+      sorted = 1;
+      break;
+
     case ':':
       fprintf(stderr, "ERROR: Missing option argument for -%c\n", optopt);
       usage(argv[0]);
       return -1;
       break;
 
+    case 'V':
+      verbose = 1;
+      break;
+
     case '?':
     case 'v':
       fprintf(stderr, "libipmeta version %d.%d.%d\n", LIBIPMETA_MAJOR_VERSION,
@@ -226,6 +408,10 @@ int main(int argc, char **argv)
       dstype = IPMETA_DS_BIGARRAY;
     } else if (strcasecmp(ds_name, "patricia") == 0) {
       dstype = IPMETA_DS_PATRICIA;
+    } else if (strcasecmp(ds_name, "treebitmap") == 0) {
+      dstype = IPMETA_DS_TREEBITMAP;
+    } else if (strcasecmp(ds_name, "cpatricia") == 0) {
+      dstype = IPMETA_DS_CPATRICIA;
     } else {
       fprintf(stderr,
               "unknown data structure type %s, falling back to default\n",
@@ -234,11 +420,17 @@ int main(int argc, char **argv)
   }
 
   /* this must be called before usage is called */
-  if ((ipmeta = ipmeta_init(dstype)) == NULL) {
+  if ((ipmeta = ipmeta_init_flags(dstype, ipmeta_flags)) == NULL) {
     fprintf(stderr, "could not initialize libipmeta\n");
     goto quit;
   }
 
+  if (cache_entries != 0 &&
+      ipmeta_set_lookup_cache(ipmeta, cache_entries) != 0) {
+    fprintf(stderr, "could not enable the lookup cache\n");
+    goto quit;
+  }
+
   /* store the value of the last index*/
   lastopt = optind;
 
@@ -294,14 +486,39 @@ int main(int argc, char **argv)
       goto quit;
     }
 
+    /* the provider has been given already, so load another instance of it
+       (which is looked up along with the first) */
+    if (ipmeta_is_provider_enabled(provider) != 0 &&
+        (provider = ipmeta_add_provider_instance(ipmeta, provider, NULL)) ==
+          NULL) {
+      fprintf(stderr, "ERROR: Could not add another %s instance\n",
+              providers[i]);
+      goto quit;
+    }
+
     if (ipmeta_enable_provider(ipmeta, provider, provider_arg_ptr,
                                IPMETA_PROVIDER_DEFAULT_NO) != 0) {
       fprintf(stderr, "ERROR: Could not enable plugin %s\n", providers[i]);
       usage(argv[0]);
       goto quit;
     }
-    providermask |= (1 << (ipmeta_get_provider_id(provider) - 1));
+    providermask |= (1U << (ipmeta_get_provider_id(provider) - 1));
     enabled_providers[enabled_providers_cnt++] = provider;
+
+    if (verbose != 0) {
+      dump_load_stats(provider);
+    }
+  }
+
+  if (verbose != 0) {
+    dump_memory_usage();
+  }
+
+  if (sorted != 0 &&
+      (sorted_stream = ipmeta_sorted_stream_init(ipmeta, providermask)) ==
+        NULL) {
+    fprintf(stderr, "ERROR: Could not create sorted lookup stream\n");
+    goto quit;
   }
 
   ipmeta_log(__func__, "dumping record headers");
@@ -345,7 +562,9 @@ int main(int argc, char **argv)
         *p = '\0';
       }
 
-      lookup(buffer, outfile);
+      if (lookup(buffer, outfile) != 0) {
+        goto quit;
+      }
     }
   }
 
@@ -353,11 +572,18 @@ int main(int argc, char **argv)
 
   /* now try looking up addresses given on the command line */
   for (i = lastopt; i < argc; i++) {
-    lookup(argv[i], outfile);
+    if (lookup(argv[i], outfile) != 0) {
+      goto quit;
+    }
   }
 
   ipmeta_log(__func__, "done");
 
+  if (verbose != 0) {
+    dump_lookup_stats();
+    dump_cache_stats();
+  }
+
   rc = 0;
 
 quit:
@@ -375,6 +601,8 @@ quit:
     free(outfile_name);
   }
 
+  ipmeta_sorted_stream_free(sorted_stream);
+
   if (ipmeta != NULL) {
     ipmeta_free(ipmeta);
   }
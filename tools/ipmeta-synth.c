@@ -0,0 +1,654 @@
+/*
+ * libipmeta
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012 The Regents of the University of California.
+ *
+ * This file is part of libipmeta.
+ *
+ * libipmeta is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libipmeta is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libipmeta.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <wandio.h>
+
+#include "wandio_utils.h"
+
+/** @file
+ *
+ * @brief Generates synthetic datasets in the input formats of the
+ * netacq-edge, maxmind and pfx2as providers
+ *
+ * The generated files are syntactically valid for the provider parsers, but
+ * all of the content (locations, ranges, polygons) is random. This allows
+ * load-time and lookup performance to be reproduced at production scale
+ * without access to the commercial datasets.
+ */
+
+/** The length of the static path buffer */
+#define BUFFER_LEN 1024
+
+#define DEFAULT_COMPRESS_LEVEL 6
+#define DEFAULT_RANGE_CNT 1000000
+#define DEFAULT_LOCATION_CNT 100000
+#define DEFAULT_POLYGON_TABLE_CNT 2
+#define DEFAULT_POLYGON_CNT 1000
+#define DEFAULT_REGION_CNT 10
+#define DEFAULT_SEED 1
+
+/** Default prefix length distribution (length:weight), loosely based on the
+    distribution of prefixes in the global routing table */
+#define DEFAULT_DISTRIBUTION "24:55,23:10,22:12,21:6,20:6,19:4,18:3,16:4"
+
+/** First address that ranges are allocated from (1.0.0.0) */
+#define FIRST_ADDR 0x01000000
+
+/** Ranges are not allocated at or above this address (224.0.0.0) */
+#define LAST_ADDR 0xE0000000
+
+/** Output formats */
+enum {
+  FORMAT_NETACQ_EDGE = 0x1,
+  FORMAT_MAXMIND = 0x2,
+  FORMAT_PFX2AS = 0x4,
+  FORMAT_ALL = FORMAT_NETACQ_EDGE | FORMAT_MAXMIND | FORMAT_PFX2AS,
+};
+
+/** A country that locations are placed in */
+typedef struct country {
+  const char *iso2;
+  const char *iso3;
+  const char *name;
+
+  /** Net Acuity continent code */
+  int continent_code;
+
+  /** Net Acuity continent name */
+  const char *continent;
+} country_t;
+
+/** The countries used for synthetic locations. These must all be known to
+    the maxmind provider. */
+static const country_t countries[] = {
+  {"us", "usa", "united states", 6, "na"},
+  {"ca", "can", "canada", 6, "na"},
+  {"mx", "mex", "mexico", 6, "na"},
+  {"br", "bra", "brazil", 7, "sa"},
+  {"ar", "arg", "argentina", 7, "sa"},
+  {"gb", "gbr", "united kingdom", 5, "eu"},
+  {"de", "deu", "germany", 5, "eu"},
+  {"fr", "fra", "france", 5, "eu"},
+  {"it", "ita", "italy", 5, "eu"},
+  {"ru", "rus", "russian federation", 5, "eu"},
+  {"cn", "chn", "china", 4, "as"},
+  {"jp", "jpn", "japan", 4, "as"},
+  {"in", "ind", "india", 4, "as"},
+  {"kr", "kor", "korea republic of", 4, "as"},
+  {"au", "aus", "australia", 3, "oc"},
+  {"nz", "nzl", "new zealand", 3, "oc"},
+  {"za", "zaf", "south africa", 1, "af"},
+  {"eg", "egy", "egypt", 1, "af"},
+  {"ng", "nga", "nigeria", 1, "af"},
+  {"aq", "ata", "antarctica", 2, "an"},
+};
+
+#define COUNTRY_CNT ((int)(sizeof(countries) / sizeof(countries[0])))
+
+/** A block of addresses assigned to a location */
+typedef struct range {
+  uint32_t first;
+  uint32_t last;
+
+  /** Prefix length, only set if the range is a single prefix */
+  uint8_t mask;
+} range_t;
+
+/** Generation parameters */
+static uint64_t range_cnt = DEFAULT_RANGE_CNT;
+static uint32_t location_cnt = DEFAULT_LOCATION_CNT;
+static int polygon_table_cnt = DEFAULT_POLYGON_TABLE_CNT;
+static uint32_t polygon_cnt = DEFAULT_POLYGON_CNT;
+static uint32_t region_cnt = DEFAULT_REGION_CNT;
+static uint64_t rng = DEFAULT_SEED;
+static int compress_level = DEFAULT_COMPRESS_LEVEL;
+static const char *out_dir = NULL;
+static const char *out_ext = "";
+
+/** Prefix length distribution (cumulative weights) */
+static uint8_t dist_lens[33];
+static uint32_t dist_weights[33];
+static int dist_cnt = 0;
+static uint32_t dist_total = 0;
+
+/** Simple xorshift PRNG so that datasets are repeatable */
+static uint32_t next_rand()
+{
+  rng ^= rng << 13;
+  rng ^= rng >> 7;
+  rng ^= rng << 17;
+  return (uint32_t)(rng >> 16);
+}
+
+/** Parse a distribution string of the form "len:weight,len:weight,..." */
+static int parse_distribution(char *str)
+{
+  char *tok;
+  char *colon;
+  int len, weight;
+
+  dist_cnt = 0;
+  dist_total = 0;
+
+  while ((tok = strsep(&str, ",")) != NULL) {
+    if ((colon = strchr(tok, ':')) == NULL) {
+      return -1;
+    }
+    *colon = '\0';
+    len = atoi(tok);
+    weight = atoi(colon + 1);
+    if (len < 8 || len > 32 || weight <= 0 || dist_cnt == 33) {
+      return -1;
+    }
+    dist_total += weight;
+    dist_lens[dist_cnt] = len;
+    dist_weights[dist_cnt] = dist_total;
+    dist_cnt++;
+  }
+
+  return dist_cnt > 0 ? 0 : -1;
+}
+
+/** Pick a prefix length from the distribution */
+static uint8_t next_mask()
+{
+  uint32_t r = next_rand() % dist_total;
+  int i;
+
+  for (i = 0; i < dist_cnt - 1 && r >= dist_weights[i]; i++)
+    ;
+  return dist_lens[i];
+}
+
+/** Generate the (sorted, non-overlapping) address ranges. If prefixes_only
+    is set, every range is a single prefix, otherwise some ranges are made up
+    of several adjacent prefixes. Returns the number of ranges generated. */
+static uint64_t generate_ranges(range_t *ranges, int prefixes_only)
+{
+  uint64_t cursor = FIRST_ADDR;
+  uint64_t size;
+  uint64_t i;
+  uint32_t r;
+  int blocks;
+
+  for (i = 0; i < range_cnt; i++) {
+    ranges[i].mask = next_mask();
+    size = (uint64_t)1 << (32 - ranges[i].mask);
+
+    /* align the cursor, and then leave some gaps in the address space */
+    cursor = (cursor + size - 1) & ~(size - 1);
+    if (next_rand() % 4 == 0) {
+      cursor += size;
+    }
+
+    /* not every range is a prefix */
+    blocks = 1;
+    if (!prefixes_only) {
+      r = next_rand() % 10;
+      blocks = (r < 7) ? 1 : (r < 9) ? 2 : 3;
+      if (blocks > 1) {
+        ranges[i].mask = 0;
+      }
+    }
+
+    if (cursor + (size * blocks) > LAST_ADDR) {
+      fprintf(stderr,
+              "WARN: Address space exhausted after %" PRIu64 " ranges\n", i);
+      break;
+    }
+
+    ranges[i].first = cursor;
+    ranges[i].last = cursor + (size * blocks) - 1;
+    cursor += size * blocks;
+  }
+
+  return i;
+}
+
+/** Open an output file in the output directory */
+static iow_t *open_out(const char *name)
+{
+  char path[BUFFER_LEN];
+  iow_t *file;
+
+  snprintf(path, BUFFER_LEN, "%s/%s%s", out_dir, name, out_ext);
+  if ((file = wandio_wcreate(path, wandio_detect_compression_type(path),
+                             compress_level, O_CREAT)) == NULL) {
+    fprintf(stderr, "ERROR: Could not open %s for writing\n", path);
+  }
+  return file;
+}
+
+static const char *addr_str(uint32_t addr, char *buf)
+{
+  sprintf(buf, "%u.%u.%u.%u", addr >> 24, (addr >> 16) & 0xff,
+          (addr >> 8) & 0xff, addr & 0xff);
+  return buf;
+}
+
+/** Random latitude/longitude values (with 4 decimal places) */
+static double next_lat()
+{
+  return (next_rand() % 1800000) / 10000.0 - 90;
+}
+
+static double next_long()
+{
+  return (next_rand() % 3600000) / 10000.0 - 180;
+}
+
+static int write_netacq_edge(range_t *ranges, uint64_t cnt)
+{
+  iow_t *file = NULL;
+  char name[BUFFER_LEN];
+  uint32_t i;
+  uint64_t j;
+  int c, t;
+  const country_t *country;
+
+  /* countries */
+  if ((file = open_out("netacq-edge-countries.csv")) == NULL) {
+    goto err;
+  }
+  wandio_printf(file, "country-iso3,country-iso2,country-name,regions,"
+                      "continent-code,continent-name,country-code\n");
+  for (c = 0; c < COUNTRY_CNT; c++) {
+    wandio_printf(file, "%s,%s,%s,1,%d,%s,%d\n", countries[c].iso3,
+                  countries[c].iso2, countries[c].name,
+                  countries[c].continent_code, countries[c].continent, c + 1);
+  }
+  wandio_wdestroy(file);
+
+  /* regions (region_cnt per country, codes are sequential) */
+  if ((file = open_out("netacq-edge-regions.csv")) == NULL) {
+    goto err;
+  }
+  wandio_printf(file, "country-code,region-code,description,region-code\n");
+  for (c = 0; c < COUNTRY_CNT; c++) {
+    for (i = 0; i < region_cnt; i++) {
+      wandio_printf(file, "%s,r%u,region %u of %s,%u\n", countries[c].iso2, i,
+                    i, countries[c].name, (c * region_cnt) + i + 1);
+    }
+  }
+  wandio_wdestroy(file);
+
+  /* polygon tables */
+  for (t = 0; t < polygon_table_cnt; t++) {
+    snprintf(name, BUFFER_LEN, "netacq-edge-polygons-%d.csv", t);
+    if ((file = open_out(name)) == NULL) {
+      goto err;
+    }
+    wandio_printf(file, "table%d-id,table%d-fqid,table%d-name,"
+                        "table%d-usercode\n",
+                  t, t, t, t);
+    for (i = 1; i <= polygon_cnt; i++) {
+      wandio_printf(file, "%u,T%d.P%u,polygon %u,U%u\n", i, t, i, i, i);
+    }
+    wandio_wdestroy(file);
+  }
+
+  /* location to polygon mapping */
+  if (polygon_table_cnt > 0) {
+    if ((file = open_out("netacq-edge-netacq2polygon.csv")) == NULL) {
+      goto err;
+    }
+    wandio_printf(file, "netacq-id");
+    for (t = 0; t < polygon_table_cnt; t++) {
+      wandio_printf(file, ",table%d-id", t);
+    }
+    wandio_printf(file, "\n");
+    for (i = 1; i <= location_cnt; i++) {
+      wandio_printf(file, "%u", i);
+      for (t = 0; t < polygon_table_cnt; t++) {
+        wandio_printf(file, ",%u", 1 + next_rand() % polygon_cnt);
+      }
+      wandio_printf(file, "\n");
+    }
+    wandio_wdestroy(file);
+  }
+
+  /* locations */
+  if ((file = open_out("netacq-edge-locations.csv")) == NULL) {
+    goto err;
+  }
+  wandio_printf(file, "edge-id,edge-country,edge-region,edge-city,"
+                      "edge-postal-code,edge-latitude,edge-longitude,"
+                      "edge-metro-code,edge-area-codes,edge-country-3,"
+                      "edge-country-code,edge-region-code,edge-city-code,"
+                      "edge-continent-code,edge-two-letter-country,"
+                      "edge-conn-speed,edge-country-conf,edge-region-conf,"
+                      "edge-city-conf,edge-postal-conf,edge-gmt-offset,"
+                      "edge-in-dst\n");
+  for (i = 1; i <= location_cnt; i++) {
+    c = next_rand() % COUNTRY_CNT;
+    country = &countries[c];
+    j = next_rand() % region_cnt;
+    wandio_printf(file,
+                  "%u,%s,r%" PRIu64 ",city %u,%05u,%.4f,%.4f,%u,0,%s,%d,"
+                  "%" PRIu64 ",%u,%d,0,broadband,99,99,99,99,0,n\n",
+                  i, country->iso2, j, i, next_rand() % 100000, next_lat(),
+                  next_long(), next_rand() % 1000, country->iso3, c + 1,
+                  (c * region_cnt) + j + 1, i, country->continent_code);
+  }
+  wandio_wdestroy(file);
+
+  /* blocks */
+  if ((file = open_out("netacq-edge-blocks.csv")) == NULL) {
+    goto err;
+  }
+  wandio_printf(file, "start-ip,end-ip,edge-id\n");
+  for (j = 0; j < cnt; j++) {
+    wandio_printf(file, "%u,%u,%u\n", ranges[j].first, ranges[j].last,
+                  1 + next_rand() % location_cnt);
+  }
+  wandio_wdestroy(file);
+
+  return 0;
+
+err:
+  return -1;
+}
+
+static int write_maxmind(range_t *ranges, uint64_t cnt)
+{
+  iow_t *file = NULL;
+  const country_t *country;
+  uint32_t i;
+  uint64_t j;
+
+  /* locations */
+  if ((file = open_out("maxmind-locations.csv")) == NULL) {
+    return -1;
+  }
+  wandio_printf(file, "Copyright (c) 2012 synthetic data\n");
+  wandio_printf(file, "locId,country,region,city,postalCode,latitude,"
+                      "longitude,metroCode,areaCode\n");
+  for (i = 1; i <= location_cnt; i++) {
+    country = &countries[next_rand() % COUNTRY_CNT];
+    wandio_printf(file, "%u,\"%c%c\",\"%02u\",\"City %u\",\"%05u\",%.4f,%.4f,"
+                        "%u,%u\n",
+                  i, country->iso2[0] - 'a' + 'A', country->iso2[1] - 'a' + 'A',
+                  next_rand() % 100, i, next_rand() % 100000, next_lat(),
+                  next_long(), next_rand() % 1000, next_rand() % 1000);
+  }
+  wandio_wdestroy(file);
+
+  /* blocks */
+  if ((file = open_out("maxmind-blocks.csv")) == NULL) {
+    return -1;
+  }
+  wandio_printf(file, "Copyright (c) 2012 synthetic data\n");
+  wandio_printf(file, "startIpNum,endIpNum,locId\n");
+  for (j = 0; j < cnt; j++) {
+    wandio_printf(file, "\"%u\",\"%u\",\"%u\"\n", ranges[j].first,
+                  ranges[j].last, 1 + next_rand() % location_cnt);
+  }
+  wandio_wdestroy(file);
+
+  return 0;
+}
+
+static int write_pfx2as(range_t *ranges, uint64_t cnt)
+{
+  iow_t *file = NULL;
+  char buf[16];
+  uint64_t j;
+
+  if ((file = open_out("pfx2as.txt")) == NULL) {
+    return -1;
+  }
+  for (j = 0; j < cnt; j++) {
+    assert(ranges[j].mask != 0);
+    wandio_printf(file, "%s\t%u\t", addr_str(ranges[j].first, buf),
+                  ranges[j].mask);
+    /* a few MOAS prefixes */
+    if (next_rand() % 100 == 0) {
+      wandio_printf(file, "%u_%u\n", 1 + next_rand() % 65000,
+                    1 + next_rand() % 65000);
+    } else {
+      wandio_printf(file, "%u\n", 1 + next_rand() % 65000);
+    }
+  }
+  wandio_wdestroy(file);
+
+  return 0;
+}
+
+static void usage(const char *name)
+{
+  fprintf(
+    stderr,
+    "usage: %s -o outdir [-f format] [-n ranges] [-d distribution]\n"
+    "       [-l locations] [-t tables] [-g polygons] [-r regions] [-s seed]\n"
+    "       [-x ext] [-c level]\n"
+    "       -c <level>    the compression level to use (default: %d)\n"
+    "       -d <dist>     prefix length distribution as len:weight,...\n"
+    "                     (default: %s)\n"
+    "       -f <format>   format to generate: netacq-edge, maxmind, pfx2as,\n"
+    "                     -f can be used multiple times (default: all)\n"
+    "       -g <count>    number of polygons in each polygon table "
+    "(default: %d)\n"
+    "       -l <count>    number of locations (default: %d)\n"
+    "       -n <count>    number of address ranges (default: %d)\n"
+    "       -o <dir>      directory to write the files to\n"
+    "       -r <count>    number of regions per country (default: %d)\n"
+    "       -s <seed>     seed for the generator (default: %d)\n"
+    "       -t <count>    number of netacq-edge polygon tables (default: %d)\n"
+    "       -x <ext>      extension to add to file names, e.g. '.gz' to\n"
+    "                     compress the output (default: none)\n",
+    name, DEFAULT_COMPRESS_LEVEL, DEFAULT_DISTRIBUTION, DEFAULT_POLYGON_CNT,
+    DEFAULT_LOCATION_CNT, DEFAULT_RANGE_CNT, DEFAULT_REGION_CNT, DEFAULT_SEED,
+    DEFAULT_POLYGON_TABLE_CNT);
+}
+
+/** Print the option string to pass to ipmeta-lookup for each provider */
+static void print_provider_args(int formats)
+{
+  int t;
+
+  if (formats & FORMAT_NETACQ_EDGE) {
+    fprintf(stdout,
+            "netacq-edge -b %s/netacq-edge-blocks.csv%s "
+            "-l %s/netacq-edge-locations.csv%s "
+            "-r %s/netacq-edge-regions.csv%s "
+            "-c %s/netacq-edge-countries.csv%s",
+            out_dir, out_ext, out_dir, out_ext, out_dir, out_ext, out_dir,
+            out_ext);
+    for (t = 0; t < polygon_table_cnt; t++) {
+      fprintf(stdout, " -t %s/netacq-edge-polygons-%d.csv%s", out_dir, t,
+              out_ext);
+    }
+    if (polygon_table_cnt > 0) {
+      fprintf(stdout, " -p %s/netacq-edge-netacq2polygon.csv%s", out_dir,
+              out_ext);
+    }
+    fprintf(stdout, "\n");
+  }
+  if (formats & FORMAT_MAXMIND) {
+    fprintf(stdout,
+            "maxmind -b %s/maxmind-blocks.csv%s -l %s/maxmind-locations.csv%s\n",
+            out_dir, out_ext, out_dir, out_ext);
+  }
+  if (formats & FORMAT_PFX2AS) {
+    fprintf(stdout, "pfx2as -f %s/pfx2as.txt%s\n", out_dir, out_ext);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  int opt;
+  int rc = -1;
+  int formats = 0;
+  char dist_buf[BUFFER_LEN];
+  range_t *ranges = NULL;
+  uint64_t cnt;
+
+  strcpy(dist_buf, DEFAULT_DISTRIBUTION);
+
+  while ((opt = getopt(argc, argv, ":c:d:f:g:l:n:o:r:s:t:x:?")) >= 0) {
+    switch (opt) {
+    case 'c':
+      compress_level = atoi(optarg);
+      break;
+
+    case 'd':
+      strncpy(dist_buf, optarg, BUFFER_LEN - 1);
+      dist_buf[BUFFER_LEN - 1] = '\0';
+      break;
+
+    case 'f':
+      if (strcmp(optarg, "netacq-edge") == 0) {
+        formats |= FORMAT_NETACQ_EDGE;
+      } else if (strcmp(optarg, "maxmind") == 0) {
+        formats |= FORMAT_MAXMIND;
+      } else if (strcmp(optarg, "pfx2as") == 0) {
+        formats |= FORMAT_PFX2AS;
+      } else {
+        fprintf(stderr, "ERROR: Unknown format %s\n", optarg);
+        usage(argv[0]);
+        goto quit;
+      }
+      break;
+
+    case 'g':
+      polygon_cnt = strtoul(optarg, NULL, 10);
+      break;
+
+    case 'l':
+      location_cnt = strtoul(optarg, NULL, 10);
+      break;
+
+    case 'n':
+      range_cnt = strtoull(optarg, NULL, 10);
+      break;
+
+    case 'o':
+      out_dir = optarg;
+      break;
+
+    case 'r':
+      region_cnt = strtoul(optarg, NULL, 10);
+      break;
+
+    case 's':
+      rng = strtoull(optarg, NULL, 10);
+      break;
+
+    case 't':
+      polygon_table_cnt = atoi(optarg);
+      break;
+
+    case 'x':
+      out_ext = optarg;
+      break;
+
+    case ':':
+      fprintf(stderr, "ERROR: Missing option argument for -%c\n", optopt);
+      usage(argv[0]);
+      goto quit;
+
+    case '?':
+    default:
+      usage(argv[0]);
+      goto quit;
+    }
+  }
+
+  if (out_dir == NULL) {
+    fprintf(stderr, "ERROR: An output directory must be given using -o\n");
+    usage(argv[0]);
+    goto quit;
+  }
+
+  if (parse_distribution(dist_buf) != 0) {
+    fprintf(stderr, "ERROR: Invalid prefix length distribution\n");
+    usage(argv[0]);
+    goto quit;
+  }
+
+  if (location_cnt == 0 || region_cnt == 0 ||
+      (polygon_table_cnt > 0 && polygon_cnt == 0)) {
+    fprintf(stderr, "ERROR: Location, region and polygon counts must be "
+                    "positive\n");
+    goto quit;
+  }
+
+  /* the netacq-edge provider supports a limited number of polygon tables */
+  if (polygon_table_cnt < 0 || polygon_table_cnt > 8) {
+    fprintf(stderr, "ERROR: Between 0 and 8 polygon tables are supported\n");
+    goto quit;
+  }
+
+  if (formats == 0) {
+    formats = FORMAT_ALL;
+  }
+
+  /* xorshift must not be seeded with zero */
+  if (rng == 0) {
+    rng = DEFAULT_SEED;
+  }
+
+  if ((ranges = malloc(sizeof(range_t) * range_cnt)) == NULL) {
+    fprintf(stderr, "ERROR: Could not allocate range list\n");
+    goto quit;
+  }
+
+  /* the geo formats use ranges, which need not be prefixes */
+  if (formats & (FORMAT_NETACQ_EDGE | FORMAT_MAXMIND)) {
+    cnt = generate_ranges(ranges, 0);
+    if ((formats & FORMAT_NETACQ_EDGE) && write_netacq_edge(ranges, cnt) != 0) {
+      goto quit;
+    }
+    if ((formats & FORMAT_MAXMIND) && write_maxmind(ranges, cnt) != 0) {
+      goto quit;
+    }
+  }
+
+  if (formats & FORMAT_PFX2AS) {
+    cnt = generate_ranges(ranges, 1);
+    if (write_pfx2as(ranges, cnt) != 0) {
+      goto quit;
+    }
+  }
+
+  /* tell the user how to load what we generated */
+  print_provider_args(formats);
+
+  rc = 0;
+
+quit:
+  free(ranges);
+  return rc;
+}